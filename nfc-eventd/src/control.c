@@ -0,0 +1,368 @@
+/*
+ * NFC Event Daemon
+ * Runtime control socket
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "control.h"
+
+/* Debugging functions */
+#include "debug/debug.h"
+#include "debug/nfc-utils.h"
+
+#define CONTROL_LINE_MAX 1024
+#define CONTROL_ARGS_MAX 16
+#define CONTROL_BACKLOG  8
+/* Pending output of a client, beyond which it is disconnected */
+#define CONTROL_REPLY_MAX (256 * 1024)
+
+struct ned_control_reply {
+    char *buf;
+    size_t len;
+    size_t size;
+    bool overflow;
+    char error[256];
+};
+
+typedef struct control_command {
+    char *name;
+    char *usage;
+    ned_control_cb cb;
+    void *data;
+    struct control_command *next;
+} control_command;
+
+typedef struct control_client {
+    int fd;
+    char in[CONTROL_LINE_MAX];
+    size_t in_len;
+    ned_control_reply out;
+    size_t out_pos;
+    struct control_client *next;
+} control_client;
+
+static struct {
+    ned_loop *loop;
+    int fd;
+    char *path;
+    control_command *commands;
+    control_client *clients;
+} control = { NULL, -1, NULL, NULL, NULL };
+
+static void
+reply_append(ned_control_reply *reply, const char *format, va_list ap)
+{
+    va_list aq;
+    int n;
+
+    va_copy(aq, ap);
+    n = vsnprintf(reply->buf ? reply->buf + reply->len : NULL, reply->buf ? reply->size - reply->len : 0, format, aq);
+    va_end(aq);
+    if (n < 0 || reply->overflow)
+        return;
+    if (reply->len + n + 1 > CONTROL_REPLY_MAX) {
+        reply->overflow = true;
+        return;
+    }
+    if (!reply->buf || reply->len + n + 1 > reply->size) {
+        size_t size = reply->size ? reply->size : 256;
+        char *buf;
+        while (size < reply->len + n + 1)
+            size *= 2;
+        buf = realloc(reply->buf, size);
+        if (!buf)
+            return;
+        reply->buf = buf;
+        reply->size = size;
+        vsnprintf(reply->buf + reply->len, reply->size - reply->len, format, ap);
+    }
+    reply->len += n;
+}
+
+void
+ned_control_printf(ned_control_reply *reply, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    reply_append(reply, format, ap);
+    va_end(ap);
+}
+
+void
+ned_control_error(ned_control_reply *reply, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(reply->error, sizeof(reply->error), format, ap);
+    va_end(ap);
+}
+
+int
+ned_control_register(const char *name, const char *usage, ned_control_cb cb, void *data)
+{
+    control_command *cmd, **tail;
+
+    cmd = calloc(1, sizeof(control_command));
+    if (!cmd)
+        return -1;
+    cmd->name = strdup(name);
+    cmd->usage = usage ? strdup(usage) : NULL;
+    cmd->cb = cb;
+    cmd->data = data;
+    /* Keep registration order for "help" */
+    for (tail = &control.commands; *tail; tail = &(*tail)->next);
+    *tail = cmd;
+    return 0;
+}
+
+static int
+help_command(int argc, char *argv[], ned_control_reply *reply, void *data)
+{
+    control_command *cmd;
+    (void) argc;
+    (void) argv;
+    (void) data;
+
+    for (cmd = control.commands; cmd; cmd = cmd->next)
+        ned_control_printf(reply, "%s%s%s\n", cmd->name, cmd->usage ? " " : "", cmd->usage ? cmd->usage : "");
+    return 0;
+}
+
+static void
+client_close(control_client *client)
+{
+    control_client **p;
+
+    for (p = &control.clients; *p; p = &(*p)->next) {
+        if (*p == client) {
+            *p = client->next;
+            break;
+        }
+    }
+    ned_loop_remove_fd(control.loop, client->fd);
+    close(client->fd);
+    free(client->out.buf);
+    free(client);
+}
+
+/**
+ * @brief Send pending output
+ * @return -1 if the connection is broken
+ */
+static int
+client_flush(control_client *client)
+{
+    while (client->out_pos < client->out.len) {
+        ssize_t n = send(client->fd, client->out.buf + client->out_pos, client->out.len - client->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        client->out_pos += n;
+    }
+    if (client->out_pos == client->out.len) {
+        client->out_pos = client->out.len = 0;
+        return ned_loop_mod_fd(control.loop, client->fd, EPOLLIN);
+    }
+    return ned_loop_mod_fd(control.loop, client->fd, EPOLLIN | EPOLLOUT);
+}
+
+static void
+client_execute(control_client *client, char *line)
+{
+    char *argv[CONTROL_ARGS_MAX + 1];
+    int argc = 0;
+    char *saveptr = NULL, *tok;
+    control_command *cmd;
+    ned_control_reply *reply = &client->out;
+
+    for (tok = strtok_r(line, " \t\r", &saveptr); tok && argc < CONTROL_ARGS_MAX; tok = strtok_r(NULL, " \t\r", &saveptr))
+        argv[argc++] = tok;
+    argv[argc] = NULL;
+    if (argc == 0)
+        return;
+
+    reply->error[0] = '\0';
+    for (cmd = control.commands; cmd; cmd = cmd->next) {
+        if (strcmp(cmd->name, argv[0]) == 0)
+            break;
+    }
+    if (!cmd) {
+        ned_control_printf(reply, "%s unknown command '%s', try 'help'\n", CONTROL_STATUS_ERR, argv[0]);
+        return;
+    }
+    DBG("Control command: '%s'", argv[0]);
+    if (cmd->cb(argc, argv, reply, cmd->data) < 0)
+        ned_control_printf(reply, "%s %s\n", CONTROL_STATUS_ERR, reply->error[0] ? reply->error : "failed");
+    else
+        ned_control_printf(reply, "%s\n", CONTROL_STATUS_OK);
+}
+
+static void
+client_cb(ned_loop *loop, int fd, uint32_t events, void *data)
+{
+    control_client *client = data;
+    (void) loop;
+    (void) fd;
+
+    if (events & EPOLLIN) {
+        ssize_t n = recv(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            client_close(client);
+            return;
+        }
+        if (n > 0) {
+            char *line = client->in, *eol;
+            client->in_len += n;
+            while ((eol = memchr(line, '\n', client->in_len - (line - client->in)))) {
+                *eol = '\0';
+                client_execute(client, line);
+                line = eol + 1;
+            }
+            client->in_len -= line - client->in;
+            memmove(client->in, line, client->in_len);
+            if (client->in_len == sizeof(client->in)) {
+                ERR("%s", "Control command too long, closing connection");
+                client_close(client);
+                return;
+            }
+        }
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        client_close(client);
+        return;
+    }
+    if (client->out.overflow) {
+        ERR("%s", "Control reply too long, closing connection");
+        client_close(client);
+        return;
+    }
+    if (client_flush(client) < 0)
+        client_close(client);
+}
+
+static void
+accept_cb(ned_loop *loop, int fd, uint32_t events, void *data)
+{
+    control_client *client;
+    int cfd;
+    (void) events;
+    (void) data;
+
+    cfd = accept(fd, NULL, NULL);
+    if (cfd < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            ERR("Control socket accept: %s", strerror(errno));
+        return;
+    }
+    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+    fcntl(cfd, F_SETFD, FD_CLOEXEC);
+    client = calloc(1, sizeof(control_client));
+    if (!client || ned_loop_add_fd(loop, cfd, EPOLLIN, client_cb, client) < 0) {
+        free(client);
+        close(cfd);
+        return;
+    }
+    client->fd = cfd;
+    client->next = control.clients;
+    control.clients = client;
+}
+
+int
+ned_control_open(ned_loop *loop, const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    /* Only replace the socket file if nobody is listening on it */
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        chmod(path, 0660) < 0 ||
+        listen(fd, CONTROL_BACKLOG) < 0 ||
+        ned_loop_add_fd(loop, fd, EPOLLIN, accept_cb, NULL) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    control.loop = loop;
+    control.fd = fd;
+    control.path = strdup(path);
+    ned_control_register("help", NULL, help_command, NULL);
+    INFO("Control socket listening on %s", path);
+    return 0;
+}
+
+void
+ned_control_close(void)
+{
+    while (control.clients)
+        client_close(control.clients);
+    while (control.commands) {
+        control_command *next = control.commands->next;
+        free(control.commands->name);
+        free(control.commands->usage);
+        free(control.commands);
+        control.commands = next;
+    }
+    if (control.fd >= 0) {
+        ned_loop_remove_fd(control.loop, control.fd);
+        close(control.fd);
+        unlink(control.path);
+        control.fd = -1;
+    }
+    free(control.path);
+    control.path = NULL;
+}
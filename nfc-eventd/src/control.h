@@ -0,0 +1,80 @@
+/*
+ * NFC Event Daemon
+ * Runtime control socket
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include "loop.h"
+
+/*
+ * Line based protocol on a local stream socket: the client sends one command
+ * per line ("name arg1 arg2\n"), the daemon answers zero or more lines of
+ * output followed by a status line, either "OK" or "ERR <message>".
+ * Commands run on the loop thread and never wait for polling threads.
+ */
+
+#define CONTROL_STATUS_OK  "OK"
+#define CONTROL_STATUS_ERR "ERR"
+
+typedef struct ned_control_reply ned_control_reply;
+
+/**
+ * @brief Command handler
+ * @param argv argv[0] is the command name
+ * @return 0 on success, -1 on error (after ned_control_error())
+ */
+typedef int (*ned_control_cb)(int argc, char *argv[], ned_control_reply *reply, void *data);
+
+/**
+ * @brief Listen on a Unix socket
+ * A stale socket file left by a previous instance is replaced.
+ */
+int ned_control_open(ned_loop *loop, const char *path);
+
+/**
+ * @brief Close the socket, every client connection and forget commands
+ */
+void ned_control_close(void);
+
+/**
+ * @brief Register a command
+ * @param usage arguments summary shown by "help", may be NULL
+ */
+int ned_control_register(const char *name, const char *usage, ned_control_cb cb, void *data);
+
+/**
+ * @brief Append formatted output to a reply
+ */
+void ned_control_printf(ned_control_reply *reply, const char *format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+;
+
+/**
+ * @brief Set the error message of a reply
+ */
+void ned_control_error(ned_control_reply *reply, const char *format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+;
+
+#endif /* __CONTROL_H__ */
@@ -23,16 +23,97 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
+#include <pthread.h>
+#include <signal.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
 
 #include "../types.h"
 #include "nfc-utils.h"
 
+#define IDENT "nfc-eventd"
+#define RING_SIZE 65536         /* bytes per thread, a power of two */
+#define ARGS_MAX 1024           /* encoded arguments of a message */
+#define STRING_MAX 256          /* %s arguments are cut there, marker included */
+#define STRING_CUT "..."
+#define LINE_MAX_LEN 1024
+#define WRITER_PERIOD 10        /* ms */
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+#define KIND_PADDING (-1)
+#define KIND_PRINT 0            /* debug_print() */
+
+/*
+ * Record: header, then each argument 8 byte aligned. Integers are stored as
+ * 64 bit values, strings as a 32 bit length and their bytes.
+ */
+typedef struct {
+    uint32_t size;              /* whole record, multiple of 8 */
+    int8_t kind;
+    int8_t level;
+    uint16_t unused;
+    uint32_t line;
+    uint32_t unused2;
+    uint64_t seq;
+    const char *file;
+    const char *format;
+} log_record;
+
+typedef struct log_ring {
+    struct log_ring *next;
+    int in_use;                 /* owned by a thread */
+    uint64_t head;              /* written by the owner */
+    uint64_t dropped;           /* written by the owner */
+    char pad[64];
+    uint64_t tail;              /* written by the writer */
+    uint64_t reported;          /* dropped messages already reported */
+    unsigned char data[RING_SIZE];
+} log_ring;
+
+/* Conversion specification of a printf format */
+typedef struct {
+    const char *start;
+    size_t len;
+    int stars;                  /* '*' width and precision */
+    char length;                /* 0, 'H' (hh), 'h', 'l', 'q' (ll), 'j', 'z', 't', 'L' */
+    char conversion;
+} format_spec;
+
 /* current debug level */
 static int debug_level = 0;
 
+static int output = DEBUG_OUTPUT_AUTO;
+static int journal_fd = -1;
+
+static log_ring *rings = NULL;
+static __thread log_ring *thread_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static uint64_t log_seq = 0;
+
+static struct {
+    bool running;
+    bool stop;
+    bool tty;
+    pid_t pid;
+    pthread_t thread;
+    pthread_mutex_t drain_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} writer = { false, false, false, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static const char string_format[] = "%s";
+
 void set_debug_level(int level) {
     debug_level = level;
 }
@@ -41,39 +122,538 @@ int get_debug_level(void) {
     return debug_level;
 }
 
+void debug_set_output(int new_output) {
+    output = new_output;
+}
+
+/* Output */
+
+static int syslog_priority(int kind, int level) {
+    switch (kind) {
+    case DEBUG_MSG_ERR: return LOG_ERR;
+    case DEBUG_MSG_WARN: return LOG_WARNING;
+    case DEBUG_MSG_DBG: return LOG_DEBUG;
+    }
+    if (level < 0) return LOG_ERR;
+    return level > 0 ? LOG_DEBUG : LOG_INFO;
+}
+
+static int journal_send(int priority, const char *file, int line, const char *message) {
+    struct sockaddr_un addr;
+    char buf[LINE_MAX_LEN + 256];
+    int len;
+
+    if (journal_fd < 0) {
+        journal_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (journal_fd < 0) return -1;
+    }
+    len = snprintf(buf, sizeof(buf), "PRIORITY=%d\nSYSLOG_IDENTIFIER=" IDENT "\nCODE_FILE=%s\nCODE_LINE=%d\nMESSAGE=%s\n",
+                   priority, file, line, message);
+    if (len < 0) return -1;
+    if ((size_t) len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+        buf[len - 1] = '\n';
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, JOURNAL_SOCKET, sizeof(addr.sun_path) - 1);
+    return sendto(journal_fd, buf, len, MSG_NOSIGNAL, (struct sockaddr *) &addr, sizeof(addr)) < 0 ? -1 : 0;
+}
+
+static void emit(int kind, int level, const char *file, int line, char *message, bool tty) {
+    int priority = syslog_priority(kind, level);
+
+    /* One line per message in the journal and syslog */
+    if (output != DEBUG_OUTPUT_AUTO) {
+        for (char *p = message; *p; p++) {
+            if (*p == '\n') *p = ' ';
+        }
+    }
+    if (output == DEBUG_OUTPUT_JOURNALD && journal_send(priority, file, line, message) == 0) return;
+    if (output != DEBUG_OUTPUT_AUTO) {
+        syslog(priority, "%s", message);
+        return;
+    }
+
+    if (kind != KIND_PRINT) {
+        const char *tag = kind == DEBUG_MSG_ERR ? "ERROR" : (kind == DEBUG_MSG_WARN ? "WARNING" : "DBG");
+#ifdef DEBUG
+        fprintf(stderr, IDENT ": %s %s:%d\n" IDENT ":     %s\n", tag, file, line, message);
+#else
+        fprintf(stderr, IDENT ": %s: %s\n", tag, message);
+#endif
+    } else if (tty) {
+        const char *t = "\033[34mDBG:"; /* blue */
+
+        if (-1 == level)
+            t = "\033[31mERR:"; /* red */
+        else if (0 == level)
+            t = ""; /* standard color */
+
+        /* print preamble */
+        if ( level > 0 ) printf("%s%s:%d: ", t, file, line);
+        else printf("%s", t);
+        /* print message and postamble */
+        printf("%s\033[0m\n", message);
+    } else {
+        /* else we use syslog(3) */
+        syslog(LOG_INFO, "%s", message);
+    }
+}
+
+static bool enabled(int kind, int level) {
+    if (kind == KIND_PRINT) return debug_level >= level;
+    return kind != DEBUG_MSG_DBG || debug_level >= 1;
+}
+
+static void write_now(int kind, int level, const char *file, int line, const char *format, va_list ap) {
+    char message[LINE_MAX_LEN];
+
+    vsnprintf(message, sizeof(message), format, ap);
+    emit(kind, level, file, line, message, isatty(1));
+}
+
+/* Formats */
+
+/**
+ * @brief Parse a conversion specification
+ * @return what follows it, NULL if the daemon does not support it
+ */
+static const char *parse_spec(const char *p, format_spec *spec) {
+    spec->start = p++;
+    spec->stars = 0;
+    spec->length = 0;
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') p++;
+        }
+    }
+    switch (*p) {
+    case 'h':
+        spec->length = p[1] == 'h' ? 'H' : 'h';
+        p += spec->length == 'H' ? 2 : 1;
+        break;
+    case 'l':
+        spec->length = p[1] == 'l' ? 'q' : 'l';
+        p += spec->length == 'q' ? 2 : 1;
+        break;
+    case 'j': case 'z': case 't': case 'L':
+        spec->length = *p++;
+        break;
+    }
+    if (!*p || !strchr("diouxXcspfFeEgGaA%", *p)) return NULL;
+    /* Wide characters */
+    if ((*p == 'c' || *p == 's') && spec->length) return NULL;
+    spec->conversion = *p++;
+    spec->len = p - spec->start;
+    return p;
+}
+
+static bool is_signed(char conversion) {
+    return conversion == 'd' || conversion == 'i';
+}
+
+static bool is_float(char conversion) {
+    return strchr("fFeEgGaA", conversion) != NULL;
+}
+
+static size_t encode_string(unsigned char *buf, size_t size, const char *s) {
+    uint32_t len;
+    size_t used;
+
+    if (!s) s = "(null)";
+    len = strlen(s);
+    if (len > STRING_MAX) len = STRING_MAX;
+    used = 8 + ((len + 1 + 7) & ~7u);
+    if (used > size) return 0;
+    memcpy(buf, &len, sizeof(len));
+    memcpy(buf + 8, s, len);
+    if (s[len] != '\0') memcpy(buf + 8 + len - strlen(STRING_CUT), STRING_CUT, strlen(STRING_CUT));
+    buf[8 + len] = '\0';
+    return used;
+}
+
+/**
+ * @brief Copy the arguments of a format to buf
+ * @return bytes used, 0 if they do not fit or the format is not supported
+ */
+static size_t encode_args(unsigned char *buf, size_t size, const char *format, va_list ap) {
+    size_t used = 0;
+    format_spec spec;
+    const char *p = format;
+
+#define ROOM(n) do { if (used + (n) > size) return 0; } while (0)
+#define PUT(type, value) do { ROOM(8); { type v_ = (value); memcpy(buf + used, &v_, sizeof(v_)); } used += 8; } while (0)
+    while ((p = strchr(p, '%'))) {
+        if (!(p = parse_spec(p, &spec))) return 0;
+        if (spec.conversion == '%') continue;
+        for (int i = 0; i < spec.stars; i++) PUT(int64_t, va_arg(ap, int));
+        if (spec.conversion == 's') {
+            size_t n = encode_string(buf + used, size - used, va_arg(ap, const char *));
+            if (!n) return 0;
+            used += n;
+        } else if (spec.conversion == 'p') {
+            PUT(void *, va_arg(ap, void *));
+        } else if (is_float(spec.conversion)) {
+            if (spec.length == 'L') {
+                long double v = va_arg(ap, long double);
+                ROOM(sizeof(long double) + 8);
+                used = (used + sizeof(long double) - 1) & ~(sizeof(long double) - 1);
+                ROOM(sizeof(long double));
+                memcpy(buf + used, &v, sizeof(v));
+                used += (sizeof(v) + 7) & ~(size_t) 7;
+            } else {
+                PUT(double, va_arg(ap, double));
+            }
+        } else if (is_signed(spec.conversion) || spec.conversion == 'c') {
+            switch (spec.length) {
+            case 'H': PUT(int64_t, (signed char) va_arg(ap, int)); break;
+            case 'h': PUT(int64_t, (short) va_arg(ap, int)); break;
+            case 'l': PUT(int64_t, va_arg(ap, long)); break;
+            case 'q': PUT(int64_t, va_arg(ap, long long)); break;
+            case 'j': PUT(int64_t, va_arg(ap, intmax_t)); break;
+            case 'z': PUT(int64_t, va_arg(ap, ssize_t)); break;
+            case 't': PUT(int64_t, va_arg(ap, ptrdiff_t)); break;
+            default: PUT(int64_t, va_arg(ap, int)); break;
+            }
+        } else {
+            switch (spec.length) {
+            case 'H': PUT(uint64_t, (unsigned char) va_arg(ap, unsigned int)); break;
+            case 'h': PUT(uint64_t, (unsigned short) va_arg(ap, unsigned int)); break;
+            case 'l': PUT(uint64_t, va_arg(ap, unsigned long)); break;
+            case 'q': PUT(uint64_t, va_arg(ap, unsigned long long)); break;
+            case 'j': PUT(uint64_t, va_arg(ap, uintmax_t)); break;
+            case 'z': PUT(uint64_t, va_arg(ap, size_t)); break;
+            case 't': PUT(uint64_t, va_arg(ap, ptrdiff_t)); break;
+            default: PUT(uint64_t, va_arg(ap, unsigned int)); break;
+            }
+        }
+    }
+#undef PUT
+#undef ROOM
+    /* A message without arguments still needs a record */
+    return used ? used : 8;
+}
+
+/**
+ * @brief Format a record, on the writer thread
+ */
+static void format_record(const log_record *rec, char *out, size_t size) {
+    const unsigned char *arg = (const unsigned char *) (rec + 1);
+    const char *p = rec->format;
+    size_t len = 0;
+    format_spec spec;
+
+    out[0] = '\0';
+    while (*p && len < size - 1) {
+        const char *next = strchr(p, '%');
+        char fmt[64];
+        size_t n, f = 0;
+        int stars[2];
+
+        if (!next) next = p + strlen(p);
+        n = (size_t) (next - p) < size - 1 - len ? (size_t) (next - p) : size - 1 - len;
+        memcpy(out + len, p, n);
+        len += n;
+        out[len] = '\0';
+        if (!*next) break;
+        p = parse_spec(next, &spec);
+        if (spec.conversion == '%') {
+            out[len++] = '%';
+            out[len] = '\0';
+            continue;
+        }
+        for (int i = 0; i < spec.stars; i++) {
+            int64_t v;
+            memcpy(&v, arg, sizeof(v));
+            stars[i] = (int) v;
+            arg += 8;
+        }
+        /* The specification, with '*' replaced and integers widened */
+        for (size_t i = 0, star = 0; i < spec.len - 1 && f < sizeof(fmt) - 16; i++) {
+            char c = spec.start[i];
+            if (c == '*') {
+                f += snprintf(fmt + f, sizeof(fmt) - f, "%d", stars[star++]);
+            } else if (!strchr("hljztL", c)) {
+                fmt[f++] = c;
+            }
+        }
+        if (is_float(spec.conversion) && spec.length == 'L') fmt[f++] = 'L';
+        else if (strchr("diouxX", spec.conversion)) {
+            fmt[f++] = 'l';
+            fmt[f++] = 'l';
+        }
+        fmt[f++] = spec.conversion;
+        fmt[f] = '\0';
+
+        if (spec.conversion == 's') {
+            uint32_t slen;
+            memcpy(&slen, arg, sizeof(slen));
+            n = snprintf(out + len, size - len, fmt, (const char *) arg + 8);
+            arg += 8 + ((slen + 1 + 7) & ~7u);
+        } else if (spec.conversion == 'p') {
+            void *v;
+            memcpy(&v, arg, sizeof(v));
+            n = snprintf(out + len, size - len, fmt, v);
+            arg += 8;
+        } else if (is_float(spec.conversion) && spec.length == 'L') {
+            long double v;
+            size_t offset = (const unsigned char *) arg - (const unsigned char *) (rec + 1);
+            offset = (offset + sizeof(long double) - 1) & ~(sizeof(long double) - 1);
+            arg = (const unsigned char *) (rec + 1) + offset;
+            memcpy(&v, arg, sizeof(v));
+            n = snprintf(out + len, size - len, fmt, v);
+            arg += (sizeof(v) + 7) & ~(size_t) 7;
+        } else if (is_float(spec.conversion)) {
+            double v;
+            memcpy(&v, arg, sizeof(v));
+            n = snprintf(out + len, size - len, fmt, v);
+            arg += 8;
+        } else if (is_signed(spec.conversion) || spec.conversion == 'c') {
+            int64_t v;
+            memcpy(&v, arg, sizeof(v));
+            if (spec.conversion == 'c') n = snprintf(out + len, size - len, fmt, (int) v);
+            else n = snprintf(out + len, size - len, fmt, (long long) v);
+            arg += 8;
+        } else {
+            uint64_t v;
+            memcpy(&v, arg, sizeof(v));
+            n = snprintf(out + len, size - len, fmt, (unsigned long long) v);
+            arg += 8;
+        }
+        len += n < size - len ? n : size - 1 - len;
+    }
+}
+
+/* Rings */
+
+static void ring_release(void *data) {
+    log_ring *ring = data;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/**
+ * @brief Ring of the calling thread, a released one or a new one
+ */
+static log_ring *ring_get(void) {
+    log_ring *ring;
+
+    if (thread_ring) return thread_ring;
+    pthread_once(&ring_once, ring_key_init);
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(log_ring));
+        if (!ring) return NULL;
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+static void ring_put(log_ring *ring, const log_record *rec, const unsigned char *args, size_t args_len) {
+    uint64_t head = ring->head;
+    size_t offset = head & (RING_SIZE - 1);
+    size_t pad = 0;
+
+    if (offset + rec->size > RING_SIZE) pad = RING_SIZE - offset;
+    if (head + pad + rec->size - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (pad) {
+        log_record *padding = (log_record *) (ring->data + offset);
+        padding->size = pad;
+        padding->kind = KIND_PADDING;
+        offset = 0;
+    }
+    memcpy(ring->data + offset, rec, sizeof(log_record));
+    memcpy(ring->data + offset + sizeof(log_record), args, args_len);
+    __atomic_store_n(&ring->head, head + pad + rec->size, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Next record of a ring, NULL if it is empty
+ */
+static const log_record *ring_peek(log_ring *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (ring->tail != head) {
+        const log_record *rec = (const log_record *) (ring->data + (ring->tail & (RING_SIZE - 1)));
+        if (rec->kind != KIND_PADDING) return rec;
+        __atomic_store_n(&ring->tail, ring->tail + rec->size, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void log_message(int kind, int level, const char *file, int line, const char *format, va_list ap) {
+    unsigned char args[ARGS_MAX];
+    log_record rec;
+    log_ring *ring;
+    size_t args_len;
+    va_list copy;
+
+    if (!__atomic_load_n(&writer.running, __ATOMIC_ACQUIRE) || writer.pid != getpid() || !(ring = ring_get())) {
+        write_now(kind, level, file, line, format, ap);
+        return;
+    }
+    va_copy(copy, ap);
+    args_len = encode_args(args, sizeof(args), format, copy);
+    va_end(copy);
+    if (args_len == 0) {
+        /* Unsupported format or too long: format it here, a byte over so a cut shows */
+        char message[STRING_MAX + 2];
+        vsnprintf(message, sizeof(message), format, ap);
+        format = string_format;
+        args_len = encode_string(args, sizeof(args), message);
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.size = sizeof(log_record) + args_len;
+    rec.kind = kind;
+    rec.level = level;
+    rec.line = line;
+    rec.seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+    rec.file = file;
+    rec.format = format;
+    ring_put(ring, &rec, args, args_len);
+}
+
 void debug_print(int level, const char *file, int line, const char *format, ...) {
     va_list ap;
-    if (debug_level >= level) {
-        /* is stdout is a tty */
-        if (isatty(1)) {
-            const char *t = "\033[34mDBG:"; /* blue */
-
-            if (-1 == level)
-                t = "\033[31mERR:"; /* red */
-            else if (0 == level)
-                t = ""; /* standard color */
-
-            /* print preamble */
-            if ( level > 0 ) printf("%s%s:%d: ", t, file, line);
-            else printf("%s", t);
-
-            /* print message */
-            va_start(ap, format);
-            vprintf(format, ap);
-            va_end(ap);
-            /* print postamble */
-            printf("\033[0m\n");
-        } else {
-            /* else we use syslog(3) */
-            char buf[100];
 
-            /* print message */
-            va_start(ap, format);
-            vsnprintf(buf, sizeof(buf), format, ap);
-            va_end(ap);
+    if (!enabled(KIND_PRINT, level)) return;
+    va_start(ap, format);
+    log_message(KIND_PRINT, level, file, line, format, ap);
+    va_end(ap);
+}
+
+void debug_message(int kind, const char *file, int line, const char *format, ...) {
+    va_list ap;
+
+    if (!enabled(kind, 0)) return;
+    va_start(ap, format);
+    log_message(kind, 0, file, line, format, ap);
+    va_end(ap);
+}
+
+/* Writer */
+
+/**
+ * @brief Write the queued messages, oldest first. Called with drain_lock held.
+ */
+static void drain(void) {
+    char message[LINE_MAX_LEN];
+    log_ring *ring;
+
+    for (;;) {
+        const log_record *oldest = NULL;
+        log_ring *from = NULL;
 
-            syslog(LOG_INFO, "%s", buf);
+        for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+            const log_record *rec = ring_peek(ring);
+            if (rec && (!oldest || rec->seq < oldest->seq)) {
+                oldest = rec;
+                from = ring;
+            }
+        }
+        if (!oldest) break;
+        format_record(oldest, message, sizeof(message));
+        emit(oldest->kind, oldest->level, oldest->file, oldest->line, message, writer.tty);
+        __atomic_store_n(&from->tail, from->tail + oldest->size, __ATOMIC_RELEASE);
+    }
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            snprintf(message, sizeof(message), "%llu log message(s) dropped", (unsigned long long) (dropped - ring->reported));
+            emit(DEBUG_MSG_WARN, 0, __FILE__, __LINE__, message, writer.tty);
+            ring->reported = dropped;
         }
     }
+    fflush(stdout);
+    fflush(stderr);
 }
 
+static void *writer_main(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&writer.lock);
+    while (!writer.stop) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WRITER_PERIOD * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&writer.cond, &writer.lock, &deadline);
+        pthread_mutex_unlock(&writer.lock);
+        pthread_mutex_lock(&writer.drain_lock);
+        drain();
+        pthread_mutex_unlock(&writer.drain_lock);
+        pthread_mutex_lock(&writer.lock);
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return NULL;
+}
+
+void debug_flush(void) {
+    if (!__atomic_load_n(&writer.running, __ATOMIC_ACQUIRE) || writer.pid != getpid()) return;
+    pthread_mutex_lock(&writer.drain_lock);
+    drain();
+    pthread_mutex_unlock(&writer.drain_lock);
+}
+
+int debug_start_writer(void) {
+    static bool registered = false;
+    sigset_t all, old;
+    int res;
+
+    if (writer.running) return 0;
+    writer.tty = isatty(1);
+    writer.pid = getpid();
+    writer.stop = false;
+    /* Signals are for the main loop, not for the writer */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = pthread_create(&writer.thread, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res != 0) return -1;
+    /* Messages queued before exit(3) */
+    if (!registered) registered = atexit(debug_flush) == 0;
+    __atomic_store_n(&writer.running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void debug_stop_writer(void) {
+    if (!writer.running || writer.pid != getpid()) return;
+    pthread_mutex_lock(&writer.lock);
+    writer.stop = true;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.thread, NULL);
+    /* Back to synchronous writes, then write what is left */
+    __atomic_store_n(&writer.running, false, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&writer.drain_lock);
+    drain();
+    pthread_mutex_unlock(&writer.drain_lock);
+}
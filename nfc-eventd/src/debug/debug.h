@@ -30,7 +30,42 @@
   #include <config.h>
 #endif
 
-#define INFO(x,...) debug_print(0, __FILE__, __LINE__, x, ## __VA_ARGS__ )
+/*
+ * Messages are written by a background thread once debug_start_writer() has
+ * been called: the calling thread only copies the format pointer and the
+ * arguments to a ring of its own, without locking nor formatting. Until
+ * then, and in the modules' copy of this library, they are written at once.
+ *
+ * Written from the rings, %s arguments are cut at 256 bytes, ending with
+ * "...", and messages of different threads are only roughly in order: one
+ * logged while another thread is copying its own may come out first.
+ * Messages of a thread keep their order.
+ */
+
+/* Levels compiled in, see --with-log-level */
+#define NED_LOG_ERROR 0
+#define NED_LOG_WARN  1
+#define NED_LOG_INFO  2
+#define NED_LOG_DEBUG 3
+#ifndef NED_LOG_LEVEL
+  #define NED_LOG_LEVEL NED_LOG_DEBUG
+#endif
+
+#if NED_LOG_LEVEL >= NED_LOG_INFO
+  #define INFO(x,...) debug_print(0, __FILE__, __LINE__, x, ## __VA_ARGS__ )
+#else
+  #define INFO(x,...) do { } while (0)
+#endif
+
+/* Kind of message, for debug_message() */
+#define DEBUG_MSG_DBG  1
+#define DEBUG_MSG_WARN 2
+#define DEBUG_MSG_ERR  3
+
+/* Where messages go, for debug_set_output() */
+#define DEBUG_OUTPUT_AUTO     0     /* terminal, else syslog(3) for INFO and stderr for the others */
+#define DEBUG_OUTPUT_SYSLOG   1
+#define DEBUG_OUTPUT_JOURNALD 2     /* systemd journal native protocol, else syslog(3) */
 
 #ifndef __DEBUG_C_
   #define DEBUG_EXTERN extern
@@ -62,7 +97,37 @@ DEBUG_EXTERN int get_debug_level(void);
  * @param format Message format
  * @param ... Optional arguments
  */
-DEBUG_EXTERN void debug_print(int level, const char *file, int line, const char *format, ...);
+DEBUG_EXTERN void debug_print(int level, const char *file, int line, const char *format, ...)
+    __attribute__ ((format (printf, 4, 5)));
+
+/**
+ * @brief Log a DBG, WARN or ERR message (see nfc-utils.h)
+ * DBG messages are only written when the debug level is at least 1.
+ */
+DEBUG_EXTERN void debug_message(int kind, const char *file, int line, const char *format, ...)
+    __attribute__ ((format (printf, 4, 5)));
+
+/**
+ * @brief Select where messages go, DEBUG_OUTPUT_*
+ */
+DEBUG_EXTERN void debug_set_output(int output);
+
+/**
+ * @brief Write messages from a background thread from now on
+ * Call it after daemon(3): threads do not survive fork(2).
+ * @return 0 on success, -1 on error (messages are still written at once)
+ */
+DEBUG_EXTERN int debug_start_writer(void);
+
+/**
+ * @brief Write every queued message now
+ */
+DEBUG_EXTERN void debug_flush(void);
+
+/**
+ * @brief Write every queued message and stop the background thread
+ */
+DEBUG_EXTERN void debug_stop_writer(void);
 
 #undef DEBUG_EXTERN
 
@@ -45,15 +45,14 @@
 #  include <string.h>
 #  include <err.h>
 
+#  include "debug.h"
+
 /**
  * @macro DBG
  * @brief Print a message of standard output only in DEBUG mode
  */
-#ifdef DEBUG
-#  define DBG(...) do { \
-    warnx ("DBG %s:%d", __FILE__, __LINE__); \
-    warnx ("    " __VA_ARGS__ ); \
-  } while (0)
+#if defined(DEBUG) && NED_LOG_LEVEL >= NED_LOG_DEBUG
+#  define DBG(...) debug_message (DEBUG_MSG_DBG, __FILE__, __LINE__, __VA_ARGS__ )
 #else
 #  define DBG(...) {}
 #endif
@@ -62,27 +61,17 @@
  * @macro WARN
  * @brief Print a warn message
  */
-#ifdef DEBUG
-#  define WARN(...) do { \
-    warnx ("WARNING %s:%d", __FILE__, __LINE__); \
-    warnx ("    " __VA_ARGS__ ); \
-  } while (0)
+#if NED_LOG_LEVEL >= NED_LOG_WARN
+#  define WARN(...) debug_message (DEBUG_MSG_WARN, __FILE__, __LINE__, __VA_ARGS__ )
 #else
-#  define WARN(...) warnx ("WARNING: " __VA_ARGS__ )
+#  define WARN(...) do { } while (0)
 #endif
 
 /**
  * @macro ERR
  * @brief Print a error message
  */
-#ifdef DEBUG
-#  define ERR(...) do { \
-    warnx ("ERROR %s:%d", __FILE__, __LINE__); \
-    warnx ("    " __VA_ARGS__ ); \
-  } while (0)
-#else
-#  define ERR(...)  warnx ("ERROR: " __VA_ARGS__ )
-#endif
+#define ERR(...) debug_message (DEBUG_MSG_ERR, __FILE__, __LINE__, __VA_ARGS__ )
 
 #ifndef MIN
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
@@ -0,0 +1,139 @@
+/*
+ * NFC Event Daemon
+ * Tag dwell time statistics
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dwell.h"
+
+#define SUB_COUNT (1 << NED_DWELL_SUB_BITS)
+
+static unsigned int
+bucket_index(uint64_t ms)
+{
+    unsigned int e;
+
+    if (ms < SUB_COUNT)
+        return ms;
+    if (ms > UINT32_MAX)
+        ms = UINT32_MAX;
+    e = 63 - __builtin_clzll(ms);
+    return ((e - NED_DWELL_SUB_BITS + 1) << NED_DWELL_SUB_BITS) +
+           ((ms >> (e - NED_DWELL_SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/**
+ * @brief Middle of the values a bucket holds
+ */
+static uint64_t
+bucket_value(unsigned int index)
+{
+    unsigned int e, sub;
+
+    if (index < SUB_COUNT)
+        return index;
+    e = (index >> NED_DWELL_SUB_BITS) + NED_DWELL_SUB_BITS - 1;
+    sub = index & (SUB_COUNT - 1);
+    return ((uint64_t) (SUB_COUNT + sub) << (e - NED_DWELL_SUB_BITS)) +
+           ((uint64_t) 1 << (e - NED_DWELL_SUB_BITS)) / 2;
+}
+
+void
+ned_dwell_add(ned_dwell_sketch *sketch, uint64_t dwell_ms)
+{
+    sketch->buckets[bucket_index(dwell_ms)]++;
+    sketch->count++;
+    sketch->sum_ms += dwell_ms;
+    if (dwell_ms > sketch->max_ms)
+        sketch->max_ms = dwell_ms;
+}
+
+uint64_t
+ned_dwell_quantile(const ned_dwell_sketch *sketch, double q)
+{
+    uint64_t rank, seen = 0;
+
+    if (sketch->count == 0)
+        return 0;
+    /* Nearest rank */
+    rank = (uint64_t) (q * sketch->count);
+    if ((double) rank < q * sketch->count)
+        rank++;
+    if (rank == 0)
+        rank = 1;
+    for (unsigned int i = 0; i < NED_DWELL_BUCKETS; i++) {
+        seen += sketch->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value > sketch->max_ms ? sketch->max_ms : value;
+        }
+    }
+    return sketch->max_ms;
+}
+
+void
+ned_dwell_top_add(ned_dwell_top *top, const uint8_t *uid, size_t uid_len,
+                  unsigned int reader_id, uint64_t dwell_ms)
+{
+    ned_dwell_top_entry *entry = NULL;
+
+    if (uid_len > NED_DWELL_UID_MAX)
+        uid_len = NED_DWELL_UID_MAX;
+    for (size_t i = 0; i < top->count; i++) {
+        ned_dwell_top_entry *e = &top->entries[i];
+        if (e->uid_len == uid_len && memcmp(e->uid, uid, uid_len) == 0) {
+            if (dwell_ms > e->dwell_ms) {
+                e->dwell_ms = dwell_ms;
+                e->reader_id = reader_id;
+            }
+            return;
+        }
+        if (!entry || e->dwell_ms < entry->dwell_ms)
+            entry = e;
+    }
+    if (top->count < NED_DWELL_TOP)
+        entry = &top->entries[top->count++];
+    else if (dwell_ms <= entry->dwell_ms)
+        return;
+    memcpy(entry->uid, uid, uid_len);
+    entry->uid_len = uid_len;
+    entry->reader_id = reader_id;
+    entry->dwell_ms = dwell_ms;
+}
+
+static int
+top_compare(const void *a, const void *b)
+{
+    const ned_dwell_top_entry *ea = a, *eb = b;
+
+    if (ea->dwell_ms == eb->dwell_ms)
+        return 0;
+    return ea->dwell_ms < eb->dwell_ms ? 1 : -1;
+}
+
+void
+ned_dwell_top_sort(ned_dwell_top *top)
+{
+    qsort(top->entries, top->count, sizeof(ned_dwell_top_entry), top_compare);
+}
@@ -0,0 +1,84 @@
+/*
+ * NFC Event Daemon
+ * Tag dwell time statistics
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __DWELL_H__
+#define __DWELL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Dwell time: how long a tag stayed on a reader, from its insertion to its
+ * removal.
+ *
+ * A sketch is a log-linear histogram: values below 32 ms are counted
+ * exactly, then each power of two is split in 32 buckets, so that quantiles
+ * are within 1/32 of the true value. Adding a value is a couple of
+ * instructions; the size is fixed whatever the number of values.
+ */
+
+#define NED_DWELL_SUB_BITS 5
+#define NED_DWELL_BUCKETS ((32 - NED_DWELL_SUB_BITS + 1) << NED_DWELL_SUB_BITS)
+
+typedef struct {
+    uint32_t buckets[NED_DWELL_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ms;
+    uint64_t max_ms;
+} ned_dwell_sketch;
+
+/* Longest dwell times, one entry per UID */
+#define NED_DWELL_TOP 16
+#define NED_DWELL_UID_MAX 10
+
+typedef struct {
+    uint8_t uid[NED_DWELL_UID_MAX];
+    uint8_t uid_len;
+    unsigned int reader_id;
+    uint64_t dwell_ms;
+} ned_dwell_top_entry;
+
+typedef struct {
+    ned_dwell_top_entry entries[NED_DWELL_TOP];
+    size_t count;
+} ned_dwell_top;
+
+void ned_dwell_add(ned_dwell_sketch *sketch, uint64_t dwell_ms);
+
+/**
+ * @brief Estimate a quantile
+ * @param q between 0 and 1
+ * @return dwell time in ms, 0 if the sketch is empty
+ */
+uint64_t ned_dwell_quantile(const ned_dwell_sketch *sketch, double q);
+
+/**
+ * @brief Offer a dwell time to the top list
+ * A UID already in the list keeps its longest dwell time.
+ */
+void ned_dwell_top_add(ned_dwell_top *top, const uint8_t *uid, size_t uid_len,
+                       unsigned int reader_id, uint64_t dwell_ms);
+
+/**
+ * @brief Sort the top list, longest first
+ */
+void ned_dwell_top_sort(ned_dwell_top *top);
+
+#endif /* __DWELL_H__ */
@@ -0,0 +1,277 @@
+/*
+ * NFC Event Daemon
+ * Shared memory event ring
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "evring.h"
+
+#ifndef MFD_CLOEXEC
+  #define MFD_CLOEXEC 0x0001U
+#endif
+
+#define CACHE_LINE 64
+
+typedef struct {
+    uint64_t head;                              /* written by the producer */
+    char pad1[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t tail;                              /* written by the consumer */
+    char pad2[CACHE_LINE - sizeof(uint64_t)];
+    /* Written by the consumer */
+    uint64_t delivered;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+    uint64_t sleeping;                          /* blocked on the eventfd */
+    char pad3[CACHE_LINE - 4 * sizeof(uint64_t)];
+    ned_evring_entry slot[NED_EVRING_SLOTS];
+} evring_shm;
+
+struct ned_evring {
+    evring_shm *shm;
+    int shm_fd;
+    int event_fd;
+    /* Producer only */
+    uint64_t pushed;
+    uint64_t dropped;
+};
+
+static int
+memfd_create_compat(void)
+{
+#ifdef SYS_memfd_create
+    int fd = syscall(SYS_memfd_create, "nfc-eventd-ring", MFD_CLOEXEC);
+    if (fd >= 0 || errno != ENOSYS)
+        return fd;
+#endif
+    /* Kernel older than 3.17: an unlinked file in /dev/shm */
+    char path[] = "/dev/shm/nfc-eventd-ring-XXXXXX";
+    int tmp = mkstemp(path);
+    if (tmp < 0)
+        return -1;
+    unlink(path);
+    if (fcntl(tmp, F_SETFD, FD_CLOEXEC) < 0) {
+        close(tmp);
+        return -1;
+    }
+    return tmp;
+}
+
+static ned_evring *
+evring_map(int shm_fd, int event_fd)
+{
+    ned_evring *ring = calloc(1, sizeof(ned_evring));
+    if (!ring)
+        return NULL;
+    ring->shm = mmap(NULL, sizeof(evring_shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (ring->shm == MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+    ring->shm_fd = shm_fd;
+    ring->event_fd = event_fd;
+    return ring;
+}
+
+ned_evring *
+ned_evring_new(void)
+{
+    ned_evring *ring;
+    int shm_fd, event_fd = -1;
+
+    shm_fd = memfd_create_compat();
+    if (shm_fd < 0)
+        return NULL;
+    if (ftruncate(shm_fd, sizeof(evring_shm)) < 0 ||
+        (event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        !(ring = evring_map(shm_fd, event_fd))) {
+        int err = errno;
+        close(shm_fd);
+        if (event_fd >= 0)
+            close(event_fd);
+        errno = err;
+        return NULL;
+    }
+    return ring;
+}
+
+ned_evring *
+ned_evring_attach(int shm_fd, int event_fd)
+{
+    struct stat st;
+    ned_evring *ring;
+
+    if (fstat(shm_fd, &st) < 0)
+        return NULL;
+    if (st.st_size != sizeof(evring_shm)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ring = evring_map(shm_fd, event_fd);
+    if (!ring)
+        return NULL;
+    fcntl(shm_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(event_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(event_fd, F_SETFL, fcntl(event_fd, F_GETFL) | O_NONBLOCK);
+    return ring;
+}
+
+void
+ned_evring_free(ned_evring *ring)
+{
+    if (!ring)
+        return;
+    munmap(ring->shm, sizeof(evring_shm));
+    close(ring->shm_fd);
+    close(ring->event_fd);
+    free(ring);
+}
+
+int
+ned_evring_shm_fd(const ned_evring *ring)
+{
+    return ring->shm_fd;
+}
+
+int
+ned_evring_event_fd(const ned_evring *ring)
+{
+    return ring->event_fd;
+}
+
+int
+ned_evring_push(ned_evring *ring, const ned_evring_entry *entry)
+{
+    uint64_t head = ring->shm->head;
+
+    if (head - __atomic_load_n(&ring->shm->tail, __ATOMIC_ACQUIRE) >= NED_EVRING_SLOTS) {
+        ring->dropped++;
+        return -1;
+    }
+    ring->shm->slot[head % NED_EVRING_SLOTS] = *entry;
+    ring->shm->slot[head % NED_EVRING_SLOTS].queued_ns = ned_evring_now_ns();
+    __atomic_store_n(&ring->shm->head, head + 1, __ATOMIC_RELEASE);
+    ring->pushed++;
+    return 0;
+}
+
+void
+ned_evring_notify(ned_evring *ring)
+{
+    uint64_t one = 1;
+    ssize_t res;
+
+    /* Pairs with ned_evring_sleep(): either the consumer sees the new head,
+     * or this sees it sleeping */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ring->shm->sleeping, __ATOMIC_RELAXED))
+        return;
+    do {
+        res = write(ring->event_fd, &one, sizeof(one));
+    } while (res < 0 && errno == EINTR);
+}
+
+void
+ned_evring_clear(ned_evring *ring)
+{
+    uint64_t value;
+    ssize_t res;
+
+    __atomic_store_n(&ring->shm->sleeping, 0, __ATOMIC_RELAXED);
+    do {
+        res = read(ring->event_fd, &value, sizeof(value));
+    } while (res < 0 && errno == EINTR);
+}
+
+bool
+ned_evring_pending(const ned_evring *ring)
+{
+    return __atomic_load_n(&ring->shm->head, __ATOMIC_ACQUIRE) != ring->shm->tail;
+}
+
+bool
+ned_evring_sleep(ned_evring *ring)
+{
+    __atomic_store_n(&ring->shm->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!ned_evring_pending(ring))
+        return true;
+    __atomic_store_n(&ring->shm->sleeping, 0, __ATOMIC_RELAXED);
+    return false;
+}
+
+size_t
+ned_evring_pop(ned_evring *ring, ned_evring_entry *entries, size_t max)
+{
+    uint64_t tail = ring->shm->tail;
+    uint64_t head = __atomic_load_n(&ring->shm->head, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+
+    while (tail != head && count < max)
+        entries[count++] = ring->shm->slot[tail++ % NED_EVRING_SLOTS];
+    /* Released before delivery: an event that crashes the module is not
+     * handed to its next instance */
+    __atomic_store_n(&ring->shm->tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+void
+ned_evring_delivered(ned_evring *ring, const ned_evring_entry *entry)
+{
+    evring_shm *shm = ring->shm;
+    uint64_t latency = ned_evring_now_ns() - entry->queued_ns;
+
+    __atomic_store_n(&shm->delivered, shm->delivered + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->latency_total_ns, shm->latency_total_ns + latency, __ATOMIC_RELAXED);
+    if (latency > shm->latency_max_ns)
+        __atomic_store_n(&shm->latency_max_ns, latency, __ATOMIC_RELAXED);
+}
+
+void
+ned_evring_get_stats(const ned_evring *ring, ned_evring_stats *stats)
+{
+    stats->pushed = ring->pushed;
+    stats->dropped = ring->dropped;
+    stats->delivered = __atomic_load_n(&ring->shm->delivered, __ATOMIC_RELAXED);
+    stats->latency_total_ns = __atomic_load_n(&ring->shm->latency_total_ns, __ATOMIC_RELAXED);
+    stats->latency_max_ns = __atomic_load_n(&ring->shm->latency_max_ns, __ATOMIC_RELAXED);
+}
+
+uint64_t
+ned_evring_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,136 @@
+/*
+ * NFC Event Daemon
+ * Shared memory event ring
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __EVRING_H__
+#define __EVRING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <nfc/nfc.h>
+
+#include "types.h"
+
+/*
+ * Module events on their way to a module host process: a single producer,
+ * single consumer ring in shared memory (memfd) and an eventfd to wake the
+ * consumer up. Events are copied in and out, the ring holds no pointer.
+ *
+ * The ring outlives the consumer: events queued while the module host is
+ * restarting are delivered to the next one. Functions returning int return 0
+ * on success, -1 with errno set otherwise.
+ */
+
+#define NED_EVRING_SLOTS 256
+#define NED_EVRING_NAME_MAX 256
+
+typedef struct ned_evring ned_evring;
+
+/* An event popped from the ring, pointers refer to the entry itself */
+typedef struct {
+    nem_event_t event;
+    unsigned int reader_id;
+    unsigned int dropped;
+    uint64_t timestamp_us;
+    uint64_t queued_ns;             /* monotonic clock, when it was pushed */
+    bool has_tag;
+    bool has_name;
+    nfc_target tag;
+    char connstring[sizeof(nfc_connstring)];
+    char reader_name[NED_EVRING_NAME_MAX];
+} ned_evring_entry;
+
+typedef struct {
+    uint64_t pushed;
+    uint64_t dropped;               /* ring full */
+    uint64_t delivered;
+    uint64_t latency_total_ns;      /* push to delivery, per event */
+    uint64_t latency_max_ns;
+} ned_evring_stats;
+
+/**
+ * @brief Create a ring (producer side)
+ */
+ned_evring *ned_evring_new(void);
+
+/**
+ * @brief Map a ring created by another process (consumer side)
+ * The ring takes ownership of both descriptors.
+ */
+ned_evring *ned_evring_attach(int shm_fd, int event_fd);
+
+void ned_evring_free(ned_evring *ring);
+
+int ned_evring_shm_fd(const ned_evring *ring);
+
+/**
+ * @brief Descriptor that becomes readable when events are pushed
+ */
+int ned_evring_event_fd(const ned_evring *ring);
+
+/**
+ * @brief Queue an event, without waking the consumer up
+ * @return 0, -1 if the ring is full and the event was dropped
+ */
+int ned_evring_push(ned_evring *ring, const ned_evring_entry *entry);
+
+/**
+ * @brief Wake the consumer up, once per batch of pushes
+ * Only if it is blocked on the event descriptor (see ned_evring_sleep()).
+ */
+void ned_evring_notify(ned_evring *ring);
+
+/**
+ * @brief Acknowledge a wake-up, before popping
+ */
+void ned_evring_clear(ned_evring *ring);
+
+/**
+ * @brief Whether events are waiting to be popped
+ */
+bool ned_evring_pending(const ned_evring *ring);
+
+/**
+ * @brief Ask to be woken up through the event descriptor, before blocking
+ * Until then, pushes do not write the descriptor.
+ * @return false if events came in meanwhile: pop them instead of blocking
+ */
+bool ned_evring_sleep(ned_evring *ring);
+
+/**
+ * @brief Take up to max events out of the ring
+ * @return number of entries filled
+ */
+size_t ned_evring_pop(ned_evring *ring, ned_evring_entry *entries, size_t max);
+
+/**
+ * @brief Record the delivery of an event popped from the ring
+ */
+void ned_evring_delivered(ned_evring *ring, const ned_evring_entry *entry);
+
+void ned_evring_get_stats(const ned_evring *ring, ned_evring_stats *stats);
+
+/**
+ * @brief Monotonic clock in nanoseconds, comparable between processes
+ */
+uint64_t ned_evring_now_ns(void);
+
+#endif /* __EVRING_H__ */
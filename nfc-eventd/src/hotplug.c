@@ -0,0 +1,308 @@
+/*
+ * NFC Event Daemon
+ * Device hotplug monitoring
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+
+#include "hotplug.h"
+
+/* Debugging functions */
+#include "debug/debug.h"
+#include "debug/nfc-utils.h"
+
+#define UEVENT_BUFFER_SIZE 8192
+#define USB_BUS_DIR "/dev/bus/usb"
+
+typedef enum {
+    BACKEND_NONE,
+    BACKEND_NETLINK,
+    BACKEND_INOTIFY,
+} hotplug_backend;
+
+static struct {
+    ned_loop *loop;
+    hotplug_backend backend;
+    int fd;
+    ned_loop_timer *debounce;
+    unsigned int debounce_ms;
+    ned_hotplug_cb cb;
+    void *data;
+    ned_hotplug_stats stats;
+} hotplug = { NULL, BACKEND_NONE, -1, NULL, 0, NULL, NULL, { 0, 0, 0 } };
+
+/* Subsystems libnfc drivers may sit on */
+static const char *const subsystems[] = { "usb", "tty", "i2c", "i2c-dev", "spi", "spidev", NULL };
+
+static void
+debounce_cb(ned_loop *loop, ned_loop_timer *timer, void *data)
+{
+    (void) loop;
+    (void) timer;
+    (void) data;
+
+    hotplug.stats.rescans++;
+    DBG("%s", "Devices changed, rescanning");
+    hotplug.cb(hotplug.data);
+}
+
+/**
+ * @brief Something changed: (re)start the quiet period
+ */
+static void
+hotplug_changed(void)
+{
+    hotplug.stats.relevant++;
+    ned_loop_timer_set(hotplug.debounce, hotplug.debounce_ms ? hotplug.debounce_ms : 1, 0);
+}
+
+void
+ned_hotplug_inject(const char *buf, size_t len)
+{
+    const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+    const char *p = buf, *end = buf + len;
+    bool relevant = false;
+
+    hotplug.stats.uevents++;
+    /* NUL separated strings, the first one may be "action@devpath" */
+    while (p < end) {
+        size_t n = strnlen(p, end - p);
+        if (strncmp(p, "ACTION=", 7) == 0)
+            action = p + 7;
+        else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+            subsystem = p + 10;
+        else if (strncmp(p, "DEVTYPE=", 8) == 0)
+            devtype = p + 8;
+        p += n + 1;
+    }
+    if (!action || !subsystem)
+        return;
+    if (strcmp(action, "add") != 0 && strcmp(action, "remove") != 0)
+        return;
+    for (const char *const *s = subsystems; *s; s++) {
+        if (strcmp(subsystem, *s) == 0) {
+            relevant = true;
+            break;
+        }
+    }
+    /* A USB device comes with one uevent per interface, only keep the device */
+    if (relevant && strcmp(subsystem, "usb") == 0 && devtype && strcmp(devtype, "usb_device") != 0)
+        relevant = false;
+    if (!relevant)
+        return;
+    DBG("uevent: %s %s%s%s", action, subsystem, devtype ? "/" : "", devtype ? devtype : "");
+    if (hotplug.debounce)
+        hotplug_changed();
+}
+
+static void
+netlink_cb(ned_loop *loop, int fd, uint32_t events, void *data)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    struct sockaddr_nl sender;
+    socklen_t sender_len = sizeof(sender);
+    ssize_t n;
+    (void) loop;
+    (void) events;
+    (void) data;
+
+    while ((n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &sender, &sender_len)) > 0) {
+        /* Only trust the kernel */
+        if (sender.nl_pid != 0)
+            continue;
+        ned_hotplug_inject(buf, n);
+        sender_len = sizeof(sender);
+    }
+}
+
+static int
+netlink_open(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel uevents */
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+dev_name_relevant(const char *name)
+{
+    return strncmp(name, "tty", 3) == 0 || strncmp(name, "i2c-", 4) == 0 || strncmp(name, "spidev", 6) == 0;
+}
+
+static void
+inotify_watch_usb_buses(int fd)
+{
+    DIR *dir = opendir(USB_BUS_DIR);
+    struct dirent *entry;
+    char path[sizeof(USB_BUS_DIR) + 256];
+
+    if (!dir)
+        return;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", USB_BUS_DIR, entry->d_name);
+        inotify_add_watch(fd, path, IN_CREATE | IN_DELETE);
+    }
+    closedir(dir);
+}
+
+static void
+inotify_cb(ned_loop *loop, int fd, uint32_t events, void *data)
+{
+    char buf[UEVENT_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    (void) loop;
+    (void) events;
+    (void) data;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+            hotplug.stats.uevents++;
+            if (ev->mask & IN_ISDIR) {
+                /* A new USB bus, or /dev/bus/usb itself */
+                inotify_watch_usb_buses(fd);
+                continue;
+            }
+            /* Device nodes under /dev/bus/usb have numeric names */
+            if (ev->len && !dev_name_relevant(ev->name) && (ev->name[0] < '0' || ev->name[0] > '9'))
+                continue;
+            DBG("inotify: %s %s", (ev->mask & IN_CREATE) ? "created" : "deleted", ev->len ? ev->name : "");
+            hotplug_changed();
+        }
+    }
+}
+
+static int
+inotify_open(void)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    inotify_watch_usb_buses(fd);
+    return fd;
+}
+
+int
+ned_hotplug_open(ned_loop *loop, unsigned int debounce_ms, ned_hotplug_cb cb, void *data)
+{
+    ned_loop_fd_cb fd_cb = netlink_cb;
+    int fd;
+
+    hotplug.backend = BACKEND_NETLINK;
+    fd = netlink_open();
+    if (fd < 0) {
+        DBG("Unable to listen to uevents (%s), watching /dev instead", strerror(errno));
+        hotplug.backend = BACKEND_INOTIFY;
+        fd_cb = inotify_cb;
+        fd = inotify_open();
+    }
+    if (fd < 0) {
+        hotplug.backend = BACKEND_NONE;
+        return -1;
+    }
+    hotplug.debounce = ned_loop_add_timer(loop, 0, 0, debounce_cb, NULL);
+    if (!hotplug.debounce || ned_loop_add_fd(loop, fd, EPOLLIN, fd_cb, NULL) < 0) {
+        int err = errno;
+        if (hotplug.debounce)
+            ned_loop_remove_timer(loop, hotplug.debounce);
+        hotplug.debounce = NULL;
+        hotplug.backend = BACKEND_NONE;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    hotplug.loop = loop;
+    hotplug.fd = fd;
+    hotplug.debounce_ms = debounce_ms;
+    hotplug.cb = cb;
+    hotplug.data = data;
+    memset(&hotplug.stats, 0, sizeof(hotplug.stats));
+    INFO("Watching device hotplug (%s)", ned_hotplug_backend());
+    return 0;
+}
+
+void
+ned_hotplug_close(void)
+{
+    if (hotplug.fd < 0)
+        return;
+    ned_loop_remove_fd(hotplug.loop, hotplug.fd);
+    close(hotplug.fd);
+    hotplug.fd = -1;
+    ned_loop_remove_timer(hotplug.loop, hotplug.debounce);
+    hotplug.debounce = NULL;
+    hotplug.backend = BACKEND_NONE;
+}
+
+const char *
+ned_hotplug_backend(void)
+{
+    switch (hotplug.backend) {
+    case BACKEND_NETLINK:
+        return "netlink";
+    case BACKEND_INOTIFY:
+        return "inotify";
+    case BACKEND_NONE:
+        break;
+    }
+    return "none";
+}
+
+void
+ned_hotplug_get_stats(ned_hotplug_stats *stats)
+{
+    *stats = hotplug.stats;
+}
@@ -0,0 +1,77 @@
+/*
+ * NFC Event Daemon
+ * Device hotplug monitoring
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __HOTPLUG_H__
+#define __HOTPLUG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "loop.h"
+
+/*
+ * Kernel uevents are received on a NETLINK_KOBJECT_UEVENT socket. When that
+ * socket can not be opened (no netlink in the sandbox, seccomp...), entries
+ * created or deleted in /dev and /dev/bus/usb are watched with inotify.
+ *
+ * Only add/remove events of subsystems libnfc drivers sit on (usb, tty, i2c,
+ * spi) are considered. They usually come in bursts (device, interfaces,
+ * tty...), so the callback runs once the bus has been quiet for the debounce
+ * delay.
+ */
+
+typedef void (*ned_hotplug_cb)(void *data);
+
+typedef struct {
+    uint64_t uevents;   /* received, relevant or not */
+    uint64_t relevant;  /* that (re)armed the debounce timer */
+    uint64_t rescans;   /* callback invocations */
+} ned_hotplug_stats;
+
+/**
+ * @brief Start monitoring device changes
+ * @param debounce_ms quiet period before cb is called
+ * @return 0 on success, -1 if neither netlink nor inotify is usable
+ */
+int ned_hotplug_open(ned_loop *loop, unsigned int debounce_ms, ned_hotplug_cb cb, void *data);
+
+/**
+ * @brief Stop monitoring
+ */
+void ned_hotplug_close(void);
+
+/**
+ * @brief Feed a synthetic uevent, as if received from the kernel
+ * @param buf "KEY=value" strings separated by NUL bytes, optionally preceded
+ * by the "action@devpath" header
+ */
+void ned_hotplug_inject(const char *buf, size_t len);
+
+/**
+ * @brief Name of the monitoring backend in use ("netlink", "inotify" or "none")
+ */
+const char *ned_hotplug_backend(void);
+
+/**
+ * @brief Counters since ned_hotplug_open()
+ */
+void ned_hotplug_get_stats(ned_hotplug_stats *stats);
+
+#endif /* __HOTPLUG_H__ */
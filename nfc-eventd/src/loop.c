@@ -0,0 +1,493 @@
+/*
+ * NFC Event Daemon
+ * Main event loop
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include "loop.h"
+
+#ifndef NSIG
+  #define NSIG 65
+#endif
+
+#define MAX_EVENTS 16
+
+typedef enum {
+    SOURCE_FD,
+    SOURCE_TIMER,
+    SOURCE_SIGNAL,
+    SOURCE_CHILD,
+    SOURCE_ASYNC,
+} source_type;
+
+struct ned_loop_source {
+    ned_loop *loop;
+    source_type type;
+    int fd;
+    pid_t pid;
+    bool dead;
+    union {
+        ned_loop_fd_cb fd;
+        ned_loop_timer_cb timer;
+        ned_loop_child_cb child;
+        ned_loop_async_cb async;
+    } cb;
+    void *data;
+    struct ned_loop_source *next;
+};
+
+struct signal_watch {
+    ned_loop_signal_cb cb;
+    void *data;
+};
+
+struct ned_loop {
+    int epfd;
+    bool quit;
+    struct ned_loop_source *sources;
+    struct ned_loop_source *garbage;
+
+    /* All signals go through a single signalfd */
+    struct ned_loop_source *signal_source;
+    sigset_t sigmask;
+    struct signal_watch signals[NSIG];
+
+    /* Set when pidfd_open() is not available: children are reaped on SIGCHLD */
+    bool children_on_sigchld;
+};
+
+uint64_t
+ned_loop_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+ned_loop_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct ned_loop_source *
+source_new(ned_loop *loop, source_type type, int fd, uint32_t events, void *data)
+{
+    struct ned_loop_source *src = calloc(1, sizeof(struct ned_loop_source));
+    if (!src)
+        return NULL;
+    src->loop = loop;
+    src->type = type;
+    src->fd = fd;
+    src->data = data;
+
+    if (fd >= 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = src;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            free(src);
+            return NULL;
+        }
+    }
+    src->next = loop->sources;
+    loop->sources = src;
+    return src;
+}
+
+/* Sources are only released once the current epoll batch has been
+ * dispatched: a callback may remove a source that has a pending event. */
+static void
+source_remove(struct ned_loop_source *src)
+{
+    ned_loop *loop = src->loop;
+    struct ned_loop_source **p;
+
+    if (src->dead)
+        return;
+    src->dead = true;
+    for (p = &loop->sources; *p; p = &(*p)->next) {
+        if (*p == src) {
+            *p = src->next;
+            break;
+        }
+    }
+    if (src->fd >= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+        if (src->type != SOURCE_FD)
+            close(src->fd);
+    }
+    src->next = loop->garbage;
+    loop->garbage = src;
+}
+
+static void
+collect_garbage(ned_loop *loop)
+{
+    while (loop->garbage) {
+        struct ned_loop_source *next = loop->garbage->next;
+        free(loop->garbage);
+        loop->garbage = next;
+    }
+}
+
+ned_loop *
+ned_loop_new(void)
+{
+    ned_loop *loop = calloc(1, sizeof(ned_loop));
+    if (!loop)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+    sigemptyset(&loop->sigmask);
+    return loop;
+}
+
+void
+ned_loop_free(ned_loop *loop)
+{
+    if (!loop)
+        return;
+    while (loop->sources)
+        source_remove(loop->sources);
+    collect_garbage(loop);
+    close(loop->epfd);
+    free(loop);
+}
+
+void
+ned_loop_quit(ned_loop *loop)
+{
+    loop->quit = true;
+}
+
+int
+ned_loop_add_fd(ned_loop *loop, int fd, uint32_t events, ned_loop_fd_cb cb, void *data)
+{
+    struct ned_loop_source *src = source_new(loop, SOURCE_FD, fd, events, data);
+    if (!src)
+        return -1;
+    src->cb.fd = cb;
+    return 0;
+}
+
+static struct ned_loop_source *
+find_fd(ned_loop *loop, int fd)
+{
+    struct ned_loop_source *src;
+    for (src = loop->sources; src; src = src->next) {
+        if (src->type == SOURCE_FD && src->fd == fd)
+            return src;
+    }
+    return NULL;
+}
+
+int
+ned_loop_mod_fd(ned_loop *loop, int fd, uint32_t events)
+{
+    struct ned_loop_source *src = find_fd(loop, fd);
+    struct epoll_event ev;
+
+    if (!src) {
+        errno = ENOENT;
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void
+ned_loop_remove_fd(ned_loop *loop, int fd)
+{
+    struct ned_loop_source *src = find_fd(loop, fd);
+    if (src)
+        source_remove(src);
+}
+
+int
+ned_loop_timer_set(ned_loop_timer *timer, unsigned int initial_ms, unsigned int interval_ms)
+{
+    struct itimerspec its;
+
+    its.it_value.tv_sec = initial_ms / 1000;
+    its.it_value.tv_nsec = (initial_ms % 1000) * 1000000L;
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    return timerfd_settime(timer->fd, 0, &its, NULL);
+}
+
+ned_loop_timer *
+ned_loop_add_timer(ned_loop *loop, unsigned int initial_ms, unsigned int interval_ms, ned_loop_timer_cb cb, void *data)
+{
+    ned_loop_timer *timer;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    timer = source_new(loop, SOURCE_TIMER, fd, EPOLLIN, data);
+    if (!timer) {
+        close(fd);
+        return NULL;
+    }
+    timer->cb.timer = cb;
+    if (ned_loop_timer_set(timer, initial_ms, interval_ms) < 0) {
+        source_remove(timer);
+        return NULL;
+    }
+    return timer;
+}
+
+void
+ned_loop_remove_timer(ned_loop *loop, ned_loop_timer *timer)
+{
+    (void) loop;
+    if (timer)
+        source_remove(timer);
+}
+
+static void reap_children(ned_loop *loop);
+
+int
+ned_loop_add_signal(ned_loop *loop, int signo, ned_loop_signal_cb cb, void *data)
+{
+    int fd;
+
+    if (signo <= 0 || signo >= NSIG) {
+        errno = EINVAL;
+        return -1;
+    }
+    sigaddset(&loop->sigmask, signo);
+    if (sigprocmask(SIG_BLOCK, &loop->sigmask, NULL) < 0)
+        return -1;
+
+    fd = signalfd(loop->signal_source ? loop->signal_source->fd : -1, &loop->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (!loop->signal_source) {
+        loop->signal_source = source_new(loop, SOURCE_SIGNAL, fd, EPOLLIN, NULL);
+        if (!loop->signal_source) {
+            close(fd);
+            return -1;
+        }
+    }
+    loop->signals[signo].cb = cb;
+    loop->signals[signo].data = data;
+    return 0;
+}
+
+static void
+sigchld_cb(ned_loop *loop, int signo, void *data)
+{
+    (void) signo;
+    (void) data;
+    reap_children(loop);
+}
+
+static int
+pidfd_open_compat(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+ned_loop_watch_child(ned_loop *loop, pid_t pid, ned_loop_child_cb cb, void *data)
+{
+    struct ned_loop_source *src;
+    int fd = -1;
+
+    if (!loop->children_on_sigchld) {
+        fd = pidfd_open_compat(pid);
+        if (fd < 0) {
+            if (errno != ENOSYS)
+                return -1;
+            /* Kernel older than 5.3: fall back to SIGCHLD */
+            if (ned_loop_add_signal(loop, SIGCHLD, sigchld_cb, NULL) < 0)
+                return -1;
+            loop->children_on_sigchld = true;
+        }
+    }
+    src = source_new(loop, SOURCE_CHILD, fd, EPOLLIN, data);
+    if (!src) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    src->pid = pid;
+    src->cb.child = cb;
+    /* The child may have exited before SIGCHLD was routed to the loop */
+    if (loop->children_on_sigchld)
+        reap_children(loop);
+    return 0;
+}
+
+static bool
+reap_child(struct ned_loop_source *src)
+{
+    int status;
+    pid_t res;
+
+    do {
+        res = waitpid(src->pid, &status, WNOHANG);
+    } while (res < 0 && errno == EINTR);
+    if (res == 0)
+        return false;
+    if (res < 0)
+        status = -1; /* reaped by someone else */
+    src->cb.child(src->loop, src->pid, status, src->data);
+    source_remove(src);
+    return true;
+}
+
+static void
+reap_children(ned_loop *loop)
+{
+    struct ned_loop_source *src, *next;
+    for (src = loop->sources; src; src = next) {
+        next = src->next;
+        if (src->type == SOURCE_CHILD && src->fd < 0)
+            reap_child(src);
+    }
+}
+
+ned_loop_async *
+ned_loop_add_async(ned_loop *loop, ned_loop_async_cb cb, void *data)
+{
+    ned_loop_async *async;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    async = source_new(loop, SOURCE_ASYNC, fd, EPOLLIN, data);
+    if (!async) {
+        close(fd);
+        return NULL;
+    }
+    async->cb.async = cb;
+    return async;
+}
+
+void
+ned_loop_async_send(ned_loop_async *async)
+{
+    uint64_t one = 1;
+    ssize_t res;
+    do {
+        res = write(async->fd, &one, sizeof(one));
+    } while (res < 0 && errno == EINTR);
+}
+
+void
+ned_loop_remove_async(ned_loop *loop, ned_loop_async *async)
+{
+    (void) loop;
+    if (async)
+        source_remove(async);
+}
+
+static void
+dispatch_signals(ned_loop *loop)
+{
+    struct signalfd_siginfo si;
+
+    while (read(loop->signal_source->fd, &si, sizeof(si)) == sizeof(si)) {
+        int signo = (int) si.ssi_signo;
+        if (signo > 0 && signo < NSIG && loop->signals[signo].cb)
+            loop->signals[signo].cb(loop, signo, loop->signals[signo].data);
+    }
+}
+
+static void
+dispatch(struct ned_loop_source *src, uint32_t events)
+{
+    uint64_t count;
+
+    switch (src->type) {
+    case SOURCE_FD:
+        src->cb.fd(src->loop, src->fd, events, src->data);
+        break;
+    case SOURCE_TIMER:
+        if (read(src->fd, &count, sizeof(count)) == sizeof(count))
+            src->cb.timer(src->loop, src, src->data);
+        break;
+    case SOURCE_ASYNC:
+        if (read(src->fd, &count, sizeof(count)) == sizeof(count))
+            src->cb.async(src->loop, src->data);
+        break;
+    case SOURCE_SIGNAL:
+        dispatch_signals(src->loop);
+        break;
+    case SOURCE_CHILD:
+        reap_child(src);
+        break;
+    }
+}
+
+int
+ned_loop_run(ned_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->quit = false;
+    while (!loop->quit) {
+        int i, n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            struct ned_loop_source *src = events[i].data.ptr;
+            if (!src->dead)
+                dispatch(src, events[i].events);
+        }
+        collect_garbage(loop);
+    }
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * NFC Event Daemon
+ * Main event loop
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __LOOP_H__
+#define __LOOP_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The daemon runs a single epoll(7) loop on its main thread. Everything that
+ * can wake it up is a file descriptor: signals (signalfd), timers (timerfd),
+ * exiting children (pidfd), wake-ups from worker threads (eventfd) and any
+ * other descriptor registered by the daemon or its modules.
+ *
+ * Callbacks always run on the loop thread. Only ned_loop_async_send() may be
+ * called from other threads.
+ */
+
+typedef struct ned_loop ned_loop;
+typedef struct ned_loop_source ned_loop_timer;
+typedef struct ned_loop_source ned_loop_async;
+
+typedef void (*ned_loop_fd_cb)(ned_loop *loop, int fd, uint32_t events, void *data);
+typedef void (*ned_loop_timer_cb)(ned_loop *loop, ned_loop_timer *timer, void *data);
+typedef void (*ned_loop_signal_cb)(ned_loop *loop, int signo, void *data);
+typedef void (*ned_loop_child_cb)(ned_loop *loop, pid_t pid, int status, void *data);
+typedef void (*ned_loop_async_cb)(ned_loop *loop, void *data);
+
+/**
+ * @brief Create a new loop
+ * @return new loop, or NULL on error (errno is set)
+ */
+ned_loop *ned_loop_new(void);
+
+/**
+ * @brief Release a loop and every source still registered on it
+ * Registered file descriptors are not closed, timers and async handles are.
+ */
+void ned_loop_free(ned_loop *loop);
+
+/**
+ * @brief Run the loop until ned_loop_quit() is called
+ * @return 0 on normal exit, -1 on epoll error
+ */
+int ned_loop_run(ned_loop *loop);
+
+/**
+ * @brief Make ned_loop_run() return once the current iteration is done
+ */
+void ned_loop_quit(ned_loop *loop);
+
+/**
+ * @brief Watch a file descriptor
+ * @param events EPOLLIN, EPOLLOUT... mask
+ * @return 0 on success, -1 on error
+ */
+int ned_loop_add_fd(ned_loop *loop, int fd, uint32_t events, ned_loop_fd_cb cb, void *data);
+
+/**
+ * @brief Change the event mask of a watched file descriptor
+ */
+int ned_loop_mod_fd(ned_loop *loop, int fd, uint32_t events);
+
+/**
+ * @brief Stop watching a file descriptor (the descriptor is not closed)
+ * It is safe to call this from any loop callback, including the fd's own.
+ */
+void ned_loop_remove_fd(ned_loop *loop, int fd);
+
+/**
+ * @brief Create a timer
+ * @param initial_ms first expiration, 0 means disarmed
+ * @param interval_ms period after first expiration, 0 means one-shot
+ */
+ned_loop_timer *ned_loop_add_timer(ned_loop *loop, unsigned int initial_ms, unsigned int interval_ms, ned_loop_timer_cb cb, void *data);
+
+/**
+ * @brief (Re)arm or disarm (initial_ms = 0) a timer
+ */
+int ned_loop_timer_set(ned_loop_timer *timer, unsigned int initial_ms, unsigned int interval_ms);
+
+/**
+ * @brief Destroy a timer
+ */
+void ned_loop_remove_timer(ned_loop *loop, ned_loop_timer *timer);
+
+/**
+ * @brief Receive a signal through the loop instead of an asynchronous handler
+ * The signal is blocked for the calling thread: call this before starting any
+ * other thread so that they inherit the mask.
+ */
+int ned_loop_add_signal(ned_loop *loop, int signo, ned_loop_signal_cb cb, void *data);
+
+/**
+ * @brief Get notified (once) when the child process pid exits
+ * The child is reaped by the loop, its wait status is passed to cb.
+ */
+int ned_loop_watch_child(ned_loop *loop, pid_t pid, ned_loop_child_cb cb, void *data);
+
+/**
+ * @brief Create a cross-thread wake-up handle
+ * Several ned_loop_async_send() calls may be coalesced into one callback.
+ */
+ned_loop_async *ned_loop_add_async(ned_loop *loop, ned_loop_async_cb cb, void *data);
+
+/**
+ * @brief Wake the loop up and run the async callback (thread-safe)
+ */
+void ned_loop_async_send(ned_loop_async *async);
+
+/**
+ * @brief Destroy an async handle
+ */
+void ned_loop_remove_async(ned_loop *loop, ned_loop_async *async);
+
+/**
+ * @brief Monotonic clock in milliseconds
+ */
+uint64_t ned_loop_now_ms(void);
+
+/**
+ * @brief Monotonic clock in microseconds
+ */
+uint64_t ned_loop_now_us(void);
+
+#endif /* __LOOP_H__ */
@@ -0,0 +1,412 @@
+/*
+ * NFC Event Daemon
+ * Out-of-process module host
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "modhost.h"
+#include "module.h"
+#include "realtime.h"
+
+#define MODHOST_ARG "module_host="
+#define MODHOST_EXE "/proc/self/exe"
+#define MODHOST_RESTART_MAX 30000 /* ms */
+#define MODHOST_STABLE 10000 /* ms: a host that ran that long crashed "once" */
+#define MODHOST_STOP_TIMEOUT 1000 /* ms */
+#define MODHOST_BATCH 16
+#define MODHOST_SPIN 50 /* us spent polling the ring before sleeping */
+#define MODHOST_CONFIG_ARG "config_file="
+
+struct ned_modhost {
+    ned_loop *loop;
+    char *name;
+    char **argv;
+    char fds_arg[32];
+    char *config_arg;
+    ned_evring *ring;
+    pid_t pid;
+    uint64_t started_ms;
+    unsigned int restart_ms;
+    unsigned int delay_ms;
+    unsigned int restarts;
+    ned_loop_timer *restart_timer;
+    bool reloading;
+};
+
+static void on_host_exit(ned_loop *loop, pid_t pid, int status, void *data);
+
+static int
+host_spawn(ned_modhost *host)
+{
+    sigset_t all;
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        /* Async-signal-safe calls only until exec: the daemon has threads */
+        int shm_fd = ned_evring_shm_fd(host->ring), event_fd = ned_evring_event_fd(host->ring);
+        sigemptyset(&all);
+        sigprocmask(SIG_SETMASK, &all, NULL);
+        fcntl(shm_fd, F_SETFD, 0);
+        fcntl(event_fd, F_SETFD, 0);
+        execv(MODHOST_EXE, host->argv);
+        _exit(127);
+    }
+    host->pid = pid;
+    host->started_ms = ned_loop_now_ms();
+    if (ned_loop_watch_child(host->loop, pid, on_host_exit, host) < 0) {
+        ERR("Unable to watch module host %s: %s", host->name, strerror(errno));
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        host->pid = -1;
+        return -1;
+    }
+    DBG("Module host %s started (pid %d)", host->name, (int) pid);
+    return 0;
+}
+
+/**
+ * @brief Try again later, waiting longer after each failure in a row
+ */
+static void
+host_schedule_restart(ned_modhost *host)
+{
+    ned_loop_timer_set(host->restart_timer, host->delay_ms, 0);
+    host->delay_ms = host->delay_ms * 2 > MODHOST_RESTART_MAX ? MODHOST_RESTART_MAX : host->delay_ms * 2;
+}
+
+static void
+on_restart_timer(ned_loop *loop, ned_loop_timer *timer, void *data)
+{
+    ned_modhost *host = data;
+    (void) loop;
+    (void) timer;
+
+    host->restarts++;
+    if (host_spawn(host) < 0) {
+        ERR("Unable to start module host %s: %s", host->name, strerror(errno));
+        host_schedule_restart(host);
+    }
+}
+
+static void
+on_host_exit(ned_loop *loop, pid_t pid, int status, void *data)
+{
+    ned_modhost *host = data;
+    (void) loop;
+
+    if (pid != host->pid)
+        return;
+    host->pid = -1;
+    if (host->reloading) {
+        host->reloading = false;
+        host->delay_ms = host->restart_ms;
+        if (host_spawn(host) == 0)
+            return;
+        ERR("Unable to start module host %s: %s", host->name, strerror(errno));
+    } else {
+        if (ned_loop_now_ms() - host->started_ms >= MODHOST_STABLE)
+            host->delay_ms = host->restart_ms;
+        if (status >= 0 && WIFSIGNALED(status))
+            WARN("Module host %s (pid %d) killed by signal %d, restarting in %u ms", host->name, (int) pid,
+                 WTERMSIG(status), host->delay_ms);
+        else
+            WARN("Module host %s (pid %d) exited with status %d, restarting in %u ms", host->name, (int) pid,
+                 status >= 0 ? WEXITSTATUS(status) : -1, host->delay_ms);
+    }
+    host_schedule_restart(host);
+}
+
+ned_modhost *
+ned_modhost_start(ned_loop *loop, const char *name, const char *config_file, int argc, char *argv[],
+                  unsigned int restart_ms)
+{
+    ned_modhost *host;
+    int n = 0;
+
+    host = calloc(1, sizeof(ned_modhost));
+    if (!host)
+        return NULL;
+    host->loop = loop;
+    host->pid = -1;
+    host->restart_ms = host->delay_ms = restart_ms ? restart_ms : 1;
+    host->name = strdup(name);
+    host->argv = calloc(argc + 3, sizeof(char *));
+    host->config_arg = malloc(strlen(MODHOST_CONFIG_ARG) + strlen(config_file) + 1);
+    host->ring = ned_evring_new();
+    host->restart_timer = ned_loop_add_timer(loop, 0, 0, on_restart_timer, host);
+    if (!host->name || !host->argv || !host->config_arg || !host->ring || !host->restart_timer)
+        goto error;
+    strcpy(host->config_arg, MODHOST_CONFIG_ARG);
+    strcat(host->config_arg, config_file);
+
+    snprintf(host->fds_arg, sizeof(host->fds_arg), MODHOST_ARG "%d,%d", ned_evring_shm_fd(host->ring),
+             ned_evring_event_fd(host->ring));
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], MODHOST_ARG, strlen(MODHOST_ARG)) != 0 && !strstr(argv[i], MODHOST_CONFIG_ARG))
+            host->argv[n++] = argv[i];
+    }
+    host->argv[n++] = host->config_arg;
+    host->argv[n++] = host->fds_arg;
+    host->argv[n] = NULL;
+
+    if (host_spawn(host) < 0)
+        goto error;
+    return host;
+
+error:
+    ERR("Unable to start module host %s: %s", name, strerror(errno));
+    if (host->restart_timer)
+        ned_loop_remove_timer(loop, host->restart_timer);
+    ned_evring_free(host->ring);
+    free(host->config_arg);
+    free(host->argv);
+    free(host->name);
+    free(host);
+    return NULL;
+}
+
+int
+ned_modhost_handle_events(ned_modhost *host, const nem_event *events, size_t count)
+{
+    ned_evring_entry entry;
+    size_t queued = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const nem_event *ev = &events[i];
+
+        entry.event = ev->event;
+        entry.reader_id = ev->reader_id;
+        entry.dropped = ev->dropped;
+        entry.timestamp_us = ev->timestamp_us;
+        entry.has_tag = ev->tag != NULL;
+        if (ev->tag)
+            entry.tag = *ev->tag;
+        snprintf(entry.connstring, sizeof(entry.connstring), "%s", ev->connstring ? ev->connstring : "");
+        entry.has_name = ev->reader_name != NULL;
+        snprintf(entry.reader_name, sizeof(entry.reader_name), "%s", ev->reader_name ? ev->reader_name : "");
+        if (ned_evring_push(host->ring, &entry) == 0)
+            queued++;
+    }
+    if (queued)
+        ned_evring_notify(host->ring);
+    if (queued < count) {
+        DBG("Module host %s lags behind, %u event(s) dropped", host->name, (unsigned int) (count - queued));
+        return -1;
+    }
+    return 0;
+}
+
+void
+ned_modhost_reload(ned_modhost *host, unsigned int restart_ms)
+{
+    host->restart_ms = host->delay_ms = restart_ms ? restart_ms : 1;
+    if (host->pid < 0) {
+        /* Waiting for a restart: do it now */
+        ned_loop_timer_set(host->restart_timer, 0, 0);
+        on_restart_timer(host->loop, host->restart_timer, host);
+        return;
+    }
+    host->reloading = true;
+    kill(host->pid, SIGTERM);
+}
+
+void
+ned_modhost_stop(ned_modhost *host)
+{
+    if (host->pid > 0) {
+        uint64_t deadline = ned_loop_now_ms() + MODHOST_STOP_TIMEOUT;
+        pid_t res;
+
+        kill(host->pid, SIGTERM);
+        while ((res = waitpid(host->pid, NULL, WNOHANG)) == 0 && ned_loop_now_ms() < deadline)
+            usleep(10000);
+        if (res == 0) {
+            WARN("Module host %s does not exit, killing it", host->name);
+            kill(host->pid, SIGKILL);
+            waitpid(host->pid, NULL, 0);
+        }
+    }
+    ned_loop_remove_timer(host->loop, host->restart_timer);
+    ned_evring_free(host->ring);
+    free(host->config_arg);
+    free(host->argv);
+    free(host->name);
+    free(host);
+}
+
+const char *
+ned_modhost_name(const ned_modhost *host)
+{
+    return host->name;
+}
+
+pid_t
+ned_modhost_pid(const ned_modhost *host)
+{
+    return host->pid;
+}
+
+unsigned int
+ned_modhost_restarts(const ned_modhost *host)
+{
+    return host->restarts;
+}
+
+void
+ned_modhost_get_stats(const ned_modhost *host, ned_evring_stats *stats)
+{
+    ned_evring_get_stats(host->ring, stats);
+}
+
+/* Host side */
+
+typedef struct {
+    ned_evring *ring;
+    ned_module *module;
+    unsigned int spin_us;
+} modhost_child;
+
+/**
+ * @brief Deliver queued events, until the ring stays empty for a while
+ * Events of a burst are then picked up by polling, without waking the
+ * process up through the eventfd. The first event after a quiet period
+ * still pays for that wake-up. There is no polling on a single CPU, where
+ * it would only delay the daemon.
+ */
+static void
+host_drain(modhost_child *child)
+{
+    static ned_evring_entry entries[MODHOST_BATCH];
+    nem_event events[MODHOST_BATCH];
+    size_t count;
+    uint64_t until;
+
+    for (;;) {
+        while ((count = ned_evring_pop(child->ring, entries, MODHOST_BATCH)) > 0) {
+            for (size_t i = 0; i < count; i++) {
+                const ned_evring_entry *e = &entries[i];
+                events[i].event = e->event;
+                events[i].device = NULL;
+                events[i].tag = e->has_tag ? &e->tag : NULL;
+                events[i].reader_id = e->reader_id;
+                events[i].connstring = e->connstring;
+                events[i].reader_name = e->has_name ? e->reader_name : NULL;
+                events[i].timestamp_us = e->timestamp_us;
+                events[i].dropped = e->dropped;
+                ned_evring_delivered(child->ring, e);
+            }
+            ned_module_handle_events(child->module, events, count);
+        }
+        until = ned_evring_now_ns() + child->spin_us * 1000;
+        while (!ned_evring_pending(child->ring) && ned_evring_now_ns() < until)
+            ;
+        if (!ned_evring_pending(child->ring) && ned_evring_sleep(child->ring))
+            return;
+    }
+}
+
+static void
+on_ring_ready(ned_loop *loop, int fd, uint32_t events, void *data)
+{
+    modhost_child *child = data;
+    (void) loop;
+    (void) fd;
+    (void) events;
+
+    ned_evring_clear(child->ring);
+    host_drain(child);
+}
+
+static void
+on_host_quit(ned_loop *loop, int signo, void *data)
+{
+    (void) signo;
+    (void) data;
+    ned_loop_quit(loop);
+}
+
+int
+ned_modhost_run(const char *fds, nfcconf_context *context, nfcconf_block *block)
+{
+    modhost_child child;
+    ned_loop *loop;
+    int shm_fd, event_fd;
+
+    if (sscanf(fds, "%d,%d", &shm_fd, &event_fd) != 2) {
+        ERR("Invalid module host descriptors: %s", fds);
+        return -1;
+    }
+    /* Do not outlive the daemon */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1)
+        return -1;
+    if (!block)
+        return -1;
+
+    child.spin_us = ned_rt_cpu_count() > 1 ? MODHOST_SPIN : 0;
+    child.ring = ned_evring_attach(shm_fd, event_fd);
+    if (!child.ring) {
+        ERR("Unable to map module host event ring: %s", strerror(errno));
+        return -1;
+    }
+    loop = ned_loop_new();
+    if (!loop || ned_loop_add_signal(loop, SIGTERM, on_host_quit, NULL) < 0 ||
+        ned_loop_add_signal(loop, SIGINT, on_host_quit, NULL) < 0) {
+        ERR("Unable to create module host loop: %s", strerror(errno));
+        ned_evring_free(child.ring);
+        if (loop)
+            ned_loop_free(loop);
+        return -1;
+    }
+    child.module = ned_module_load(loop, context, block);
+    if (!child.module) {
+        ned_loop_free(loop);
+        ned_evring_free(child.ring);
+        return -1;
+    }
+    if (ned_loop_add_fd(loop, event_fd, EPOLLIN, on_ring_ready, &child) < 0) {
+        ERR("Unable to watch module host event ring: %s", strerror(errno));
+    } else {
+        /* Events queued while no host was running */
+        host_drain(&child);
+        ned_loop_run(loop);
+        ned_loop_remove_fd(loop, event_fd);
+    }
+    ned_module_unload(child.module);
+    ned_loop_free(loop);
+    ned_evring_free(child.ring);
+    return 0;
+}
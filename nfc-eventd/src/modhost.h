@@ -0,0 +1,89 @@
+/*
+ * NFC Event Daemon
+ * Out-of-process module host
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __MODHOST_H__
+#define __MODHOST_H__
+
+#include <sys/types.h>
+
+#include "loop.h"
+#include "evring.h"
+#include "modules/nem_common.h"
+
+/*
+ * With module_isolate, the module runs in a child process: the daemon
+ * executable started again with a module_host=<fds> argument. It parses the
+ * same configuration, loads the module and gets events from an evring.
+ *
+ * A module crash only takes the module host down. The daemon restarts it,
+ * waiting restart_ms, then twice as long after each crash in a row. Events
+ * queued meanwhile are delivered to the new host, except the ones that were
+ * being handled: modules see every event at most once. Hosted modules get a
+ * NULL device in their events.
+ */
+
+typedef struct ned_modhost ned_modhost;
+
+/**
+ * @brief Start a module host (daemon side)
+ * @param config_file configuration file of the host, absolute as the host
+ * may be started after the daemon changed directory
+ * @param argv daemon command line, passed on to the host
+ * @return host, or NULL on error
+ */
+ned_modhost *ned_modhost_start(ned_loop *loop, const char *name, const char *config_file, int argc, char *argv[],
+                               unsigned int restart_ms);
+
+/**
+ * @brief Queue events for the module
+ * @return 0, -1 if some were dropped because the host lags behind
+ */
+int ned_modhost_handle_events(ned_modhost *host, const nem_event *events, size_t count);
+
+/**
+ * @brief Restart the host so that it loads the new configuration
+ */
+void ned_modhost_reload(ned_modhost *host, unsigned int restart_ms);
+
+/**
+ * @brief Terminate the host and release everything
+ */
+void ned_modhost_stop(ned_modhost *host);
+
+const char *ned_modhost_name(const ned_modhost *host);
+
+/**
+ * @brief Process id of the running host, -1 while it is being restarted
+ */
+pid_t ned_modhost_pid(const ned_modhost *host);
+
+unsigned int ned_modhost_restarts(const ned_modhost *host);
+
+void ned_modhost_get_stats(const ned_modhost *host, ned_evring_stats *stats);
+
+/**
+ * @brief Module host main loop (host side)
+ * @param fds value of the module_host argument
+ * @param block module configuration block
+ * @return 0 on normal exit, -1 on error
+ */
+int ned_modhost_run(const char *fds, nfcconf_context *context, nfcconf_block *block);
+
+#endif /* __MODHOST_H__ */
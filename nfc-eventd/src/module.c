@@ -0,0 +1,337 @@
+/*
+ * NFC Event Daemon
+ * NEM module loader
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dlfcn.h>
+#include <sys/epoll.h>
+
+#include "module.h"
+
+#ifdef BUILTIN_MODULES
+  #include "modules/nem_execute.h"
+  #include "modules/nem_webhook.h"
+  #ifdef BUILTIN_NEM_DBUS
+    #include "modules/nem_dbus.h"
+  #endif
+
+/* Modules linked into the daemon, found without looking into NEMDIR */
+static const struct {
+    const char *name;
+    const nem_module *ops;                      /* ABI v2 and later */
+    module_init_fct v1_init;                    /* ABI v1 */
+    module_event_handler_fct v1_event_handler;
+} builtin_modules[] = {
+    { "nem_execute", &nem_execute_module, NULL, NULL },
+    { "nem_webhook", &nem_webhook_module, NULL, NULL },
+  #ifdef BUILTIN_NEM_DBUS
+    { "nem_dbus", NULL, nem_dbus_init, nem_dbus_event_handler },
+  #endif
+};
+#endif // BUILTIN_MODULES
+
+struct ned_module {
+    char *name;
+    void *handle;
+    ned_loop *loop;
+    unsigned int abi;
+    const nem_module *ops;
+    void *instance;
+    int fd;
+    uint64_t load_us;
+
+    /* ABI v1 entry points, behind the adapter */
+    module_init_fct v1_init;
+    module_event_handler_fct v1_event_handler;
+};
+
+/* ABI v1 adapter: the instance is the ned_module itself */
+static int
+v1_handle_events(void *instance, const nem_event *events, size_t count)
+{
+    ned_module *module = instance;
+    int res = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        /* Unknown to v1 modules */
+        if (events[i].event == EVENT_RATE_LIMITED)
+            continue;
+        if (module->v1_event_handler(events[i].device, events[i].tag, events[i].event) < 0)
+            res = -1;
+    }
+    return res;
+}
+
+static const nem_module v1_adapter = {
+    1,
+    NULL,
+    v1_handle_events,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+/**
+ * @brief Resolve a function symbol without the object to function pointer cast
+ */
+static int
+module_symbol(void *handle, const char *name, const char *suffix, void *fct)
+{
+    char symbol[256];
+    const char *error;
+
+    snprintf(symbol, sizeof(symbol), "%s%s", name, suffix);
+    dlerror();
+    *(void **) fct = dlsym(handle, symbol);
+    if ((error = dlerror()) != NULL) {
+        ERR("%s", error);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+module_fd_cb(ned_loop *loop, int fd, uint32_t events, void *data)
+{
+    ned_module *module = data;
+    (void) loop;
+    (void) fd;
+    (void) events;
+
+    module->ops->poll_ready(module->instance);
+}
+
+/**
+ * @brief Create an instance, the adapter stands in for v1 modules
+ */
+static void *
+module_instantiate(ned_module *module, nfcconf_context *context, nfcconf_block *block)
+{
+    if (module->abi == 1) {
+        module->v1_init(context, block);
+        return module;
+    }
+    return module->ops->init(context, block);
+}
+
+static void
+module_watch(ned_module *module)
+{
+    module->fd = -1;
+    if (!module->ops->poll_fd || !module->ops->poll_ready)
+        return;
+    module->fd = module->ops->poll_fd(module->instance);
+    if (module->fd >= 0 && ned_loop_add_fd(module->loop, module->fd, EPOLLIN, module_fd_cb, module) < 0) {
+        ERR("Unable to watch file descriptor of module %s", module->name);
+        module->fd = -1;
+    }
+}
+
+static void
+module_shutdown(ned_module *module)
+{
+    if (module->fd >= 0) {
+        ned_loop_remove_fd(module->loop, module->fd);
+        module->fd = -1;
+    }
+    if (module->ops->shutdown)
+        module->ops->shutdown(module->instance);
+    module->instance = NULL;
+}
+
+/**
+ * @brief Find a module linked into the daemon
+ * @return 0 if found
+ */
+static int
+module_open_builtin(ned_module *module)
+{
+#ifdef BUILTIN_MODULES
+    for (size_t i = 0; i < sizeof(builtin_modules) / sizeof(builtin_modules[0]); i++) {
+        if (strcmp(builtin_modules[i].name, module->name) != 0)
+            continue;
+        if (builtin_modules[i].ops) {
+            module->ops = builtin_modules[i].ops;
+            module->abi = module->ops->abi_version;
+        } else {
+            module->v1_init = builtin_modules[i].v1_init;
+            module->v1_event_handler = builtin_modules[i].v1_event_handler;
+            module->ops = &v1_adapter;
+            module->abi = 1;
+        }
+        return 0;
+    }
+#else
+    (void) module;
+#endif // BUILTIN_MODULES
+    return -1;
+}
+
+/**
+ * @brief Load a module from NEMDIR
+ * @return 0 on success
+ */
+static int
+module_open_shared(ned_module *module)
+{
+    char path[256];
+    const char *name = module->name;
+
+    snprintf(path, sizeof(path), "%s/%s.so", NEMDIR, name);
+    DBG("Module found at: '%s'...", path);
+    module->handle = dlopen(path, RTLD_LAZY);
+    if (module->handle == NULL) {
+        ERR("Unable to open module: %s", dlerror());
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s_module", name);
+    module->ops = dlsym(module->handle, path);
+    if (module->ops) {
+        if (module->ops->abi_version < 2 || module->ops->abi_version > NEM_ABI_VERSION ||
+            !module->ops->init || !module->ops->handle_events) {
+            ERR("Module %s implements ABI v%u, expected v2 to v%u", name, module->ops->abi_version, NEM_ABI_VERSION);
+            return -1;
+        }
+        module->abi = module->ops->abi_version;
+    } else {
+        /* No descriptor: ABI v1 */
+        if (module_symbol(module->handle, name, "_init", &module->v1_init) < 0 ||
+            module_symbol(module->handle, name, "_event_handler", &module->v1_event_handler) < 0)
+            return -1;
+        module->abi = 1;
+        module->ops = &v1_adapter;
+    }
+    return 0;
+}
+
+ned_module *
+ned_module_load(ned_loop *loop, nfcconf_context *context, nfcconf_block *block)
+{
+    ned_module *module;
+    const char *name = block->name->data;
+    uint64_t start = ned_loop_now_us();
+
+    DBG("Loading module: '%s'...", name);
+    module = calloc(1, sizeof(ned_module));
+    if (!module)
+        return NULL;
+    module->name = strdup(name);
+    module->loop = loop;
+    module->fd = -1;
+    if (module_open_builtin(module) < 0 && module_open_shared(module) < 0)
+        goto error;
+
+    module->instance = module_instantiate(module, context, block);
+    if (!module->instance) {
+        ERR("Unable to initialize module %s", name);
+        goto error;
+    }
+    module_watch(module);
+    module->load_us = ned_loop_now_us() - start;
+    DBG("Module %s loaded (ABI v%u, %s) in %llu us", name, module->abi, module->handle ? "shared" : "builtin",
+        (unsigned long long) module->load_us);
+    return module;
+
+error:
+    if (module->handle)
+        dlclose(module->handle);
+    free(module->name);
+    free(module);
+    return NULL;
+}
+
+int
+ned_module_reload(ned_module *module, nfcconf_context *context, nfcconf_block *block)
+{
+    void *instance;
+
+    if (module->abi == 1) {
+        /* v1 has no teardown: initializing it again would set it up twice */
+        WARN("Module %s (ABI v1) keeps its configuration until the daemon is restarted", module->name);
+        return 0;
+    }
+    /* v2 descriptors end before reload */
+    if (module->abi >= 3 && module->ops->reload) {
+        if (module->ops->reload(module->instance, context, block) < 0) {
+            ERR("Unable to reconfigure module %s, keeping its previous configuration", module->name);
+            return -1;
+        }
+        return 0;
+    }
+    instance = module->ops->init(context, block);
+    if (!instance) {
+        ERR("Unable to reinitialize module %s, keeping its previous configuration", module->name);
+        return -1;
+    }
+    module_shutdown(module);
+    module->instance = instance;
+    module_watch(module);
+    return 0;
+}
+
+int
+ned_module_handle_events(ned_module *module, const nem_event *events, size_t count)
+{
+    if (count == 0)
+        return 0;
+    return module->ops->handle_events(module->instance, events, count);
+}
+
+void
+ned_module_unload(ned_module *module)
+{
+    module_shutdown(module);
+    if (module->handle)
+        dlclose(module->handle);
+    free(module->name);
+    free(module);
+}
+
+const char *
+ned_module_name(const ned_module *module)
+{
+    return module->name;
+}
+
+unsigned int
+ned_module_abi(const ned_module *module)
+{
+    return module->abi;
+}
+
+bool
+ned_module_is_builtin(const ned_module *module)
+{
+    return module->handle == NULL;
+}
+
+uint64_t
+ned_module_load_us(const ned_module *module)
+{
+    return module->load_us;
+}
@@ -0,0 +1,86 @@
+/*
+ * NFC Event Daemon
+ * NEM module loader
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __MODULE_H__
+#define __MODULE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "loop.h"
+#include "modules/nem_common.h"
+
+/*
+ * Modules are shared objects found in NEMDIR, or linked into the daemon when
+ * built with --enable-builtin-modules. ABI v2 and v3 modules export a
+ * nem_module descriptor; ABI v1 modules (init + per-event handler) are
+ * wrapped by an adapter that presents the same interface to the daemon.
+ */
+
+typedef struct ned_module ned_module;
+
+/**
+ * @brief Load a module and create its instance
+ * @param block module configuration block, its name is the module name
+ * @return module, or NULL on error
+ */
+ned_module *ned_module_load(ned_loop *loop, nfcconf_context *context, nfcconf_block *block);
+
+/**
+ * @brief Apply a new configuration
+ * A module with a reload hook (v3) reconfigures its instance. Otherwise a v2
+ * or v3 module gets a new instance, the old one is shut down once the new
+ * one is up. A v1 module keeps running as it is: it cannot be shut down, so
+ * it needs a restart to pick up the new configuration.
+ * @return 0 on success, -1 if the module kept its previous configuration
+ */
+int ned_module_reload(ned_module *module, nfcconf_context *context, nfcconf_block *block);
+
+/**
+ * @brief Deliver a batch of events
+ */
+int ned_module_handle_events(ned_module *module, const nem_event *events, size_t count);
+
+/**
+ * @brief Shut the instance down and unload the module
+ */
+void ned_module_unload(ned_module *module);
+
+/**
+ * @brief Module name
+ */
+const char *ned_module_name(const ned_module *module);
+
+/**
+ * @brief ABI version the module implements
+ */
+unsigned int ned_module_abi(const ned_module *module);
+
+/**
+ * @brief Whether the module is linked into the daemon (--enable-builtin-modules)
+ */
+bool ned_module_is_builtin(const ned_module *module);
+
+/**
+ * @brief Time it took to find, load and initialize the module
+ */
+uint64_t ned_module_load_us(const ned_module *module);
+
+#endif /* __MODULE_H__ */
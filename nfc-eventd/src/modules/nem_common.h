@@ -21,6 +21,9 @@
 #ifndef __NEM_COMMON__
 #define __NEM_COMMON__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <nfc/nfc.h>
 
 /* Nfc Event Module, aka NEM, common defines */
@@ -29,8 +32,61 @@
 #include "../debug/nfc-utils.h"
 #include "../types.h"
 
+/*
+ * ABI v1: a module exports <name>_init() and <name>_event_handler(), state has
+ * to live in globals and events come one at a time. Still supported, but the
+ * configuration is only read at startup: there is no way to tear it down.
+ */
 typedef void (*module_init_fct)(nfcconf_context*, nfcconf_block*);
 typedef int (*module_event_handler_fct)( const nfc_device*, const nfc_target*, const nem_event_t );
 
+/*
+ * ABI v2: a module exports a nem_module descriptor named <name>_module.
+ * init() returns an opaque instance handed back to every other hook, so a
+ * module may be instantiated more than once. Events are delivered in batches:
+ * everything that happened since the last main loop iteration, in order.
+ * All hooks are called from the daemon main loop thread.
+ *
+ * ABI v3 adds the optional reload() hook. v2 modules are still loaded, and
+ * get a new instance on every configuration reload.
+ */
+#define NEM_ABI_VERSION 3
+
+typedef struct {
+    nem_event_t event;
+    const nfc_device *device;    /* NULL in a module host (module_isolate) */
+    const nfc_target *tag;       /* NULL for EVENT_EXPIRE_TIME */
+    unsigned int reader_id;
+    const char *connstring;
+    const char *reader_name;     /* as reported by libnfc, may be NULL */
+    uint64_t timestamp_us;       /* monotonic clock, when the reader saw it */
+    unsigned int dropped;        /* EVENT_RATE_LIMITED: events dropped since
+                                    the previous one, tag is the last of them */
+} nem_event;
+
+typedef struct {
+    /* NEM_ABI_VERSION the module was built against */
+    unsigned int abi_version;
+
+    /* Create an instance from the module configuration block, NULL on error */
+    void *(*init)(nfcconf_context *context, nfcconf_block *block);
+
+    /* Handle count events, return 0 on success */
+    int (*handle_events)(void *instance, const nem_event *events, size_t count);
+
+    /* Optional: a file descriptor the daemon watches on behalf of the module,
+     * or -1. poll_ready() is called when it becomes readable. */
+    int (*poll_fd)(void *instance);
+    void (*poll_ready)(void *instance);
+
+    /* Optional: release the instance, on exit or configuration reload */
+    void (*shutdown)(void *instance);
+
+    /* Optional (v3): apply a new configuration to the instance, keeping
+     * its state. Return 0 on success, or -1 with the previous configuration
+     * still in use. Without it, reloads create a new instance. */
+    int (*reload)(void *instance, nfcconf_context *context, nfcconf_block *block);
+} nem_module;
+
 #endif /* __NEM_COMMON__ */
 
@@ -23,13 +23,17 @@
 #endif // HAVE_CONFIG_H
 
 #include "nem_execute.h"
+#include "nem_rules.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <unistd.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <errno.h>
 
 #define ONERROR_IGNORE	0
@@ -43,10 +47,51 @@
     extern char **environ;
 #endif
 
-static nfcconf_context* _nem_execute_config_context;
-static nfcconf_block* _nem_execute_config_block;
+/* In ONERROR_* order */
+static const char *const onerror_names[] = { "ignore", "return", "quit", NULL };
 
-static char * _tag_uid = NULL;
+/* Settings of an event block */
+typedef struct {
+    int onerror;
+    nfcconf_list *actions;
+} execute_rule;
+
+static const nfcconf_field execute_rule_fields[] = {
+    { "on_error", SCCONF_ENUM, 0, offsetof ( execute_rule, onerror ), "ignore", 0, 0, onerror_names },
+    { "action", SCCONF_LIST, 0, offsetof ( execute_rule, actions ), NULL, 0, 0, NULL },
+    { NULL, 0, 0, 0, NULL, 0, 0, NULL }
+};
+
+/* Everything read from the module block, replaced as a whole */
+typedef struct {
+    nem_rules *rules;
+    execute_rule **settings;    /* by rule number */
+    size_t count;
+} execute_config;
+
+/* Actions of one event, run one after the other */
+typedef struct execute_job {
+    struct execute_job *next;
+    char **commands;            /* $TAG_UID substituted */
+    size_t count;
+    size_t done;
+    int onerror;
+} execute_job;
+
+typedef struct {
+    nfcconf_snapshot config;
+    /* Jobs in event order, the first one is running */
+    execute_job *jobs;
+    execute_job **jobs_tail;
+    /* Running action, and its pidfd in epoll_fd */
+    pid_t pid;
+    int pid_fd;
+    int epoll_fd;
+    /* UID of the last inserted tag, reported again on removal */
+    char *tag_uid;
+    /* UID of the last tag dropped by rate limiting */
+    char *limited_uid;
+} nem_execute_instance;
 
 static int strsubst(char *dest, const char *src, const char *search, const char *subst) {
     const char *delim = strstr(src, search);
@@ -66,20 +111,30 @@ static int strsubst(char *dest, const char *src, const char *search, const char
     }
 }
 
-static int my_system ( char *command ) {
-    int pid, status;
-    if ( !command ) return 1;
-    pid = fork();
-    if ( pid == -1 ) return -1;
+/**
+ * @brief Start a command without waiting for it
+ * @return pid of the child, or -1 on error
+ */
+static pid_t action_spawn ( const char *command ) {
+    pid_t pid = fork();
     if ( pid == 0 ) {
+        /* Async-signal-safe calls only until exec: the daemon has threads */
         char *argv[4];
+        sigset_t all;
+        sigemptyset ( &all );
+        sigprocmask ( SIG_SETMASK, &all, NULL );
         argv[0] = "/bin/sh";
         argv[1] = "-c";
-        argv[2] = command;
+        argv[2] = ( char * ) command;
         argv[3] = 0;
         execve ( "/bin/sh", argv, environ );
-        exit ( 127 );
+        _exit ( 127 );
     }
+    return pid;
+}
+
+static int action_wait ( pid_t pid ) {
+    int status;
     do {
         if ( waitpid ( pid, &status, 0 ) == -1 ) {
             if ( errno != EINTR ) return -1;
@@ -87,20 +142,208 @@ static int my_system ( char *command ) {
     } while ( 1 );
 }
 
-void
+static int pidfd_open_compat ( pid_t pid ) {
+#ifdef SYS_pidfd_open
+    return syscall ( SYS_pidfd_open, pid, 0 );
+#else
+    ( void ) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void
+execute_job_free ( execute_job *job ) {
+    for ( size_t i = 0; i < job->count; i++ ) free ( job->commands[i] );
+    free ( job->commands );
+    free ( job );
+}
+
+/**
+ * @brief Account for the end of the running action, and take care of on_error
+ * @param res wait status, -1 if the action could not be run
+ */
+static void
+execute_done ( nem_execute_instance *instance, int res ) {
+    execute_job *job = instance->jobs;
+
+    /* evaluate return and take care on "onerror" value */
+    DBG ( "Action '%s' returns %d", job->commands[job->done], res );
+    job->done++;
+    if ( !res ) return;
+    switch ( job->onerror ) {
+    case ONERROR_IGNORE:
+        break;
+    case ONERROR_RETURN:
+        job->done = job->count;
+        break;
+    case ONERROR_QUIT:
+        exit ( EXIT_FAILURE );
+    default:
+        DBG ( "%s", "Invalid onerror value" );
+        job->done = job->count;
+        break;
+    }
+}
+
+/**
+ * @brief Start the next queued action, unless one is running
+ * Completion comes through poll_ready(). Without pidfd (Linux < 5.3) the
+ * actions are waited for here, blocking the daemon as they always did.
+ */
+static void
+execute_next ( nem_execute_instance *instance ) {
+    while ( instance->pid == 0 && instance->jobs ) {
+        execute_job *job = instance->jobs;
+        struct epoll_event ev;
+        pid_t pid;
+        int fd;
+
+        if ( job->done == job->count ) {
+            instance->jobs = job->next;
+            if ( instance->jobs == NULL ) instance->jobs_tail = &instance->jobs;
+            execute_job_free ( job );
+            continue;
+        }
+        DBG ( "Executing action: '%s'", job->commands[job->done] );
+        /*
+        there are some security issues on using system() in
+        setuid/setgid programs. so we will use an alternate function
+        	*/
+        pid = action_spawn ( job->commands[job->done] );
+        if ( pid < 0 ) {
+            execute_done ( instance, -1 );
+            continue;
+        }
+        fd = pidfd_open_compat ( pid );
+        memset ( &ev, 0, sizeof ( ev ) );
+        ev.events = EPOLLIN;
+        if ( fd >= 0 && epoll_ctl ( instance->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) == 0 ) {
+            instance->pid = pid;
+            instance->pid_fd = fd;
+            return;
+        }
+        if ( fd >= 0 ) close ( fd );
+        execute_done ( instance, action_wait ( pid ) );
+    }
+}
+
+static void
+execute_config_free ( void *data ) {
+    execute_config *config = data;
+    for ( size_t i = 0; i < config->count; i++ ) {
+        nfcconf_schema_free ( execute_rule_fields, config->settings[i] );
+    }
+    free ( config->settings );
+    nem_rules_free ( config->rules );
+    free ( config );
+}
+
+/**
+ * @brief Compile the rules and read the settings of their event blocks
+ */
+static execute_config *
+execute_config_load ( nfcconf_context *module_context, nfcconf_block *module_block ) {
+    execute_config *config = calloc ( 1, sizeof ( execute_config ) );
+    const nfcconf_atom *event_key = nfcconf_atom_get ( module_context, "event" );
+    const nfcconf_block *block;
+    nfcconf_iter iter;
+    size_t uids, prefixes, i = 0;
+    const char *error;
+
+    if ( config == NULL ) return NULL;
+    config->rules = nem_rules_compile ( module_context, module_block );
+    if ( config->rules == NULL ) {
+        ERR ( "%s", "Invalid event rules" );
+        free ( config );
+        return NULL;
+    }
+    nem_rules_count ( config->rules, &config->count, &uids, &prefixes );
+    DBG ( "%zu event rules, %zu UIDs, %zu UID prefixes", config->count, uids, prefixes );
+
+    /* The event blocks, in rule order */
+    config->settings = calloc ( config->count ? config->count : 1, sizeof ( execute_rule * ) );
+    if ( ( config->count && event_key == NULL ) || config->settings == NULL ) {
+        config->count = 0;
+        execute_config_free ( config );
+        return NULL;
+    }
+    for ( block = nfcconf_iter_blocks ( &iter, module_block, event_key, NULL ); block && i < config->count; block = nfcconf_iter_next_block ( &iter ), i++ ) {
+        config->settings[i] = nfcconf_schema_load ( module_context, block, execute_rule_fields, sizeof ( execute_rule ), &error );
+        if ( config->settings[i] == NULL ) {
+            if ( error ) ERR ( "Invalid %s value in event '%s'", error, block->name ? block->name->data : "" );
+            execute_config_free ( config );
+            return NULL;
+        }
+    }
+    return config;
+}
+
+static void *
 nem_execute_init( nfcconf_context *module_context, nfcconf_block* module_block ) {
+    nem_execute_instance *instance = calloc ( 1, sizeof ( nem_execute_instance ) );
+    execute_config *config;
+    if ( instance == NULL ) return NULL;
+    instance->jobs_tail = &instance->jobs;
+    instance->pid_fd = -1;
+    instance->epoll_fd = epoll_create1 ( EPOLL_CLOEXEC );
+    if ( instance->epoll_fd < 0 ) {
+        free ( instance );
+        return NULL;
+    }
+#ifndef NEM_BUILTIN
     set_debug_level ( 1 );
-    _nem_execute_config_context = module_context;
-    _nem_execute_config_block = module_block;
+#endif
+    config = execute_config_load ( module_context, module_block );
+    if ( config == NULL ) {
+        close ( instance->epoll_fd );
+        free ( instance );
+        return NULL;
+    }
+    nfcconf_snapshot_init ( &instance->config, execute_config_free );
+    nfcconf_snapshot_publish ( &instance->config, config );
+    return instance;
+}
+
+/**
+ * @brief Replace the settings, under event handlers of other threads if any
+ */
+static int
+nem_execute_reload( void *data, nfcconf_context *module_context, nfcconf_block *module_block ) {
+    nem_execute_instance *instance = data;
+    execute_config *config = execute_config_load ( module_context, module_block );
+    if ( config == NULL ) return -1;
+    nfcconf_snapshot_publish ( &instance->config, config );
+    return 0;
 }
 
-void
-tag_get_uid(nfc_device* nfc_device, nfc_target* tag, char **dest) {
+static void
+nem_execute_shutdown( void *data ) {
+    nem_execute_instance *instance = data;
+    if ( instance->pid && waitpid ( instance->pid, NULL, WNOHANG ) == 0 ) {
+        /* Left to finish on its own */
+        DBG ( "Action '%s' still running", instance->jobs->commands[instance->jobs->done] );
+    }
+    if ( instance->pid_fd >= 0 ) close ( instance->pid_fd );
+    close ( instance->epoll_fd );
+    while ( instance->jobs ) {
+        execute_job *job = instance->jobs;
+        instance->jobs = job->next;
+        execute_job_free ( job );
+    }
+    nfcconf_snapshot_destroy ( &instance->config );
+    free ( instance->tag_uid );
+    free ( instance->limited_uid );
+    free ( instance );
+}
+
+static void
+tag_get_uid(const nfc_target* tag, char **dest) {
   debug_print_tag(tag);
 
-  /// @TODO We don't need to reselect tag to get his UID: nfc_target contains this data.
-  // Poll for a ISO14443A (MIFARE) tag
-  if ( nfc_initiator_select_passive_target ( nfc_device, tag->nm, tag->nti.nai.abtUid, tag->nti.nai.szUidLen, tag ) ) {
+  /* Events are dispatched from the main loop while the reader keeps polling
+   * from its own thread: use the UID from nfc_target, don't reselect tag. */
+  if ( tag != NULL ) {
       *dest = malloc(tag->nti.nai.szUidLen*sizeof(char)*2+1);
       size_t szPos;
       char *pcUid = *dest;
@@ -110,7 +353,6 @@ tag_get_uid(nfc_device* nfc_device, nfc_target* tag, char **dest) {
       }
       pcUid[0]='\0';
       DBG( "ISO14443A tag found: UID=0x%s", *dest );
-      nfc_initiator_deselect_target ( nfc_device );
   } else {
       *dest = NULL;
       DBG("%s", "ISO14443A (MIFARE) tag not found" );
@@ -118,60 +360,22 @@ tag_get_uid(nfc_device* nfc_device, nfc_target* tag, char **dest) {
   }
 }
 
-int
-nem_execute_event_handler(nfc_device* nfc_device, nfc_target* tag, const nem_event_t event) {
-    int onerr;
-    const char *onerrorstr;
-    const nfcconf_list *actionlist;
-    nfcconf_block **blocklist, *myblock;
-
-    const char* action;
-
-    switch (event) {
-    case EVENT_TAG_INSERTED:
-        action = "tag_insert";
-        if ( _tag_uid != NULL ) {
-            free(_tag_uid);
-        }
-        tag_get_uid(nfc_device, tag, &_tag_uid);
-        break;
-    case EVENT_TAG_REMOVED:
-        action = "tag_remove";
-        break;
-    default:
-	return -1;
-	break;
-    }
-
-    blocklist = nfcconf_find_blocks ( _nem_execute_config_context, _nem_execute_config_block, "event", action );
-    if ( !blocklist ) {
-        DBG ( "%s", "Event block list not found" );
-        return -1;
-    }
-    myblock = blocklist[0];
-    free ( blocklist );
-    if ( !myblock ) {
-        DBG ( "Event item not found: '%s'", action );
-        return -1;
-    }
-    onerrorstr = nfcconf_get_str ( myblock, "on_error", "ignore" );
-    if ( !strcmp ( onerrorstr, "ignore" ) ) onerr = ONERROR_IGNORE;
-    else if ( !strcmp ( onerrorstr, "return" ) ) onerr = ONERROR_RETURN;
-    else if ( !strcmp ( onerrorstr, "quit" ) ) onerr = ONERROR_QUIT;
-    else {
-        onerr = ONERROR_IGNORE;
-        DBG ( "Invalid onerror value: '%s'. Assumed 'ignore'", onerrorstr );
-    }
+/**
+ * @brief Queue the actions of the matching rule
+ */
+static int
+execute_actions ( nem_execute_instance *instance, const execute_rule *rule, const char *uid, const char *action ) {
+    const nfcconf_list *actionlist = rule->actions;
+    int onerr = rule->onerror;
+    execute_job *job;
 
     /* search actions */
-    actionlist = nfcconf_find_list ( myblock, "action" );
     if ( !actionlist ) {
         DBG ( "No action list for event '%s'", action );
         return 0;
     }
-    // DBG ( "Onerror is set to: '%s'", onerrorstr );
 
-    if ( _tag_uid == NULL ) {
+    if ( uid == NULL ) {
         ERR( "%s", "Unable to read tag UID... This should not happend !" );
         switch ( onerr ) {
         case ONERROR_IGNORE:
@@ -184,37 +388,130 @@ nem_execute_event_handler(nfc_device* nfc_device, nfc_target* tag, const nem_eve
             DBG ( "%s", "Invalid onerror value" );
             return -1;
         }
-    } else {
-        while ( actionlist ) {
-            int res;
-            char *action_cmd_src = actionlist->data;
-            char *action_cmd_dest = malloc((strlen(action_cmd_src) + strlen(_tag_uid))*sizeof(char));
-            strsubst(action_cmd_dest, action_cmd_src, "$TAG_UID", _tag_uid);
-
-            DBG ( "Executing action: '%s'", action_cmd_dest );
-            /*
-            there are some security issues on using system() in
-            setuid/setgid programs. so we will use an alternate function
-            	*/
-            /* res=system(action_cmd); */
-            res = my_system ( action_cmd_dest );
-            actionlist = actionlist->next;
-            /* evaluate return and take care on "onerror" value */
-            DBG ( "Action '%s' returns %d", action_cmd_dest, res );
-            if ( !res ) continue;
-            switch ( onerr ) {
-            case ONERROR_IGNORE:
-                continue;
-            case ONERROR_RETURN:
-                return 0;
-            case ONERROR_QUIT:
-                exit ( EXIT_FAILURE );
-            default:
-                DBG ( "%s", "Invalid onerror value" );
-                return -1;
-            }
+        return 0;
+    }
+
+    job = calloc ( 1, sizeof ( execute_job ) );
+    if ( job == NULL ) return -1;
+    job->onerror = onerr;
+    for ( ; actionlist; actionlist = actionlist->next ) job->count++;
+    job->commands = calloc ( job->count, sizeof ( char * ) );
+    if ( job->commands == NULL ) {
+        free ( job );
+        return -1;
+    }
+    for ( actionlist = rule->actions; actionlist; actionlist = actionlist->next ) {
+        char *action_cmd_src = actionlist->data;
+        char *action_cmd_dest = malloc((strlen(action_cmd_src) + strlen(uid) + 1)*sizeof(char));
+        if ( action_cmd_dest == NULL ) {
+            job->count = job->done;
+            execute_job_free ( job );
+            return -1;
         }
+        strsubst(action_cmd_dest, action_cmd_src, "$TAG_UID", uid);
+        job->commands[job->done++] = action_cmd_dest;
     }
+    job->done = 0;
+    *instance->jobs_tail = job;
+    instance->jobs_tail = &job->next;
     return 0;
 }
 
+static int
+nem_execute_event_handler(nem_execute_instance *instance, const execute_config *config, const nem_event *ev) {
+    const nfc_target *tag = ev->tag;
+    char **uid = &instance->tag_uid;
+    int rule, res = 0;
+
+    const char* action;
+
+    switch (ev->event) {
+    case EVENT_TAG_INSERTED:
+        action = "tag_insert";
+        if ( instance->tag_uid != NULL ) {
+            free(instance->tag_uid);
+        }
+        tag_get_uid(tag, &instance->tag_uid);
+        break;
+    case EVENT_TAG_REMOVED:
+        action = "tag_remove";
+        /* The removed tag comes with the event, even across reloads */
+        if ( tag != NULL ) {
+            free(instance->tag_uid);
+            tag_get_uid(tag, &instance->tag_uid);
+        }
+        break;
+    case EVENT_RATE_LIMITED:
+        action = "rate_limited";
+        DBG ( "%u event(s) dropped by rate limiting", ev->dropped );
+        free(instance->limited_uid);
+        tag_get_uid(tag, &instance->limited_uid);
+        uid = &instance->limited_uid;
+        break;
+    default:
+	return -1;
+	break;
+    }
+
+    /* Plain reads of the settings loaded with the configuration */
+    rule = nem_rules_match_rule ( config->rules, ev );
+    if ( rule < 0 ) {
+        DBG ( "No rule matches event '%s'", action );
+    } else {
+        res = execute_actions ( instance, config->settings[rule], *uid, action );
+    }
+    return res;
+}
+
+static int
+nem_execute_handle_events( void *data, const nem_event *events, size_t count ) {
+    nem_execute_instance *instance = data;
+    const execute_config *config;
+    unsigned int token;
+    int res = 0;
+
+    /* One snapshot for the whole batch */
+    config = nfcconf_snapshot_get ( &instance->config, &token );
+    for ( size_t i = 0; i < count; i++ ) {
+        if ( nem_execute_event_handler ( instance, config, &events[i] ) < 0 ) res = -1;
+    }
+    nfcconf_snapshot_put ( &instance->config, token );
+    execute_next ( instance );
+    return res;
+}
+
+static int
+nem_execute_poll_fd( void *data ) {
+    nem_execute_instance *instance = data;
+    return instance->epoll_fd;
+}
+
+/**
+ * @brief Reap the running action, then go on with the next ones
+ */
+static void
+nem_execute_poll_ready( void *data ) {
+    nem_execute_instance *instance = data;
+    int status;
+    pid_t res;
+
+    if ( instance->pid == 0 ) return;
+    res = waitpid ( instance->pid, &status, WNOHANG );
+    if ( res == 0 || ( res < 0 && errno == EINTR ) ) return;
+    epoll_ctl ( instance->epoll_fd, EPOLL_CTL_DEL, instance->pid_fd, NULL );
+    close ( instance->pid_fd );
+    instance->pid_fd = -1;
+    instance->pid = 0;
+    execute_done ( instance, res < 0 ? -1 : status );
+    execute_next ( instance );
+}
+
+const nem_module nem_execute_module = {
+    NEM_ABI_VERSION,
+    nem_execute_init,
+    nem_execute_handle_events,
+    nem_execute_poll_fd,
+    nem_execute_poll_ready,
+    nem_execute_shutdown,
+    nem_execute_reload
+};
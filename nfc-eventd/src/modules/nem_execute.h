@@ -23,8 +23,7 @@
 
 #include "nem_common.h"
 
-void nem_execute_init(nfcconf_context *module_context, nfcconf_block* module_block);
-int nem_execute_event_handler(nfc_device* nfc_device, nfc_target* tag, const nem_event_t event);
+extern const nem_module nem_execute_module;
 
 #endif /* __NEM_EXECUTE__ */
 
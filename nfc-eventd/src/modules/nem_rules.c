@@ -0,0 +1,593 @@
+/*
+ * NFC Event Daemon
+ * Event routing rules for NEM modules
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "nem_rules.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define UID_MAX     10              /* bytes, ISO14443A triple size UID */
+#define NIBBLES_MAX (UID_MAX * 2)
+#define EVENT_COUNT (EVENT_RATE_LIMITED + 1)
+#define NONE        (-1)
+
+typedef struct {
+    nfcconf_block *block;
+    bool any_uid;
+    int atqa;                       /* NONE for any */
+    int sak;
+    int modulation;
+    char **readers;                 /* NULL terminated, NULL for any */
+} rule;
+
+/* Exact UIDs, chained hash table */
+typedef struct {
+    uint8_t uid[UID_MAX];
+    uint8_t len;
+    int rule;
+    int next;
+} uid_entry;
+
+/* Prefix trie node, one hex digit per level */
+typedef struct {
+    int child[16];
+    int rules;                      /* first rule_link, NONE if none */
+} trie_node;
+
+typedef struct {
+    int rule;
+    int next;
+} rule_link;
+
+/* Everything needed to route one kind of event */
+typedef struct {
+    uid_entry *entries;
+    size_t entries_count, entries_size;
+    int *buckets;
+    size_t buckets_mask;
+
+    trie_node *nodes;
+    size_t nodes_count, nodes_size;
+    rule_link *links;
+    size_t links_count, links_size;
+    size_t prefixes;
+
+    int *any;                       /* rules without UID criteria, in order */
+    size_t any_count, any_size;
+} rule_table;
+
+struct nem_rules {
+    rule *rules;
+    size_t rules_count;
+    rule_table tables[EVENT_COUNT];
+};
+
+static const struct {
+    const char *name;
+    nfc_modulation_type nmt;
+} modulations[] = {
+    { "iso14443a", NMT_ISO14443A },
+    { "jewel", NMT_JEWEL },
+    { "iso14443b", NMT_ISO14443B },
+    { "iso14443bi", NMT_ISO14443BI },
+    { "iso14443b2sr", NMT_ISO14443B2SR },
+    { "iso14443b2ct", NMT_ISO14443B2CT },
+    { "felica", NMT_FELICA },
+    { "dep", NMT_DEP },
+};
+
+/**
+ * @brief Grow an array so that it can hold one more element
+ */
+static int
+grow(void **array, size_t *size, size_t count, size_t elem)
+{
+    void *p;
+    size_t n;
+
+    if (count < *size)
+        return 0;
+    n = *size ? *size * 2 : 16;
+    p = realloc(*array, n * elem);
+    if (!p)
+        return -1;
+    *array = p;
+    *size = n;
+    return 0;
+}
+
+static uint32_t
+uid_hash(const uint8_t *uid, size_t len)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= uid[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    c = tolower((unsigned char) c);
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return NONE;
+}
+
+/**
+ * @brief Parse hex digits
+ * @return number of digits, -1 on error
+ */
+static int
+parse_nibbles(const char *s, uint8_t *nibbles)
+{
+    int n = 0;
+    for (; *s; s++) {
+        int d = hex_digit(*s);
+        if (d < 0 || n == NIBBLES_MAX)
+            return -1;
+        nibbles[n++] = d;
+    }
+    return n;
+}
+
+static int
+parse_hex_int(const char *s, int digits)
+{
+    uint8_t nibbles[NIBBLES_MAX];
+    int value = 0;
+
+    if (parse_nibbles(s, nibbles) != digits)
+        return NONE;
+    for (int i = 0; i < digits; i++)
+        value = (value << 4) | nibbles[i];
+    return value;
+}
+
+static int
+table_add_uid(rule_table *table, const uint8_t *nibbles, int count, int rule)
+{
+    uid_entry *e;
+
+    if (count == 0 || count % 2 || count > NIBBLES_MAX)
+        return -1;
+    if (grow((void **) &table->entries, &table->entries_size, table->entries_count, sizeof(uid_entry)) < 0)
+        return -1;
+    e = &table->entries[table->entries_count++];
+    e->len = count / 2;
+    for (int i = 0; i < e->len; i++)
+        e->uid[i] = (nibbles[2 * i] << 4) | nibbles[2 * i + 1];
+    e->rule = rule;
+    e->next = NONE;
+    return 0;
+}
+
+static int
+table_new_node(rule_table *table)
+{
+    trie_node *node;
+
+    if (grow((void **) &table->nodes, &table->nodes_size, table->nodes_count, sizeof(trie_node)) < 0)
+        return NONE;
+    node = &table->nodes[table->nodes_count];
+    for (int i = 0; i < 16; i++)
+        node->child[i] = NONE;
+    node->rules = NONE;
+    return table->nodes_count++;
+}
+
+static int
+table_add_prefix(rule_table *table, const uint8_t *nibbles, int count, int rule)
+{
+    int node = 0;
+
+    if (count <= 0)
+        return -1;
+    if (table->nodes_count == 0 && table_new_node(table) == NONE)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        int next = table->nodes[node].child[nibbles[i]];
+        if (next == NONE) {
+            next = table_new_node(table);
+            if (next == NONE)
+                return -1;
+            table->nodes[node].child[nibbles[i]] = next;
+        }
+        node = next;
+    }
+    if (grow((void **) &table->links, &table->links_size, table->links_count, sizeof(rule_link)) < 0)
+        return -1;
+    /* Rules are added in order: keep each node's list sorted by appending */
+    rule_link *link = &table->links[table->links_count];
+    link->rule = rule;
+    link->next = NONE;
+    if (table->nodes[node].rules == NONE) {
+        table->nodes[node].rules = table->links_count;
+    } else {
+        int l = table->nodes[node].rules;
+        while (table->links[l].next != NONE)
+            l = table->links[l].next;
+        table->links[l].next = table->links_count;
+    }
+    table->links_count++;
+    table->prefixes++;
+    return 0;
+}
+
+/**
+ * @brief Add "uid" or "uid*" to a table
+ */
+static int
+table_add(rule_table *table, const char *value, int rule, bool prefix)
+{
+    uint8_t nibbles[NIBBLES_MAX];
+    char buf[NIBBLES_MAX + 2];
+    size_t len = strlen(value);
+    int count;
+
+    if (len > 0 && value[len - 1] == '*') {
+        prefix = true;
+        len--;
+    }
+    if (len == 0 || len > NIBBLES_MAX)
+        return -1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    count = parse_nibbles(buf, nibbles);
+    if (count < 0)
+        return -1;
+    return prefix ? table_add_prefix(table, nibbles, count, rule) : table_add_uid(table, nibbles, count, rule);
+}
+
+static int
+table_add_file(rule_table *table, const char *path, int rule)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    unsigned int lineno = 0, invalid = 0;
+
+    if (!f) {
+        ERR("Unable to open UID file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *s = line, *end;
+        lineno++;
+        if ((end = strchr(s, '#')))
+            *end = '\0';
+        while (isspace((unsigned char) *s))
+            s++;
+        end = s + strlen(s);
+        while (end > s && isspace((unsigned char) end[-1]))
+            *--end = '\0';
+        if (*s == '\0')
+            continue;
+        if (table_add(table, s, rule, false) < 0) {
+            if (invalid++ == 0)
+                ERR("%s:%u: invalid UID '%s'", path, lineno, s);
+        }
+    }
+    fclose(f);
+    if (invalid > 1)
+        ERR("%s: %u invalid lines ignored", path, invalid);
+    return 0;
+}
+
+/**
+ * @brief Build the hash table once all exact UIDs are known
+ */
+static int
+table_index(rule_table *table)
+{
+    size_t size = 16;
+
+    while (size < table->entries_count * 2)
+        size *= 2;
+    table->buckets = malloc(size * sizeof(int));
+    if (!table->buckets)
+        return -1;
+    table->buckets_mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        table->buckets[i] = NONE;
+    /* Insert backwards so that chains keep configuration order */
+    for (size_t i = table->entries_count; i-- > 0; ) {
+        uid_entry *e = &table->entries[i];
+        uint32_t b = uid_hash(e->uid, e->len) & table->buckets_mask;
+        e->next = table->buckets[b];
+        table->buckets[b] = i;
+    }
+    return 0;
+}
+
+static char **
+string_list(const nfcconf_list *list)
+{
+    size_t n = 0;
+    char **v;
+
+    for (const nfcconf_list *l = list; l; l = l->next)
+        n++;
+    v = calloc(n + 1, sizeof(char *));
+    if (!v)
+        return NULL;
+    n = 0;
+    for (const nfcconf_list *l = list; l; l = l->next)
+        v[n++] = strdup(l->data);
+    return v;
+}
+
+static int
+event_index(const char *name)
+{
+    if (strcmp(name, "tag_insert") == 0) return EVENT_TAG_INSERTED;
+    if (strcmp(name, "tag_remove") == 0) return EVENT_TAG_REMOVED;
+    if (strcmp(name, "expire_time") == 0) return EVENT_EXPIRE_TIME;
+    if (strcmp(name, "rate_limited") == 0) return EVENT_RATE_LIMITED;
+    return NONE;
+}
+
+static int
+compile_rule(nem_rules *rules, nfcconf_block *block, int index)
+{
+    rule *r = &rules->rules[index];
+    rule_table *table;
+    const nfcconf_list *l;
+    const char *s;
+    int event;
+
+    r->block = block;
+    r->atqa = r->sak = r->modulation = NONE;
+    if (!block->name || !block->name->data)
+        return -1;
+    event = event_index(block->name->data);
+    if (event == NONE) {
+        DBG("Ignoring unknown event '%s'", block->name->data);
+        return 0;
+    }
+    table = &rules->tables[event];
+
+    if ((s = nfcconf_get_str(block, "atqa", NULL)) && (r->atqa = parse_hex_int(s, 4)) == NONE) {
+        ERR("Invalid atqa '%s' in event %s", s, block->name->data);
+        return -1;
+    }
+    if ((s = nfcconf_get_str(block, "sak", NULL)) && (r->sak = parse_hex_int(s, 2)) == NONE) {
+        ERR("Invalid sak '%s' in event %s", s, block->name->data);
+        return -1;
+    }
+    if ((s = nfcconf_get_str(block, "modulation", NULL))) {
+        for (size_t i = 0; i < sizeof(modulations) / sizeof(modulations[0]); i++) {
+            if (strcasecmp(s, modulations[i].name) == 0)
+                r->modulation = modulations[i].nmt;
+        }
+        if (r->modulation == NONE) {
+            ERR("Invalid modulation '%s' in event %s", s, block->name->data);
+            return -1;
+        }
+    }
+    if ((l = nfcconf_find_list(block, "reader")) && !(r->readers = string_list(l)))
+        return -1;
+
+    r->any_uid = true;
+    for (l = nfcconf_find_list(block, "uid"); l; l = l->next, r->any_uid = false) {
+        if (table_add(table, l->data, index, false) < 0) {
+            ERR("Invalid uid '%s' in event %s", l->data, block->name->data);
+            return -1;
+        }
+    }
+    for (l = nfcconf_find_list(block, "uid_prefix"); l; l = l->next, r->any_uid = false) {
+        if (table_add(table, l->data, index, true) < 0) {
+            ERR("Invalid uid_prefix '%s' in event %s", l->data, block->name->data);
+            return -1;
+        }
+    }
+    for (l = nfcconf_find_list(block, "uid_file"); l; l = l->next, r->any_uid = false) {
+        if (table_add_file(table, l->data, index) < 0)
+            return -1;
+    }
+    if (r->any_uid) {
+        if (grow((void **) &table->any, &table->any_size, table->any_count, sizeof(int)) < 0)
+            return -1;
+        table->any[table->any_count++] = index;
+    }
+    return 0;
+}
+
+nem_rules *
+nem_rules_compile(nfcconf_context *context, nfcconf_block *module_block)
+{
+    const nfcconf_atom *event_key;
+    const nfcconf_block *block;
+    nfcconf_iter iter;
+    nem_rules *rules;
+    size_t n = 0;
+
+    event_key = nfcconf_atom_get(context, "event");
+    rules = calloc(1, sizeof(nem_rules));
+    if (!event_key || !rules) {
+        free(rules);
+        return NULL;
+    }
+    /* Count, then compile */
+    for (block = nfcconf_iter_blocks(&iter, module_block, event_key, NULL); block; block = nfcconf_iter_next_block(&iter))
+        n++;
+    rules->rules = calloc(n ? n : 1, sizeof(rule));
+    if (!rules->rules)
+        goto error;
+    for (block = nfcconf_iter_blocks(&iter, module_block, event_key, NULL); block; block = nfcconf_iter_next_block(&iter)) {
+        if (compile_rule(rules, (nfcconf_block *) block, rules->rules_count) < 0)
+            goto error;
+        rules->rules_count++;
+    }
+    for (int e = 0; e < EVENT_COUNT; e++) {
+        if (table_index(&rules->tables[e]) < 0)
+            goto error;
+    }
+    return rules;
+
+error:
+    nem_rules_free(rules);
+    return NULL;
+}
+
+/**
+ * @brief Criteria other than the UID
+ */
+static bool
+rule_accepts(const rule *r, const nem_event *event)
+{
+    const nfc_target *tag = event->tag;
+
+    if (r->modulation != NONE && (!tag || (int) tag->nm.nmt != r->modulation))
+        return false;
+    if (r->atqa != NONE || r->sak != NONE) {
+        if (!tag || tag->nm.nmt != NMT_ISO14443A)
+            return false;
+        if (r->atqa != NONE && ((tag->nti.nai.abtAtqa[0] << 8) | tag->nti.nai.abtAtqa[1]) != r->atqa)
+            return false;
+        if (r->sak != NONE && tag->nti.nai.btSak != r->sak)
+            return false;
+    }
+    if (r->readers) {
+        char **name;
+        for (name = r->readers; *name; name++) {
+            if ((event->reader_name && strcmp(*name, event->reader_name) == 0) ||
+                (event->connstring && strcmp(*name, event->connstring) == 0))
+                break;
+        }
+        if (!*name)
+            return false;
+    }
+    return true;
+}
+
+int
+nem_rules_match_rule(const nem_rules *rules, const nem_event *event)
+{
+    const rule_table *table;
+    const uint8_t *uid = NULL;
+    size_t len = 0;
+    int best = NONE;
+
+    if (!rules || (int) event->event < 0 || (int) event->event >= EVENT_COUNT)
+        return NONE;
+    table = &rules->tables[event->event];
+
+    /* Rules without UID criteria: the first acceptable one bounds the search */
+    for (size_t i = 0; i < table->any_count; i++) {
+        if (rule_accepts(&rules->rules[table->any[i]], event)) {
+            best = table->any[i];
+            break;
+        }
+    }
+
+    if (event->tag && event->tag->nm.nmt == NMT_ISO14443A) {
+        uid = event->tag->nti.nai.abtUid;
+        len = event->tag->nti.nai.szUidLen;
+        if (len > UID_MAX)
+            len = UID_MAX;
+    }
+    if (len == 0)
+        return best;
+
+    /* Exact UIDs */
+    for (int i = table->buckets[uid_hash(uid, len) & table->buckets_mask]; i != NONE; i = table->entries[i].next) {
+        const uid_entry *e = &table->entries[i];
+        if (best != NONE && e->rule >= best)
+            continue;
+        if (e->len == len && memcmp(e->uid, uid, len) == 0 && rule_accepts(&rules->rules[e->rule], event))
+            best = e->rule;
+    }
+
+    /* Prefixes, walking down the trie along the UID digits */
+    if (table->nodes_count) {
+        int node = 0;
+        for (size_t i = 0; i < len * 2 && node != NONE; i++) {
+            int digit = (i % 2) ? (uid[i / 2] & 0x0f) : (uid[i / 2] >> 4);
+            node = table->nodes[node].child[digit];
+            if (node == NONE)
+                break;
+            for (int l = table->nodes[node].rules; l != NONE; l = table->links[l].next) {
+                int r = table->links[l].rule;
+                if (best != NONE && r >= best)
+                    break;
+                if (rule_accepts(&rules->rules[r], event)) {
+                    best = r;
+                    break;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+nfcconf_block *
+nem_rules_match(const nem_rules *rules, const nem_event *event)
+{
+    int best = nem_rules_match_rule(rules, event);
+
+    return best == NONE ? NULL : rules->rules[best].block;
+}
+
+void
+nem_rules_count(const nem_rules *rules, size_t *rules_count, size_t *uids, size_t *prefixes)
+{
+    *rules_count = rules->rules_count;
+    *uids = *prefixes = 0;
+    for (int e = 0; e < EVENT_COUNT; e++) {
+        *uids += rules->tables[e].entries_count;
+        *prefixes += rules->tables[e].prefixes;
+    }
+}
+
+void
+nem_rules_free(nem_rules *rules)
+{
+    if (!rules)
+        return;
+    for (size_t i = 0; i < rules->rules_count; i++) {
+        char **name = rules->rules[i].readers;
+        if (!name)
+            continue;
+        for (; *name; name++)
+            free(*name);
+        free(rules->rules[i].readers);
+    }
+    free(rules->rules);
+    for (int e = 0; e < EVENT_COUNT; e++) {
+        rule_table *t = &rules->tables[e];
+        free(t->entries);
+        free(t->buckets);
+        free(t->nodes);
+        free(t->links);
+        free(t->any);
+    }
+    free(rules);
+}
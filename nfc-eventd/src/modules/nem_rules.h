@@ -0,0 +1,73 @@
+/*
+ * NFC Event Daemon
+ * Event routing rules for NEM modules
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __NEM_RULES__
+#define __NEM_RULES__
+
+#include "nem_common.h"
+
+/*
+ * Each "event <name> { ... }" block of a module is a rule. Besides its
+ * actions, a rule may restrict the events it applies to:
+ *
+ *   uid = "04a1b2c3", ...;          exact UIDs (hex)
+ *   uid_prefix = "04a", ...;        UID prefixes (hex digits)
+ *   uid_file = "/path/list", ...;   one UID per line, "prefix*" for prefixes
+ *   atqa = "0044";  sak = "08";
+ *   modulation = "iso14443a";
+ *   reader = "name or connstring", ...;
+ *
+ * UID criteria are or'ed together, everything else is and'ed. An event goes
+ * to the first matching rule in configuration order.
+ *
+ * Rules are compiled into a hash table of exact UIDs and a trie of prefixes
+ * (one hex digit per level), so routing costs O(UID length) whatever the
+ * number of rules and UIDs.
+ */
+
+typedef struct nem_rules nem_rules;
+
+/**
+ * @brief Compile the event blocks of a module block
+ * @return rules, or NULL on error (invalid criteria, unreadable UID file)
+ */
+nem_rules *nem_rules_compile(nfcconf_context *context, nfcconf_block *module_block);
+
+/**
+ * @brief Find the rule an event goes to
+ * @return the event block, NULL if no rule matches
+ */
+nfcconf_block *nem_rules_match(const nem_rules *rules, const nem_event *event);
+
+/**
+ * @brief Find the rule an event goes to
+ * @return the rule number, that of its event block in the module block,
+ *         -1 if no rule matches
+ */
+int nem_rules_match_rule(const nem_rules *rules, const nem_event *event);
+
+/**
+ * @brief Number of rules, and of UIDs and prefixes they hold
+ */
+void nem_rules_count(const nem_rules *rules, size_t *rules_count, size_t *uids, size_t *prefixes);
+
+void nem_rules_free(nem_rules *rules);
+
+#endif /* __NEM_RULES__ */
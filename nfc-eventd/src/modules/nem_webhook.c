@@ -0,0 +1,959 @@
+/*
+ * Nfc Event Module Webhook
+ *
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "nem_webhook.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#define DEF_CONNECTIONS 2
+#define DEF_BATCH_WINDOW 10 /* ms */
+#define DEF_BATCH_MAX 32
+#define DEF_RETRY_QUEUE 256
+#define DEF_RETRY_DELAY 200 /* ms */
+#define DEF_TIMEOUT 2000 /* ms */
+#define DEF_SHUTDOWN_TIMEOUT 500 /* ms */
+#define RETRY_DELAY_MAX 10000 /* ms */
+#define RESPONSE_MAX 65536
+#define MAX_EVENTS 16
+#define NEVER UINT64_MAX
+
+/* A complete HTTP request, ready to be sent (again) */
+typedef struct request {
+    struct request *next;
+    char *data;
+    size_t len;
+    unsigned int events;
+    unsigned int attempts;
+} request;
+
+typedef enum {
+    CONN_CLOSED,
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_RECEIVING,
+    CONN_IDLE                       /* connected, kept alive */
+} conn_state;
+
+typedef struct endpoint endpoint;
+
+typedef struct {
+    endpoint *endpoint;
+    int fd;
+    conn_state state;
+    unsigned int requests;          /* sent over this connection */
+    request *request;
+    size_t sent;
+    char *response;
+    size_t response_len, response_size;
+    uint64_t deadline_ms;
+} conn;
+
+typedef struct {
+    int epoll_fd;
+    int timer_fd;
+    endpoint *endpoints;
+    size_t endpoints_count;
+    unsigned int connections;
+    unsigned int batch_window;
+    unsigned int batch_max;
+    unsigned int retry_queue;
+    unsigned int retry_delay;
+    unsigned int timeout;
+    unsigned int shutdown_timeout;
+    /* JSON of the event being queued */
+    char *json;
+    size_t json_len, json_size;
+} nem_webhook_instance;
+
+struct endpoint {
+    nem_webhook_instance *instance;
+    const char *url;
+    char *host;                     /* Host header */
+    char *path;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    conn *conns;
+
+    /* Events waiting for the batch window, comma separated JSON objects */
+    char *batch;
+    size_t batch_len, batch_size;
+    unsigned int batch_events;
+    uint64_t batch_deadline_ms;
+
+    /* Requests waiting for a connection, oldest first */
+    request *head, *tail;
+    unsigned int queued;
+    unsigned int retry_delay_ms;
+    uint64_t retry_ms;
+    bool failing;
+
+    uint64_t delivered;
+    uint64_t dropped;
+};
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+append(char **buf, size_t *len, size_t *size, const char *data, size_t n)
+{
+    if (*len + n + 1 > *size) {
+        size_t new_size = *size ? *size : 256;
+        char *p;
+        while (*len + n + 1 > new_size)
+            new_size *= 2;
+        p = realloc(*buf, new_size);
+        if (!p)
+            return -1;
+        *buf = p;
+        *size = new_size;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+static int
+appendf(char **buf, size_t *len, size_t *size, const char *format, ...)
+{
+    char tmp[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(tmp, sizeof(tmp), format, ap);
+    va_end(ap);
+    if (n < 0 || (size_t) n >= sizeof(tmp))
+        return -1;
+    return append(buf, len, size, tmp, n);
+}
+
+static int
+append_json_string(char **buf, size_t *len, size_t *size, const char *s)
+{
+    if (append(buf, len, size, "\"", 1) < 0)
+        return -1;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        int res;
+        if (c == '"' || c == '\\')
+            res = appendf(buf, len, size, "\\%c", c);
+        else if (c < 0x20)
+            res = appendf(buf, len, size, "\\u%04x", c);
+        else
+            res = append(buf, len, size, (const char *) &c, 1);
+        if (res < 0)
+            return -1;
+    }
+    return append(buf, len, size, "\"", 1);
+}
+
+static const char *
+event_name(nem_event_t event)
+{
+    switch (event) {
+    case EVENT_TAG_INSERTED: return "tag_insert";
+    case EVENT_TAG_REMOVED: return "tag_remove";
+    case EVENT_EXPIRE_TIME: return "expire_time";
+    case EVENT_RATE_LIMITED: return "rate_limited";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Compact JSON object of an event, in instance->json
+ */
+static int
+event_json(nem_webhook_instance *instance, const nem_event *ev)
+{
+    char **buf = &instance->json;
+    size_t *len = &instance->json_len, *size = &instance->json_size;
+
+    *len = 0;
+    if (appendf(buf, len, size, "{\"event\":\"%s\"", event_name(ev->event)) < 0)
+        return -1;
+    if (ev->tag) {
+        if (append(buf, len, size, ",\"uid\":\"", 8) < 0)
+            return -1;
+        for (size_t i = 0; i < ev->tag->nti.nai.szUidLen; i++) {
+            if (appendf(buf, len, size, "%02x", ev->tag->nti.nai.abtUid[i]) < 0)
+                return -1;
+        }
+        if (append(buf, len, size, "\"", 1) < 0)
+            return -1;
+    }
+    if (appendf(buf, len, size, ",\"reader\":%u", ev->reader_id) < 0)
+        return -1;
+    if (ev->reader_name &&
+        (append(buf, len, size, ",\"reader_name\":", 15) < 0 || append_json_string(buf, len, size, ev->reader_name) < 0))
+        return -1;
+    if (ev->event == EVENT_RATE_LIMITED && appendf(buf, len, size, ",\"dropped\":%u", ev->dropped) < 0)
+        return -1;
+    return appendf(buf, len, size, ",\"timestamp_us\":%llu}", (unsigned long long) ev->timestamp_us);
+}
+
+static void
+request_free(request *req)
+{
+    free(req->data);
+    free(req);
+}
+
+/**
+ * @brief Queue a request, at the front for a retry
+ * When the queue is full, requests are dropped from the other end: the
+ * oldest for a new request, the newest for a retry.
+ */
+static void
+queue_push(endpoint *ep, request *req, bool front)
+{
+    req->next = NULL;
+    if (!ep->head) {
+        ep->head = ep->tail = req;
+    } else if (front) {
+        req->next = ep->head;
+        ep->head = req;
+    } else {
+        ep->tail->next = req;
+        ep->tail = req;
+    }
+    ep->queued++;
+    while (ep->queued > ep->instance->retry_queue) {
+        request *victim = ep->head, *prev = NULL;
+        if (front) {
+            for (; victim->next; victim = victim->next)
+                prev = victim;
+        }
+        if (prev) {
+            prev->next = NULL;
+            ep->tail = prev;
+        } else {
+            ep->head = victim->next;
+        }
+        ep->queued--;
+        ep->dropped += victim->events;
+        DBG("Webhook %s: retry queue full, %u event(s) dropped", ep->url, victim->events);
+        request_free(victim);
+    }
+    if (!ep->head)
+        ep->tail = NULL;
+}
+
+static request *
+queue_pop(endpoint *ep)
+{
+    request *req = ep->head;
+    if (req) {
+        ep->head = req->next;
+        if (!ep->head)
+            ep->tail = NULL;
+        ep->queued--;
+    }
+    return req;
+}
+
+/**
+ * @brief Turn the events of the batch window into a request
+ */
+static void
+batch_flush(endpoint *ep)
+{
+    request *req;
+    size_t size = 0;
+
+    if (ep->batch_events == 0)
+        return;
+    req = calloc(1, sizeof(request));
+    if (!req || appendf(&req->data, &req->len, &size,
+                        "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\n"
+                        "Content-Length: %zu\r\n\r\n[", ep->path, ep->host, ep->batch_len + 2) < 0 ||
+        append(&req->data, &req->len, &size, ep->batch, ep->batch_len) < 0 ||
+        append(&req->data, &req->len, &size, "]", 1) < 0) {
+        ERR("Webhook %s: out of memory, %u event(s) dropped", ep->url, ep->batch_events);
+        ep->dropped += ep->batch_events;
+        if (req)
+            request_free(req);
+    } else {
+        req->events = ep->batch_events;
+        queue_push(ep, req, false);
+    }
+    ep->batch_len = 0;
+    ep->batch_events = 0;
+}
+
+static int
+conn_watch(conn *c, uint32_t events, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    return epoll_ctl(c->endpoint->instance->epoll_fd, op, c->fd, &ev);
+}
+
+static void
+conn_close(conn *c)
+{
+    if (c->fd >= 0) {
+        epoll_ctl(c->endpoint->instance->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->state = CONN_CLOSED;
+    c->requests = 0;
+    c->response_len = 0;
+}
+
+/**
+ * @brief Put the request back in the queue, wait before retrying
+ * A request that found its kept alive connection closed by the server
+ * (stale) is retried at once, the first time.
+ */
+static void
+request_retry(endpoint *ep, request *req, bool stale, const char *why)
+{
+    nem_webhook_instance *instance = ep->instance;
+    bool at_once = stale && req->attempts == 0;
+
+    /* Decided first: a full queue may drop the request */
+    req->attempts++;
+    queue_push(ep, req, true);
+    if (at_once)
+        return;
+    if (!ep->failing)
+        WARN("Webhook %s: %s, retrying in %u ms", ep->url, why, ep->retry_delay_ms);
+    else
+        DBG("Webhook %s: %s, retrying in %u ms", ep->url, why, ep->retry_delay_ms);
+    ep->failing = true;
+    ep->retry_ms = now_ms() + ep->retry_delay_ms;
+    ep->retry_delay_ms = ep->retry_delay_ms * 2 > RETRY_DELAY_MAX ? RETRY_DELAY_MAX : ep->retry_delay_ms * 2;
+    if (ep->retry_delay_ms < instance->retry_delay)
+        ep->retry_delay_ms = instance->retry_delay;
+}
+
+/**
+ * @brief Drop the connection and retry its request
+ * @param closed the server closed the connection (end of file, reset)
+ * Only a connection that was closed after a previous response, before any
+ * byte of this one, is stale: timeouts and other errors are real failures.
+ */
+static void
+conn_fail(conn *c, bool closed, const char *why)
+{
+    request *req = c->request;
+    bool stale = closed && c->requests > 0 && c->response_len == 0;
+
+    c->request = NULL;
+    conn_close(c);
+    if (req)
+        request_retry(c->endpoint, req, stale, why);
+}
+
+static void
+conn_send(conn *c)
+{
+    request *req = c->request;
+
+    while (c->sent < req->len) {
+        ssize_t n = send(c->fd, req->data + c->sent, req->len - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            /* Sending to a closed connection */
+            conn_fail(c, errno == EPIPE || errno == ECONNRESET, strerror(errno));
+            return;
+        }
+        c->sent += n;
+    }
+    c->state = CONN_RECEIVING;
+    if (conn_watch(c, EPOLLIN, EPOLL_CTL_MOD) < 0)
+        conn_fail(c, false, strerror(errno));
+}
+
+static void
+conn_connect(conn *c)
+{
+    endpoint *ep = c->endpoint;
+    int one = 1;
+
+    c->fd = socket(ep->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        conn_fail(c, false, strerror(errno));
+        return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *) &ep->addr, ep->addr_len) == 0) {
+        c->state = CONN_SENDING;
+    } else if (errno == EINPROGRESS) {
+        c->state = CONN_CONNECTING;
+    } else {
+        conn_fail(c, false, strerror(errno));
+        return;
+    }
+    if (conn_watch(c, EPOLLOUT, EPOLL_CTL_ADD) < 0) {
+        conn_fail(c, false, strerror(errno));
+        return;
+    }
+    if (c->state == CONN_SENDING)
+        conn_send(c);
+}
+
+static void
+conn_start(conn *c, request *req)
+{
+    c->request = req;
+    c->sent = 0;
+    c->response_len = 0;
+    c->deadline_ms = now_ms() + c->endpoint->instance->timeout;
+    if (c->state == CONN_CLOSED) {
+        conn_connect(c);
+        return;
+    }
+    c->state = CONN_SENDING;
+    if (conn_watch(c, EPOLLOUT, EPOLL_CTL_MOD) < 0) {
+        conn_fail(c, false, strerror(errno));
+        return;
+    }
+    conn_send(c);
+}
+
+/**
+ * @brief Hand queued requests to the connections that are free
+ */
+static void
+endpoint_dispatch(endpoint *ep)
+{
+    unsigned int n = ep->instance->connections;
+
+    if (!ep->head || now_ms() < ep->retry_ms)
+        return;
+    /* Kept alive connections first */
+    for (unsigned int i = 0; i < n && ep->head; i++) {
+        if (ep->conns[i].state == CONN_IDLE)
+            conn_start(&ep->conns[i], queue_pop(ep));
+    }
+    for (unsigned int i = 0; i < n && ep->head; i++) {
+        if (ep->conns[i].state == CONN_CLOSED)
+            conn_start(&ep->conns[i], queue_pop(ep));
+    }
+}
+
+/**
+ * @brief Look for a complete response
+ * @return 1 if complete, 0 if more is needed, -1 if invalid
+ */
+static int
+response_parse(conn *c, bool eof, int *status, bool *keep_alive)
+{
+    char *headers_end, *line;
+    long content_length = -1;
+    bool chunked = false;
+    size_t header_len;
+
+    headers_end = strstr(c->response, "\r\n\r\n");
+    if (!headers_end)
+        return eof ? -1 : 0;
+    header_len = headers_end + 4 - c->response;
+    if (sscanf(c->response, "HTTP/1.%*d %d", status) != 1)
+        return -1;
+    *keep_alive = true;
+    for (line = strstr(c->response, "\r\n") + 2; line < headers_end; line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtol(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            char *token = strstr(line, "chunked");
+            chunked = token && token < strstr(line, "\r\n");
+        } else if (strncasecmp(line, "Connection:", 11) == 0 &&
+                   strncasecmp(line + 11 + strspn(line + 11, " "), "close", 5) == 0) {
+            *keep_alive = false;
+        }
+    }
+    if (chunked) {
+        /* Good enough for the short bodies we ignore: no trailers */
+        if (strstr(c->response + header_len, "0\r\n\r\n"))
+            return 1;
+        return eof ? -1 : 0;
+    }
+    if (content_length >= 0)
+        return c->response_len >= header_len + content_length ? 1 : (eof ? -1 : 0);
+    /* Body up to the end of the connection */
+    *keep_alive = false;
+    return eof ? 1 : 0;
+}
+
+static void
+response_done(conn *c, int status, bool keep_alive)
+{
+    endpoint *ep = c->endpoint;
+    request *req = c->request;
+
+    c->request = NULL;
+    c->requests++;
+    c->response_len = 0;
+    if (status >= 200 && status < 300) {
+        ep->delivered += req->events;
+        ep->retry_delay_ms = ep->instance->retry_delay;
+        if (ep->failing)
+            INFO("Webhook %s: delivering events again", ep->url);
+        ep->failing = false;
+        request_free(req);
+    } else if (status >= 400 && status < 500 && status != 408 && status != 429) {
+        ERR("Webhook %s: HTTP status %d, %u event(s) dropped", ep->url, status, req->events);
+        ep->dropped += req->events;
+        request_free(req);
+    } else {
+        char why[32];
+        snprintf(why, sizeof(why), "HTTP status %d", status);
+        request_retry(ep, req, false, why);
+    }
+    if (keep_alive) {
+        c->state = CONN_IDLE;
+        if (conn_watch(c, EPOLLIN, EPOLL_CTL_MOD) < 0)
+            conn_close(c);
+    } else {
+        conn_close(c);
+    }
+}
+
+static void
+conn_receive(conn *c)
+{
+    for (;;) {
+        char buf[4096];
+        int status, res;
+        bool keep_alive;
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            conn_fail(c, errno == ECONNRESET, strerror(errno));
+            return;
+        }
+        if (c->state == CONN_IDLE) {
+            /* Closed by the server, or unexpected data */
+            conn_close(c);
+            return;
+        }
+        if (n > 0 && (c->response_len + n > RESPONSE_MAX ||
+                      append(&c->response, &c->response_len, &c->response_size, buf, n) < 0)) {
+            conn_fail(c, false, "response too large");
+            return;
+        }
+        if (c->response_len == 0) {
+            conn_fail(c, true, "connection closed");
+            return;
+        }
+        res = response_parse(c, n == 0, &status, &keep_alive);
+        if (res < 0) {
+            conn_fail(c, false, "invalid response");
+            return;
+        }
+        if (res > 0) {
+            response_done(c, status, keep_alive && n > 0);
+            return;
+        }
+        if (n == 0) {
+            conn_fail(c, true, "connection closed");
+            return;
+        }
+    }
+}
+
+static void
+conn_ready(conn *c, uint32_t events)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    switch (c->state) {
+    case CONN_CONNECTING:
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (err) {
+            conn_fail(c, false, strerror(err));
+            return;
+        }
+        c->state = CONN_SENDING;
+        conn_send(c);
+        break;
+    case CONN_SENDING:
+        if (events & (EPOLLERR | EPOLLHUP))
+            conn_fail(c, (events & EPOLLHUP) != 0, "connection closed");
+        else
+            conn_send(c);
+        break;
+    case CONN_RECEIVING:
+    case CONN_IDLE:
+        conn_receive(c);
+        break;
+    case CONN_CLOSED:
+        break;
+    }
+}
+
+/**
+ * @brief Batch windows, retries and request timeouts that are due, then
+ * arm the timer for the next one
+ */
+static void
+webhook_process(nem_webhook_instance *instance)
+{
+    uint64_t now = now_ms(), next = NEVER;
+    struct itimerspec its;
+
+    for (size_t i = 0; i < instance->endpoints_count; i++) {
+        endpoint *ep = &instance->endpoints[i];
+
+        for (unsigned int j = 0; j < instance->connections; j++) {
+            conn *c = &ep->conns[j];
+            if (c->request && now >= c->deadline_ms)
+                conn_fail(c, false, "timeout");
+        }
+        if (ep->batch_events && now >= ep->batch_deadline_ms)
+            batch_flush(ep);
+        endpoint_dispatch(ep);
+
+        if (ep->batch_events && ep->batch_deadline_ms < next)
+            next = ep->batch_deadline_ms;
+        if (ep->head && ep->retry_ms > now && ep->retry_ms < next)
+            next = ep->retry_ms;
+        for (unsigned int j = 0; j < instance->connections; j++) {
+            if (ep->conns[j].request && ep->conns[j].deadline_ms < next)
+                next = ep->conns[j].deadline_ms;
+        }
+    }
+
+    memset(&its, 0, sizeof(its));
+    if (next != NEVER) {
+        uint64_t delay = next > now ? next - now : 1;
+        its.it_value.tv_sec = delay / 1000;
+        its.it_value.tv_nsec = (delay % 1000) * 1000000;
+    }
+    timerfd_settime(instance->timer_fd, 0, &its, NULL);
+}
+
+static void
+webhook_poll(nem_webhook_instance *instance, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    n = epoll_wait(instance->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL) {
+            uint64_t expirations;
+            if (read(instance->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                DBG("Webhook timer: %s", strerror(errno));
+        } else {
+            conn_ready(events[i].data.ptr, events[i].events);
+        }
+    }
+    webhook_process(instance);
+}
+
+/**
+ * @brief Parse http://host[:port][/path]
+ */
+static int
+endpoint_init(endpoint *ep, const char *url)
+{
+    struct addrinfo hints, *res;
+    char host[256], port[16] = "80";
+    const char *p, *end;
+    size_t len;
+    int err;
+
+    ep->url = url;
+    if (strncmp(url, "http://", 7) != 0) {
+        ERR("Webhook %s: only http:// URLs are supported", url);
+        return -1;
+    }
+    p = url + 7;
+    end = p + strcspn(p, "/");
+    len = end - p;
+    if (len == 0 || len >= sizeof(host)) {
+        ERR("Webhook %s: invalid host", url);
+        return -1;
+    }
+    memcpy(host, p, len);
+    host[len] = '\0';
+    ep->host = strdup(host);
+    ep->path = strdup(*end ? end : "/");
+    if (!ep->host || !ep->path)
+        return -1;
+
+    /* [v6 address]:port or name:port */
+    if (host[0] == '[') {
+        char *close_bracket = strchr(host, ']');
+        if (!close_bracket) {
+            ERR("Webhook %s: invalid host", url);
+            return -1;
+        }
+        *close_bracket = '\0';
+        if (close_bracket[1] == ':')
+            snprintf(port, sizeof(port), "%s", close_bracket + 2);
+        memmove(host, host + 1, strlen(host));
+    } else {
+        char *colon = strchr(host, ':');
+        if (colon) {
+            *colon = '\0';
+            snprintf(port, sizeof(port), "%s", colon + 1);
+        }
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        ERR("Webhook %s: %s", url, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&ep->addr, res->ai_addr, res->ai_addrlen);
+    ep->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void
+instance_free(nem_webhook_instance *instance)
+{
+    uint64_t lost = 0;
+
+    for (size_t i = 0; i < instance->endpoints_count; i++) {
+        endpoint *ep = &instance->endpoints[i];
+        request *req;
+
+        for (unsigned int j = 0; ep->conns && j < instance->connections; j++) {
+            conn *c = &ep->conns[j];
+            if (c->request) {
+                lost += c->request->events;
+                request_free(c->request);
+            }
+            if (c->fd >= 0)
+                close(c->fd);
+            free(c->response);
+        }
+        while ((req = queue_pop(ep))) {
+            lost += req->events;
+            request_free(req);
+        }
+        DBG("Webhook %s: %llu event(s) delivered, %llu dropped", ep->url, (unsigned long long) ep->delivered,
+            (unsigned long long) ep->dropped);
+        free(ep->conns);
+        free(ep->batch);
+        free(ep->host);
+        free(ep->path);
+    }
+    if (lost)
+        WARN("Webhook: %llu event(s) not delivered", (unsigned long long) lost);
+    if (instance->epoll_fd >= 0)
+        close(instance->epoll_fd);
+    if (instance->timer_fd >= 0)
+        close(instance->timer_fd);
+    free(instance->endpoints);
+    free(instance->json);
+    free(instance);
+}
+
+static void
+nem_webhook_shutdown(void *data)
+{
+    nem_webhook_instance *instance = data;
+    uint64_t deadline = now_ms() + instance->shutdown_timeout;
+
+    /* Give what is pending a chance to go out */
+    for (;;) {
+        bool pending = false;
+        uint64_t now;
+
+        for (size_t i = 0; i < instance->endpoints_count; i++) {
+            endpoint *ep = &instance->endpoints[i];
+            batch_flush(ep);
+            endpoint_dispatch(ep);
+            pending = pending || ep->head;
+            for (unsigned int j = 0; j < instance->connections; j++)
+                pending = pending || ep->conns[j].request;
+        }
+        now = now_ms();
+        if (!pending || now >= deadline)
+            break;
+        webhook_poll(instance, deadline - now);
+    }
+    instance_free(instance);
+}
+
+static void *
+nem_webhook_init(nfcconf_context *module_context, nfcconf_block *module_block)
+{
+    nem_webhook_instance *instance;
+    const nfcconf_list *urls, *item;
+    struct epoll_event ev;
+    size_t count = 0;
+    (void) module_context;
+
+    urls = nfcconf_find_list(module_block, "url");
+    for (item = urls; item; item = item->next)
+        count++;
+    if (count == 0) {
+        ERR("%s", "Webhook: no url configured");
+        return NULL;
+    }
+
+    instance = calloc(1, sizeof(nem_webhook_instance));
+    if (!instance)
+        return NULL;
+    instance->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    instance->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    instance->connections = nfcconf_get_int(module_block, "connections", DEF_CONNECTIONS);
+    instance->batch_window = nfcconf_get_int(module_block, "batch_window", DEF_BATCH_WINDOW);
+    instance->batch_max = nfcconf_get_int(module_block, "batch_max", DEF_BATCH_MAX);
+    instance->retry_queue = nfcconf_get_int(module_block, "retry_queue", DEF_RETRY_QUEUE);
+    instance->retry_delay = nfcconf_get_int(module_block, "retry_delay", DEF_RETRY_DELAY);
+    instance->timeout = nfcconf_get_int(module_block, "timeout", DEF_TIMEOUT);
+    instance->shutdown_timeout = nfcconf_get_int(module_block, "shutdown_timeout", DEF_SHUTDOWN_TIMEOUT);
+    if (instance->connections == 0)
+        instance->connections = 1;
+    if (instance->batch_max == 0)
+        instance->batch_max = 1;
+    if (instance->retry_queue == 0)
+        instance->retry_queue = 1;
+    if (instance->retry_delay == 0)
+        instance->retry_delay = 1;
+
+    instance->endpoints = calloc(count, sizeof(endpoint));
+    if (instance->epoll_fd < 0 || instance->timer_fd < 0 || !instance->endpoints) {
+        ERR("Webhook: %s", strerror(errno));
+        instance_free(instance);
+        return NULL;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(instance->epoll_fd, EPOLL_CTL_ADD, instance->timer_fd, &ev) < 0) {
+        ERR("Webhook: %s", strerror(errno));
+        instance_free(instance);
+        return NULL;
+    }
+
+    for (item = urls; item; item = item->next) {
+        endpoint *ep = &instance->endpoints[instance->endpoints_count++];
+        ep->instance = instance;
+        ep->retry_delay_ms = instance->retry_delay;
+        ep->conns = calloc(instance->connections, sizeof(conn));
+        for (unsigned int j = 0; ep->conns && j < instance->connections; j++) {
+            ep->conns[j].endpoint = ep;
+            ep->conns[j].fd = -1;
+        }
+        if (!ep->conns || endpoint_init(ep, item->data) < 0) {
+            instance_free(instance);
+            return NULL;
+        }
+        DBG("Webhook %s: %u connection(s), %u ms batch window", ep->url, instance->connections,
+            instance->batch_window);
+    }
+    return instance;
+}
+
+static int
+nem_webhook_handle_events(void *data, const nem_event *events, size_t count)
+{
+    nem_webhook_instance *instance = data;
+    uint64_t now = now_ms();
+    int res = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (event_json(instance, &events[i]) < 0) {
+            ERR("%s", "Webhook: out of memory");
+            res = -1;
+            continue;
+        }
+        for (size_t j = 0; j < instance->endpoints_count; j++) {
+            endpoint *ep = &instance->endpoints[j];
+
+            if ((ep->batch_events && append(&ep->batch, &ep->batch_len, &ep->batch_size, ",", 1) < 0) ||
+                append(&ep->batch, &ep->batch_len, &ep->batch_size, instance->json, instance->json_len) < 0) {
+                ep->dropped++;
+                res = -1;
+                continue;
+            }
+            if (ep->batch_events++ == 0)
+                ep->batch_deadline_ms = now + instance->batch_window;
+            if (ep->batch_events >= instance->batch_max || instance->batch_window == 0)
+                batch_flush(ep);
+        }
+    }
+    webhook_process(instance);
+    return res;
+}
+
+static int
+nem_webhook_poll_fd(void *data)
+{
+    nem_webhook_instance *instance = data;
+    return instance->epoll_fd;
+}
+
+static void
+nem_webhook_poll_ready(void *data)
+{
+    webhook_poll(data, 0);
+}
+
+const nem_module nem_webhook_module = {
+    NEM_ABI_VERSION,
+    nem_webhook_init,
+    nem_webhook_handle_events,
+    nem_webhook_poll_fd,
+    nem_webhook_poll_ready,
+    nem_webhook_shutdown,
+    NULL
+};
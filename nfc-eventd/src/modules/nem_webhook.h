@@ -0,0 +1,42 @@
+/*
+ * Nfc Event Module Webhook
+ *
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __NEM_WEBHOOK__
+#define __NEM_WEBHOOK__
+
+#include "nem_common.h"
+
+/*
+ * POSTs events as JSON to HTTP endpoints, over a pool of persistent
+ * HTTP/1.1 connections per endpoint. Events arriving within batch_window ms
+ * are sent in one request, as a JSON array:
+ *
+ *   [{"event":"tag_insert","uid":"04a1b2c3","reader":0,"reader_name":"...",
+ *     "timestamp_us":123456}]
+ *
+ * Failed requests are retried, waiting longer after each failure, from a
+ * queue of at most retry_queue requests per endpoint (the oldest ones are
+ * dropped). Only plain http:// URLs are supported: this is meant for
+ * services on the same host or network.
+ */
+
+extern const nem_module nem_webhook_module;
+
+#endif /* __NEM_WEBHOOK__ */
@@ -0,0 +1,127 @@
+/*
+ * NFC Event Daemon control client
+ * Send commands to a running nfc-eventd through its control socket
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+#define DEF_CONTROL_SOCKET LOCALSTATEDIR"/run/nfc-eventd.sock"
+#define REPLY_TIMEOUT 5 /* seconds */
+
+static void usage ( const char *name ) {
+    printf( "NFC Event Daemon control client\n" );
+    printf( "Usage %s [socket=<path>] <command> [<args>...]\n", name );
+    printf( "Defaults: socket=%s\n", DEF_CONTROL_SOCKET );
+    printf( "Use the 'help' command to list commands supported by the daemon.\n" );
+}
+
+int
+main ( int argc, char *argv[] ) {
+    const char *path = DEF_CONTROL_SOCKET;
+    struct sockaddr_un addr;
+    struct timeval tv = { REPLY_TIMEOUT, 0 };
+    char request[1024] = { '\0', };
+    char buf[4096];
+    size_t len = 0;
+    int first = 1;
+    int fd, i;
+
+    if ( ( argc > first ) && ( strncmp ( argv[first], "socket=", 7 ) == 0 ) ) {
+        path = argv[first] + 7;
+        first++;
+    }
+    if ( argc <= first ) {
+        usage ( argv[0] );
+        return EXIT_FAILURE;
+    }
+    for ( i = first; i < argc; i++ ) {
+        if ( strlen ( request ) + strlen ( argv[i] ) + 2 >= sizeof ( request ) ) {
+            fprintf ( stderr, "Command too long\n" );
+            return EXIT_FAILURE;
+        }
+        if ( i > first ) strcat ( request, " " );
+        strcat ( request, argv[i] );
+    }
+    strcat ( request, "\n" );
+
+    if ( strlen ( path ) >= sizeof ( addr.sun_path ) ) {
+        fprintf ( stderr, "Socket path too long: %s\n", path );
+        return EXIT_FAILURE;
+    }
+    memset ( &addr, 0, sizeof ( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy ( addr.sun_path, path );
+
+    fd = socket ( AF_UNIX, SOCK_STREAM, 0 );
+    if ( ( fd < 0 ) || ( connect ( fd, (struct sockaddr *) &addr, sizeof ( addr ) ) < 0 ) ) {
+        fprintf ( stderr, "Unable to connect to %s: %s\n", path, strerror ( errno ) );
+        return EXIT_FAILURE;
+    }
+    setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof ( tv ) );
+    if ( write ( fd, request, strlen ( request ) ) < 0 ) {
+        fprintf ( stderr, "Unable to send command: %s\n", strerror ( errno ) );
+        return EXIT_FAILURE;
+    }
+
+    /* Print every line up to the status line */
+    for ( ;; ) {
+        char *line = buf, *eol;
+        ssize_t n = read ( fd, buf + len, sizeof ( buf ) - len - 1 );
+        if ( n <= 0 ) {
+            fprintf ( stderr, "No reply from nfc-eventd%s%s\n", n < 0 ? ": " : "", n < 0 ? strerror ( errno ) : "" );
+            return EXIT_FAILURE;
+        }
+        len += n;
+        buf[len] = '\0';
+        while ( ( eol = strchr ( line, '\n' ) ) ) {
+            *eol = '\0';
+            if ( strcmp ( line, CONTROL_STATUS_OK ) == 0 ) {
+                close ( fd );
+                return EXIT_SUCCESS;
+            }
+            if ( strncmp ( line, CONTROL_STATUS_ERR " ", strlen ( CONTROL_STATUS_ERR ) + 1 ) == 0 ) {
+                fprintf ( stderr, "%s\n", line + strlen ( CONTROL_STATUS_ERR ) + 1 );
+                close ( fd );
+                return EXIT_FAILURE;
+            }
+            printf ( "%s\n", line );
+            line = eol + 1;
+        }
+        len -= line - buf;
+        memmove ( buf, line, len );
+        if ( len == sizeof ( buf ) - 1 ) {
+            /* Line longer than the buffer: print it as is */
+            fwrite ( buf, 1, len, stdout );
+            len = 0;
+        }
+    }
+}
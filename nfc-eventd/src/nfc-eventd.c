@@ -35,7 +35,6 @@
 #include <signal.h>
 
 /* Dynamic load */
-#include <dlfcn.h>
 /* Configuration parser */
 #include "nfcconf/nfcconf.h"
 /* Debugging functions */
@@ -46,14 +45,50 @@
 #include "debug/nfc-utils.h"
 
 #include "types.h"
+#include "loop.h"
+#include "reader.h"
+#include "control.h"
+#include "hotplug.h"
+#include "ratelimit.h"
+#include "snapshot.h"
+#include "dwell.h"
+#include "realtime.h"
+#include "module.h"
+#include "modhost.h"
 
 #define DEF_POLLING 1    /* 1 second timeout */
 #define DEF_EXPIRE 0    /* no expire */
+#define DEF_HOTPLUG_DEBOUNCE 500 /* ms */
+#define DEF_DUTY_CYCLE_ON 300 /* ms */
+#define DEF_DUTY_CYCLE_OFF 700 /* ms */
+#define DEF_DUTY_CYCLE_IDLE 10000 /* ms */
+#define HOTPLUG_RECHECK 2000 /* ms */
+#define HOTPLUG_RECHECKS 5
+#define MAX_DEVICES 16
+#define DEF_RATE_LIMIT_BURST 5
+#define DEF_RATE_LIMIT_REPORT 10000 /* ms */
+#define JITTER_TEST_PERIOD 1000 /* us */
 
 #define DEF_CONFIG_FILE SYSCONFDIR"/nfc-eventd.conf"
+#define DEF_CONTROL_SOCKET LOCALSTATEDIR"/run/nfc-eventd.sock"
+#define DEF_STATE_FILE LOCALSTATEDIR"/run/nfc-eventd.state"
+#define DEF_STATE_SYNC 1000 /* ms */
+#define DEF_MODULE_RESTART_DELAY 100 /* ms */
 
 int polling_time;
 int expire_time;
+ned_duty_cycle duty_cycle;
+ned_rate rate_limit_uid;
+ned_rate rate_limit_reader;
+unsigned int rate_limit_report;
+int poll_cpus[MAX_DEVICES];
+int poll_cpus_count;
+int poll_priority;
+int lock_memory;
+int module_isolate;
+unsigned int module_restart_delay;
+int jitter_test;
+int log_async;
 int daemonize;
 int debug;
 char *cfgfile;
@@ -61,111 +96,110 @@ char *cfgfile;
 nfcconf_context *ctx;
 const nfcconf_block *root;
 
-typedef struct slot_st slot_t;
-
-static module_init_fct module_init_fct_ptr = NULL;
-static module_event_handler_fct module_event_handler_fct_ptr = NULL;
+static ned_module *module = NULL;
+/* module_isolate: the module runs in a module host process instead */
+static ned_modhost *modhost = NULL;
+static const char *module_host_fds = NULL;
 static nfc_connstring* connstring = NULL;
 
-nfc_device* device = NULL;
 nfc_context* context;
+static ned_loop* loop = NULL;
 
-bool quit_flag = false;
-
-static void stop_polling(int sig) 
-{ 
-  (void) sig;
-  DBG( "Stop polling... (sig:%d)", sig);
-  if (device != NULL) {
-    nfc_abort_command(device);
-    DBG( "%s", "Polling aborted.");
-    quit_flag = true;
-  } else {
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
-  }
+/* Rescans after an unplug, until the reader notices it lost its device */
+static ned_loop_timer *recheck_timer = NULL;
+static unsigned int rechecks;
+
+/* Dwell times, all readers together */
+static ned_dwell_sketch dwell_all;
+static ned_dwell_top dwell_top;
+
+/* Tag insertion rate limiting, NULL when disabled */
+static ned_ratelimit *ratelimit = NULL;
+static ned_loop_timer *rate_report_timer = NULL;
+static bool rate_report_armed;
+
+static int args_count;
+static char **args_values;
+
+/* Daemon statistics, loop thread only */
+static struct {
+    uint64_t started_ms;
+    uint64_t events;
+    uint64_t dispatch_latency_total_us;
+    uint64_t dispatch_latency_max_us;
+    uint64_t batches;
+    /* Restart: tags restored from the snapshot, when every reader was ready */
+    unsigned int restored_tags;
+    bool ready;
+    uint64_t ready_ms;
+} stats;
+
+/**
+ * @brief Find the NEM module block in config file
+ */
+static nfcconf_block *find_module_block( void ) {
+    const nfcconf_atom *module_key = nfcconf_atom_get ( ctx, "module" );
+    const nfcconf_block *my_module;
+    nfcconf_iter iter;
+
+    my_module = module_key ? nfcconf_iter_blocks ( &iter, root, module_key, NULL ) : NULL;
+    if ( !my_module ) {
+        ERR ( "%s", "Module item not found." );
+        return NULL;
+    }
+    return ( nfcconf_block * ) my_module;
 }
 
 /**
  * @brief Load and init specified (in config file) NEM module
  */
 static int load_module( void ) {
-    nfcconf_block **module_list, *my_module;
+    nfcconf_block *my_module = find_module_block();
 
-    module_list = nfcconf_find_blocks ( ctx, root, "module", NULL );
-    if ( !module_list ) {
-        ERR ( "%s", "Module item not found." );
-        return -1;
-    }
-    my_module = module_list[0];
-    free ( module_list );
     if ( !my_module ) {
-        ERR ( "%s", "Module item not found." );
         return -1;
     }
-    DBG("Loading module: '%s'...", my_module->name->data);
-    char module_path[256]={ '\0', };
-    strcat(module_path, NEMDIR"/" );
-    strcat(module_path, my_module->name->data);
-    strcat(module_path, ".so");
-    DBG("Module found at: '%s'...", module_path);
-
-    void *module_handler;
-    module_handler = dlopen(module_path,RTLD_LAZY);
-    if ( module_handler == NULL ) {
-        ERR("Unable to open module: %s", dlerror());
-        exit(EXIT_FAILURE);
-    }
-
-    char module_fct_name[256];
-    char *error;
-
-    module_fct_name[0]='\0';
-    strcat(module_fct_name,my_module->name->data);
-    strcat(module_fct_name,"_init");
-
-    module_init_fct_ptr = dlsym(module_handler,module_fct_name);
-
-    if ((error = dlerror()) != NULL) {
-        ERR ("%s", error);
-        exit(EXIT_FAILURE);
+    if ( module_isolate ) {
+        modhost = ned_modhost_start ( loop, my_module->name->data, cfgfile, args_count, args_values, module_restart_delay );
+        if ( modhost == NULL ) {
+            exit(EXIT_FAILURE);
+        }
+        return 0;
     }
-
-    module_fct_name[0]='\0';
-    strcat(module_fct_name,my_module->name->data);
-    strcat(module_fct_name,"_event_handler");
-
-    module_event_handler_fct_ptr = dlsym(module_handler,module_fct_name);
-    if ((error = dlerror()) != NULL) {
-        ERR ( "%s", error);
+    module = ned_module_load ( loop, ctx, my_module );
+    if ( module == NULL ) {
         exit(EXIT_FAILURE);
     }
-
-    (*module_init_fct_ptr)( ctx, my_module );
     return 0;
 }
 
 /**
- * @brief Execute NEM function that handle events
+ * @brief Deliver events to the NEM module
  */
-static int execute_event ( const nfc_device *dev, const nfc_target* tag, const nem_event_t event ) {
-    return (*module_event_handler_fct_ptr)( dev, tag, event );
+static int execute_events ( const nem_event *events, size_t count ) {
+    if ( modhost ) return ned_modhost_handle_events ( modhost, events, count );
+    if ( module == NULL ) return -1;
+    return ned_module_handle_events ( module, events, count );
 }
 
 /**
- * @brief Parse configuration file
+ * @brief Module view of a reader event
  */
-static int parse_config_file(void) {
-    ctx = nfcconf_new ( cfgfile );
-    if ( !ctx ) {
-        ERR ( "%s", "Error creating conf context" );
-        return -1;
-    }
-    if ( nfcconf_parse ( ctx ) <= 0 ) {
-        ERR ( "Error parsing file '%s'", cfgfile );
-        return -1;
-    }
-    /* now parse options */
+static void fill_event ( nem_event *nev, const ned_reader *reader, nem_event_t event, const nfc_target *tag, uint64_t timestamp_us ) {
+    nev->event = event;
+    nev->device = reader->device;
+    nev->tag = tag;
+    nev->reader_id = reader->id;
+    nev->connstring = reader->connstring;
+    nev->reader_name = reader->name;
+    nev->timestamp_us = timestamp_us;
+    nev->dropped = 0;
+}
+
+/**
+ * @brief Read the options of the parsed configuration file
+ */
+static int read_config ( void ) {
     root = nfcconf_find_block ( ctx, NULL, "nfc-eventd" );
     if ( !root ) {
         ERR ( "nfc-eventd block not found in config: '%s'", cfgfile );
@@ -175,6 +209,34 @@ static int parse_config_file(void) {
     daemonize = nfcconf_get_bool ( root, "daemon", daemonize );
     polling_time = nfcconf_get_int ( root, "polling_time", polling_time );
     expire_time = nfcconf_get_int ( root, "expire_time", expire_time );
+    duty_cycle.enabled = nfcconf_get_bool ( root, "duty_cycle", 0 );
+    duty_cycle.on_ms = nfcconf_get_int ( root, "duty_cycle_on", DEF_DUTY_CYCLE_ON );
+    duty_cycle.off_ms = nfcconf_get_int ( root, "duty_cycle_off", DEF_DUTY_CYCLE_OFF );
+    duty_cycle.idle_ms = nfcconf_get_int ( root, "duty_cycle_idle", DEF_DUTY_CYCLE_IDLE );
+    rate_limit_uid.rate = nfcconf_get_int ( root, "rate_limit_uid", 0 );
+    rate_limit_uid.burst = nfcconf_get_int ( root, "rate_limit_uid_burst", DEF_RATE_LIMIT_BURST );
+    rate_limit_reader.rate = nfcconf_get_int ( root, "rate_limit_reader", 0 );
+    rate_limit_reader.burst = nfcconf_get_int ( root, "rate_limit_reader_burst", DEF_RATE_LIMIT_BURST );
+    rate_limit_report = nfcconf_get_int ( root, "rate_limit_report", DEF_RATE_LIMIT_REPORT );
+    poll_cpus_count = 0;
+    for ( const nfcconf_list *cpu = nfcconf_find_list ( root, "poll_cpus" ); cpu && ( poll_cpus_count < MAX_DEVICES ); cpu = cpu->next ) {
+        poll_cpus[poll_cpus_count++] = atoi ( cpu->data );
+    }
+    poll_priority = nfcconf_get_int ( root, "poll_priority", 0 );
+    lock_memory = nfcconf_get_bool ( root, "lock_memory", 0 );
+    module_isolate = nfcconf_get_bool ( root, "module_isolate", 0 );
+    module_restart_delay = nfcconf_get_int ( root, "module_restart_delay", DEF_MODULE_RESTART_DELAY );
+    log_async = nfcconf_get_bool ( root, "log_async", 1 );
+
+    const char *log_output = nfcconf_get_str ( root, "log_output", "auto" );
+    if ( strcmp ( log_output, "syslog" ) == 0 ) {
+        debug_set_output ( DEBUG_OUTPUT_SYSLOG );
+    } else if ( strcmp ( log_output, "journald" ) == 0 ) {
+        debug_set_output ( DEBUG_OUTPUT_JOURNALD );
+    } else {
+        if ( strcmp ( log_output, "auto" ) != 0 ) WARN ( "Unknown log_output '%s', using auto", log_output );
+        debug_set_output ( DEBUG_OUTPUT_AUTO );
+    }
 
     if ( debug ) set_debug_level ( 1 );
 
@@ -216,34 +278,28 @@ static int parse_config_file(void) {
 }
 
 /**
- * @brief Parse command line args
+ * @brief Parse configuration file
  */
-static int parse_args ( int argc, char *argv[] ) {
-    int i;
-    int res;
-    polling_time = DEF_POLLING;
-    expire_time = DEF_EXPIRE;
-    debug   = 0;
-    daemonize  = 0;
-    cfgfile = DEF_CONFIG_FILE;
-    /* first of all check whether debugging should be enabled */
-    for ( i = 0; i < argc; i++ ) {
-        if ( ! strcmp ( "debug", argv[i] ) ) set_debug_level ( 1 );
-    }
-    /* try to find a configuration file entry */
-    for ( i = 0; i < argc; i++ ) {
-        if ( strstr ( argv[i], "config_file=" ) ) {
-            cfgfile = 1 + strchr ( argv[i], '=' );
-            break;
-        }
+static int parse_config_file(void) {
+    ctx = nfcconf_new ( cfgfile );
+    if ( !ctx ) {
+        ERR ( "%s", "Error creating conf context" );
+        return -1;
     }
-    /* parse configuration file */
-    if ( parse_config_file() < 0 ) {
-        ERR ( "Error parsing configuration file %s", cfgfile );
-        exit ( EXIT_FAILURE );
+    if ( nfcconf_parse ( ctx ) <= 0 ) {
+        ERR ( "Error parsing file '%s'", cfgfile );
+        return -1;
     }
+    return read_config();
+}
+
+/**
+ * @brief Apply command line args that take precedence over cfgfile
+ */
+static int apply_args ( int argc, char *argv[] ) {
+    int i;
+    int res;
 
-    /* and now re-parse command line to take precedence over cfgfile */
     for ( i = 1; i < argc; i++ ) {
         if ( strcmp ( "daemon", argv[i] ) == 0 ) {
             daemonize = 1;
@@ -261,6 +317,14 @@ static int parse_args ( int argc, char *argv[] ) {
             res = sscanf ( argv[i], "expire_time=%d", &expire_time );
             continue;
         }
+        if ( strstr ( argv[i], "jitter_test=" ) ) {
+            res = sscanf ( argv[i], "jitter_test=%d", &jitter_test );
+            continue;
+        }
+        if ( strstr ( argv[i], "module_host=" ) ) {
+            module_host_fds = argv[i] + strlen ( "module_host=" );
+            continue;
+        }
         if ( strstr ( argv[i], "debug" ) ) {
             continue;  /* already parsed: skip */
         }
@@ -275,63 +339,797 @@ static int parse_args ( int argc, char *argv[] ) {
 
         /* arriving here means syntax error */
         printf( "NFC Event Daemon\n" );
-        printf( "Usage %s [[no]debug] [[no]daemon] [polling_time=<time>] [expire_time=<limit>] [config_file=<file>]", argv[0] );
+        printf( "Usage %s [[no]debug] [[no]daemon] [polling_time=<time>] [expire_time=<limit>] [config_file=<file>] [jitter_test=<seconds>]", argv[0] );
         printf( "\nDefaults: debug=0 daemon=0 polltime=%d (ms) expiretime=0 (none) config_file=%s", DEF_POLLING, DEF_CONFIG_FILE );
         exit ( EXIT_FAILURE );
     } /* for */
+    return 0;
+}
+
+/**
+ * @brief Parse command line args
+ */
+static int parse_args ( int argc, char *argv[] ) {
+    char *path;
+    int i;
+    polling_time = DEF_POLLING;
+    expire_time = DEF_EXPIRE;
+    debug   = 0;
+    daemonize  = 0;
+    cfgfile = DEF_CONFIG_FILE;
+    /* first of all check whether debugging should be enabled */
+    for ( i = 0; i < argc; i++ ) {
+        if ( ! strcmp ( "debug", argv[i] ) ) set_debug_level ( 1 );
+    }
+    /* try to find a configuration file entry */
+    for ( i = 0; i < argc; i++ ) {
+        if ( strstr ( argv[i], "config_file=" ) ) {
+            cfgfile = 1 + strchr ( argv[i], '=' );
+            break;
+        }
+    }
+    /* Absolute, for reloads and the module host once daemon() left the directory */
+    if ( ( path = realpath ( cfgfile, NULL ) ) != NULL ) cfgfile = path;
+    /* parse configuration file */
+    if ( parse_config_file() < 0 ) {
+        ERR ( "Error parsing configuration file %s", cfgfile );
+        exit ( EXIT_FAILURE );
+    }
+
+    /* and now re-parse command line to take precedence over cfgfile */
+    args_count = argc;
+    args_values = argv;
+    apply_args ( argc, argv );
     /* end of config: return */
     return 0;
 }
 
-typedef enum {
-  NFC_POLL_HARDWARE,
-  NFC_POLL_SOFTWARE,
-} nfc_poll_mode;
-
-static nfc_target*
-ned_poll_for_tag(nfc_device* dev, nfc_target* tag)
-{
-  uint8_t uiPollNr;
-  const uint8_t uiPeriod = 2; /* 2 x 150 ms = 300 ms */
-  const nfc_modulation nm[1] = { { .nmt = NMT_ISO14443A, .nbr = NBR_106 } };
-
-  if( tag != NULL ) {
-    /* We are looking for a previous tag */
-    /* In this case, to prevent for intensive polling we add a sleeping time */
-    sleep ( polling_time );
-    uiPollNr = 3; /* Polling duration : btPollNr * szTargetTypes * btPeriod * 150 = btPollNr * 300 = 900 */
-  } else {
-    /* We are looking for any tag */
-    uiPollNr = 0xff; /* We endless poll for a new tag */
-  }
-
-  nfc_target target;
-  int res = nfc_initiator_poll_target (dev, nm, 1, uiPollNr, uiPeriod, &target);
-  if (res > 0) {
-    if ( (tag != NULL) && (0 == memcmp(tag->nti.nai.abtUid, target.nti.nai.abtUid, target.nti.nai.szUidLen)) ) {
-      return tag;
-    } else {
-      nfc_target* rv = malloc(sizeof(nfc_target));
-      memcpy(rv, &target, sizeof(nfc_target));
-      nfc_initiator_deselect_target ( dev );
-      return rv;
+/**
+ * @brief Stop the main loop on SIGINT/SIGTERM
+ */
+static void on_quit_signal ( ned_loop *l, int sig, void *data ) {
+    (void) data;
+    DBG( "Stop polling... (sig:%d)", sig);
+    ned_loop_quit ( l );
+}
+
+/**
+ * @brief Scheduling of a reader polling thread, from poll_cpus and poll_priority
+ */
+static ned_rt_sched reader_sched ( const ned_reader *reader ) {
+    ned_rt_sched sched;
+    sched.cpu = poll_cpus_count ? poll_cpus[reader->id % poll_cpus_count] : -1;
+    sched.priority = poll_priority;
+    return sched;
+}
+
+static void apply_reader_sched ( ned_reader *reader ) {
+    ned_rt_sched sched = reader_sched ( reader );
+
+    if ( ( sched.cpu < 0 ) && ( sched.priority == 0 ) && !reader->sched_applied ) return;
+    if ( ned_rt_apply ( reader->thread, &sched ) < 0 ) {
+        WARN( "Unable to schedule polling thread of %s (cpu %d, priority %d): %s", reader->name, sched.cpu, sched.priority, strerror ( errno ) );
+        return;
+    }
+    reader->sched_applied = true;
+    DBG( "Polling thread of %s: cpu %d, priority %d", reader->name, sched.cpu, sched.priority );
+}
+
+/**
+ * @brief Report events dropped by rate limiting, one event per reader
+ */
+static void on_rate_report_timer ( ned_loop *l, ned_loop_timer *timer, void *data ) {
+    nem_event nevs[NED_EVENT_BATCH_MAX];
+    size_t n = 0;
+    uint64_t now = ned_loop_now_us();
+    (void) l;
+    (void) timer;
+    (void) data;
+
+    rate_report_armed = false;
+    for ( ned_reader *reader = ned_readers_first(); reader && ( n < NED_EVENT_BATCH_MAX ); reader = reader->next ) {
+        if ( reader->rate_limited_pending == 0 ) continue;
+        fill_event ( &nevs[n], reader, EVENT_RATE_LIMITED, &reader->rate_limited_tag, now );
+        nevs[n++].dropped = reader->rate_limited_pending;
+        INFO( "%u event(s) from %s dropped by rate limiting", reader->rate_limited_pending, reader->name );
+        reader->rate_limited_pending = 0;
+    }
+    execute_events ( nevs, n );
+}
+
+/**
+ * @brief Apply rate limits to a reader event
+ * A tag insertion takes a token from the buckets of its UID and of its
+ * reader. When it is dropped, so is the matching removal, so that modules
+ * always see pairs.
+ * @return true if the event is to be dispatched
+ */
+static bool rate_limit_accept ( const ned_event *event ) {
+    ned_reader *reader = event->reader;
+    const uint8_t *uid = NULL;
+    size_t uid_len = 0;
+
+    /* A dropped insertion does not outlive the device */
+    if ( event->reopened ) reader->rate_limited = false;
+    if ( event->event == EVENT_TAG_REMOVED && reader->rate_limited ) {
+        reader->rate_limited = false;
+        NED_STAT_INC ( reader->stats.rate_limited );
+        return false;
+    }
+    if ( event->event != EVENT_TAG_INSERTED || ratelimit == NULL ) return true;
+
+    if ( event->has_tag && event->tag.nm.nmt == NMT_ISO14443A ) {
+        uid = event->tag.nti.nai.abtUid;
+        uid_len = event->tag.nti.nai.szUidLen;
+    }
+    reader->rate_limited = ned_ratelimit_check ( ratelimit, reader->id, uid, uid_len, event->timestamp_us / 1000 ) != NED_RATE_PASS;
+    if ( !reader->rate_limited ) return true;
+
+    NED_STAT_INC ( reader->stats.rate_limited );
+    if ( rate_report_timer ) {
+        reader->rate_limited_pending++;
+        reader->rate_limited_tag = event->tag;
+        if ( !rate_report_armed ) {
+            ned_loop_timer_set ( rate_report_timer, rate_limit_report, 0 );
+            rate_report_armed = true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief (Re)create the rate limiter from the configuration
+ * Buckets start full again after a reload.
+ */
+static void setup_rate_limit ( void ) {
+    ned_ratelimit_free ( ratelimit );
+    ratelimit = ned_ratelimit_new ( &rate_limit_uid, &rate_limit_reader );
+    if ( ratelimit ) {
+        DBG( "Rate limiting tag insertions: %u/min (burst %u) per UID, %u/min (burst %u) per reader",
+             rate_limit_uid.rate, rate_limit_uid.burst, rate_limit_reader.rate, rate_limit_reader.burst );
+    }
+    if ( ratelimit && rate_limit_report ) {
+        if ( rate_report_timer == NULL ) {
+            rate_report_timer = ned_loop_add_timer ( loop, 0, 0, on_rate_report_timer, NULL );
+            rate_report_armed = false;
+        }
+    } else if ( rate_report_timer ) {
+        ned_loop_remove_timer ( loop, rate_report_timer );
+        rate_report_timer = NULL;
+        for ( ned_reader *reader = ned_readers_first(); reader; reader = reader->next ) {
+            reader->rate_limited_pending = 0;
+        }
+    }
+}
+
+/**
+ * @brief Go back to the tree of before the reload, and its options
+ */
+static int reload_rollback ( void ) {
+    nfcconf_reload_rollback ( ctx );
+    read_config();
+    apply_args ( args_count, args_values );
+    return -1;
+}
+
+/**
+ * @brief Reload configuration file
+ * The new tree is checked, and the module reconfigured with it, before the
+ * previous one is released. On error, the current configuration is kept and
+ * the files are parsed again on the next reload.
+ */
+static int reload_config ( void ) {
+    nfcconf_block *my_module;
+    uint64_t start = ned_loop_now_ms();
+
+    /* Only the files that changed are parsed again, the tree is left
+     * unchanged on error */
+    if ( nfcconf_reload_begin ( ctx ) <= 0 ) {
+        ERR ( "Error parsing configuration file %s (%s), keeping current configuration", cfgfile, ctx->errmsg );
+        return -1;
+    }
+    if ( read_config() < 0 ) {
+        ERR ( "Invalid configuration file %s, keeping current configuration", cfgfile );
+        return reload_rollback();
+    }
+    apply_args ( args_count, args_values );
+
+    my_module = find_module_block();
+    if ( my_module == NULL ) {
+        ERR ( "No module in configuration file %s, keeping current configuration", cfgfile );
+        return reload_rollback();
+    }
+    if ( module && ( ned_module_reload ( module, ctx, my_module ) < 0 ) ) {
+        /* The module instance keeps its previous configuration */
+        ERR ( "Module rejected configuration file %s", cfgfile );
+        return reload_rollback();
+    }
+    /* Nothing points into the previous tree anymore */
+    nfcconf_reload_commit ( ctx );
+    if ( modhost ) {
+        /* The module host parses the configuration file again */
+        ned_modhost_reload ( modhost, module_restart_delay );
+    }
+    setup_rate_limit();
+    for ( ned_reader *reader = ned_readers_first(); reader; reader = reader->next ) {
+        ned_reader_set_poll_interval ( reader, polling_time * 1000 );
+        ned_reader_set_duty_cycle ( reader, &duty_cycle );
+        apply_reader_sched ( reader );
+    }
+    DBG( "Configuration reloaded in %llu ms", (unsigned long long) ( ned_loop_now_ms() - start ) );
+    return 0;
+}
+
+/**
+ * @brief Reload configuration file on SIGHUP
+ */
+static void on_reload_signal ( ned_loop *l, int sig, void *data ) {
+    (void) l;
+    (void) data;
+    INFO( "Reloading configuration file %s (sig:%d)", cfgfile, sig );
+    reload_config();
+}
+
+/**
+ * @brief Tag removed for too long
+ */
+static void on_expire_timer ( ned_loop *l, ned_loop_timer *timer, void *data ) {
+    ned_reader *reader = data;
+    nem_event nev;
+    (void) l;
+    (void) timer;
+    DBG ( "%s", "Timeout on tag removed " );
+    fill_event ( &nev, reader, EVENT_EXPIRE_TIME, NULL, ned_loop_now_us() );
+    execute_events ( &nev, 1 );
+}
+
+/**
+ * @brief Account for the time a tag stayed on its reader
+ * Tags restored after a restart have no known insertion time and are left
+ * out.
+ */
+static void record_dwell ( const ned_event *event ) {
+    ned_reader *reader = event->reader;
+    uint64_t dwell_ms;
+
+    if ( event->event == EVENT_TAG_INSERTED ) {
+        reader->dwell_since_us = event->timestamp_us;
+        return;
+    }
+    if ( ( event->event != EVENT_TAG_REMOVED ) || ( reader->dwell_since_us == 0 ) ) return;
+    dwell_ms = ( event->timestamp_us - reader->dwell_since_us ) / 1000;
+    reader->dwell_since_us = 0;
+    ned_dwell_add ( &reader->dwell, dwell_ms );
+    ned_dwell_add ( &dwell_all, dwell_ms );
+    if ( event->has_tag && ( event->tag.nm.nmt == NMT_ISO14443A ) ) {
+        ned_dwell_top_add ( &dwell_top, event->tag.nti.nai.abtUid, event->tag.nti.nai.szUidLen, reader->id, dwell_ms );
+    }
+}
+
+/**
+ * @brief Dispatch a batch of events posted by reader polling threads
+ */
+static void on_reader_events ( const ned_event *events, size_t count, void *data ) {
+    nem_event nevs[NED_EVENT_BATCH_MAX];
+    size_t n = 0;
+    uint64_t now = ned_loop_now_us();
+    (void) data;
+
+    for ( size_t i = 0; i < count; i++ ) {
+        const ned_event *event = &events[i];
+        ned_reader *reader = event->reader;
+        uint64_t latency_us = now - event->timestamp_us;
+
+        stats.events++;
+        stats.dispatch_latency_total_us += latency_us;
+        if ( latency_us > stats.dispatch_latency_max_us ) stats.dispatch_latency_max_us = latency_us;
+        record_dwell ( event );
+        bool accepted = rate_limit_accept ( event );
+        ned_snapshot_save ( reader );
+        if ( !accepted ) continue;
+
+        switch ( event->event ) {
+        case EVENT_TAG_INSERTED:
+            if ( reader->expire_timer ) ned_loop_timer_set ( reader->expire_timer, 0, 0 );
+            break;
+        case EVENT_TAG_REMOVED:
+            if ( reader->expire_timer && ( expire_time > 0 ) ) {
+                ned_loop_timer_set ( reader->expire_timer, expire_time * 1000, expire_time * 1000 );
+            }
+            break;
+        default:
+            break;
+        }
+        fill_event ( &nevs[n++], reader, event->event, event->has_tag ? &event->tag : NULL, event->timestamp_us );
+    }
+    stats.batches++;
+    execute_events ( nevs, n );
+}
+
+/**
+ * @brief Pick up the tag a reader had before a restart
+ * It was reported already: the module only hears about it again if it is
+ * gone or another one took its place.
+ */
+static void restore_reader ( ned_reader *reader ) {
+    nfc_target tag;
+    bool suppressed;
+
+    if ( !ned_snapshot_restore ( reader, &tag, &suppressed ) ) return;
+    ned_reader_restore_tag ( reader, &tag );
+    reader->rate_limited = suppressed;
+    stats.restored_tags++;
+    DBG( "Restored tag state of %s", reader->name );
+}
+
+/**
+ * @brief Start polling a reader that has just been opened
+ */
+static ned_reader *start_reader ( ned_reader *reader ) {
+    reader->expire_timer = ned_loop_add_timer ( loop, 0, 0, on_expire_timer, reader );
+    ned_reader_set_duty_cycle ( reader, &duty_cycle );
+    INFO( "Connected to NFC device: %s", reader->name );
+    restore_reader ( reader );
+    if ( ned_reader_start ( reader ) < 0 ) {
+        ned_reader_close ( reader );
+        return NULL;
+    }
+    apply_reader_sched ( reader );
+    return reader;
+}
+
+/**
+ * @brief Open a reader and start polling it
+ * @param connstring device to open, NULL for libnfc's default device
+ */
+static ned_reader *add_reader ( const char *connstring ) {
+    ned_reader *reader = ned_reader_open ( context, connstring, polling_time * 1000 );
+    if ( reader == NULL ) {
+        return NULL;
+    }
+    return start_reader ( reader );
+}
+
+/**
+ * @brief Match the reader list with the devices libnfc can see
+ * Devices already opened are not always listed (USB drivers can not claim
+ * them twice), so only readers that are not healthy are closed when they
+ * disappear from the list. Healthy ones are checked again a bit later.
+ */
+static void on_scan_done ( ned_scan_device *found, size_t count, void *data ) {
+    size_t i;
+    ned_reader *reader, *next;
+    bool recheck = false;
+    (void) data;
+
+    for ( reader = ned_readers_first(); reader; reader = next ) {
+        next = reader->next;
+        for ( i = 0; i < count; i++ ) {
+            if ( strcmp ( found[i].connstring, reader->connstring ) == 0 ) break;
+        }
+        if ( i < count ) continue;
+        if ( ned_reader_get_health ( reader, NULL ) == NED_READER_HEALTHY ) {
+            recheck = true;
+            continue;
+        }
+        INFO( "NFC device %s has been unplugged", reader->name );
+        if ( reader->has_tag ) {
+            ned_event event = { reader, EVENT_TAG_REMOVED, true, reader->tag, ned_loop_now_us(), false };
+            on_reader_events ( &event, 1, NULL );
+        }
+        ned_snapshot_forget ( reader );
+        ned_reader_close ( reader );
+    }
+    for ( i = 0; i < count; i++ ) {
+        for ( reader = ned_readers_first(); reader; reader = reader->next ) {
+            if ( strcmp ( found[i].connstring, reader->connstring ) == 0 ) break;
+        }
+        if ( reader != NULL ) continue;
+        if ( found[i].device == NULL ) {
+            WARN( "Unable to open NFC device %s", found[i].connstring );
+            continue;
+        }
+        reader = ned_reader_adopt ( context, found[i].device, polling_time * 1000 );
+        found[i].device = NULL;
+        if ( ( reader == NULL ) || ( start_reader ( reader ) == NULL ) ) {
+            WARN( "Unable to open NFC device %s", found[i].connstring );
+        }
+    }
+    if ( recheck && recheck_timer && ( rechecks < HOTPLUG_RECHECKS ) ) {
+        ned_loop_timer_set ( recheck_timer, HOTPLUG_RECHECK, 0 );
+    }
+}
+
+/**
+ * @brief Scan for devices from a worker thread, or right away if wait is set
+ */
+static void rescan_readers ( bool wait ) {
+    if ( ned_readers_scan ( context, wait, on_scan_done, NULL ) < 0 ) {
+        WARN( "%s", "Unable to scan NFC devices" );
+    }
+}
+
+/**
+ * @brief Devices have been plugged or unplugged
+ */
+static void on_devices_changed ( void *data ) {
+    (void) data;
+    rechecks = 0;
+    rescan_readers ( false );
+}
+
+static void on_recheck_timer ( ned_loop *l, ned_loop_timer *timer, void *data ) {
+    (void) l;
+    (void) timer;
+    (void) data;
+    rechecks++;
+    rescan_readers ( false );
+}
+
+/**
+ * @brief Note when every reader reports a reliable tag state after startup
+ */
+static void check_ready ( void ) {
+    uint64_t ready_ms = 0;
+
+    if ( stats.ready || ( ned_readers_first() == NULL ) ) return;
+    for ( ned_reader *reader = ned_readers_first(); reader; reader = reader->next ) {
+        uint64_t ms = NED_STAT_GET ( reader->stats.ready_ms );
+        if ( ms == 0 ) return;
+        if ( ms > ready_ms ) ready_ms = ms;
+    }
+    stats.ready = true;
+    stats.ready_ms = ready_ms - stats.started_ms;
+    INFO( "Ready %llu ms after start, %u tag(s) restored", (unsigned long long) stats.ready_ms, stats.restored_tags );
+}
+
+/**
+ * @brief Write the tag state snapshot to disk
+ */
+static void on_state_timer ( ned_loop *l, ned_loop_timer *timer, void *data ) {
+    (void) l;
+    (void) timer;
+    (void) data;
+    ned_snapshot_sync ( false );
+    check_ready();
+}
+
+/**
+ * @brief Dwell time summary of a sketch
+ */
+static void print_dwell ( ned_control_reply *reply, const char *prefix, const ned_dwell_sketch *sketch ) {
+    static const struct { const char *name; double q; } quantiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }
+    };
+
+    ned_control_printf ( reply, "%s.count %llu\n", prefix, (unsigned long long) sketch->count );
+    if ( sketch->count == 0 ) return;
+    ned_control_printf ( reply, "%s.mean_ms %llu\n", prefix, (unsigned long long) ( sketch->sum_ms / sketch->count ) );
+    for ( size_t i = 0; i < sizeof ( quantiles ) / sizeof ( quantiles[0] ); i++ ) {
+        ned_control_printf ( reply, "%s.%s_ms %llu\n", prefix, quantiles[i].name, (unsigned long long) ned_dwell_quantile ( sketch, quantiles[i].q ) );
+    }
+    ned_control_printf ( reply, "%s.max_ms %llu\n", prefix, (unsigned long long) sketch->max_ms );
+}
+
+/**
+ * @brief Find readers designated by a control command argument
+ * "all", a reader id or a connstring
+ */
+static bool reader_match ( const ned_reader *reader, const char *arg ) {
+    char *end;
+    unsigned long id;
+
+    if ( strcmp ( arg, "all" ) == 0 ) return true;
+    if ( strcmp ( arg, reader->connstring ) == 0 ) return true;
+    id = strtoul ( arg, &end, 10 );
+    return ( *arg != '\0' ) && ( *end == '\0' ) && ( id == reader->id );
+}
+
+static void print_uid ( ned_control_reply *reply, const nfc_target *tag ) {
+    for ( size_t i = 0; i < tag->nti.nai.szUidLen; i++ ) {
+        ned_control_printf ( reply, "%02x", tag->nti.nai.abtUid[i] );
+    }
+}
+
+static int list_command ( int argc, char *argv[], ned_control_reply *reply, void *data ) {
+    uint64_t now = ned_loop_now_ms();
+    (void) argc;
+    (void) argv;
+    (void) data;
+
+    for ( ned_reader *reader = ned_readers_first(); reader; reader = reader->next ) {
+        unsigned int failures;
+        ned_reader_health health = ned_reader_get_health ( reader, &failures );
+        ned_control_printf ( reply, "%u %s %s %s %s \"%s\" interval=%ums failures=%u tag=", reader->id,
+                             ned_reader_is_paused ( reader ) ? "paused" : "polling",
+                             ned_reader_health_name ( health ),
+                             ned_reader_get_power_mode ( reader ) == NED_POWER_DUTY_CYCLE ? "duty-cycle" : "continuous",
+                             reader->connstring, reader->name, ned_reader_get_poll_interval ( reader ), failures );
+        if ( reader->has_tag ) {
+            print_uid ( reply, &reader->tag );
+            ned_control_printf ( reply, " present=%llums\n", (unsigned long long) ( now - reader->tag_since_ms ) );
+        } else {
+            ned_control_printf ( reply, "none\n" );
+        }
+    }
+    return 0;
+}
+
+static int pause_command ( int argc, char *argv[], ned_control_reply *reply, void *data ) {
+    int found = 0;
+    (void) data;
+
+    if ( argc != 2 ) {
+        ned_control_error ( reply, "usage: %s <reader|all>", argv[0] );
+        return -1;
+    }
+    for ( ned_reader *reader = ned_readers_first(); reader; reader = reader->next ) {
+        if ( !reader_match ( reader, argv[1] ) ) continue;
+        if ( strcmp ( argv[0], "pause" ) == 0 ) {
+            ned_reader_pause ( reader );
+        } else {
+            ned_reader_resume ( reader );
+        }
+        found++;
+    }
+    if ( !found ) {
+        ned_control_error ( reply, "no such reader: %s", argv[1] );
+        return -1;
+    }
+    return 0;
+}
+
+static int interval_command ( int argc, char *argv[], ned_control_reply *reply, void *data ) {
+    int found = 0;
+    char *end;
+    unsigned long ms;
+    (void) data;
+
+    if ( argc != 3 ) {
+        ned_control_error ( reply, "usage: %s <reader|all> <milliseconds>", argv[0] );
+        return -1;
+    }
+    ms = strtoul ( argv[2], &end, 10 );
+    if ( ( *argv[2] == '\0' ) || ( *end != '\0' ) ) {
+        ned_control_error ( reply, "invalid interval: %s", argv[2] );
+        return -1;
+    }
+    for ( ned_reader *reader = ned_readers_first(); reader; reader = reader->next ) {
+        if ( !reader_match ( reader, argv[1] ) ) continue;
+        ned_reader_set_poll_interval ( reader, ms );
+        found++;
+    }
+    if ( !found ) {
+        ned_control_error ( reply, "no such reader: %s", argv[1] );
+        return -1;
+    }
+    return 0;
+}
+
+static int stats_command ( int argc, char *argv[], ned_control_reply *reply, void *data ) {
+    ned_hotplug_stats hotplug;
+    char prefix[32];
+    (void) argc;
+    (void) argv;
+    (void) data;
+
+    ned_control_printf ( reply, "uptime_ms %llu\n", (unsigned long long) ( ned_loop_now_ms() - stats.started_ms ) );
+    ned_control_printf ( reply, "events %llu\n", (unsigned long long) stats.events );
+    ned_control_printf ( reply, "event_batches %llu\n", (unsigned long long) stats.batches );
+    if ( module ) {
+        ned_control_printf ( reply, "module.name %s\n", ned_module_name ( module ) );
+        ned_control_printf ( reply, "module.builtin %d\n", ned_module_is_builtin ( module ) );
+        ned_control_printf ( reply, "module.load_us %llu\n", (unsigned long long) ned_module_load_us ( module ) );
+        ned_control_printf ( reply, "module.isolated 0\n" );
+    }
+    if ( modhost ) {
+        ned_evring_stats ring;
+        ned_modhost_get_stats ( modhost, &ring );
+        ned_control_printf ( reply, "module.name %s\n", ned_modhost_name ( modhost ) );
+        ned_control_printf ( reply, "module.isolated 1\n" );
+        ned_control_printf ( reply, "module.host.pid %d\n", (int) ned_modhost_pid ( modhost ) );
+        ned_control_printf ( reply, "module.host.restarts %u\n", ned_modhost_restarts ( modhost ) );
+        ned_control_printf ( reply, "module.host.queued %llu\n", (unsigned long long) ring.pushed );
+        ned_control_printf ( reply, "module.host.dropped %llu\n", (unsigned long long) ring.dropped );
+        ned_control_printf ( reply, "module.host.delivered %llu\n", (unsigned long long) ring.delivered );
+        ned_control_printf ( reply, "module.host.latency_avg_ns %llu\n",
+                             (unsigned long long) ( ring.delivered ? ring.latency_total_ns / ring.delivered : 0 ) );
+        ned_control_printf ( reply, "module.host.latency_max_ns %llu\n", (unsigned long long) ring.latency_max_ns );
+    }
+    ned_control_printf ( reply, "startup.restored_tags %u\n", stats.restored_tags );
+    if ( stats.ready ) ned_control_printf ( reply, "startup.ready_ms %llu\n", (unsigned long long) stats.ready_ms );
+    ned_control_printf ( reply, "dispatch_latency_avg_us %llu\n",
+                         (unsigned long long) ( stats.events ? stats.dispatch_latency_total_us / stats.events : 0 ) );
+    ned_control_printf ( reply, "dispatch_latency_max_us %llu\n", (unsigned long long) stats.dispatch_latency_max_us );
+    for ( ned_reader *reader = ned_readers_first(); reader; reader = reader->next ) {
+        ned_control_printf ( reply, "reader.%u.polls %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.polls ) );
+        ned_control_printf ( reply, "reader.%u.poll_errors %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.poll_errors ) );
+        ned_control_printf ( reply, "reader.%u.inserted %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.inserted ) );
+        ned_control_printf ( reply, "reader.%u.removed %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.removed ) );
+        ned_control_printf ( reply, "reader.%u.reconnects %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.reconnects ) );
+        ned_control_printf ( reply, "reader.%u.reconnect_attempts %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.reconnect_attempts ) );
+        ned_control_printf ( reply, "reader.%u.watchdog_trips %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.watchdog_trips ) );
+        ned_control_printf ( reply, "reader.%u.last_reconnect_ms %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.last_reconnect_ms ) );
+        ned_control_printf ( reply, "reader.%u.downtime_ms %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.downtime_ms ) );
+        ned_control_printf ( reply, "reader.%u.rate_limited %llu\n", reader->id, (unsigned long long) NED_STAT_GET ( reader->stats.rate_limited ) );
+        snprintf ( prefix, sizeof ( prefix ), "reader.%u.dwell", reader->id );
+        print_dwell ( reply, prefix, &reader->dwell );
+        uint64_t open_ms = ned_loop_now_ms() - reader->opened_ms;
+        ned_control_printf ( reply, "reader.%u.field_on_ratio %.3f\n", reader->id,
+                             open_ms ? (double) ned_reader_field_on_ms ( reader ) / open_ms : 1.0 );
+        for ( int mode = NED_POWER_CONTINUOUS; mode <= NED_POWER_DUTY_CYCLE; mode++ ) {
+            const char *name = ( mode == NED_POWER_DUTY_CYCLE ) ? "duty_cycle" : "continuous";
+            uint64_t detections = NED_STAT_GET ( reader->stats.detections[mode] );
+            ned_control_printf ( reply, "reader.%u.%s.detections %llu\n", reader->id, name, (unsigned long long) detections );
+            ned_control_printf ( reply, "reader.%u.%s.detection_latency_avg_ms %llu\n", reader->id, name,
+                                 (unsigned long long) ( detections ? NED_STAT_GET ( reader->stats.detection_latency_ms[mode] ) / detections : 0 ) );
+            ned_control_printf ( reply, "reader.%u.%s.detection_latency_max_ms %llu\n", reader->id, name,
+                                 (unsigned long long) NED_STAT_GET ( reader->stats.detection_latency_max_ms[mode] ) );
+        }
+    }
+    ned_hotplug_get_stats ( &hotplug );
+    ned_control_printf ( reply, "hotplug.backend %s\n", ned_hotplug_backend() );
+    ned_control_printf ( reply, "hotplug.uevents %llu\n", (unsigned long long) hotplug.uevents );
+    ned_control_printf ( reply, "hotplug.relevant %llu\n", (unsigned long long) hotplug.relevant );
+    ned_control_printf ( reply, "hotplug.rescans %llu\n", (unsigned long long) hotplug.rescans );
+    if ( ratelimit ) {
+        ned_ratelimit_stats rate;
+        ned_ratelimit_get_stats ( ratelimit, &rate );
+        ned_control_printf ( reply, "rate_limit.passed %llu\n", (unsigned long long) rate.passed );
+        ned_control_printf ( reply, "rate_limit.uid_rejected %llu\n", (unsigned long long) rate.uid_rejected );
+        ned_control_printf ( reply, "rate_limit.reader_rejected %llu\n", (unsigned long long) rate.reader_rejected );
+        ned_control_printf ( reply, "rate_limit.evictions %llu\n", (unsigned long long) rate.evictions );
+    }
+    print_dwell ( reply, "dwell", &dwell_all );
+    ned_dwell_top_sort ( &dwell_top );
+    for ( size_t i = 0; i < dwell_top.count; i++ ) {
+        const ned_dwell_top_entry *entry = &dwell_top.entries[i];
+        char uid[2 * NED_DWELL_UID_MAX + 1];
+        for ( size_t j = 0; j < entry->uid_len; j++ ) sprintf ( uid + 2 * j, "%02x", entry->uid[j] );
+        uid[2 * entry->uid_len] = '\0';
+        ned_control_printf ( reply, "dwell.top.%zu %s %llu reader=%u\n", i, uid, (unsigned long long) entry->dwell_ms, entry->reader_id );
+    }
+    return 0;
+}
+
+/**
+ * @brief Inject a synthetic uevent, to exercise hotplug without hardware
+ */
+static int uevent_command ( int argc, char *argv[], ned_control_reply *reply, void *data ) {
+    char buf[512];
+    int len;
+    (void) data;
+
+    if ( ( argc < 3 ) || ( argc > 4 ) ) {
+        ned_control_error ( reply, "usage: %s <action> <subsystem> [<devtype>]", argv[0] );
+        return -1;
+    }
+    len = snprintf ( buf, sizeof ( buf ), "%s@/devices/synthetic%cACTION=%s%cSUBSYSTEM=%s%cDEVTYPE=%s",
+                     argv[1], '\0', argv[1], '\0', argv[2], '\0', argc > 3 ? argv[3] : "" );
+    if ( ( len < 0 ) || ( (size_t) len >= sizeof ( buf ) ) ) {
+        ned_control_error ( reply, "%s", "uevent too long" );
+        return -1;
+    }
+    /* An empty DEVTYPE means no DEVTYPE: drop it */
+    if ( argc == 3 ) len -= strlen ( "DEVTYPE=" ) + 1;
+    ned_hotplug_inject ( buf, len );
+    return 0;
+}
+
+static int flush_command ( int argc, char *argv[], ned_control_reply *reply, void *data ) {
+    (void) argc;
+    (void) argv;
+    (void) data;
+
+    /* Messages still queued for the log writer, then stdio buffers */
+    debug_flush();
+    if ( ( fflush ( stdout ) != 0 ) || ( fflush ( stderr ) != 0 ) ) {
+        ned_control_error ( reply, "flush failed: %s", strerror ( errno ) );
+        return -1;
+    }
+    return 0;
+}
+
+static int reload_command ( int argc, char *argv[], ned_control_reply *reply, void *data ) {
+    (void) argc;
+    (void) argv;
+    (void) data;
+
+    INFO( "Reloading configuration file %s (control socket)", cfgfile );
+    if ( reload_config() < 0 ) {
+        ned_control_error ( reply, "unable to reload %s, configuration unchanged", cfgfile );
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Map the tag state snapshot, if enabled
+ */
+static void open_state_file ( void ) {
+    const char *path = nfcconf_get_str ( root, "state_file", DEF_STATE_FILE );
+    int sync_ms = nfcconf_get_int ( root, "state_sync", DEF_STATE_SYNC );
+
+    if ( strcmp ( path, "" ) == 0 ) {
+        DBG( "%s", "Tag state snapshot disabled" );
+    } else if ( ned_snapshot_open ( path ) < 0 ) {
+        WARN( "Unable to open tag state snapshot %s: %s", path, strerror ( errno ) );
     }
-  } else {
-    return NULL;
-  }
+    if ( sync_ms <= 0 ) sync_ms = DEF_STATE_SYNC;
+    ned_loop_add_timer ( loop, sync_ms, sync_ms, on_state_timer, NULL );
+}
+
+/**
+ * @brief Open the control socket, if enabled, and register its commands
+ */
+static void open_control_socket ( void ) {
+    const char *path = nfcconf_get_str ( root, "control_socket", DEF_CONTROL_SOCKET );
+
+    if ( strcmp ( path, "" ) == 0 ) {
+        DBG( "%s", "Control socket disabled" );
+        return;
+    }
+    if ( ned_control_open ( loop, path ) < 0 ) {
+        ERR( "Unable to open control socket %s: %s", path, strerror ( errno ) );
+        return;
+    }
+    ned_control_register ( "list", NULL, list_command, NULL );
+    ned_control_register ( "pause", "<reader|all>", pause_command, NULL );
+    ned_control_register ( "resume", "<reader|all>", pause_command, NULL );
+    ned_control_register ( "interval", "<reader|all> <milliseconds>", interval_command, NULL );
+    ned_control_register ( "stats", NULL, stats_command, NULL );
+    ned_control_register ( "flush", NULL, flush_command, NULL );
+    ned_control_register ( "reload", NULL, reload_command, NULL );
+    ned_control_register ( "uevent", "<action> <subsystem> [<devtype>]", uevent_command, NULL );
+}
+
+/**
+ * @brief Compare the wake-up jitter of a default thread and of a thread
+ * scheduled like the first polling thread, then exit
+ */
+static int run_jitter_test ( void ) {
+    ned_rt_sched configured = { poll_cpus_count ? poll_cpus[0] : -1, poll_priority };
+    ned_rt_sched normal = { -1, 0 };
+    const ned_rt_sched *runs[2] = { &normal, &configured };
+    const char *names[2] = { "default", "configured" };
+
+    printf ( "Jitter test: %u us period, %d s per run, %d CPU(s)\n", JITTER_TEST_PERIOD, jitter_test, ned_rt_cpu_count() );
+    printf ( "configured: cpu %d, %s priority %d%s\n", configured.cpu, configured.priority ? "SCHED_FIFO" : "SCHED_OTHER",
+             configured.priority, lock_memory ? ", memory locked" : "" );
+    printf ( "%-12s %10s %10s %10s %10s %10s\n", "run", "samples", "p50_us", "p99_us", "p99.9_us", "max_us" );
+    for ( int i = 0; i < 2; i++ ) {
+        ned_rt_jitter result;
+        if ( ( i == 1 ) && lock_memory && ( ned_rt_lock_memory() < 0 ) ) {
+            WARN( "Unable to lock memory: %s", strerror ( errno ) );
+        }
+        if ( ned_rt_jitter_test ( runs[i], JITTER_TEST_PERIOD, jitter_test * 1000, &result ) < 0 ) {
+            ERR( "Jitter test (%s) failed: %s", names[i], strerror ( errno ) );
+            return -1;
+        }
+        printf ( "%-12s %10llu %10llu %10llu %10llu %10llu\n", names[i], (unsigned long long) result.samples,
+                 (unsigned long long) result.p50_us, (unsigned long long) result.p99_us,
+                 (unsigned long long) result.p999_us, (unsigned long long) result.max_us );
+        fflush ( stdout );
+    }
+    return 0;
 }
 
 int
 main ( int argc, char *argv[] ) {
-    nfc_target* old_tag = NULL;
-    nfc_target* new_tag;
-
-    int expire_count = 0;
+    uint64_t stop_start;
 
+    stats.started_ms = ned_loop_now_ms();
     INFO ("%s", PACKAGE_STRING);
 
     /* parse args and configuration file */
     parse_args ( argc, argv );
+    if ( jitter_test > 0 ) {
+        exit ( run_jitter_test() < 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+    }
+    if ( module_host_fds ) {
+        /* Started by the daemon to run the module (module_isolate) */
+        exit ( ned_modhost_run ( module_host_fds, ctx, find_module_block() ) < 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+    }
 
     /* put my self into background if flag is set */
     if ( daemonize ) {
@@ -341,84 +1139,96 @@ main ( int argc, char *argv[] ) {
             return 1;
         }
     }
+    /* Async logging cuts %s arguments at 256 bytes and only roughly orders threads, see debug.h */
+    if ( log_async && ( debug_start_writer() < 0 ) ) {
+        WARN( "%s", "Unable to start log writer, logging synchronously" );
+    }
 
+    if ( lock_memory && ( ned_rt_lock_memory() < 0 ) ) {
+        WARN( "Unable to lock memory: %s", strerror ( errno ) );
+    }
+
+    /*
+     * Every event source (signals, timers, polling threads...) is a file
+     * descriptor watched by the main loop. Signals have to be routed to the
+     * loop before any thread is started so that threads inherit the mask.
+     */
+    loop = ned_loop_new();
+    if ( loop == NULL ) {
+        ERR( "Unable to create main loop: %s", strerror ( errno ) );
+        exit(EXIT_FAILURE);
+    }
+    if ( ( ned_loop_add_signal ( loop, SIGINT, on_quit_signal, NULL ) < 0 ) ||
+         ( ned_loop_add_signal ( loop, SIGTERM, on_quit_signal, NULL ) < 0 ) ||
+         ( ned_loop_add_signal ( loop, SIGHUP, on_reload_signal, NULL ) < 0 ) ) {
+        ERR( "Unable to watch signals: %s", strerror ( errno ) );
+        exit(EXIT_FAILURE);
+    }
     load_module();
+    setup_rate_limit();
+    if ( ned_readers_init ( loop, on_reader_events, NULL ) < 0 ) {
+        ERR( "Unable to create event queue: %s", strerror ( errno ) );
+        exit(EXIT_FAILURE);
+    }
+    open_control_socket();
+    open_state_file();
 
     /*
-     * Wait endlessly for all events in the list of readers
-     * We only stop in case of an error
+     * Each reader is polled endlessly from its own thread.
      *
      * COMMENT:
      * There are no way in libnfc API to detect if a card is present or not
      * so the way we proceed is to look for an tag
      * Any ideas will be welcomed
      */
-    signal(SIGINT, stop_polling);
-    signal(SIGTERM, stop_polling);
-
     nfc_init(&context);
     if (context == NULL) {
       ERR("Unable to init libnfc (malloc)");
       exit(EXIT_FAILURE);
     }
-    // Try to open the NFC device
-    if ( device == NULL ) device = nfc_open( context, NULL );
-    if ( device == NULL ) {
-        ERR( "%s", "NFC device not found" );
-        exit(EXIT_FAILURE);
-    }
-    nfc_initiator_init ( device );
-
-    // Drop the field for a while
-    nfc_device_set_property_bool ( device, NP_ACTIVATE_FIELD, false );
-    nfc_device_set_property_bool ( device, NP_INFINITE_SELECT, false );
-
-    // Configure the CRC and Parity settings
-    nfc_device_set_property_bool ( device, NP_HANDLE_CRC, true );
-    nfc_device_set_property_bool ( device, NP_HANDLE_PARITY, true );
-
-    // Enable field so more power consuming cards can power themselves up
-    nfc_device_set_property_bool ( device, NP_ACTIVATE_FIELD, true );
-
-    INFO( "Connected to NFC device: %s", nfc_device_get_name(device) );
-
-    do {
-detect:
-        new_tag = ned_poll_for_tag(device, old_tag);
-
-        if ( old_tag == new_tag ) { /* state unchanged */
-            /* on card not present, increase and check expire time */
-            if (( !quit_flag ) && ( expire_time == 0 )) goto detect;
-            if (( !quit_flag ) && ( new_tag != NULL )) goto detect;
-            expire_count += polling_time;
-            if ( expire_count >= expire_time ) {
-                DBG ( "%s", "Timeout on tag removed " );
-                execute_event ( device, new_tag,EVENT_EXPIRE_TIME );
-                expire_count = 0; /*restart timer */
-            }
-        } else { /* state changed; parse event */
-            expire_count = 0;
-            if ( new_tag == NULL ) {
-                DBG ( "%s", "Event detected: tag removed" );
-                execute_event ( device, old_tag, EVENT_TAG_REMOVED );
-                free(old_tag);
-            } else {
-                DBG ( "%s", "Event detected: tag inserted " );
-                execute_event ( device, new_tag, EVENT_TAG_INSERTED );
+    if ( nfcconf_get_bool ( root, "hotplug", 1 ) ) {
+        /* Every device libnfc can see, now and when plugged in later */
+        int watching = ned_hotplug_open ( loop, nfcconf_get_int ( root, "hotplug_debounce", DEF_HOTPLUG_DEBOUNCE ), on_devices_changed, NULL ) == 0;
+        if ( watching ) {
+            recheck_timer = ned_loop_add_timer ( loop, 0, 0, on_recheck_timer, NULL );
+        } else {
+            WARN( "Unable to watch device hotplug: %s", strerror ( errno ) );
+        }
+        rescan_readers ( true );
+        if ( ned_readers_first() == NULL ) {
+            if ( !watching ) {
+                ERR( "%s", "NFC device not found" );
+                exit(EXIT_FAILURE);
             }
-            old_tag = new_tag;
+            INFO( "%s", "No NFC device found, waiting for one to be plugged in" );
         }
-    } while ( !quit_flag );
+    } else {
+        // Try to open the NFC device
+        if ( add_reader ( NULL ) == NULL ) {
+            ERR( "%s", "NFC device not found" );
+            exit(EXIT_FAILURE);
+        }
+    }
+    ned_snapshot_forget_unclaimed();
 
-    if ( device != NULL ) {
-        nfc_close(device);
-        DBG ( "NFC device (0x%08x) is disconnected", device );
-        device = NULL;
+    if ( ned_loop_run ( loop ) < 0 ) {
+        ERR( "Main loop failed: %s", strerror ( errno ) );
     }
 
     /* If we get here means that an error or exit status occurred */
     DBG ( "%s", "Exited from main loop" );
+    stop_start = ned_loop_now_ms();
+    ned_control_close();
+    ned_hotplug_close();
+    ned_readers_shutdown();
+    DBG ( "Readers stopped in %llu ms", (unsigned long long) ( ned_loop_now_ms() - stop_start ) );
+    ned_snapshot_close();
+    if ( module ) ned_module_unload ( module );
+    if ( modhost ) ned_modhost_stop ( modhost );
+    ned_ratelimit_free ( ratelimit );
+
+    ned_loop_free ( loop );
     nfc_exit(context);
-    exit ( EXIT_FAILURE );
+    debug_stop_writer();
+    exit ( EXIT_SUCCESS );
 } /* main */
-
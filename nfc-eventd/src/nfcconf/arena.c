@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "nfcconf.h"
+#include "internal.h"
+
+/*
+ * Context arena
+ *
+ * Bump pointer allocation from chunks, each one twice as large as the
+ * previous one (up to CHUNK_MAX). Nodes and strings of a parsed file are
+ * laid out one after the other, in file order, and released all at once.
+ *
+ * The arena of a loaded image (see image.c) lives in the image mapping:
+ * it has no chunks until something is allocated from it.
+ */
+
+#define CHUNK_MIN	4096
+#define CHUNK_MAX	(1024 * 1024)
+#define ALIGN		(sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double))
+
+struct _nfcconf_arena_chunk {
+    struct _nfcconf_arena_chunk *next;
+    size_t size, used;
+    /* data follows, aligned */
+};
+
+#define CHUNK_HEADER	((sizeof(struct _nfcconf_arena_chunk) + ALIGN - 1) & ~(ALIGN - 1))
+
+static struct _nfcconf_arena_chunk *chunk_new(size_t size) {
+    struct _nfcconf_arena_chunk *chunk;
+
+    chunk = (struct _nfcconf_arena_chunk *) malloc(CHUNK_HEADER + size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+nfcconf_arena *nfcconf_arena_new(void) {
+    nfcconf_arena *arena;
+
+    arena = (nfcconf_arena *) calloc(1, sizeof(nfcconf_arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->chunks = chunk_new(CHUNK_MIN);
+    if (!arena->chunks) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void *nfcconf_arena_alloc(nfcconf_arena * arena, size_t size) {
+    struct _nfcconf_arena_chunk *chunk = arena->chunks;
+    void *ptr;
+
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+    if (!chunk) {
+        chunk = chunk_new(size > CHUNK_MIN ? size : CHUNK_MIN);
+        if (!chunk) {
+            return NULL;
+        }
+        arena->chunks = chunk;
+    } else if (chunk->used + size > chunk->size) {
+        size_t chunk_size = chunk->size < CHUNK_MAX ? chunk->size * 2 : CHUNK_MAX;
+
+        if (size > chunk_size / 4) {
+            /* Large: a chunk of its own, behind the current one */
+            chunk = chunk_new(size);
+            if (!chunk) {
+                return NULL;
+            }
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+            chunk->used = size;
+            arena->allocated += size;
+            return (char *) chunk + CHUNK_HEADER;
+        }
+        chunk = chunk_new(chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    ptr = (char *) chunk + CHUNK_HEADER + chunk->used;
+    chunk->used += size;
+    arena->allocated += size;
+    return ptr;
+}
+
+char *nfcconf_arena_strndup(nfcconf_arena * arena, const char *string, size_t len) {
+    char *copy;
+
+    copy = (char *) nfcconf_arena_alloc(arena, len + 1);
+    if (copy) {
+        memcpy(copy, string, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+char *nfcconf_arena_strdup(nfcconf_arena * arena, const char *string) {
+    return nfcconf_arena_strndup(arena, string, strlen(string));
+}
+
+/* Whether ptr was allocated from the arena */
+int nfcconf_arena_owns(const nfcconf_arena * arena, const void *ptr) {
+    const struct _nfcconf_arena_chunk *chunk;
+    const char *p = (const char *) ptr;
+
+    for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+        if (p >= (const char *) chunk + CHUNK_HEADER && p < (const char *) chunk + CHUNK_HEADER + chunk->used) {
+            return 1;
+        }
+    }
+    return arena->map && p >= (const char *) arena->map && p < (const char *) arena->map + arena->map_size;
+}
+
+void nfcconf_arena_free(nfcconf_arena * arena) {
+    struct _nfcconf_arena_chunk *chunk, *next;
+
+    if (!arena) {
+        return;
+    }
+    nfcconf_source_free(arena->sources);
+    if (arena->atoms && arena->atoms->owner == arena) {
+        nfcconf_atoms_free(arena->atoms);
+    }
+    nfcconf_index_free_list(arena->indexes);
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    if (arena->map) {
+        /* The arena is part of the mapping */
+        munmap(arena->map, arena->map_size);
+    } else {
+        free(arena);
+    }
+}
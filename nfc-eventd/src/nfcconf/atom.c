@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "nfcconf.h"
+#include "internal.h"
+
+/*
+ * Interned keys
+ *
+ * The parser turns every key into an atom: one copy per spelling in the
+ * context, which lasts as long as the context (a full reload hands the
+ * table over to the new tree). Keys are case insensitive, so each atom
+ * also points to the atom of its lower case spelling, the same for all
+ * the spellings of a key: two keys are equal if their folds are.
+ *
+ * The table is an open addressing hash table, keyed by the case folded hash
+ * of index.c so that the atoms carry the hash lookups need. The atoms
+ * themselves live in an arena of the table.
+ */
+
+nfcconf_atoms *nfcconf_atoms_new(nfcconf_arena * owner) {
+    nfcconf_atoms *atoms;
+
+    atoms = (nfcconf_atoms *) calloc(1, sizeof(nfcconf_atoms));
+    if (!atoms) {
+        return NULL;
+    }
+    atoms->size = 64;
+    atoms->slots = (nfcconf_atom **) calloc(atoms->size, sizeof(nfcconf_atom *));
+    atoms->store = nfcconf_arena_new();
+    if (!atoms->slots || !atoms->store) {
+        nfcconf_atoms_free(atoms);
+        return NULL;
+    }
+    atoms->owner = owner;
+    return atoms;
+}
+
+void nfcconf_atoms_free(nfcconf_atoms * atoms) {
+    if (!atoms) {
+        return;
+    }
+    nfcconf_arena_free(atoms->store);
+    free(atoms->slots);
+    free(atoms);
+}
+
+void nfcconf_atoms_move(nfcconf_arena * from, nfcconf_arena * to) {
+    if (to->atoms && to->atoms->owner == to) {
+        nfcconf_atoms_free(to->atoms);
+    }
+    to->atoms = from->atoms;
+    from->atoms = NULL;
+    if (to->atoms) {
+        to->atoms->owner = to;
+    }
+}
+
+static int atoms_rehash(nfcconf_atoms * atoms) {
+    nfcconf_atom **slots;
+    size_t size = atoms->size * 2, i, j;
+
+    slots = (nfcconf_atom **) calloc(size, sizeof(nfcconf_atom *));
+    if (!slots) {
+        return -1;
+    }
+    for (i = 0; i < atoms->size; i++) {
+        if (atoms->slots[i]) {
+            for (j = atoms->slots[i]->hash & (size - 1); slots[j]; j = (j + 1) & (size - 1));
+            slots[j] = atoms->slots[i];
+        }
+    }
+    free(atoms->slots);
+    atoms->slots = slots;
+    atoms->size = size;
+    return 0;
+}
+
+const nfcconf_atom *nfcconf_atoms_intern(nfcconf_atoms * atoms, const char *key, size_t len) {
+    uint32_t hash = nfcconf_index_hash(key, len);
+    nfcconf_atom *atom;
+    size_t i, j;
+
+    for (i = hash & (atoms->size - 1); (atom = atoms->slots[i]) != NULL; i = (i + 1) & (atoms->size - 1)) {
+        if (atom->hash == hash && strncmp(atom->name, key, len) == 0 && atom->name[len] == '\0') {
+            return atom;
+        }
+    }
+    if ((atoms->used + 1) * 4 > atoms->size * 3) {
+        if (atoms_rehash(atoms) < 0) {
+            return NULL;
+        }
+        for (i = hash & (atoms->size - 1); atoms->slots[i]; i = (i + 1) & (atoms->size - 1));
+    }
+    atom = (nfcconf_atom *) nfcconf_arena_alloc(atoms->store, offsetof(nfcconf_atom, name) + len + 1);
+    if (!atom) {
+        return NULL;
+    }
+    atom->hash = hash;
+    atom->fold = atom;
+    memcpy(atom->name, key, len);
+    atom->name[len] = '\0';
+    for (j = 0; j < len; j++) {
+        if (isupper((unsigned char) key[j])) {
+            break;
+        }
+    }
+    if (j < len) {
+        /* The lower case spelling, interned first */
+        char *lower = (char *) malloc(len);
+        const nfcconf_atom *fold;
+
+        if (!lower) {
+            return NULL;
+        }
+        for (j = 0; j < len; j++) {
+            lower[j] = (char) tolower((unsigned char) key[j]);
+        }
+        fold = nfcconf_atoms_intern(atoms, lower, len);
+        free(lower);
+        if (!fold) {
+            return NULL;
+        }
+        atom->fold = fold;
+        /* The table may have grown meanwhile */
+        for (i = hash & (atoms->size - 1); atoms->slots[i]; i = (i + 1) & (atoms->size - 1));
+    }
+    atoms->slots[i] = atom;
+    atoms->used++;
+    return atom;
+}
+
+void nfcconf_key_atom(nfcconf_key * key, const nfcconf_atom * atom) {
+    key->name = atom->name;
+    key->hash = atom->hash;
+    key->fold = atom->fold;
+}
+
+const nfcconf_atom *nfcconf_atom_get(nfcconf_context * config, const char *key) {
+    if (!config->arena->atoms) {
+        config->arena->atoms = nfcconf_atoms_new(config->arena);
+        if (!config->arena->atoms) {
+            return NULL;
+        }
+    }
+    return nfcconf_atoms_intern(config->arena->atoms, key, strlen(key));
+}
+
+const char *nfcconf_atom_name(const nfcconf_atom * atom) {
+    return atom->name;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nfcconf.h"
+#include "internal.h"
+
+/*
+ * Configuration images
+ *
+ * An image is a parsed tree, saved as the very structures the parser builds:
+ * blocks, items, lists and strings, plus an arena structure owning them all.
+ * Pointers are stored for the address the image prefers to be mapped at.
+ * Loading is then a mmap() and one pass over the relocation table, which
+ * checks the pointers it lists, and moves them when the image lands
+ * elsewhere: nothing is parsed nor allocated.
+ *
+ * The mapping is private and writable: lookup indexes are attached to the
+ * blocks on demand, and nodes may be added later on as with a parsed tree.
+ * Images are replaced by a rename, never rewritten in place, so that
+ * mapped pages cannot go away (SIGBUS) while a tree uses them.
+ *
+ * The source stamp (mtime, size and content hash) of the text file tells
+ * whether the image is stale. Images are only valid on the architecture,
+ * and with the library version, that wrote them.
+ */
+
+#define IMAGE_MAGIC	"NFCCIMG"
+#define IMAGE_VERSION	1
+#define IMAGE_ENDIAN	0x01020304u
+
+/* Images prefer an address in 16-80 TiB, at a 1 GiB boundary */
+#define IMAGE_BASE_MIN	0x100000000000ull
+#define IMAGE_BASE_SLOTS	65536ull
+#define IMAGE_BASE_STEP	0x40000000ull
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t abi;		/* structure sizes */
+    uint32_t unused;
+    uint64_t base;		/* address the pointers are for */
+    uint64_t size;		/* of the whole image */
+    uint64_t root;		/* offsets */
+    uint64_t arena;
+    uint64_t relocs;
+    uint64_t relocs_count;
+    /* source stamp */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t source_size;
+    uint64_t source_hash;
+} image_header;
+
+#define IMAGE_ABI	((uint32_t) (sizeof(void *) << 24 | sizeof(nfcconf_block) << 16 | \
+			 sizeof(nfcconf_item) << 8 | (sizeof(nfcconf_list) + sizeof(nfcconf_arena))))
+
+typedef struct {
+    char *buf;
+    size_t len, max;
+    uint64_t base;
+    uint64_t *relocs;
+    size_t relocs_count, relocs_max;
+    int error;
+} image_writer;
+
+static uint64_t hash_bytes(uint64_t hash, const unsigned char *p, size_t len) {
+    /* FNV-1a */
+    while (len--) {
+        hash ^= *p++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+#define HASH_INIT	14695981039346656037ull
+
+/* Content hash of a file, 0 on error */
+static uint64_t hash_file(const char *filename, uint64_t * size) {
+    unsigned char buf[65536];
+    uint64_t hash = HASH_INIT;
+    ssize_t n;
+    int fd;
+
+    *size = 0;
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return 0;
+        }
+        hash = hash_bytes(hash, buf, n);
+        *size += n;
+    }
+    close(fd);
+    return hash;
+}
+
+/* Writer */
+
+static uint64_t emit(image_writer * w, const void *data, size_t len, size_t align) {
+    uint64_t offset = (w->len + align - 1) & ~(uint64_t) (align - 1);
+
+    if (offset + len > w->max) {
+        size_t max = w->max ? w->max : 65536;
+        char *tmp;
+
+        while (offset + len > max) {
+            max *= 2;
+        }
+        tmp = (char *) realloc(w->buf, max);
+        if (!tmp) {
+            w->error = ENOMEM;
+            return 0;
+        }
+        w->buf = tmp;
+        w->max = max;
+    }
+    memset(w->buf + w->len, 0, offset - w->len);
+    if (data) {
+        memcpy(w->buf + offset, data, len);
+    } else {
+        memset(w->buf + offset, 0, len);
+    }
+    w->len = offset + len;
+    return offset;
+}
+
+/* Store, at offset where, a pointer to offset target */
+static void set_pointer(image_writer * w, uint64_t where, uint64_t target) {
+    uint64_t value = w->base + target;
+    void *ptr = (void *) (uintptr_t) value;
+
+    if (w->error) {
+        return;
+    }
+    if (w->relocs_count == w->relocs_max) {
+        size_t max = w->relocs_max ? w->relocs_max * 2 : 1024;
+        uint64_t *tmp = (uint64_t *) realloc(w->relocs, max * sizeof(uint64_t));
+
+        if (!tmp) {
+            w->error = ENOMEM;
+            return;
+        }
+        w->relocs = tmp;
+        w->relocs_max = max;
+    }
+    w->relocs[w->relocs_count++] = where;
+    memcpy(w->buf + where, &ptr, sizeof(ptr));
+}
+
+static uint64_t emit_string(image_writer * w, const char *string) {
+    return emit(w, string, strlen(string) + 1, 1);
+}
+
+static void emit_list(image_writer * w, const nfcconf_list * list, uint64_t where) {
+    for (; list && !w->error; list = list->next) {
+        uint64_t node = emit(w, NULL, sizeof(nfcconf_list), sizeof(void *));
+
+        set_pointer(w, where, node);
+        ((nfcconf_list *) (w->buf + node))->flags = SCCONF_NODE_ARENA;
+        if (list->data) {
+            uint64_t data = emit_string(w, list->data);
+            set_pointer(w, node + offsetof(nfcconf_list, data), data);
+        }
+        where = node + offsetof(nfcconf_list, next);
+    }
+}
+
+static uint64_t emit_block(image_writer * w, const nfcconf_block * block, uint64_t parent, uint64_t arena) {
+    uint64_t offset, where;
+    const nfcconf_item *item;
+
+    offset = emit(w, NULL, sizeof(nfcconf_block), sizeof(void *));
+    if (w->error) {
+        return 0;
+    }
+    set_pointer(w, offset + offsetof(nfcconf_block, arena), arena);
+    if (parent) {
+        set_pointer(w, offset + offsetof(nfcconf_block, parent), parent);
+    }
+    emit_list(w, block->name, offset + offsetof(nfcconf_block, name));
+
+    where = offset + offsetof(nfcconf_block, items);
+    for (item = block->items; item && !w->error; item = item->next) {
+        uint64_t node = emit(w, NULL, sizeof(nfcconf_item), sizeof(void *));
+        uint64_t value = 0;
+
+        if (w->error) {
+            break;
+        }
+        set_pointer(w, where, node);
+        ((nfcconf_item *) (w->buf + node))->type = item->type;
+        ((nfcconf_item *) (w->buf + node))->flags = SCCONF_NODE_ARENA;
+        if (item->key) {
+            uint64_t key = emit_string(w, item->key);
+            set_pointer(w, node + offsetof(nfcconf_item, key), key);
+        }
+        switch (item->type) {
+        case SCCONF_ITEM_TYPE_COMMENT:
+            if (item->value.comment) {
+                value = emit_string(w, item->value.comment);
+                set_pointer(w, node + offsetof(nfcconf_item, value), value);
+            }
+            break;
+        case SCCONF_ITEM_TYPE_BLOCK:
+            if (item->value.block) {
+                value = emit_block(w, item->value.block, offset, arena);
+                set_pointer(w, node + offsetof(nfcconf_item, value), value);
+            }
+            break;
+        case SCCONF_ITEM_TYPE_VALUE:
+            emit_list(w, item->value.list, node + offsetof(nfcconf_item, value));
+            break;
+        }
+        where = node + offsetof(nfcconf_item, next);
+    }
+    return offset;
+}
+
+int nfcconf_image_write(const nfcconf_context * config, const char *source, const char *filename) {
+    image_writer w;
+    image_header header;
+    struct stat st;
+    char *tmpname;
+    uint64_t arena, size;
+    int fd, r;
+
+    if (!source) {
+        source = config->filename;
+    }
+    if (!source || stat(source, &st) < 0) {
+        return source ? errno : EINVAL;
+    }
+    if (config->arena->sources && config->arena->sources->children) {
+        /* Only the main file would be checked for changes */
+        return ENOTSUP;
+    }
+    memset(&w, 0, sizeof(w));
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.endian = IMAGE_ENDIAN;
+    header.abi = IMAGE_ABI;
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+    header.source_hash = hash_file(source, &header.source_size);
+    if (header.source_size != (uint64_t) st.st_size) {
+        /* Changed meanwhile: the stamp would not match the tree */
+        return EAGAIN;
+    }
+    w.base = header.base = IMAGE_BASE_MIN + (hash_bytes(HASH_INIT, (const unsigned char *) source, strlen(source)) % IMAGE_BASE_SLOTS) * IMAGE_BASE_STEP;
+
+    emit(&w, &header, sizeof(header), sizeof(void *));
+    arena = emit(&w, NULL, sizeof(nfcconf_arena), sizeof(void *));
+    header.arena = arena;
+    header.root = emit_block(&w, config->root, 0, arena);
+    size = (w.len + 7) & ~(uint64_t) 7;
+    header.relocs = size;
+    header.relocs_count = w.relocs_count;
+    header.size = size + w.relocs_count * sizeof(uint64_t);
+    if (w.error) {
+        free(w.buf);
+        free(w.relocs);
+        return w.error;
+    }
+    emit(&w, NULL, 0, 8);
+    memcpy(w.buf, &header, sizeof(header));
+
+    /* Into a temporary file, renamed once complete */
+    tmpname = (char *) malloc(strlen(filename) + 8);
+    if (!tmpname) {
+        free(w.buf);
+        free(w.relocs);
+        return ENOMEM;
+    }
+    sprintf(tmpname, "%s.XXXXXX", filename);
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+        r = errno;
+    } else {
+        r = nfcconf_write_all(fd, w.buf, size);
+        if (!r) {
+            r = nfcconf_write_all(fd, w.relocs, w.relocs_count * sizeof(uint64_t));
+        }
+        if (!r && (fchmod(fd, 0644) < 0 || fsync(fd) < 0)) {
+            r = errno;
+        }
+        if (close(fd) < 0 && !r) {
+            r = errno;
+        }
+        if (!r && rename(tmpname, filename) < 0) {
+            r = errno;
+        }
+        if (r) {
+            unlink(tmpname);
+        }
+    }
+    free(tmpname);
+    free(w.buf);
+    free(w.relocs);
+    return r;
+}
+
+/* Loader */
+
+static int image_fresh(const image_header * header, const char *source) {
+    struct stat st;
+    uint64_t size;
+
+    if (stat(source, &st) < 0 || (uint64_t) st.st_size != header->source_size) {
+        return 0;
+    }
+    if (st.st_mtim.tv_sec == header->mtime_sec && st.st_mtim.tv_nsec == header->mtime_nsec) {
+        return 1;
+    }
+    /* Touched, maybe not changed */
+    return hash_file(source, &size) == header->source_hash && size == header->source_size;
+}
+
+/*
+ * Check that every pointer of the relocation table is in the image, pointing
+ * into it, and move them by the distance to the base the image was written
+ * for. Also run when the image is at that base, without writing anything,
+ * since the pointers are then used as they are.
+ */
+static int image_relocate(char *map, const image_header * header) {
+    const uint64_t *relocs = (const uint64_t *) (map + header->relocs);
+    uint64_t delta = (uint64_t) (uintptr_t) map - header->base;
+    uint64_t i;
+
+    for (i = 0; i < header->relocs_count; i++) {
+        uint64_t value;
+
+        if (relocs[i] > header->relocs - sizeof(void *) || relocs[i] % sizeof(void *)) {
+            return -1;
+        }
+        memcpy(&value, map + relocs[i], sizeof(value));
+        if (value - header->base >= header->relocs) {
+            return -1;
+        }
+        if (delta) {
+            value += delta;
+            memcpy(map + relocs[i], &value, sizeof(value));
+        }
+    }
+    return 0;
+}
+
+int nfcconf_image_load(nfcconf_context * config, const char *filename, const char *source) {
+    image_header header;
+    struct stat st, src;
+    nfcconf_arena *arena;
+    char *map;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    /* As trusted as the source: same owner (or root), not writable by others */
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || stat(source, &src) < 0 ||
+            (st.st_uid != src.st_uid && st.st_uid != 0) || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+            pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return 0;
+    }
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 || header.version != IMAGE_VERSION ||
+            header.endian != IMAGE_ENDIAN || header.abi != IMAGE_ABI || header.size != (uint64_t) st.st_size ||
+            header.relocs > header.size || header.relocs % sizeof(uint64_t) || header.relocs_count > (header.size - header.relocs) / sizeof(uint64_t) ||
+            header.arena + sizeof(nfcconf_arena) > header.relocs || header.root + sizeof(nfcconf_block) > header.relocs ||
+            !image_fresh(&header, source)) {
+        close(fd);
+        return 0;
+    }
+    map = (char *) mmap((void *) (uintptr_t) header.base, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    if (image_relocate(map, &header) < 0) {
+        munmap(map, header.size);
+        return 0;
+    }
+
+    arena = (nfcconf_arena *) (map + header.arena);
+    arena->map = map;
+    arena->map_size = header.size;
+    nfcconf_atoms_move(config->arena, arena);
+    nfcconf_arena_free(config->arena);
+    config->arena = arena;
+    config->root = (nfcconf_block *) (map + header.root);
+    return 1;
+}
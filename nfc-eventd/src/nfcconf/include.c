@@ -0,0 +1,639 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include "nfcconf.h"
+#include "internal.h"
+
+/*
+ * Included files
+ *
+ *   include "path";
+ *   include_dir "conf.d/nfc-*.conf";
+ *
+ * The directive stays in the tree as a comment item, the anchor, followed by
+ * the items of the file (or of the files, in glob order), which belong to
+ * the including block. Relative paths are relative to the including file.
+ *
+ * Each file is a source: the nodes parsed from it live in an arena of its
+ * own, and the source remembers where they are spliced, with the stamp of
+ * the file (device, inode, mtime, size and content hash). nfcconf_reload()
+ * parses again the files whose stamp changed, and only them, then replaces
+ * their items after the anchor. Changing the file list of an include_dir
+ * parses the whole directory again.
+ */
+
+#define INCLUDE_MAX	16
+
+/* Content hash, 8 bytes at a time */
+static uint64_t hash_content(const char *data, size_t size) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ size, word;
+
+    for (; size >= 8; data += 8, size -= 8) {
+        memcpy(&word, data, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    word = 0;
+    memcpy(&word, data, size);
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 29);
+}
+
+void nfcconf_source_stamp(nfcconf_source * source, const struct stat *st, const char *data, size_t size) {
+    source->dev = st->st_dev;
+    source->ino = st->st_ino;
+    source->mtime_sec = st->st_mtim.tv_sec;
+    source->mtime_nsec = st->st_mtim.tv_nsec;
+    source->size = size;
+    source->hash = hash_content(data, size);
+}
+
+/* Whether the file changed since it was parsed */
+static int source_changed(nfcconf_source * source) {
+    struct stat st;
+    FILE *file;
+    char *data;
+    size_t size;
+    int changed;
+
+    if (stat(source->path, &st) < 0) {
+        return 1;
+    }
+    if (st.st_dev == source->dev && st.st_ino == source->ino && (uint64_t) st.st_size == source->size &&
+            st.st_mtim.tv_sec == source->mtime_sec && st.st_mtim.tv_nsec == source->mtime_nsec) {
+        return 0;
+    }
+    if ((uint64_t) st.st_size != source->size) {
+        return 1;
+    }
+    /* Touched or replaced, maybe with the same contents */
+    file = fopen(source->path, "r");
+    if (!file) {
+        return 1;
+    }
+    size = st.st_size;
+    data = (char *) malloc(size ? size : 1);
+    changed = !data || fread(data, 1, size, file) != size || hash_content(data, size) != source->hash;
+    fclose(file);
+    free(data);
+    if (!changed) {
+        source->dev = st.st_dev;
+        source->ino = st.st_ino;
+        source->mtime_sec = st.st_mtim.tv_sec;
+        source->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+    return changed;
+}
+
+void nfcconf_source_free(nfcconf_source * source) {
+    nfcconf_source *child, *next;
+
+    if (!source) {
+        return;
+    }
+    for (child = source->children; child; child = next) {
+        next = child->next;
+        nfcconf_source_free(child);
+    }
+    nfcconf_arena_free(source->arena);
+    free(source->path);
+    free(source);
+}
+
+int nfcconf_source_late(const nfcconf_source * source) {
+    const nfcconf_source *child;
+
+    if (!source) {
+        return 0;
+    }
+    if (source->arena && source->arena->late) {
+        return 1;
+    }
+    for (child = source->children; child; child = child->next) {
+        if (nfcconf_source_late(child)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static nfcconf_source *source_new(nfcconf_source * parent, const char *path, int dir) {
+    nfcconf_source *source;
+
+    source = (nfcconf_source *) calloc(1, sizeof(nfcconf_source));
+    if (!source) {
+        return NULL;
+    }
+    source->path = strdup(path);
+    source->arena = nfcconf_arena_new();
+    if (!source->path || !source->arena) {
+        nfcconf_source_free(source);
+        return NULL;
+    }
+    source->parent = parent;
+    source->dir = dir;
+    return source;
+}
+
+/* Path relative to the directory of the including file */
+static char *resolve(const nfcconf_source * parent, const char *path) {
+    const char *slash = strrchr(parent->path, '/');
+    size_t dirlen = (path[0] != '/' && slash) ? (size_t) (slash - parent->path + 1) : 0;
+    char *resolved;
+
+    resolved = (char *) malloc(dirlen + strlen(path) + 1);
+    if (resolved) {
+        memcpy(resolved, parent->path, dirlen);
+        strcpy(resolved + dirlen, path);
+    }
+    return resolved;
+}
+
+/* Sources included by a file were spliced into its top block first */
+static void source_rebase(nfcconf_source * source, const nfcconf_block * top, nfcconf_block * block) {
+    nfcconf_source *child;
+
+    for (child = source->children; child; child = child->next) {
+        if (child->block == top) {
+            child->block = block;
+            source_rebase(child, top, block);
+        }
+    }
+}
+
+nfcconf_source *nfcconf_source_main(nfcconf_context * config) {
+    nfcconf_source *source;
+
+    source = (nfcconf_source *) calloc(1, sizeof(nfcconf_source));
+    if (!source) {
+        return NULL;
+    }
+    source->path = strdup(config->filename);
+    if (!source->path) {
+        free(source);
+        return NULL;
+    }
+    /* The nodes are those of the context arena */
+    source->block = config->root;
+    return source;
+}
+
+static int source_depth(const nfcconf_source * source) {
+    int depth = 0;
+
+    while ((source = source->parent) != NULL) {
+        depth++;
+    }
+    return depth;
+}
+
+static nfcconf_item *anchor_new(nfcconf_arena * arena, int dir, const char *path) {
+    nfcconf_item *anchor;
+    char *comment;
+
+    anchor = (nfcconf_item *) nfcconf_arena_alloc(arena, sizeof(nfcconf_item));
+    comment = (char *) nfcconf_arena_alloc(arena, strlen(path) + sizeof("#include_dir \"\""));
+    if (!anchor || !comment) {
+        return NULL;
+    }
+    sprintf(comment, "#%s \"%s\"", dir ? "include_dir" : "include", path);
+    memset(anchor, 0, sizeof(nfcconf_item));
+    anchor->type = SCCONF_ITEM_TYPE_COMMENT;
+    anchor->flags = SCCONF_NODE_ARENA | SCCONF_NODE_INCLUDE;
+    anchor->value.comment = comment;
+    return anchor;
+}
+
+static nfcconf_source *source_dir(nfcconf_context * config, nfcconf_source * parent, const char *pattern,
+                                  nfcconf_block * block, nfcconf_item * anchor, char *emesg, size_t size);
+
+/* Parse a file, or the files of a directory, to a new source */
+static nfcconf_source *source_parse(nfcconf_context * config, nfcconf_source * parent, const char *path, int dir,
+                                    nfcconf_block * block, nfcconf_item * anchor, char *emesg, size_t size) {
+    nfcconf_source *source;
+    nfcconf_parser p;
+    nfcconf_block *top;
+    nfcconf_item *item;
+
+    if (source_depth(parent) >= INCLUDE_MAX) {
+        snprintf(emesg, size, "%s: includes nested too deep\n", path);
+        return NULL;
+    }
+    if (dir) {
+        return source_dir(config, parent, path, block, anchor, emesg, size);
+    }
+    source = source_new(parent, path, 0);
+    top = source ? (nfcconf_block *) nfcconf_arena_alloc(source->arena, sizeof(nfcconf_block)) : NULL;
+    if (!top) {
+        snprintf(emesg, size, "%s: out of memory\n", path);
+        nfcconf_source_free(source);
+        return NULL;
+    }
+    source->block = block;
+    source->anchor = anchor;
+
+    /* Into a block of its own, spliced afterwards */
+    memset(top, 0, sizeof(nfcconf_block));
+    top->arena = source->arena;
+    memset(&p, 0, sizeof(p));
+    p.config = config;
+    p.arena = source->arena;
+    p.source = source;
+    p.atoms = config->arena->atoms;
+    p.block = top;
+    p.line = 1;
+    if (!nfcconf_lex_parse(&p, source->path)) {
+        snprintf(emesg, size, "%s", p.emesg);
+        free(p.parents);
+        nfcconf_source_free(source);
+        return NULL;
+    }
+    if (p.error) {
+        snprintf(emesg, size, "%s: %.200s", source->path, p.emesg);
+        free(p.parents);
+        nfcconf_source_free(source);
+        return NULL;
+    }
+    free(p.parents);
+
+    source->first = top->items;
+    for (item = top->items; item; item = item->next) {
+        if (item->type == SCCONF_ITEM_TYPE_BLOCK && item->value.block) {
+            item->value.block->parent = block;
+        }
+        source->last = item;
+    }
+    source_rebase(source, top, block);
+    return source;
+}
+
+static nfcconf_source *source_dir(nfcconf_context * config, nfcconf_source * parent, const char *pattern,
+                                  nfcconf_block * block, nfcconf_item * anchor, char *emesg, size_t size) {
+    nfcconf_source *source, *file, **tail;
+    nfcconf_item *tip = NULL;
+    glob_t g;
+    size_t i;
+    int r;
+
+    source = source_new(parent, pattern, 1);
+    if (!source) {
+        snprintf(emesg, size, "%s: out of memory\n", pattern);
+        return NULL;
+    }
+    source->block = block;
+    source->anchor = anchor;
+    r = glob(source->path, 0, NULL, &g);
+    if (r != 0 && r != GLOB_NOMATCH) {
+        snprintf(emesg, size, "%s: can't be read\n", source->path);
+        nfcconf_source_free(source);
+        return NULL;
+    }
+    /* One anchor per file, in the arena of the directory */
+    tail = &source->children;
+    for (i = 0; r == 0 && i < g.gl_pathc; i++) {
+        nfcconf_item *file_anchor = anchor_new(source->arena, 0, g.gl_pathv[i]);
+
+        file = file_anchor ? source_parse(config, source, g.gl_pathv[i], 0, block, file_anchor, emesg, size) : NULL;
+        if (!file) {
+            if (!file_anchor) {
+                snprintf(emesg, size, "%s: out of memory\n", source->path);
+            }
+            globfree(&g);
+            nfcconf_source_free(source);
+            return NULL;
+        }
+        if (tip) {
+            tip->next = file_anchor;
+        } else {
+            source->first = file_anchor;
+        }
+        file_anchor->next = file->first;
+        tip = file->last ? file->last : file_anchor;
+        *tail = file;
+        tail = &file->next;
+    }
+    if (r == 0) {
+        globfree(&g);
+    }
+    source->last = tip;
+    return source;
+}
+
+/* Last item of the contents of a source, or its anchor */
+static nfcconf_item *source_tail(const nfcconf_source * source) {
+    return source->last ? source->last : source->anchor;
+}
+
+const nfcconf_item *nfcconf_source_end(const nfcconf_source * source, const nfcconf_item * anchor) {
+    const nfcconf_source *child;
+    const nfcconf_item *end;
+
+    for (child = source ? source->children : NULL; child; child = child->next) {
+        if (child->anchor == anchor) {
+            return source_tail(child);
+        }
+        if ((end = nfcconf_source_end(child, anchor)) != NULL) {
+            return end;
+        }
+    }
+    return NULL;
+}
+
+int nfcconf_source_include(nfcconf_parser * parser, const char *directive, const char *path) {
+    nfcconf_source *source, **tail;
+    nfcconf_item *anchor, *item;
+    char *resolved;
+    int dir = strcmp(directive, "include_dir") == 0;
+
+    if (!parser->source) {
+        snprintf(parser->emesg, sizeof(parser->emesg), "Line %d: %s is only supported in files\n", parser->line, directive);
+        return -1;
+    }
+    anchor = anchor_new(parser->arena, dir, path);
+    resolved = resolve(parser->source, path);
+    if (!anchor || !resolved) {
+        snprintf(parser->emesg, sizeof(parser->emesg), "Line %d: out of memory\n", parser->line);
+        free(resolved);
+        return -1;
+    }
+    source = source_parse(parser->config, parser->source, resolved, dir, parser->block, anchor, parser->emesg, sizeof(parser->emesg));
+    free(resolved);
+    if (!source) {
+        return -1;
+    }
+    for (tail = &parser->source->children; *tail; tail = &(*tail)->next);
+    *tail = source;
+
+    /* The anchor, then the contents, at the end of the block */
+    if (parser->last_item) {
+        parser->last_item->next = anchor;
+    } else {
+        parser->block->items = anchor;
+    }
+    anchor->next = source->first;
+    for (item = anchor; item; item = item->next) {
+        nfcconf_index_add(parser->block, item);
+        parser->last_item = item;
+        if (item == source->last) {
+            break;
+        }
+    }
+    parser->current_item = parser->last_item;
+    return 0;
+}
+
+/* Reload */
+
+typedef struct _pending {
+    struct _pending *next;
+    nfcconf_source *old, *source;
+} pending;
+
+static int pending_add(pending ** list, nfcconf_source * old, nfcconf_source * source) {
+    pending *p = (pending *) malloc(sizeof(pending));
+
+    if (!p) {
+        return -1;
+    }
+    p->old = old;
+    p->source = source;
+    p->next = *list;
+    *list = p;
+    return 0;
+}
+
+/* Whether the files of a directory are still those of its sources */
+static int dir_changed(const nfcconf_source * source) {
+    const nfcconf_source *file = source->children;
+    glob_t g;
+    size_t i;
+    int r, changed = 0;
+
+    r = glob(source->path, 0, NULL, &g);
+    if (r != 0 && r != GLOB_NOMATCH) {
+        return 1;
+    }
+    for (i = 0; r == 0 && i < g.gl_pathc; i++) {
+        if (!file || strcmp(file->path, g.gl_pathv[i]) != 0) {
+            changed = 1;
+            break;
+        }
+        file = file->next;
+    }
+    if (r == 0) {
+        globfree(&g);
+    }
+    return changed || file != NULL;
+}
+
+/* Parse again what changed below a source */
+static int source_check(nfcconf_context * config, nfcconf_source * source, pending ** list, char *emesg, size_t size) {
+    nfcconf_source *child, *fresh;
+
+    for (child = source->children; child; child = child->next) {
+        if (child->dir ? !dir_changed(child) : !source_changed(child)) {
+            if (source_check(config, child, list, emesg, size) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        fresh = source_parse(config, source, child->path, child->dir, child->block, child->anchor, emesg, size);
+        if (!fresh) {
+            return -1;
+        }
+        if (pending_add(list, child, fresh) < 0) {
+            nfcconf_source_free(fresh);
+            snprintf(emesg, size, "%s: out of memory\n", child->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Put a new source in place of an old one, which is left as it was */
+static void source_splice(nfcconf_source * old, nfcconf_source * source) {
+    nfcconf_item *after = old->last ? old->last->next : old->anchor->next;
+    nfcconf_item *old_tail = source_tail(old), *new_tail = source_tail(source);
+    nfcconf_source **link, *parent;
+
+    old->anchor->next = source->first ? source->first : after;
+    if (source->last) {
+        source->last->next = after;
+    }
+    for (parent = old->parent; parent && parent->last == old_tail; parent = parent->parent) {
+        parent->last = new_tail;
+    }
+    for (link = &old->parent->children; *link != old; link = &(*link)->next);
+    source->next = old->next;
+    *link = source;
+    old->next = NULL;
+    nfcconf_index_reset(old->block);
+}
+
+/* Free a source no longer in the tree */
+static void source_release(nfcconf_source * source) {
+    if (nfcconf_source_late(source) && source->first) {
+        /* Heap nodes added to its contents */
+        source->last->next = NULL;
+        nfcconf_item_destroy(source->first);
+    }
+    nfcconf_source_free(source);
+}
+
+/*
+ * A reload between nfcconf_reload_begin() and its commit or rollback: the
+ * previous tree of a full reload, or the sources replaced, last one first.
+ */
+struct _nfcconf_pending {
+    nfcconf_arena *arena;
+    nfcconf_block *root;
+    pending *sources;
+};
+
+int nfcconf_reload_begin(nfcconf_context * config) {
+    static char buffer[256];
+    nfcconf_source *main;
+    nfcconf_context *fresh;
+    pending *list = NULL, *p, *next;
+    int r;
+
+    nfcconf_reload_commit(config);
+    config->pending = (struct _nfcconf_pending *) calloc(1, sizeof(struct _nfcconf_pending));
+    if (!config->pending) {
+        return 0;
+    }
+    main = config->arena->sources;
+    if (!main || source_changed(main)) {
+        /* From scratch, into another context */
+        fresh = nfcconf_new(config->filename);
+        if (!fresh) {
+            free(config->pending);
+            config->pending = NULL;
+            return 0;
+        }
+        fresh->debug = config->debug;
+        /* Atoms last as long as the context */
+        nfcconf_atoms_move(config->arena, fresh->arena);
+        r = nfcconf_parse(fresh);
+        if (r <= 0) {
+            nfcconf_atoms_move(fresh->arena, config->arena);
+            config->errmsg = fresh->errmsg;
+            nfcconf_free(fresh);
+            free(config->pending);
+            config->pending = NULL;
+            return r;
+        }
+        config->pending->arena = config->arena;
+        config->pending->root = config->root;
+        config->arena = fresh->arena;
+        config->root = fresh->root;
+        free(fresh->filename);
+        free(fresh);
+        return 1;
+    }
+
+    /* Everything is parsed before anything is replaced */
+    r = source_check(config, main, &list, buffer, sizeof(buffer));
+    for (p = list; p; p = next) {
+        next = p->next;
+        if (r == 0) {
+            source_splice(p->old, p->source);
+            p->next = config->pending->sources;
+            config->pending->sources = p;
+        } else {
+            nfcconf_source_free(p->source);
+            free(p);
+        }
+    }
+    if (r < 0) {
+        free(config->pending);
+        config->pending = NULL;
+        config->errmsg = buffer;
+        return 0;
+    }
+    return 1;
+}
+
+void nfcconf_reload_commit(nfcconf_context * config) {
+    struct _nfcconf_pending *state = config->pending;
+    pending *p, *next;
+
+    if (!state) {
+        return;
+    }
+    if (state->arena) {
+        if (state->arena->late || nfcconf_source_late(state->arena->sources)) {
+            nfcconf_block_destroy(state->root);
+        }
+        nfcconf_arena_free(state->arena);
+    }
+    for (p = state->sources; p; p = next) {
+        next = p->next;
+        source_release(p->old);
+        free(p);
+    }
+    free(state);
+    config->pending = NULL;
+}
+
+void nfcconf_reload_rollback(nfcconf_context * config) {
+    struct _nfcconf_pending *state = config->pending;
+    pending *p, *next;
+
+    if (!state) {
+        return;
+    }
+    if (state->arena) {
+        nfcconf_atoms_move(config->arena, state->arena);
+        if (config->arena->late || nfcconf_source_late(config->arena->sources)) {
+            nfcconf_block_destroy(config->root);
+        }
+        nfcconf_arena_free(config->arena);
+        config->arena = state->arena;
+        config->root = state->root;
+    }
+    /* In the reverse order of the splices */
+    for (p = state->sources; p; p = next) {
+        next = p->next;
+        source_splice(p->source, p->old);
+        source_release(p->source);
+        free(p);
+    }
+    free(state);
+    config->pending = NULL;
+}
+
+int nfcconf_reload(nfcconf_context * config) {
+    int r;
+
+    r = nfcconf_reload_begin(config);
+    nfcconf_reload_commit(config);
+    return r;
+}
@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef HAVE_STRINGS_H
+#include <strings.h>
+#endif
+#include <ctype.h>
+#include "nfcconf.h"
+#include "internal.h"
+
+/*
+ * Block lookup index
+ *
+ * Blocks with at least INDEX_MIN items get a hash table of their keys,
+ * case folded, built on the first lookup. Each key slot holds the first value
+ * item with that key and every block item with that key, in file order.
+ * Items added later are added to the table as well.
+ *
+ * (item_name, block name) pairs, as looked up by nfcconf_find_blocks() with a
+ * key, have a second table. It is built on the first such lookup and dropped
+ * whenever a block item is added.
+ *
+ * Keys that are atoms (see atom.c) are compared by their folds, the others
+ * as strings.
+ *
+ * Lookups only take const blocks: the tables are published with an atomic
+ * compare and swap, so that concurrent readers may build them. The tables of
+ * arena blocks belong to the arena, as the blocks themselves.
+ */
+
+#define INDEX_MIN	8
+
+typedef struct {
+    uint32_t hash;
+    const char *key;
+    const nfcconf_atom *fold;	/* if one of its items is an atom */
+    nfcconf_item *value;
+    nfcconf_item **blocks;
+    size_t blocks_count, blocks_max;
+} key_slot;
+
+typedef struct {
+    uint32_t hash;
+    const char *key;
+    const char *name;
+    size_t first, count;	/* in name_index.blocks */
+} name_slot;
+
+typedef struct {
+    size_t size, used;
+    name_slot *slots;
+    nfcconf_block **blocks;	/* grouped by slot */
+} name_index;
+
+struct _nfcconf_index {
+    size_t size, used;
+    key_slot *slots;
+    name_index *names;
+    nfcconf_index *next;	/* in the arena list */
+};
+
+static uint32_t hash_fold(uint32_t hash, const char *s) {
+    /* FNV-1a */
+    for (; *s; s++) {
+        hash ^= (unsigned char) tolower((unsigned char) *s);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_key(const char *key) {
+    return hash_fold(2166136261u, key);
+}
+
+uint32_t nfcconf_index_hash(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    for (; len > 0; key++, len--) {
+        hash ^= (unsigned char) tolower((unsigned char) *key);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void nfcconf_key_init(nfcconf_key * key, const char *name) {
+    /* Compared as a string: a probe of the atoms would cost as much */
+    key->name = name;
+    key->hash = hash_key(name);
+    key->fold = NULL;
+}
+
+/* Fold of the key of an item, NULL if it is no atom */
+static const nfcconf_atom *item_fold(const nfcconf_item * item) {
+    return (item->flags & SCCONF_NODE_ATOM) ? SCCONF_ATOM(item->key)->fold : NULL;
+}
+
+static int key_equal(const char *name, const nfcconf_atom * fold, const nfcconf_key * key) {
+    if (fold && key->fold) {
+        return fold == key->fold;
+    }
+    return strcasecmp(name, key->name) == 0;
+}
+
+static int item_match(const nfcconf_item * item, int type, const nfcconf_key * key) {
+    return item->type == type && item->key && key_equal(item->key, item_fold(item), key);
+}
+
+static uint32_t hash_pair(const char *key, const char *name) {
+    /* '\0' between both strings so that ("ab", "c") != ("a", "bc") */
+    return hash_fold(hash_key(key) * 16777619u, name);
+}
+
+static int grow(void **array, size_t *max, size_t count, size_t elem_size) {
+    void *tmp;
+    size_t new_max;
+
+    if (count < *max) {
+        return 0;
+    }
+    new_max = *max ? *max * 2 : 4;
+    tmp = realloc(*array, new_max * elem_size);
+    if (!tmp) {
+        return -1;
+    }
+    *array = tmp;
+    *max = new_max;
+    return 0;
+}
+
+static key_slot *key_lookup(const nfcconf_index * index, const nfcconf_key * key) {
+    size_t i;
+
+    for (i = key->hash & (index->size - 1); index->slots[i].key; i = (i + 1) & (index->size - 1)) {
+        key_slot *slot = &index->slots[i];
+
+        if (slot->hash == key->hash && key_equal(slot->key, slot->fold, key)) {
+            return slot;
+        }
+    }
+    return &index->slots[i];
+}
+
+static int key_rehash(nfcconf_index * index, size_t size) {
+    key_slot *old = index->slots;
+    size_t old_size = index->size, i;
+
+    index->slots = (key_slot *) calloc(size, sizeof(key_slot));
+    if (!index->slots) {
+        index->slots = old;
+        return -1;
+    }
+    index->size = size;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].key) {
+            nfcconf_key key;
+
+            key.name = old[i].key;
+            key.hash = old[i].hash;
+            key.fold = old[i].fold;
+            *key_lookup(index, &key) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static void name_index_free(name_index * names) {
+    if (!names) {
+        return;
+    }
+    free(names->blocks);
+    free(names->slots);
+    free(names);
+}
+
+void nfcconf_index_free(nfcconf_index * index) {
+    size_t i;
+
+    if (!index) {
+        return;
+    }
+    for (i = 0; i < index->size; i++) {
+        free(index->slots[i].blocks);
+    }
+    free(index->slots);
+    name_index_free(index->names);
+    free(index);
+}
+
+void nfcconf_index_free_list(nfcconf_index * indexes) {
+    nfcconf_index *next;
+
+    for (; indexes; indexes = next) {
+        next = indexes->next;
+        nfcconf_index_free(indexes);
+    }
+}
+
+static int index_add(nfcconf_index * index, nfcconf_item * item) {
+    key_slot *slot;
+    nfcconf_key key;
+
+    if (!item->key || item->type == SCCONF_ITEM_TYPE_COMMENT) {
+        return 0;
+    }
+    if ((index->used + 1) * 4 > index->size * 3 && key_rehash(index, index->size * 2) < 0) {
+        return -1;
+    }
+    key.name = item->key;
+    key.fold = item_fold(item);
+    key.hash = key.fold ? key.fold->hash : hash_key(item->key);
+    slot = key_lookup(index, &key);
+    if (!slot->key) {
+        slot->key = item->key;
+        slot->hash = key.hash;
+        index->used++;
+    }
+    if (!slot->fold) {
+        slot->fold = key.fold;
+    }
+    if (item->type == SCCONF_ITEM_TYPE_VALUE) {
+        if (!slot->value) {
+            slot->value = item;
+        }
+    } else {
+        if (grow((void **) &slot->blocks, &slot->blocks_max, slot->blocks_count, sizeof(nfcconf_item *)) < 0) {
+            return -1;
+        }
+        slot->blocks[slot->blocks_count++] = item;
+    }
+    return 0;
+}
+
+static nfcconf_index *index_build(const nfcconf_block * block) {
+    nfcconf_index *index;
+    nfcconf_item *item;
+    size_t size = 16;
+
+    index = (nfcconf_index *) calloc(1, sizeof(nfcconf_index));
+    if (!index) {
+        return NULL;
+    }
+    index->slots = (key_slot *) calloc(size, sizeof(key_slot));
+    if (!index->slots) {
+        free(index);
+        return NULL;
+    }
+    index->size = size;
+    for (item = block->items; item; item = item->next) {
+        if (index_add(index, item) < 0) {
+            nfcconf_index_free(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+/* Index of a block, NULL if it is too small to need one (or out of memory) */
+static nfcconf_index *index_get(const nfcconf_block * block) {
+    nfcconf_block *b = (nfcconf_block *) block;
+    nfcconf_index *index, *expected = NULL;
+    nfcconf_item *item;
+    size_t count = 0;
+
+    index = __atomic_load_n(&b->index, __ATOMIC_ACQUIRE);
+    if (index) {
+        return index;
+    }
+    for (item = block->items; item && count < INDEX_MIN; item = item->next) {
+        count++;
+    }
+    if (count < INDEX_MIN) {
+        return NULL;
+    }
+    index = index_build(block);
+    if (!index) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&b->index, &expected, index, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* Built by another thread meanwhile */
+        nfcconf_index_free(index);
+        return expected;
+    }
+    if (b->arena) {
+        index->next = __atomic_load_n(&b->arena->indexes, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&b->arena->indexes, &index->next, index, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return index;
+}
+
+void nfcconf_index_add(nfcconf_block * block, nfcconf_item * item) {
+    nfcconf_index *index = block->index;
+
+    if (!index) {
+        return;
+    }
+    if (item->type == SCCONF_ITEM_TYPE_BLOCK && index->names) {
+        name_index_free(index->names);
+        index->names = NULL;
+    }
+    if (index_add(index, item) < 0) {
+        /* Drop it, it will be rebuilt on the next lookup */
+        block->index = NULL;
+        if (!block->arena) {
+            nfcconf_index_free(index);
+        }
+    }
+}
+
+void nfcconf_index_reset(nfcconf_block * block) {
+    nfcconf_index *index = block->index, **link;
+
+    if (!index) {
+        return;
+    }
+    block->index = NULL;
+    if (block->arena) {
+        /* Not while others look up the block */
+        for (link = &block->arena->indexes; *link && *link != index; link = &(*link)->next);
+        if (*link) {
+            *link = index->next;
+        }
+    }
+    nfcconf_index_free(index);
+}
+
+nfcconf_item *nfcconf_index_find_value(const nfcconf_block * block, const nfcconf_key * key) {
+    nfcconf_index *index = index_get(block);
+    nfcconf_item *item;
+
+    if (index) {
+        return key_lookup(index, key)->value;
+    }
+    for (item = block->items; item; item = item->next) {
+        if (item_match(item, SCCONF_ITEM_TYPE_VALUE, key)) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+nfcconf_item *nfcconf_index_find_block(const nfcconf_block * block, const nfcconf_key * key) {
+    nfcconf_index *index = index_get(block);
+    nfcconf_item *item;
+
+    if (index) {
+        key_slot *slot = key_lookup(index, key);
+        return slot->blocks_count ? slot->blocks[0] : NULL;
+    }
+    for (item = block->items; item; item = item->next) {
+        if (item_match(item, SCCONF_ITEM_TYPE_BLOCK, key)) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static name_slot *name_lookup(const name_index * names, const char *key, const char *name, uint32_t hash) {
+    size_t i;
+
+    for (i = hash & (names->size - 1); names->slots[i].key; i = (i + 1) & (names->size - 1)) {
+        name_slot *slot = &names->slots[i];
+        if (slot->hash == hash && strcasecmp(slot->key, key) == 0 && strcasecmp(slot->name, name) == 0) {
+            return slot;
+        }
+    }
+    return &names->slots[i];
+}
+
+static nfcconf_block *named_block(const nfcconf_item * item) {
+    nfcconf_block *b = item->value.block;
+
+    return b && b->name && b->name->data ? b : NULL;
+}
+
+static name_index *name_index_build(const nfcconf_index * index) {
+    name_index *names;
+    name_slot *slot;
+    size_t count = 0, first = 0, i, j;
+
+    for (i = 0; i < index->size; i++) {
+        count += index->slots[i].blocks_count;
+    }
+    names = (name_index *) calloc(1, sizeof(name_index));
+    if (!names) {
+        return NULL;
+    }
+    names->size = 16;
+    while (names->size * 3 < count * 4) {
+        names->size *= 2;
+    }
+    names->slots = (name_slot *) calloc(names->size, sizeof(name_slot));
+    names->blocks = (nfcconf_block **) malloc(sizeof(nfcconf_block *) * (count ? count : 1));
+    if (!names->slots || !names->blocks) {
+        name_index_free(names);
+        return NULL;
+    }
+
+    /* Count the blocks of each pair, share out the array, then fill it */
+    for (i = 0; i < index->size; i++) {
+        const key_slot *ks = &index->slots[i];
+
+        for (j = 0; j < ks->blocks_count; j++) {
+            nfcconf_block *b = named_block(ks->blocks[j]);
+            uint32_t hash;
+
+            if (!b) {
+                continue;
+            }
+            hash = hash_pair(ks->key, b->name->data);
+            slot = name_lookup(names, ks->key, b->name->data, hash);
+            if (!slot->key) {
+                slot->key = ks->key;
+                slot->name = b->name->data;
+                slot->hash = hash;
+                names->used++;
+            }
+            slot->count++;
+        }
+    }
+    for (i = 0; i < names->size; i++) {
+        names->slots[i].first = first;
+        first += names->slots[i].count;
+        names->slots[i].count = 0;
+    }
+    for (i = 0; i < index->size; i++) {
+        const key_slot *ks = &index->slots[i];
+
+        for (j = 0; j < ks->blocks_count; j++) {
+            nfcconf_block *b = named_block(ks->blocks[j]);
+
+            if (!b) {
+                continue;
+            }
+            slot = name_lookup(names, ks->key, b->name->data, hash_pair(ks->key, b->name->data));
+            names->blocks[slot->first + slot->count++] = b;
+        }
+    }
+    return names;
+}
+
+/* Iterators */
+
+static const nfcconf_block *iter_walk(nfcconf_iter * iter) {
+    const nfcconf_item *item;
+    nfcconf_key key;
+
+    key.name = iter->key;
+    key.fold = iter->fold;
+    for (item = iter->item; item; item = item->next) {
+        if (item_match(item, SCCONF_ITEM_TYPE_BLOCK, &key) && item->value.block &&
+                (!iter->name || (named_block(item) && strcasecmp(iter->name, item->value.block->name->data) == 0))) {
+            iter->item = item->next;
+            return item->value.block;
+        }
+    }
+    iter->item = NULL;
+    return NULL;
+}
+
+const nfcconf_block *nfcconf_index_iter_blocks(nfcconf_iter * iter, const nfcconf_block * block, const nfcconf_key * key, const char *name) {
+    nfcconf_index *index = index_get(block);
+
+    memset(iter, 0, sizeof(nfcconf_iter));
+    iter->key = key->name;
+    iter->fold = key->fold;
+    iter->name = name;
+    if (!index) {
+        iter->item = block->items;
+        return iter_walk(iter);
+    }
+    if (name) {
+        name_index *names = __atomic_load_n(&index->names, __ATOMIC_ACQUIRE), *expected = NULL;
+        name_slot *slot;
+
+        if (!names) {
+            names = name_index_build(index);
+            if (!names) {
+                /* Out of memory: the hard way */
+                iter->item = block->items;
+                return iter_walk(iter);
+            }
+            if (!__atomic_compare_exchange_n(&index->names, &expected, names, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                name_index_free(names);
+                names = expected;
+            }
+        }
+        slot = name_lookup(names, key->name, name, hash_pair(key->name, name));
+        iter->blocks = names->blocks + slot->first;
+        iter->left = slot->count;
+    } else {
+        key_slot *slot = key_lookup(index, key);
+
+        iter->items = slot->blocks;
+        iter->left = slot->blocks_count;
+    }
+    return nfcconf_iter_next_block(iter);
+}
+
+const nfcconf_block *nfcconf_iter_blocks(nfcconf_iter * iter, const nfcconf_block * block, const nfcconf_atom * item_name, const char *name) {
+    nfcconf_key key;
+
+    if (!block) {
+        memset(iter, 0, sizeof(nfcconf_iter));
+        return NULL;
+    }
+    nfcconf_key_atom(&key, item_name);
+    return nfcconf_index_iter_blocks(iter, block, &key, name);
+}
+
+const nfcconf_block *nfcconf_iter_next_block(nfcconf_iter * iter) {
+    if (iter->item) {
+        return iter_walk(iter);
+    }
+    while (iter->left > 0) {
+        iter->left--;
+        if (iter->blocks) {
+            return *iter->blocks++;
+        }
+        if ((*iter->items)->value.block) {
+            return (*iter->items++)->value.block;
+        }
+        iter->items++;
+    }
+    return NULL;
+}
+
+const char *nfcconf_iter_list(nfcconf_iter * iter, const nfcconf_block * block, const nfcconf_atom * option) {
+    nfcconf_item *item = NULL;
+    nfcconf_key key;
+
+    memset(iter, 0, sizeof(nfcconf_iter));
+    if (block) {
+        nfcconf_key_atom(&key, option);
+        item = nfcconf_index_find_value(block, &key);
+    }
+    iter->value = item ? item->value.list : NULL;
+    return nfcconf_iter_next_value(iter);
+}
+
+const char *nfcconf_iter_next_value(nfcconf_iter * iter) {
+    const nfcconf_list *value = iter->value;
+
+    if (!value) {
+        return NULL;
+    }
+    iter->value = value->next;
+    return value->data;
+}
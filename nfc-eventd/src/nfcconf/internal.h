@@ -23,6 +23,10 @@
 #ifndef _SCCONF_INTERNAL_H
 #define _SCCONF_INTERNAL_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,8 +36,75 @@ extern "C" {
 #define TOKEN_TYPE_STRING	2
 #define TOKEN_TYPE_PUNCT	3
 
+    struct _nfcconf_arena {
+        struct _nfcconf_arena_chunk *chunks;	/* current one first */
+        size_t allocated;
+        int late;		/* heap nodes added to arena blocks */
+        int written;		/* late when last written, see write.c */
+        nfcconf_index *indexes;	/* of arena blocks, freed with the arena */
+        void *map;		/* image mapping holding the arena, see image.c */
+        size_t map_size;
+        struct _nfcconf_source *sources;	/* context arena: the parsed files */
+        struct _nfcconf_atoms *atoms;	/* of the context, owned by its arena */
+    };
+
+    /* Interned key, see atom.c
+     */
+    struct _nfcconf_atom {
+        uint32_t hash;		/* case folded, see index.c */
+        const nfcconf_atom *fold;	/* lower case spelling, itself if it is */
+        char name[];
+    };
+
+    /* Atom of the key of an item flagged SCCONF_NODE_ATOM */
+#define SCCONF_ATOM(key)	((const nfcconf_atom *) ((key) - offsetof(nfcconf_atom, name)))
+
+    typedef struct _nfcconf_atoms {
+        nfcconf_arena *owner;
+        nfcconf_arena *store;	/* of the atoms */
+        size_t size, used;
+        nfcconf_atom **slots;
+    } nfcconf_atoms;
+
+    /* A key to look up: its atom, if there is one, is compared instead of
+     * the string
+     */
+    typedef struct {
+        const char *name;
+        uint32_t hash;
+        const nfcconf_atom *fold;	/* NULL if it is no atom */
+    } nfcconf_key;
+
+    /* A parsed file, see include.c
+     */
+    typedef struct _nfcconf_source {
+        struct _nfcconf_source *next;	/* included by the same file */
+        struct _nfcconf_source *children;
+        struct _nfcconf_source *parent;
+        char *path;		/* resolved, or the pattern of an include_dir */
+        int dir;
+        /* stamp */
+        dev_t dev;
+        ino_t ino;
+        int64_t mtime_sec, mtime_nsec;
+        uint64_t size;
+        uint64_t hash;
+
+        nfcconf_arena *arena;	/* of its nodes, NULL for the main file */
+        nfcconf_block *block;	/* including block */
+        nfcconf_item *anchor;	/* the directive, followed by the contents */
+        nfcconf_item *first, *last;	/* contents, NULL if empty */
+    } nfcconf_source;
+
     typedef struct _nfcconf_parser {
         nfcconf_context *config;
+        nfcconf_arena *arena;	/* NULL when not parsing: heap nodes */
+        nfcconf_source *source;	/* NULL for strings */
+        nfcconf_atoms *atoms;	/* keys are interned if not NULL */
+
+        nfcconf_list *last_value;	/* of current_item, while parsing it */
+        nfcconf_item **parents;	/* last item of the enclosing blocks */
+        size_t depth, parents_max;
 
         nfcconf_block *block;
         nfcconf_item *last_item, *current_item;
@@ -55,7 +126,73 @@ unsigned int warnings:
     extern int nfcconf_lex_parse(nfcconf_parser * parser, const char *filename);
     extern int nfcconf_lex_parse_string(nfcconf_parser * parser,
                                             const char *config_string);
-    extern void nfcconf_parse_token(nfcconf_parser * parser, int token_type, const char *token);
+    /* The token is not NUL terminated
+     */
+    extern void nfcconf_parse_token(nfcconf_parser * parser, int token_type, const char *token, size_t len);
+
+    /* Block lookup index (index.c)
+     */
+    extern uint32_t nfcconf_index_hash(const char *key, size_t len);
+    extern void nfcconf_key_init(nfcconf_key * key, const char *name);
+    extern nfcconf_item *nfcconf_index_find_value(const nfcconf_block * block, const nfcconf_key * key);
+    extern nfcconf_item *nfcconf_index_find_block(const nfcconf_block * block, const nfcconf_key * key);
+    extern const nfcconf_block *nfcconf_index_iter_blocks(nfcconf_iter * iter, const nfcconf_block * block, const nfcconf_key * key, const char *name);
+    /* To be called for every item added to a block
+     */
+    extern void nfcconf_index_add(nfcconf_block * block, nfcconf_item * item);
+    extern void nfcconf_index_free(nfcconf_index * index);
+    /* Drop the index of a block whose items were replaced
+     */
+    extern void nfcconf_index_reset(nfcconf_block * block);
+    extern void nfcconf_index_free_list(nfcconf_index * indexes);
+
+    /* Context arena (arena.c)
+     */
+    extern nfcconf_arena *nfcconf_arena_new(void);
+    extern int nfcconf_arena_owns(const nfcconf_arena * arena, const void *ptr);
+    extern void *nfcconf_arena_alloc(nfcconf_arena * arena, size_t size);
+    extern char *nfcconf_arena_strdup(nfcconf_arena * arena, const char *string);
+    extern char *nfcconf_arena_strndup(nfcconf_arena * arena, const char *string, size_t len);
+    extern void nfcconf_arena_free(nfcconf_arena * arena);
+
+    /* Interned keys (atom.c)
+     */
+    extern nfcconf_atoms *nfcconf_atoms_new(nfcconf_arena * owner);
+    extern void nfcconf_atoms_free(nfcconf_atoms * atoms);
+    /* Hand the table of an arena over to another one */
+    extern void nfcconf_atoms_move(nfcconf_arena * from, nfcconf_arena * to);
+    /* Returns NULL if out of memory */
+    extern const nfcconf_atom *nfcconf_atoms_intern(nfcconf_atoms * atoms, const char *key, size_t len);
+    extern void nfcconf_key_atom(nfcconf_key * key, const nfcconf_atom * atom);
+
+    /* Configuration images (image.c)
+     * Replaces the tree of the context with the image, if it is valid and
+     * up to date with the source file. Returns 1 = loaded, 0 = not
+     */
+    extern int nfcconf_image_load(nfcconf_context * config, const char *filename, const char *source);
+
+    /* Included files (include.c)
+     */
+    extern nfcconf_source *nfcconf_source_main(nfcconf_context * config);
+    extern void nfcconf_source_stamp(nfcconf_source * source, const struct stat *st, const char *data, size_t size);
+    /* Parse and splice the file(s) of an include directive at the end of
+     * the current block. Returns 0 = ok, -1 = error (in parser->emesg)
+     */
+    extern int nfcconf_source_include(nfcconf_parser * parser, const char *directive, const char *path);
+    /* Last item spliced after an anchor, NULL if it is none of the sources'
+     */
+    extern const nfcconf_item *nfcconf_source_end(const nfcconf_source * source, const nfcconf_item * anchor);
+    /* Whether nodes were added to the arenas of the sources */
+    extern int nfcconf_source_late(const nfcconf_source * source);
+    extern void nfcconf_source_free(nfcconf_source * source);
+
+    /* write(2) of all the data, returns 0 or errno
+     */
+    extern int nfcconf_write_all(int fd, const void *data, size_t len);
+
+    /* nfcconf_list_add() of len bytes of value, in the arena if not NULL
+     */
+    extern nfcconf_list *nfcconf_list_add_internal(nfcconf_arena * arena, nfcconf_list ** list, const char *value, size_t len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Throughput benchmark of the parser (--enable-fuzzing)
+ *
+ * Generates configurations of increasing size and nesting depth, and reports
+ * for each one the nfcconf_parse_string() and nfcconf_write() throughputs
+ * (best of a few runs), the allocations of a parse and the peak RSS. Each
+ * configuration is measured in its own process, so that the peak RSS is its
+ * own. Files are written to $TMPDIR, or /tmp.
+ *
+ * Then, for blocks of increasing item counts, the time of nfcconf_get_int()
+ * and nfcconf_find_blocks() lookups by name, in scattered order. It should
+ * not grow with the size of the block but for cache misses.
+ *
+ *   ./nfcconf-bench [max size in MB]
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "nfcconf.h"
+
+#define RUNS	5
+#define LOOKUPS	(1 << 20)
+
+/*
+ * Allocation counting
+ *
+ * With glibc, malloc() and friends are overridden here and forward to the
+ * libc entry points; elsewhere the counts are not available.
+ */
+#ifdef __GLIBC__
+static unsigned long allocations;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCATIONS()	((long) allocations)
+#else
+#define ALLOCATIONS()	(-1L)
+#endif
+
+typedef struct {
+    char *data;
+    size_t len, size;
+} buffer;
+
+static void put(buffer * b, const char *fmt, ...) __attribute__ ((format(printf, 2, 3)));
+
+static void put(buffer * b, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && b->len + n < b->size) {
+            b->len += n;
+            return;
+        }
+        b->size = b->size * 2 + n;
+        b->data = (char *) realloc(b->data, b->size);
+        if (!b->data) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* An nfc-eventd like configuration of about size bytes, blocks nested depth deep */
+static char *generate(size_t size, int depth) {
+    buffer b = { NULL, 0, 0 };
+    int n, d;
+
+    put(&b, "# generated configuration\nnfc-eventd {\n  nem_path = /usr/lib/nfc-eventd/modules;\n");
+    for (n = 0; b.len < size; n++) {
+        put(&b, "  module nem_execute%d {\n", n);
+        for (d = 0; d < depth; d++) {
+            put(&b, "%*sevent tag_%s%d {\n", 4 + 2 * d, "", d % 2 ? "removed" : "inserted", d);
+            put(&b, "%*saction = \"(echo -n 'Tag %d uid: ' && echo $TAG_UID) >> /tmp/nfc-eventd.log\";\n", 6 + 2 * d, "", n);
+            put(&b, "%*stargets = uid0, uid1, \"uid %d\", %d;\n", 6 + 2 * d, "", d, n);
+        }
+        for (d = depth - 1; d >= 0; d--) {
+            put(&b, "%*s}\n", 4 + 2 * d, "");
+        }
+        put(&b, "  }\n");
+    }
+    put(&b, "}\n");
+    return b.data;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Best time of nfcconf_write(), synced file included */
+static double measure_write(nfcconf_context * config) {
+    const char *dir = getenv("TMPDIR");
+    char filename[4096];
+    double start, best = 0;
+    int i, r;
+
+    snprintf(filename, sizeof(filename), "%s/nfcconf-bench.%d", dir ? dir : "/tmp", (int) getpid());
+    for (i = 0; i < RUNS; i++) {
+        start = now();
+        r = nfcconf_write(config, filename);
+        start = now() - start;
+        if (r) {
+            fprintf(stderr, "%s: %s\n", filename, strerror(r));
+            unlink(filename);
+            return -1;
+        }
+        if (i == 0 || start < best) {
+            best = start;
+        }
+    }
+    unlink(filename);
+    return best;
+}
+
+static int measure(size_t size, int depth) {
+    nfcconf_context *config;
+    struct rusage usage;
+    char *string;
+    double start, best = 0, write;
+    long count = 0;
+    size_t len;
+    int i;
+
+    string = generate(size, depth);
+    len = strlen(string);
+    for (i = 0; i < RUNS; i++) {
+        config = nfcconf_new(NULL);
+        if (!config) {
+            return -1;
+        }
+        count = ALLOCATIONS();
+        start = now();
+        if (nfcconf_parse_string(config, string) <= 0) {
+            fprintf(stderr, "%s\n", config->errmsg);
+            nfcconf_free(config);
+            return -1;
+        }
+        start = now() - start;
+        count = ALLOCATIONS() - count;
+        if (i == 0 || start < best) {
+            best = start;
+        }
+        if (i < RUNS - 1) {
+            nfcconf_free(config);
+        }
+    }
+    write = measure_write(config);
+    nfcconf_free(config);
+    if (write < 0) {
+        return -1;
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%10lu %6d %10.1f %10.1f %12ld %10ld\n", (unsigned long) len, depth, len / best / (1 << 20),
+           len / write / (1 << 20), ALLOCATIONS() < 0 ? -1L : count, usage.ru_maxrss);
+    fflush(stdout);
+    free(string);
+    return 0;
+}
+
+/* A block of count values and count named blocks */
+static char *generate_block(int count) {
+    buffer b = { NULL, 0, 0 };
+    int n;
+
+    put(&b, "lookup {\n");
+    for (n = 0; n < count; n++) {
+        put(&b, "  value%d = %d;\n  module m%d {\n    event = tag_inserted;\n  }\n", n, n, n);
+    }
+    put(&b, "}\n");
+    return b.data;
+}
+
+/* Nanoseconds per lookup by name, in scattered order */
+static double measure_lookup(nfcconf_context * config, const nfcconf_block * block, int count, int blocks) {
+    nfcconf_block **found;
+    char name[32];
+    double start, best = 0;
+    int i, k, r;
+
+    for (r = 0; r < RUNS; r++) {
+        start = now();
+        for (i = 0, k = 0; i < LOOKUPS; i++, k = (k + 7919) % count) {
+            if (blocks) {
+                snprintf(name, sizeof(name), "m%d", k);
+                found = nfcconf_find_blocks(config, block, "module", name);
+                if (!found || !found[0] || found[1]) {
+                    fprintf(stderr, "Block %s not found\n", name);
+                    free(found);
+                    return -1;
+                }
+                free(found);
+            } else {
+                snprintf(name, sizeof(name), "value%d", k);
+                if (nfcconf_get_int(block, name, -1) != k) {
+                    fprintf(stderr, "Wrong value of %s\n", name);
+                    return -1;
+                }
+            }
+        }
+        start = now() - start;
+        if (r == 0 || start < best) {
+            best = start;
+        }
+    }
+    return best / LOOKUPS * 1e9;
+}
+
+static int lookups(void) {
+    nfcconf_context *config;
+    const nfcconf_block *block;
+    char *string;
+    double values, blocks;
+    int count;
+
+    printf("\n%10s %12s %12s\n", "items", "get_int ns", "blocks ns");
+    for (count = 10; count <= 100000; count *= 10) {
+        string = generate_block(count);
+        config = nfcconf_new(NULL);
+        if (!config || nfcconf_parse_string(config, string) <= 0) {
+            fprintf(stderr, "%s\n", config ? config->errmsg : "out of memory");
+            nfcconf_free(config);
+            free(string);
+            return -1;
+        }
+        free(string);
+        block = nfcconf_find_block(config, NULL, "lookup");
+        if (!block) {
+            fprintf(stderr, "%s\n", "Block lookup not found");
+            nfcconf_free(config);
+            return -1;
+        }
+        values = measure_lookup(config, block, count, 0);
+        blocks = values < 0 ? -1 : measure_lookup(config, block, count, 1);
+        nfcconf_free(config);
+        if (blocks < 0) {
+            return -1;
+        }
+        printf("%10d %12.1f %12.1f\n", 2 * count, values, blocks);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const int depths[] = { 1, 4, 16 };
+    size_t size, max = 16;
+    unsigned int i;
+    pid_t pid;
+    int status;
+
+    if (argc > 1) {
+        max = strtoul(argv[1], NULL, 10);
+    }
+    max <<= 20;
+    printf("%10s %6s %10s %10s %12s %10s\n", "bytes", "depth", "parse MB/s", "write MB/s", "allocations", "peak KB");
+    fflush(stdout);
+    for (size = 16 << 10; size <= max; size *= 4) {
+        for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+            pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return EXIT_FAILURE;
+            }
+            if (pid == 0) {
+                _exit(measure(size, depths[i]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+            }
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                fprintf(stderr, "Benchmark of %lu bytes, depth %d failed\n", (unsigned long) size, depths[i]);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return lookups() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Compile a configuration file into the image nfcconf_parse() loads
+ * instead of parsing it (see image.c)
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nfcconf.h"
+
+static void usage(const char *name) {
+    printf("Compile a configuration file into a binary image\n");
+    printf("Usage %s [-o <image>] <config>\n", name);
+    printf("Defaults: image=<config>%s\n", SCCONF_IMAGE_SUFFIX);
+}
+
+int main(int argc, char *argv[]) {
+    const char *source, *output = NULL;
+    char *image = NULL;
+    nfcconf_context *config;
+    int r;
+
+    if (argc == 4 && strcmp(argv[1], "-o") == 0) {
+        output = argv[2];
+        source = argv[3];
+    } else if (argc == 2 && argv[1][0] != '-') {
+        source = argv[1];
+    } else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!output) {
+        image = (char *) malloc(strlen(source) + sizeof(SCCONF_IMAGE_SUFFIX));
+        if (!image) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        strcpy(image, source);
+        strcat(image, SCCONF_IMAGE_SUFFIX);
+        output = image;
+    }
+
+    config = nfcconf_new(source);
+    if (!config) {
+        fprintf(stderr, "Out of memory\n");
+        free(image);
+        return EXIT_FAILURE;
+    }
+    /* An up to date image is loaded rather than parsed: same tree */
+    if (nfcconf_parse(config) <= 0) {
+        fprintf(stderr, "%s\n", config->errmsg);
+        r = EXIT_FAILURE;
+    } else if ((r = nfcconf_image_write(config, NULL, output)) != 0) {
+        fprintf(stderr, "Unable to write \"%s\": %s\n", output, strerror(r));
+        r = EXIT_FAILURE;
+    } else {
+        r = EXIT_SUCCESS;
+    }
+    nfcconf_free(config);
+    free(image);
+    return r;
+}
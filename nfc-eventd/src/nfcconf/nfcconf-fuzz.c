@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Fuzzing harness of the parser (--enable-fuzzing)
+ *
+ * Each input is parsed with nfcconf_parse_string(), then the tree is looked
+ * up, iterated, copied and written, as the daemon and its modules do.
+ *
+ * Built with libFuzzer when the compiler has it:
+ *   ./nfcconf-fuzz corpus ../../conf
+ * Otherwise, the program parses its file arguments, or its standard input,
+ * which suits AFL (configure with CC=afl-clang-fast):
+ *   afl-fuzz -i ../../conf -o findings ./nfcconf-fuzz
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "nfcconf.h"
+
+#define INPUT_MAX	(1 << 20)
+
+static void walk(nfcconf_context * config, const nfcconf_block * block, int depth) {
+    const nfcconf_item *item;
+    nfcconf_block **blocks;
+    nfcconf_iter iter;
+    const nfcconf_block *b;
+    const char *value;
+    int i;
+
+    if (depth > 64) {
+        return;
+    }
+    for (item = block->items; item; item = item->next) {
+        const nfcconf_atom *key;
+
+        if (!item->key) {
+            continue;
+        }
+        /* The lookups must agree with the tree */
+        key = nfcconf_atom_get(config, item->key);
+        if (item->type == SCCONF_ITEM_TYPE_VALUE) {
+            nfcconf_find_list(block, item->key);
+            if (key) {
+                for (value = nfcconf_iter_list(&iter, block, key); value; value = nfcconf_iter_next_value(&iter));
+            }
+            nfcconf_get_int(block, item->key, 0);
+            nfcconf_get_bool(block, item->key, 0);
+        } else if (item->type == SCCONF_ITEM_TYPE_BLOCK) {
+            blocks = nfcconf_find_blocks(config, block, item->key, NULL);
+            b = key ? nfcconf_iter_blocks(&iter, block, key, NULL) : NULL;
+            for (i = 0; blocks && blocks[i]; i++, b = nfcconf_iter_next_block(&iter)) {
+                if (blocks[i] != b) {
+                    abort();
+                }
+            }
+            free(blocks);
+            if (item->value.block) {
+                walk(config, item->value.block, depth + 1);
+            }
+        }
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    nfcconf_context *config;
+    nfcconf_block *copy = NULL;
+    char *string;
+
+    if (size > INPUT_MAX) {
+        return 0;
+    }
+    string = (char *) malloc(size + 1);
+    if (!string) {
+        return 0;
+    }
+    memcpy(string, data, size);
+    string[size] = '\0';
+
+    config = nfcconf_new(NULL);
+    if (config) {
+        if (nfcconf_parse_string(config, string) > 0) {
+            walk(config, config->root, 0);
+            nfcconf_block_copy(config->root, &copy);
+            nfcconf_block_destroy(copy);
+            nfcconf_write(config, "/dev/null");
+        }
+        nfcconf_free(config);
+    }
+    free(string);
+    return 0;
+}
+
+#ifndef NFCCONF_LIBFUZZER
+static int run(FILE * file) {
+    char *data;
+    size_t size;
+
+    data = (char *) malloc(INPUT_MAX);
+    if (!data) {
+        return -1;
+    }
+    size = fread(data, 1, INPUT_MAX, file);
+    LLVMFuzzerTestOneInput((const uint8_t *) data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *file;
+    int i;
+
+    if (argc < 2) {
+        return run(stdin) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    for (i = 1; i < argc; i++) {
+        file = fopen(argv[i], "r");
+        if (!file) {
+            fprintf(stderr, "Unable to open \"%s\"\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        if (run(file) < 0) {
+            fclose(file);
+            return EXIT_FAILURE;
+        }
+        fclose(file);
+    }
+    return EXIT_SUCCESS;
+}
+#endif
@@ -35,6 +35,7 @@
 
 #include <ctype.h>
 #include "nfcconf.h"
+#include "internal.h"
 
 nfcconf_context *nfcconf_new(const char *filename) {
     nfcconf_context *config;
@@ -44,22 +45,40 @@ nfcconf_context *nfcconf_new(const char *filename) {
         return NULL;
     }
     memset(config, 0, sizeof(nfcconf_context));
+    config->arena = nfcconf_arena_new();
+    if (!config->arena) {
+        free(config);
+        return NULL;
+    }
+    config->arena->atoms = nfcconf_atoms_new(config->arena);
+    if (!config->arena->atoms) {
+        nfcconf_arena_free(config->arena);
+        free(config);
+        return NULL;
+    }
     config->filename = filename ? strdup(filename) : NULL;
-    config->root = (nfcconf_block *) malloc(sizeof(nfcconf_block));
+    config->root = (nfcconf_block *) nfcconf_arena_alloc(config->arena, sizeof(nfcconf_block));
     if (!config->root) {
         if (config->filename) {
             free(config->filename);
         }
+        nfcconf_arena_free(config->arena);
         free(config);
         return NULL;
     }
     memset(config->root, 0, sizeof(nfcconf_block));
+    config->root->arena = config->arena;
     return config;
 }
 
 void nfcconf_free(nfcconf_context * config) {
     if (config) {
-        nfcconf_block_destroy(config->root);
+        nfcconf_reload_commit(config);
+        /* Only heap nodes need to be walked */
+        if (config->arena->late || nfcconf_source_late(config->arena->sources)) {
+            nfcconf_block_destroy(config->root);
+        }
+        nfcconf_arena_free(config->arena);
         if (config->filename) {
             free(config->filename);
         }
@@ -69,6 +88,7 @@ void nfcconf_free(nfcconf_context * config) {
 
 const nfcconf_block *nfcconf_find_block(const nfcconf_context * config, const nfcconf_block * block, const char *item_name) {
     nfcconf_item *item;
+    nfcconf_key key;
 
     if (!block) {
         block = config->root;
@@ -76,19 +96,17 @@ const nfcconf_block *nfcconf_find_block(const nfcconf_context * config, const nf
     if (!item_name) {
         return NULL;
     }
-    for (item = block->items; item; item = item->next) {
-        if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-                strcasecmp(item_name, item->key) == 0) {
-            return item->value.block;
-        }
-    }
-    return NULL;
+    nfcconf_key_init(&key, item_name);
+    item = nfcconf_index_find_block(block, &key);
+    return item ? item->value.block : NULL;
 }
 
 nfcconf_block **nfcconf_find_blocks(const nfcconf_context * config, const nfcconf_block * block, const char *item_name, const char *key) {
-    nfcconf_block **blocks = NULL, **tmp;
-    int alloc_size, size;
-    nfcconf_item *item;
+    nfcconf_block **blocks;
+    nfcconf_iter iter;
+    nfcconf_key k;
+    const nfcconf_block *b;
+    int size;
 
     if (!block) {
         block = config->root;
@@ -96,45 +114,46 @@ nfcconf_block **nfcconf_find_blocks(const nfcconf_context * config, const nfccon
     if (!item_name) {
         return NULL;
     }
-    size = 0;
-    alloc_size = 10;
-    blocks = (nfcconf_block **) realloc(blocks, sizeof(nfcconf_block *) * alloc_size);
+    nfcconf_key_init(&k, item_name);
+    b = nfcconf_index_iter_blocks(&iter, block, &k, key);
+    /* At most the matches left in the index, or the items of a small block */
+    size = b ? iter.left + 1 : 0;
+    if (iter.item) {
+        const nfcconf_item *item;
 
-    for (item = block->items; item; item = item->next) {
-        if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-                strcasecmp(item_name, item->key) == 0) {
-            if (key && strcasecmp(key, item->value.block->name->data)) {
-                continue;
-            }
-            if (size + 1 >= alloc_size) {
-                alloc_size *= 2;
-                tmp = (nfcconf_block **) realloc(blocks, sizeof(nfcconf_block *) * alloc_size);
-                if (!tmp) {
-                    free(blocks);
-                    return NULL;
-                }
-                blocks = tmp;
-            }
-            blocks[size++] = item->value.block;
+        for (item = iter.item; item; item = item->next) {
+            size++;
         }
     }
+    blocks = (nfcconf_block **) malloc(sizeof(nfcconf_block *) * (size + 1));
+    if (!blocks) {
+        return NULL;
+    }
+    size = 0;
+    if (b && iter.blocks) {
+        /* Named blocks of an index, contiguous */
+        blocks[size++] = (nfcconf_block *) b;
+        memcpy(blocks + size, iter.blocks, sizeof(nfcconf_block *) * iter.left);
+        size += iter.left;
+        b = NULL;
+    }
+    for (; b; b = nfcconf_iter_next_block(&iter)) {
+        blocks[size++] = (nfcconf_block *) b;
+    }
     blocks[size] = NULL;
     return blocks;
 }
 
 const nfcconf_list *nfcconf_find_list(const nfcconf_block * block, const char *option) {
     nfcconf_item *item;
+    nfcconf_key key;
 
     if (!block) {
         return NULL;
     }
-    for (item = block->items; item; item = item->next) {
-        if (item->type == SCCONF_ITEM_TYPE_VALUE &&
-                strcasecmp(option, item->key) == 0) {
-            return item->value.list;
-        }
-    }
-    return NULL;
+    nfcconf_key_init(&key, option);
+    item = nfcconf_index_find_value(block, &key);
+    return item ? item->value.list : NULL;
 }
 
 const char *nfcconf_get_str(const nfcconf_block * block, const char *option, const char *def) {
@@ -237,14 +256,16 @@ void nfcconf_item_destroy(nfcconf_item * item) {
     nfcconf_item *next;
 
     while (item) {
+        int heap = !(item->flags & SCCONF_NODE_ARENA);
+
         next = item->next;
 
+        /* Arena items may still hold heap nodes */
         switch (item->type) {
         case SCCONF_ITEM_TYPE_COMMENT:
-            if (item->value.comment) {
+            if (heap && item->value.comment) {
                 free(item->value.comment);
             }
-            item->value.comment = NULL;
             break;
         case SCCONF_ITEM_TYPE_BLOCK:
             nfcconf_block_destroy(item->value.block);
@@ -254,11 +275,12 @@ void nfcconf_item_destroy(nfcconf_item * item) {
             break;
         }
 
-        if (item->key) {
-            free(item->key);
+        if (heap) {
+            if (item->key) {
+                free(item->key);
+            }
+            free(item);
         }
-        item->key = NULL;
-        free(item);
         item = next;
     }
 }
@@ -288,19 +310,36 @@ void nfcconf_block_destroy(nfcconf_block * block) {
     if (block) {
         nfcconf_list_destroy(block->name);
         nfcconf_item_destroy(block->items);
-        free(block);
+        /* The arena frees its blocks, and their index */
+        if (!block->arena) {
+            nfcconf_index_free(block->index);
+            free(block);
+        }
     }
 }
 
-nfcconf_list *nfcconf_list_add(nfcconf_list ** list, const char *value) {
+nfcconf_list *nfcconf_list_add_internal(nfcconf_arena * arena, nfcconf_list ** list, const char *value, size_t len) {
     nfcconf_list *rec, **tmp;
 
-    rec = (nfcconf_list *) malloc(sizeof(nfcconf_list));
+    if (arena) {
+        rec = (nfcconf_list *) nfcconf_arena_alloc(arena, sizeof(nfcconf_list));
+    } else {
+        rec = (nfcconf_list *) malloc(sizeof(nfcconf_list));
+    }
     if (!rec) {
         return NULL;
     }
     memset(rec, 0, sizeof(nfcconf_list));
-    rec->data = value ? strdup(value) : NULL;
+    if (arena) {
+        rec->flags = SCCONF_NODE_ARENA;
+        rec->data = value ? nfcconf_arena_strndup(arena, value, len) : NULL;
+    } else if (value) {
+        rec->data = (char *) malloc(len + 1);
+        if (rec->data) {
+            memcpy(rec->data, value, len);
+            rec->data[len] = '\0';
+        }
+    }
 
     if (!*list) {
         *list = rec;
@@ -311,6 +350,10 @@ nfcconf_list *nfcconf_list_add(nfcconf_list ** list, const char *value) {
     return rec;
 }
 
+nfcconf_list *nfcconf_list_add(nfcconf_list ** list, const char *value) {
+    return nfcconf_list_add_internal(NULL, list, value, value ? strlen(value) : 0);
+}
+
 nfcconf_list *nfcconf_list_copy(const nfcconf_list * src, nfcconf_list ** dst) {
     nfcconf_list *next;
 
@@ -327,10 +370,12 @@ void nfcconf_list_destroy(nfcconf_list * list) {
 
     while (list) {
         next = list->next;
-        if (list->data) {
-            free(list->data);
+        if (!(list->flags & SCCONF_NODE_ARENA)) {
+            if (list->data) {
+                free(list->data);
+            }
+            free(list);
         }
-        free(list);
         list = next;
     }
 }
@@ -25,6 +25,8 @@
 #ifndef _SC_CONF_H
 #define _SC_CONF_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -52,12 +54,28 @@ extern "C" {
 #define SCCONF_BOOLEAN		11
 #define SCCONF_INTEGER		12
 #define SCCONF_STRING		13
+#define SCCONF_ENUM		14	/* nfcconf_field only: index among the choices */
 
     typedef struct _nfcconf_block nfcconf_block;
+    typedef struct _nfcconf_arena nfcconf_arena;
+
+    /* Node flags
+     * Nodes created by the parser live in the context arena, with their
+     * strings, and are only released by nfcconf_free(). The others, added
+     * later on, are allocated on the heap.
+     */
+#define SCCONF_NODE_ARENA	0x00000001
+    /* Comment standing for an include directive, followed by the items
+     * of the included file(s)
+     */
+#define SCCONF_NODE_INCLUDE	0x00000002
+    /* The key is interned, see nfcconf_atom_get() */
+#define SCCONF_NODE_ATOM	0x00000004
 
     typedef struct _nfcconf_list {
         struct _nfcconf_list *next;
         char *data;
+        int flags;
     } nfcconf_list;
 
 #define SCCONF_ITEM_TYPE_COMMENT	0	/* key = NULL, comment */
@@ -67,6 +85,7 @@ extern "C" {
     typedef struct _nfcconf_item {
         struct _nfcconf_item *next;
         int type;
+        int flags;
         char *key;
         union {
             char *comment;
@@ -75,10 +94,14 @@ extern "C" {
         } value;
     } nfcconf_item;
 
+    typedef struct _nfcconf_index nfcconf_index;
+
     struct _nfcconf_block {
         nfcconf_block *parent;
         nfcconf_list *name;
         nfcconf_item *items;
+        nfcconf_index *index;	/* lookup cache, see index.c */
+        nfcconf_arena *arena;	/* NULL if allocated on the heap */
     };
 
     typedef struct {
@@ -86,6 +109,8 @@ extern "C" {
         int debug;
         nfcconf_block *root;
         char *errmsg;
+        nfcconf_arena *arena;
+        struct _nfcconf_pending *pending;	/* reload not committed yet */
     } nfcconf_context;
 
     /* Allocate nfcconf_context
@@ -94,6 +119,7 @@ extern "C" {
     extern nfcconf_context *nfcconf_new(const char *filename);
 
     /* Free nfcconf_context
+     * In O(1) unless nodes were added after parsing
      */
     extern void nfcconf_free(nfcconf_context * config);
 
@@ -102,6 +128,26 @@ extern "C" {
      */
     extern int nfcconf_parse(nfcconf_context * config);
 
+    /* Parse again the configuration file
+     * Only the files that changed since they were parsed, the main one or
+     * included ones, are parsed again; the nodes of the others are kept.
+     * On error, the tree is left unchanged.
+     * Returns 1 = ok, 0 = error, -1 = error opening config file
+     */
+    extern int nfcconf_reload(nfcconf_context * config);
+
+    /* Reload in two steps, to check the new tree before dropping the old one
+     * nfcconf_reload_begin() is nfcconf_reload(), but keeps the previous
+     * nodes until nfcconf_reload_commit() releases them, or
+     * nfcconf_reload_rollback() puts them back, with the stamps of their
+     * files: the next reload then parses them again. Nothing is pending
+     * after an error. A reload still pending is committed by the next
+     * nfcconf_reload_begin() and by nfcconf_free().
+     */
+    extern int nfcconf_reload_begin(nfcconf_context * config);
+    extern void nfcconf_reload_commit(nfcconf_context * config);
+    extern void nfcconf_reload_rollback(nfcconf_context * config);
+
     /* Parse a static configuration string
      * Returns 1 = ok, 0 = error
      */
@@ -111,12 +157,90 @@ extern "C" {
      */
     extern int nfcconf_parse_entries(const nfcconf_context * config, const nfcconf_block * block, nfcconf_entry * entry);
 
+    /* Typed configuration
+     * A schema describes a structure filled from the options of a block,
+     * one field per member, ended by a field with a NULL name.
+     * Members are int (SCCONF_BOOLEAN, SCCONF_INTEGER, SCCONF_ENUM),
+     * char * (SCCONF_STRING) or nfcconf_list * (SCCONF_LIST).
+     */
+    typedef struct _nfcconf_field {
+        const char *name;
+        unsigned int type;
+        unsigned int flags;	/* SCCONF_MANDATORY */
+        size_t offset;		/* of the member */
+        const char *def;	/* used if the option is absent, as in a file */
+        int min, max;		/* SCCONF_INTEGER valid range, if min < max */
+        const char *const *choices;	/* SCCONF_ENUM, NULL terminated */
+    } nfcconf_field;
+
+    /* Allocate and fill a structure of size bytes
+     * If the block is NULL, the root block is used
+     * Returns NULL on error: error is then the name of the invalid option,
+     * or NULL if out of memory
+     */
+    extern void *nfcconf_schema_load(const nfcconf_context * config, const nfcconf_block * block, const nfcconf_field * fields, size_t size, const char **error);
+
+    /* Free a structure from nfcconf_schema_load(), with its strings and lists
+     */
+    extern void nfcconf_schema_free(const nfcconf_field * fields, void *data);
+
+    /* Snapshots
+     * The current version of some read-only data, typically a structure from
+     * nfcconf_schema_load(), shared with readers on other threads. Readers
+     * neither lock nor wait; nfcconf_snapshot_publish() replaces the data and
+     * returns once no reader uses the previous one, which it releases.
+     * Publishers must be serialized.
+     */
+    typedef struct _nfcconf_snapshot {
+        void *current;
+        unsigned int epoch;
+        unsigned long readers[2];
+        void (*release) (void *data);
+    } nfcconf_snapshot;
+
+    extern void nfcconf_snapshot_init(nfcconf_snapshot * snapshot, void (*release) (void *data));
+
+    /* Get the current data, valid until nfcconf_snapshot_put() with the
+     * same token
+     */
+    extern const void *nfcconf_snapshot_get(nfcconf_snapshot * snapshot, unsigned int *token);
+    extern void nfcconf_snapshot_put(nfcconf_snapshot * snapshot, unsigned int token);
+
+    extern void nfcconf_snapshot_publish(nfcconf_snapshot * snapshot, void *data);
+
+    /* Release the current data, no reader may be left
+     */
+    extern void nfcconf_snapshot_destroy(nfcconf_snapshot * snapshot);
+
     /* Write config to a file
      * If the filename is NULL, use the config->filename
+     * A regular file is replaced at once, through a temporary file.
+     * Included files are written as their include directive; when writing
+     * to config->filename, those with changes are also written to their
+     * own files.
      * Returns 0 = ok, else = errno
      */
     extern int nfcconf_write(nfcconf_context * config, const char *filename);
 
+    /* Write config to config->filename if it changed since it was parsed
+     * or last written there, and the included files that changed to theirs
+     * Changes such as the nfcconf_put_*() ones are written at once by the
+     * next nfcconf_sync(), not one by one.
+     * Returns 0 = ok, else = errno
+     */
+    extern int nfcconf_sync(nfcconf_context * config);
+
+    /* Write a configuration image of the parsed config
+     * The image is a binary copy of the tree that nfcconf_parse() loads
+     * instead of parsing the source file, as long as the latter is unchanged.
+     * If the source is NULL, use the config->filename
+     * Returns 0 = ok, else = errno
+     */
+    extern int nfcconf_image_write(const nfcconf_context * config, const char *source, const char *filename);
+
+    /* Image of a configuration file, loaded by nfcconf_parse() */
+#define SCCONF_IMAGE_SUFFIX	".cache"
+
     /* Write configuration entries to block
      */
     extern int nfcconf_write_entries(nfcconf_context * config, nfcconf_block * block, nfcconf_entry * entry);
@@ -132,6 +256,49 @@ extern "C" {
      */
     extern nfcconf_block **nfcconf_find_blocks(const nfcconf_context * config, const nfcconf_block * block, const char *item_name, const char *key);
 
+    /* Interned keys
+     * The parser interns the keys of the items, one copy per spelling for
+     * the context: looking up an atom compares pointers rather than strings.
+     */
+    typedef struct _nfcconf_atom nfcconf_atom;
+
+    /* Return the atom of a key, added if needed, valid as long as the context
+     * Not while other threads look up the context
+     * Returns NULL if out of memory
+     */
+    extern const nfcconf_atom *nfcconf_atom_get(nfcconf_context * config, const char *key);
+    extern const char *nfcconf_atom_name(const nfcconf_atom * atom);
+
+    /* Iterators
+     * Cursors over the results of a lookup, which allocate nothing. The block
+     * must not change until the last result.
+     */
+    typedef struct _nfcconf_iter {
+        const nfcconf_item *item;	/* walking the items of the block */
+        nfcconf_item *const *items;	/* or the block items of a key */
+        nfcconf_block *const *blocks;	/* or the blocks of a key and name */
+        size_t left;
+        const char *key;
+        const nfcconf_atom *fold;
+        const char *name;
+        const nfcconf_list *value;
+    } nfcconf_iter;
+
+    /* Return the first block of the block with item_name as key, and name as
+     * first name if not NULL, or NULL if none
+     */
+    extern const nfcconf_block *nfcconf_iter_blocks(nfcconf_iter * iter, const nfcconf_block * block, const nfcconf_atom * item_name, const char *name);
+    /* Return the next block, NULL after the last one
+     */
+    extern const nfcconf_block *nfcconf_iter_next_block(nfcconf_iter * iter);
+
+    /* Return the first value of the option, or NULL if none
+     */
+    extern const char *nfcconf_iter_list(nfcconf_iter * iter, const nfcconf_block * block, const nfcconf_atom * option);
+    /* Return the next value, NULL after the last one
+     */
+    extern const char *nfcconf_iter_next_value(nfcconf_iter * iter);
+
     /* Get a list of values for option
      */
     extern const nfcconf_list *nfcconf_find_list(const nfcconf_block * block, const char *option);
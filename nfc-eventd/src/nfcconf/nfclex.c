@@ -29,160 +29,185 @@
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "nfcconf.h"
 #include "internal.h"
 
+/*
+ * The lexer works on the whole input at once: the file is read into one
+ * buffer and strings are lexed in place. Tokens are
+ * slices of the input, the parser copies what it keeps to the arena.
+ */
+
 typedef struct {
-    char *buf;
-    size_t bufmax;
-    size_t bufcur;
-    int saved_char;
-    const char *saved_string;
-    FILE *fp;
+    const char *cur;
+    const char *end;
 } BUFHAN;
 
-static void buf_init(BUFHAN * bp, FILE * fp, const char *saved_string) {
-    bp->fp = fp;
-    bp->saved_char = 0;
-    bp->buf = (char *) malloc(256);
-    bp->bufmax = 256;
-    bp->bufcur = 0;
-    bp->buf[0] = '\0';
-    bp->saved_string = saved_string;
-}
-
-static void buf_addch(BUFHAN * bp, char ch) {
-    if (bp->bufcur >= bp->bufmax) {
-        bp->bufmax += 256;
-        bp->buf = (char *) realloc(bp->buf, bp->bufmax);
-    }
-#if 0
-    printf("pushback %c\n", ch);
-#endif
-    bp->buf[bp->bufcur++] = ch;
-    bp->buf[bp->bufcur] = '\0';
-}
-
-static int buf_nextch(BUFHAN * bp) {
-    int saved;
-
-    if (bp->saved_char) {
-        saved = bp->saved_char;
-        bp->saved_char = 0;
-        return saved;
-    }
-    if (bp->saved_string) {
-        if (*(bp->saved_string) == '\0')
-            return EOF;
-        saved = (unsigned char) (*(bp->saved_string++));
-        return saved;
-    } else {
-        saved = fgetc(bp->fp);
-        return saved;
-    }
-}
-
-static void buf_finished(BUFHAN * bp) {
-    if (bp->buf) {
-        free(bp->buf);
-        bp->buf = NULL;
-    }
-}
-
-static void buf_eat_till(BUFHAN * bp, char start, const char *end) {
-    int i;
-
-    if (start) {
-        buf_addch(bp, start);
-    }
-    while (1) {
-        i = buf_nextch(bp);
-        if (i == EOF)
-            return;
-        if (strchr(end, i)) {
-            bp->saved_char = i;
-            return;
-        }
-        buf_addch(bp, (char) i);
+/* Characters ending a comment, a quoted string or a word */
+#define END_LINE	0x01
+#define END_QUOTE	0x02
+#define END_WORD	0x04
+
+static const unsigned char end_chars[256] = {
+    ['\0'] = END_LINE | END_QUOTE | END_WORD,
+    ['\n'] = END_LINE | END_QUOTE | END_WORD,
+    ['\r'] = END_LINE | END_QUOTE | END_WORD,
+    ['"'] = END_QUOTE,
+    [' '] = END_WORD,
+    ['\t'] = END_WORD,
+    [','] = END_WORD,
+    [';'] = END_WORD,
+};
+
+/* Length of the token starting at p, up to an end character */
+static size_t buf_span(const BUFHAN * bp, const char *p, int end) {
+    const char *q = p;
+
+    while (q < bp->end && !(end_chars[(unsigned char) *q] & end)) {
+        q++;
     }
-}
-
-static void buf_zero(BUFHAN * bp) {
-    bp->bufcur = 0;
-    bp->buf[0] = '\0';
+    return q - p;
 }
 
 static int nfcconf_lex_engine(nfcconf_parser * parser, BUFHAN * bp) {
-    int this_char;
+    const char *token;
+    size_t len;
 
-    while (1) {
-        switch (this_char = buf_nextch(bp)) {
+    while (bp->cur < bp->end) {
+        token = bp->cur;
+        switch (*token) {
         case '#':
             /* comment till end of line */
-            buf_eat_till(bp, '#', "\r\n");
-            nfcconf_parse_token(parser, TOKEN_TYPE_COMMENT, bp->buf);
-            buf_zero(bp);
-            continue;
+            len = 1 + buf_span(bp, token + 1, END_LINE);
+            nfcconf_parse_token(parser, TOKEN_TYPE_COMMENT, token, len);
+            break;
         case '\n':
-            nfcconf_parse_token(parser, TOKEN_TYPE_NEWLINE, NULL);
-            continue;
+            nfcconf_parse_token(parser, TOKEN_TYPE_NEWLINE, NULL, 0);
+            len = 1;
+            break;
         case ' ':
         case '\t':
         case '\r':
+        case '\0':
             /* eat up whitespace */
-            continue;
+            len = 1;
+            break;
         case ',':
         case '{':
         case '}':
         case '=':
         case ';':
-            buf_addch(bp, (char) this_char);
-            nfcconf_parse_token(parser, TOKEN_TYPE_PUNCT, bp->buf);
-            buf_zero(bp);
-            continue;
+            len = 1;
+            nfcconf_parse_token(parser, TOKEN_TYPE_PUNCT, token, len);
+            break;
         case '"':
-            buf_eat_till(bp, (char) this_char, "\"\r\n");
-            buf_addch(bp, (char) buf_nextch(bp));
-            nfcconf_parse_token(parser, TOKEN_TYPE_STRING, bp->buf);
-            buf_zero(bp);
-            continue;
-        case EOF:
+            /* up to the closing quote, included, or to the end of line */
+            len = 1 + buf_span(bp, token + 1, END_QUOTE);
+            if (token + len < bp->end && token[len] == '"') {
+                len++;
+            }
+            nfcconf_parse_token(parser, TOKEN_TYPE_STRING, token, len);
             break;
         default:
-            buf_eat_till(bp, (char) this_char, ";, \t\r\n");
-            nfcconf_parse_token(parser, TOKEN_TYPE_STRING, bp->buf);
-            buf_zero(bp);
-            continue;
+            len = buf_span(bp, token, END_WORD);
+            nfcconf_parse_token(parser, TOKEN_TYPE_STRING, token, len);
+            break;
         }
-        break;
+        bp->cur += len;
     }
-    buf_finished(bp);
     return 1;
 }
 
+/*
+ * Read a whole file, hint being its expected size (0 if unknown: pipes,
+ * /proc...)
+ *
+ * Files are not lexed from a mapping: one truncated or rewritten in place
+ * while being parsed, as an editor saving it before nfcconf_reload(), would
+ * raise SIGBUS in the lexer. A copy also stays consistent with its stamp.
+ */
+static char *read_all(int fd, size_t hint, size_t * size) {
+    char *buf = NULL, *tmp;
+    size_t max = 0, len = 0;
+    ssize_t n;
+
+    for (;;) {
+        if (len == max) {
+            /* A byte over the expected size, to see the end at once */
+            max = max ? max * 2 : hint ? hint + 1 : 4096;
+            tmp = (char *) realloc(buf, max);
+            if (!tmp) {
+                free(buf);
+                return NULL;
+            }
+            buf = tmp;
+        }
+        n = read(fd, buf + len, max - len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    *size = len;
+    return buf;
+}
+
 int nfcconf_lex_parse(nfcconf_parser * parser, const char *filename) {
-    FILE *fp;
     BUFHAN bhan;
-    int ret;
+    struct stat st;
+    char *buf;
+    size_t size = 0;
+    int fd, ret, saved;
 
-    fp = fopen(filename, "r");
-    if (!fp) {
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         parser->error = 1;
         snprintf(parser->emesg, sizeof(parser->emesg),
                  "File %s can't be opened\n", filename);
         return 0;
     }
-    buf_init(&bhan, fp, (char *) NULL);
+    memset(&st, 0, sizeof(st));
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size;
+    }
+    buf = read_all(fd, size, &size);
+    if (!buf) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        parser->error = 1;
+        snprintf(parser->emesg, sizeof(parser->emesg),
+                 "File %s can't be read\n", filename);
+        return 0;
+    }
+    close(fd);
+
+    bhan.cur = buf;
+    bhan.end = bhan.cur + size;
+    if (parser->source) {
+        /* For nfcconf_reload() */
+        nfcconf_source_stamp(parser->source, &st, bhan.cur, size);
+    }
     ret = nfcconf_lex_engine(parser, &bhan);
-    fclose(fp);
+    free(buf);
     return ret;
 }
 
 int nfcconf_lex_parse_string(nfcconf_parser * parser, const char *string) {
     BUFHAN bhan;
-    int ret;
 
-    buf_init(&bhan, (FILE *) NULL, string);
-    ret = nfcconf_lex_engine(parser, &bhan);
-    return ret;
+    bhan.cur = string;
+    bhan.end = string + strlen(string);
+    return nfcconf_lex_engine(parser, &bhan);
 }
@@ -58,11 +58,11 @@ static void nfcconf_parse_error(nfcconf_parser * parser, const char *error) {
 }
 
 static void nfcconf_parse_error_not_expect(nfcconf_parser * parser,
-        const char *token) {
+        const char *token, size_t len) {
     /* FIXME: save the error somewhere */
     parser->error = 1;
 
-    snprintf(parser->emesg, sizeof(parser->emesg), "Line %d: not expecting '%s'\n", parser->line, token);
+    snprintf(parser->emesg, sizeof(parser->emesg), "Line %d: not expecting '%.*s'\n", parser->line, (int) len, token);
 }
 
 static void nfcconf_parse_warning_expect(nfcconf_parser * parser, const char *token) {
@@ -74,16 +74,28 @@ static void nfcconf_parse_warning_expect(nfcconf_parser * parser, const char *to
              parser->line, token);
 }
 
-static nfcconf_item *nfcconf_item_find(nfcconf_parser * parser, const char *key) {
-    nfcconf_item *item;
+/* Parsed strings go to the arena, the ones added later on to the heap */
+static char *nfcconf_parser_strndup(nfcconf_parser * parser, const char *string, size_t len) {
+    char *copy;
 
-    for (item = parser->block->items; item; item = item->next) {
-        if (item->type == SCCONF_ITEM_TYPE_VALUE &&
-                strcasecmp(item->key, parser->key) == 0) {
-            return item;
-        }
+    if (!string) {
+        return NULL;
+    }
+    if (parser->arena) {
+        return nfcconf_arena_strndup(parser->arena, string, len);
+    }
+    copy = (char *) malloc(len + 1);
+    if (copy) {
+        memcpy(copy, string, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static void nfcconf_parser_free(nfcconf_parser * parser, char *string) {
+    if (!parser->arena && string) {
+        free(string);
     }
-    return item;
 }
 
 static nfcconf_item *nfcconf_item_add_internal(nfcconf_parser * parser, int type) {
@@ -91,22 +103,42 @@ static nfcconf_item *nfcconf_item_add_internal(nfcconf_parser * parser, int type
 
     if (type == SCCONF_ITEM_TYPE_VALUE) {
         /* if item with same key already exists, use it */
-        item = nfcconf_item_find(parser, parser->key);
-        if (item) {
-            if (parser->key) {
-                free(parser->key);
+        item = NULL;
+        if (parser->key) {
+            nfcconf_key key;
+
+            if (parser->atoms) {
+                nfcconf_key_atom(&key, SCCONF_ATOM(parser->key));
+            } else {
+                nfcconf_key_init(&key, parser->key);
             }
+            item = nfcconf_index_find_value(parser->block, &key);
+        }
+        if (item && parser->source && !nfcconf_arena_owns(parser->arena, item)) {
+            /* Defined by an included file, which may be parsed again */
+            item = NULL;
+        }
+        if (item) {
+            nfcconf_parser_free(parser, parser->key);
             parser->key = NULL;
             parser->current_item = item;
             return item;
         }
     }
-    item = (nfcconf_item *) malloc(sizeof(nfcconf_item));
+    if (parser->arena) {
+        item = (nfcconf_item *) nfcconf_arena_alloc(parser->arena, sizeof(nfcconf_item));
+    } else {
+        item = (nfcconf_item *) malloc(sizeof(nfcconf_item));
+    }
     if (!item) {
         return NULL;
     }
     memset(item, 0, sizeof(nfcconf_item));
     item->type = type;
+    item->flags = parser->arena ? SCCONF_NODE_ARENA : 0;
+    if (parser->atoms && parser->key) {
+        item->flags |= SCCONF_NODE_ATOM;
+    }
 
     item->key = parser->key;
     parser->key = NULL;
@@ -116,12 +148,22 @@ static nfcconf_item *nfcconf_item_add_internal(nfcconf_parser * parser, int type
     } else {
         parser->block->items = item;
     }
+    nfcconf_index_add(parser->block, item);
     parser->current_item = parser->last_item = item;
     return item;
 }
 
+/* Arena of the nearest arena block, where the nodes added below are counted */
+static nfcconf_arena *nfcconf_block_arena(const nfcconf_block * block) {
+    while (block && !block->arena) {
+        block = block->parent;
+    }
+    return block ? block->arena : NULL;
+}
+
 nfcconf_item *nfcconf_item_add(nfcconf_context * config, nfcconf_block * block, nfcconf_item * item, int type, const char *key, const void *data) {
     nfcconf_parser parser;
+    nfcconf_arena *arena;
     nfcconf_block *dst = NULL;
 
     if (!config && !block)
@@ -134,6 +176,11 @@ nfcconf_item *nfcconf_item_add(nfcconf_context * config, nfcconf_block * block,
     parser.key = key ? strdup(key) : NULL;
     parser.block = block ? block : config->root;
     parser.name = NULL;
+    arena = nfcconf_block_arena(parser.block);
+    if (arena) {
+        /* nfcconf_free() has to look for heap nodes now */
+        arena->late++;
+    }
     parser.last_item = nfcconf_get_last_item(parser.block);
     parser.current_item = item;
 
@@ -164,16 +211,21 @@ static void nfcconf_block_add_internal(nfcconf_parser * parser) {
 
     item = nfcconf_item_add_internal(parser, SCCONF_ITEM_TYPE_BLOCK);
 
-    block = (nfcconf_block *) malloc(sizeof(nfcconf_block));
+    if (parser->arena) {
+        block = (nfcconf_block *) nfcconf_arena_alloc(parser->arena, sizeof(nfcconf_block));
+    } else {
+        block = (nfcconf_block *) malloc(sizeof(nfcconf_block));
+    }
     if (!block) {
         return;
     }
     memset(block, 0, sizeof(nfcconf_block));
     block->parent = parser->block;
+    block->arena = parser->arena;
     item->value.block = block;
 
     if (!parser->name) {
-        nfcconf_list_add(&parser->name, "");
+        nfcconf_list_add_internal(parser->arena, &parser->name, "", 0);
     }
     block->name = parser->name;
     parser->name = NULL;
@@ -184,11 +236,16 @@ static void nfcconf_block_add_internal(nfcconf_parser * parser) {
 
 nfcconf_block *nfcconf_block_add(nfcconf_context * config, nfcconf_block * block, const char *key, const nfcconf_list *name) {
     nfcconf_parser parser;
+    nfcconf_arena *arena;
 
     memset(&parser, 0, sizeof(nfcconf_parser));
     parser.config = config ? config : NULL;
     parser.key = key ? strdup(key) : NULL;
     parser.block = block ? block : config->root;
+    arena = nfcconf_block_arena(parser.block);
+    if (arena) {
+        arena->late++;
+    }
     nfcconf_list_copy(name, &parser.name);
     parser.last_item = nfcconf_get_last_item(parser.block);
     parser.current_item = parser.block->items;
@@ -197,9 +254,29 @@ nfcconf_block *nfcconf_block_add(nfcconf_context * config, nfcconf_block * block
     return parser.block;
 }
 
+/* Remember the last item of the enclosing block, when entering a block */
+static int nfcconf_parse_push(nfcconf_parser * parser, nfcconf_item * item) {
+    if (parser->depth == parser->parents_max) {
+        size_t max = parser->parents_max ? parser->parents_max * 2 : 16;
+        nfcconf_item **tmp = (nfcconf_item **) realloc(parser->parents, max * sizeof(nfcconf_item *));
+
+        if (!tmp) {
+            return -1;
+        }
+        parser->parents = tmp;
+        parser->parents_max = max;
+    }
+    parser->parents[parser->depth++] = item;
+    return 0;
+}
+
 static void nfcconf_parse_parent(nfcconf_parser * parser) {
     parser->block = parser->block->parent;
 
+    if (parser->depth > 0) {
+        parser->last_item = parser->parents[--parser->depth];
+        return;
+    }
     parser->last_item = parser->block->items;
     if (parser->last_item) {
         while (parser->last_item->next) {
@@ -210,9 +287,7 @@ static void nfcconf_parse_parent(nfcconf_parser * parser) {
 
 static void nfcconf_parse_reset_state(nfcconf_parser * parser) {
     if (parser) {
-        if (parser->key) {
-            free(parser->key);
-        }
+        nfcconf_parser_free(parser, parser->key);
         nfcconf_list_destroy(parser->name);
 
         parser->key = NULL;
@@ -221,9 +296,9 @@ static void nfcconf_parse_reset_state(nfcconf_parser * parser) {
     }
 }
 
-void nfcconf_parse_token(nfcconf_parser * parser, int token_type, const char *token) {
-    nfcconf_item *item;
-    int len;
+void nfcconf_parse_token(nfcconf_parser * parser, int token_type, const char *token, size_t len) {
+    nfcconf_item *item, *current;
+    char *key;
 
     if (parser->error) {
         /* fatal error */
@@ -237,12 +312,20 @@ void nfcconf_parse_token(nfcconf_parser * parser, int token_type, const char *to
         }
         /* fall through - treat empty lines as comments */
     case TOKEN_TYPE_COMMENT:
+        /* A comment inside a statement leaves its key and values alone */
+        key = parser->key;
+        parser->key = NULL;
+        current = parser->current_item;
         item = nfcconf_item_add_internal(parser, SCCONF_ITEM_TYPE_COMMENT);
-        item->value.comment = token ? strdup(token) : NULL;
+        parser->key = key;
+        parser->current_item = current;
+        if (!item) {
+            nfcconf_parse_error(parser, "out of memory");
+            break;
+        }
+        item->value.comment = nfcconf_parser_strndup(parser, token, len);
         break;
-    case TOKEN_TYPE_STRING: {
-        char *stoken = NULL;
-
+    case TOKEN_TYPE_STRING:
         if ((parser->state & (STATE_VALUE | STATE_SET)) ==
                 (STATE_VALUE | STATE_SET)) {
             nfcconf_parse_warning_expect(parser, ";");
@@ -251,59 +334,61 @@ void nfcconf_parse_token(nfcconf_parser * parser, int token_type, const char *to
         if (*token == '"') {
             /* quoted string, remove them */
             token++;
-            len = strlen(token);
+            len--;
             if (len < 1 || token[len - 1] != '"') {
                 nfcconf_parse_warning_expect(parser, "\"");
             } else {
-                /* stoken */
-                stoken = token ? strdup(token) : NULL;
-                if (stoken) {
-                    stoken[len - 1] = '\0';
-                }
+                len--;
             }
         }
-        if (!stoken) {
-            stoken = token ? strdup(token) : NULL;
-        }
         if (parser->state == 0) {
             /* key */
-            parser->key = stoken ? strdup(stoken) : NULL;
+            if (parser->atoms) {
+                const nfcconf_atom *atom = nfcconf_atoms_intern(parser->atoms, token, len);
+
+                if (!atom) {
+                    nfcconf_parse_error(parser, "out of memory");
+                    break;
+                }
+                parser->key = (char *) atom->name;
+            } else {
+                parser->key = nfcconf_parser_strndup(parser, token, len);
+            }
             parser->state = STATE_NAME;
         } else if (parser->state == STATE_NAME) {
             /* name */
             parser->state |= STATE_SET;
-            nfcconf_list_add(&parser->name, stoken);
+            nfcconf_list_add_internal(parser->arena, &parser->name, token, len);
         } else if (parser->state == STATE_VALUE) {
-            /* value */
+            /* value, appended to the last one rather than walking the list */
             parser->state |= STATE_SET;
-            nfcconf_list_add(&parser->current_item->value.list,
-                             stoken);
+            parser->last_value = nfcconf_list_add_internal(parser->arena,
+                                 parser->last_value ? &parser->last_value->next : &parser->current_item->value.list,
+                                 token, len);
         } else {
             /* error */
-            nfcconf_parse_error_not_expect(parser, stoken);
-        }
-        if (stoken) {
-            free(stoken);
+            nfcconf_parse_error_not_expect(parser, token, len);
         }
-        stoken = NULL;
-    }
-    break;
+        break;
     case TOKEN_TYPE_PUNCT:
         switch (*token) {
         case '{':
             if ((parser->state & STATE_NAME) == 0) {
-                nfcconf_parse_error_not_expect(parser, "{");
+                nfcconf_parse_error_not_expect(parser, "{", 1);
                 break;
             }
             nfcconf_block_add_internal(parser);
             nfcconf_parse_reset_state(parser);
+            /* current_item holds the new block */
+            if (nfcconf_parse_push(parser, parser->current_item) < 0) {
+                nfcconf_parse_error(parser, "out of memory");
+            }
             break;
         case '}':
             if (parser->state != 0) {
                 if ((parser->state & STATE_VALUE) == 0 ||
                         (parser->state & STATE_SET) == 0) {
-                    nfcconf_parse_error_not_expect(parser,
-                                                   "}");
+                    nfcconf_parse_error_not_expect(parser, "}", 1);
                     break;
                 }
                 /* foo = bar } */
@@ -320,26 +405,34 @@ void nfcconf_parse_token(nfcconf_parser * parser, int token_type, const char *to
             break;
         case ',':
             if ((parser->state & (STATE_NAME | STATE_VALUE)) == 0) {
-                nfcconf_parse_error_not_expect(parser, ",");
+                nfcconf_parse_error_not_expect(parser, ",", 1);
             }
             parser->state &= ~STATE_SET;
             break;
         case '=':
             if ((parser->state & STATE_NAME) == 0) {
-                nfcconf_parse_error_not_expect(parser, "=");
+                nfcconf_parse_error_not_expect(parser, "=", 1);
                 break;
             }
             nfcconf_item_add_internal(parser, SCCONF_ITEM_TYPE_VALUE);
+            parser->last_value = NULL;
             parser->state = STATE_VALUE;
             break;
         case ';':
 #if 0
             if ((parser->state & STATE_VALUE) == 0 ||
                     (parser->state & STATE_SET) == 0) {
-                nfcconf_parse_error_not_expect(parser, ";");
+                nfcconf_parse_error_not_expect(parser, ";", 1);
                 break;
             }
 #endif
+            if (parser->state == (STATE_NAME | STATE_SET) && !parser->name->next &&
+                    (strcmp(parser->key, "include") == 0 || strcmp(parser->key, "include_dir") == 0)) {
+                /* include "path"; */
+                if (nfcconf_source_include(parser, parser->key, parser->name->data) < 0) {
+                    parser->error = 1;
+                }
+            }
             nfcconf_parse_reset_state(parser);
             break;
         default:
@@ -358,8 +451,30 @@ int nfcconf_parse(nfcconf_context * config) {
     nfcconf_parser p;
     int r = 1;
 
+    if (config->filename && !config->root->items && !config->arena->late) {
+        /* Up to date image of the file, from nfcconf-compile */
+        char *image = (char *) malloc(strlen(config->filename) + sizeof(SCCONF_IMAGE_SUFFIX));
+
+        if (image) {
+            strcpy(image, config->filename);
+            strcat(image, SCCONF_IMAGE_SUFFIX);
+            r = nfcconf_image_load(config, image, config->filename);
+            free(image);
+            if (r) {
+                return 1;
+            }
+        }
+    }
+
+    if (config->filename && !config->arena->sources) {
+        config->arena->sources = nfcconf_source_main(config);
+    }
+
     memset(&p, 0, sizeof(p));
     p.config = config;
+    p.arena = config->arena;
+    p.source = config->arena->sources;
+    p.atoms = config->arena->atoms;
     p.block = config->root;
     p.line = 1;
 
@@ -374,6 +489,7 @@ int nfcconf_parse(nfcconf_context * config) {
     } else {
         r = 1;
     }
+    free(p.parents);
 
     if (r <= 0)
         config->errmsg = buffer;
@@ -387,6 +503,8 @@ int nfcconf_parse_string(nfcconf_context * config, const char *string) {
 
     memset(&p, 0, sizeof(p));
     p.config = config;
+    p.arena = config->arena;
+    p.atoms = config->arena->atoms;
     p.block = config->root;
     p.line = 1;
 
@@ -400,6 +518,7 @@ int nfcconf_parse_string(nfcconf_context * config, const char *string) {
     } else {
         r = 1;
     }
+    free(p.parents);
 
     if (r <= 0)
         config->errmsg = buffer;
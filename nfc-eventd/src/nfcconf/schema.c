@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2009
+ *  Romuald Conty <romuald@libnfc.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include "nfcconf.h"
+
+/*
+ * Typed configuration
+ *
+ * A schema maps the options of a block onto the members of a structure,
+ * filled once by nfcconf_parse_entries() and checked: afterwards, reading
+ * an option is reading a member. The structure owns its strings and lists,
+ * so it outlives the context it was loaded from.
+ *
+ * Snapshots publish such structures to readers running on other threads,
+ * RCU style: readers take no lock and never wait, the publisher waits for
+ * the readers of the previous structure to be done before releasing it.
+ */
+
+#define MEMBER(data, field, type)	((type *) ((char *) (data) + (field)->offset))
+
+static int field_count(const nfcconf_field * fields) {
+    int n = 0;
+
+    while (fields[n].name) {
+        n++;
+    }
+    return n;
+}
+
+static int enum_lookup(const nfcconf_field * field, const char *value) {
+    int i;
+
+    for (i = 0; field->choices[i]; i++) {
+        if (strcmp(field->choices[i], value) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Default value of an absent option, written as in a file */
+static int set_default(const nfcconf_field * field, void *data) {
+    const char *def = field->def;
+
+    switch (field->type) {
+    case SCCONF_BOOLEAN:
+        *MEMBER(data, field, int) = def && (toupper((int) *def) == 'T' || toupper((int) *def) == 'Y');
+        break;
+    case SCCONF_INTEGER:
+        *MEMBER(data, field, int) = def ? atoi(def) : 0;
+        break;
+    case SCCONF_STRING:
+        if (def && !(*MEMBER(data, field, char *) = strdup(def))) {
+            return -1;
+        }
+        break;
+    case SCCONF_LIST:
+        if (def && !nfcconf_list_add(MEMBER(data, field, nfcconf_list *), def)) {
+            return -1;
+        }
+        break;
+    case SCCONF_ENUM:
+        *MEMBER(data, field, int) = def ? enum_lookup(field, def) : 0;
+        break;
+    }
+    return 0;
+}
+
+void *nfcconf_schema_load(const nfcconf_context * config, const nfcconf_block * block, const nfcconf_field * fields, size_t size, const char **error) {
+    int n = field_count(fields), i, r, oom = 0;
+    nfcconf_entry *entries;
+    char **values;
+    void *data;
+
+    *error = NULL;
+    if (!block) {
+        block = config->root;
+    }
+    data = calloc(1, size);
+    entries = (nfcconf_entry *) calloc(n + 1, sizeof(nfcconf_entry));
+    values = (char **) calloc(n + 1, sizeof(char *));
+    if (!data || !entries || !values) {
+        free(data);
+        free(entries);
+        free(values);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        const nfcconf_field *field = &fields[i];
+
+        entries[i].name = field->name;
+        entries[i].type = field->type == SCCONF_ENUM ? SCCONF_STRING : field->type;
+        entries[i].flags = field->flags & SCCONF_MANDATORY;
+        switch (field->type) {
+        case SCCONF_STRING:
+        case SCCONF_LIST:
+            entries[i].flags |= SCCONF_ALLOC;
+            entries[i].parm = MEMBER(data, field, void);
+            break;
+        case SCCONF_ENUM:
+            /* Looked up among the choices afterwards */
+            entries[i].flags |= SCCONF_ALLOC;
+            entries[i].parm = &values[i];
+            break;
+        default:
+            entries[i].parm = MEMBER(data, field, void);
+        }
+    }
+
+    r = nfcconf_parse_entries(config, block, entries);
+    for (i = 0; i < n && !*error; i++) {
+        const nfcconf_field *field = &fields[i];
+
+        if (!(entries[i].flags & SCCONF_PRESENT)) {
+            if (r != 0 && ((field->flags & SCCONF_MANDATORY) || nfcconf_find_list(block, field->name))) {
+                /* Where nfcconf_parse_entries() stopped */
+                *error = field->name;
+            } else if (set_default(field, data) < 0) {
+                oom = 1;
+                break;
+            }
+        } else if (field->type == SCCONF_INTEGER && field->min < field->max) {
+            int value = *MEMBER(data, field, int);
+
+            if (value < field->min || value > field->max) {
+                *error = field->name;
+            }
+        } else if (field->type == SCCONF_ENUM) {
+            if ((*MEMBER(data, field, int) = enum_lookup(field, values[i])) < 0) {
+                *error = field->name;
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        free(values[i]);
+    }
+    free(values);
+    free(entries);
+    if (oom || r != 0 || *error) {
+        nfcconf_schema_free(fields, data);
+        return NULL;
+    }
+    return data;
+}
+
+void nfcconf_schema_free(const nfcconf_field * fields, void *data) {
+    const nfcconf_field *field;
+
+    if (!data) {
+        return;
+    }
+    for (field = fields; field->name; field++) {
+        if (field->type == SCCONF_STRING) {
+            free(*MEMBER(data, field, char *));
+        } else if (field->type == SCCONF_LIST) {
+            nfcconf_list_destroy(*MEMBER(data, field, nfcconf_list *));
+        }
+    }
+    free(data);
+}
+
+/* Snapshots
+ *
+ * Readers count themselves in one of two counters, picked by the parity of
+ * the epoch. Once the new structure is published, the publisher flips the
+ * epoch and waits for the counter of the previous parity to drain, twice:
+ * a reader that picked its counter before the first flip, but registered
+ * after the first wait, is waited for by the second one.
+ */
+
+void nfcconf_snapshot_init(nfcconf_snapshot * snapshot, void (*release) (void *data)) {
+    memset(snapshot, 0, sizeof(nfcconf_snapshot));
+    snapshot->release = release;
+}
+
+const void *nfcconf_snapshot_get(nfcconf_snapshot * snapshot, unsigned int *token) {
+    *token = __atomic_load_n(&snapshot->epoch, __ATOMIC_RELAXED) & 1;
+    __atomic_add_fetch(&snapshot->readers[*token], 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&snapshot->current, __ATOMIC_SEQ_CST);
+}
+
+void nfcconf_snapshot_put(nfcconf_snapshot * snapshot, unsigned int token) {
+    __atomic_sub_fetch(&snapshot->readers[token], 1, __ATOMIC_RELEASE);
+}
+
+void nfcconf_snapshot_publish(nfcconf_snapshot * snapshot, void *data) {
+    void *old = __atomic_exchange_n(&snapshot->current, data, __ATOMIC_SEQ_CST);
+    int phase;
+
+    if (!old) {
+        return;
+    }
+    for (phase = 0; phase < 2; phase++) {
+        unsigned int parity = __atomic_fetch_add(&snapshot->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+        while (__atomic_load_n(&snapshot->readers[parity], __ATOMIC_ACQUIRE) != 0) {
+            sched_yield();
+        }
+    }
+    if (snapshot->release) {
+        snapshot->release(old);
+    }
+}
+
+void nfcconf_snapshot_destroy(nfcconf_snapshot * snapshot) {
+    nfcconf_snapshot_publish(snapshot, NULL);
+}
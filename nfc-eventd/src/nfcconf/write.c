@@ -29,36 +29,104 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "nfcconf.h"
+#include "internal.h"
 
 #define INDENT_CHAR	'\t'
 #define INDENT_LEVEL	1
 
+/* Output buffered before each write(2) */
+#define WRITE_BUFFER	65536
+
+/*
+ * The tree is streamed through one buffer into a temporary file, which is
+ * synced and then renamed over the original, and the directory is synced in
+ * turn so that the rename itself survives: a crash leaves either the old or
+ * the new file, not a truncated one. Other targets (devices, pipes) are
+ * written in place. Included files are written the same way, each to its
+ * own file.
+ */
+
 typedef struct {
-    FILE *f;
+    int fd;
+    char *buf;
+    size_t len;
 
     int indent_char;
     int indent_pos;
     int indent_level;
 
     int error;
+    const nfcconf_source *sources;
 } nfcconf_writer;
 
-static void write_line(nfcconf_writer * writer, const char *data) {
-    int i;
+int nfcconf_write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
 
-    if (writer->error) {
-        return;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        p += n;
+        len -= n;
     }
-    if (!((data) == NULL || (data)[0] == '\0')) {
-        for (i = 0; i < writer->indent_pos; i++) {
-            fputc(writer->indent_char, writer->f);
+    return 0;
+}
+
+static void writer_flush(nfcconf_writer * writer) {
+    if (!writer->error && writer->len > 0) {
+        writer->error = nfcconf_write_all(writer->fd, writer->buf, writer->len);
+    }
+    writer->len = 0;
+}
+
+static void writer_put(nfcconf_writer * writer, const char *data, size_t len) {
+    if (writer->len + len > WRITE_BUFFER) {
+        writer_flush(writer);
+        if (len > WRITE_BUFFER) {
+            if (!writer->error) {
+                writer->error = nfcconf_write_all(writer->fd, data, len);
+            }
+            return;
         }
-        fputs(data, writer->f);
     }
-    if (fputc('\n', writer->f) == EOF) {
-        writer->error = errno;
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+static void writer_putc(nfcconf_writer * writer, int c) {
+    if (writer->len == WRITE_BUFFER) {
+        writer_flush(writer);
     }
+    writer->buf[writer->len++] = (char) c;
+}
+
+static void writer_puts(nfcconf_writer * writer, const char *data) {
+    writer_put(writer, data, strlen(data));
+}
+
+static void write_indent(nfcconf_writer * writer) {
+    int i;
+
+    for (i = 0; i < writer->indent_pos; i++) {
+        writer_putc(writer, writer->indent_char);
+    }
+}
+
+static void write_line(nfcconf_writer * writer, const char *data) {
+    if (!((data) == NULL || (data)[0] == '\0')) {
+        write_indent(writer);
+        writer_puts(writer, data);
+    }
+    writer_putc(writer, '\n');
 }
 
 static int string_need_quotes(const char *str) {
@@ -73,60 +141,44 @@ static int string_need_quotes(const char *str) {
     return 0;
 }
 
-static char *nfcconf_list_get_string(nfcconf_list * list) {
-    char *buffer = NULL, *tmp;
-    int datalen, len, alloc_len, quote;
-
-    if (!list) {
-        return strdup("");
-    }
-    len = 0;
-    alloc_len = 1024;
-    buffer = (char *) realloc(buffer, alloc_len);
-    if (!buffer) {
-        return strdup("");
-    }
-    memset(buffer, 0, alloc_len);
-    while (list) {
-        datalen = strlen(list->data);
-        if (len + datalen + 4 > alloc_len) {
-            alloc_len += datalen + 2;
-            tmp = (char *) realloc(buffer, alloc_len);
-            if (!tmp) {
-                free(buffer);
-                return strdup("");
-            }
-            buffer = tmp;
-        }
-        if (len != 0) {
-            memcpy(buffer + len, ", ", 2);
-            len += 2;
-        }
+static void write_list(nfcconf_writer * writer, const nfcconf_list * list) {
+    int quote;
+
+    for (; list; list = list->next) {
         quote = string_need_quotes(list->data);
         if (quote) {
-            buffer[len++] = '"';
+            writer_putc(writer, '"');
         }
-        memcpy(buffer + len, list->data, datalen);
-        len += datalen;
+        writer_puts(writer, list->data);
         if (quote) {
-            buffer[len++] = '"';
+            writer_putc(writer, '"');
+        }
+        if (list->next) {
+            writer_put(writer, ", ", 2);
         }
-        list = list->next;
     }
-    buffer[len] = '\0';
-    return buffer;
 }
 
-static void nfcconf_write_items(nfcconf_writer * writer, const nfcconf_block * block) {
+static void nfcconf_write_items(nfcconf_writer * writer, const nfcconf_block * block);
+
+/* Write the items from first up to last, or to the end if last is NULL */
+static void nfcconf_write_range(nfcconf_writer * writer, const nfcconf_item * first, const nfcconf_item * last) {
     nfcconf_block *subblock;
-    nfcconf_item *item;
-    char *data = NULL, *name = NULL;
-    size_t datalen;
+    const nfcconf_item *item, *end;
 
-    for (item = block->items; item; item = item->next) {
+    for (item = first; item; item = item->next) {
         switch (item->type) {
         case SCCONF_ITEM_TYPE_COMMENT:
-            write_line(writer, item->value.comment);
+            end = (item->flags & SCCONF_NODE_INCLUDE) ? nfcconf_source_end(writer->sources, item) : NULL;
+            if (!end) {
+                write_line(writer, item->value.comment);
+                break;
+            }
+            /* The directive rather than the included items */
+            write_indent(writer);
+            writer_puts(writer, item->value.comment + 1);
+            writer_put(writer, ";\n", 2);
+            item = end;
             break;
         case SCCONF_ITEM_TYPE_BLOCK:
             subblock = item->value.block;
@@ -137,17 +189,11 @@ static void nfcconf_write_items(nfcconf_writer * writer, const nfcconf_block * b
             }
 
             /* header */
-            name = nfcconf_list_get_string(subblock->name);
-            datalen = strlen(item->key) + strlen(name) + 6;
-            data = (char *) malloc(datalen);
-            if (!data) {
-                free(name);
-                continue;
-            }
-            snprintf(data, datalen, "%s %s {", item->key, name);
-            write_line(writer, data);
-            free(data);
-            free(name);
+            write_indent(writer);
+            writer_puts(writer, item->key);
+            writer_putc(writer, ' ');
+            write_list(writer, subblock->name);
+            writer_put(writer, " {\n", 3);
 
             /* items */
             writer->indent_pos += writer->indent_level;
@@ -158,37 +204,186 @@ static void nfcconf_write_items(nfcconf_writer * writer, const nfcconf_block * b
             write_line(writer, "}");
             break;
         case SCCONF_ITEM_TYPE_VALUE:
-            name = nfcconf_list_get_string(item->value.list);
-            datalen = strlen(item->key) + strlen(name) + 6;
-            data = (char *) malloc(datalen);
-            if (!data) {
-                free(name);
-                continue;
-            }
-            snprintf(data, datalen, "%s = %s;", item->key, name);
-            write_line(writer, data);
-            free(data);
-            free(name);
+            write_indent(writer);
+            writer_puts(writer, item->key);
+            writer_put(writer, " = ", 3);
+            write_list(writer, item->value.list);
+            writer_put(writer, ";\n", 2);
+            break;
+        }
+        if (item == last) {
             break;
         }
     }
 }
 
-int nfcconf_write(nfcconf_context * config, const char *filename) {
-    nfcconf_writer writer;
+static void nfcconf_write_items(nfcconf_writer * writer, const nfcconf_block * block) {
+    nfcconf_write_range(writer, block->items, NULL);
+}
 
-    if (!filename) {
-        filename = config->filename;
+/* Sync the directory that holds path, so that an entry renamed there is on disk */
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    int fd, r = 0;
+
+    if (!slash) {
+        dir = strdup(".");
+    } else {
+        /* "/name" lives in "/" */
+        dir = strndup(path, slash == path ? 1 : (size_t) (slash - path));
+    }
+    if (!dir) {
+        return ENOMEM;
     }
-    writer.f = fopen(filename, "w");
-    if (!writer.f) {
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) {
         return errno;
     }
+    if (fsync(fd) < 0) {
+        r = errno;
+    }
+    if (close(fd) < 0 && !r) {
+        r = errno;
+    }
+    return r;
+}
+
+/* Write the items from first up to last (to the end if NULL) to filename */
+static int write_file(const char *filename, const nfcconf_source * sources, const nfcconf_item * first,
+                      const nfcconf_item * last) {
+    nfcconf_writer writer;
+    struct stat st;
+    char *path, *tmpname = NULL;
+    int exists, r;
+
+    memset(&writer, 0, sizeof(writer));
+    writer.buf = (char *) malloc(WRITE_BUFFER);
+    if (!writer.buf) {
+        return ENOMEM;
+    }
+    if (lstat(filename, &st) == 0 && S_ISLNK(st.st_mode)) {
+        /* Replace the target, not the link */
+        path = realpath(filename, NULL);
+        if (!path) {
+            free(writer.buf);
+            return errno;
+        }
+    } else {
+        path = strdup(filename);
+        if (!path) {
+            free(writer.buf);
+            return ENOMEM;
+        }
+    }
+    exists = stat(path, &st) == 0;
+
+    if (exists && !S_ISREG(st.st_mode)) {
+        writer.fd = open(path, O_WRONLY | O_TRUNC);
+    } else {
+        /* Into a temporary file, renamed once complete */
+        tmpname = (char *) malloc(strlen(path) + 8);
+        if (!tmpname) {
+            free(path);
+            free(writer.buf);
+            return ENOMEM;
+        }
+        sprintf(tmpname, "%s.XXXXXX", path);
+        writer.fd = mkstemp(tmpname);
+        if (writer.fd >= 0 && fchmod(writer.fd, exists ? st.st_mode & 07777 : 0644) < 0) {
+            writer.error = errno;
+        }
+        if (writer.fd >= 0 && exists && (st.st_uid != geteuid() || st.st_gid != getegid())) {
+            /* Keep the owner if allowed to, as writing in place did */
+            if (fchown(writer.fd, st.st_uid, st.st_gid) < 0 && errno != EPERM) {
+                writer.error = errno;
+            }
+        }
+    }
+    if (writer.fd < 0) {
+        r = errno;
+        free(tmpname);
+        free(path);
+        free(writer.buf);
+        return r;
+    }
     writer.indent_char = INDENT_CHAR;
     writer.indent_pos = 0;
     writer.indent_level = INDENT_LEVEL;
-    writer.error = 0;
-    nfcconf_write_items(&writer, config->root);
-    fclose(writer.f);
-    return writer.error;
+    writer.sources = sources;
+    nfcconf_write_range(&writer, first, last);
+    writer_flush(&writer);
+    r = writer.error;
+
+    if (tmpname) {
+        if (!r && fsync(writer.fd) < 0) {
+            r = errno;
+        }
+    }
+    if (close(writer.fd) < 0 && !r) {
+        r = errno;
+    }
+    if (tmpname) {
+        if (!r && rename(tmpname, path) < 0) {
+            r = errno;
+        }
+        if (r) {
+            unlink(tmpname);
+        } else {
+            /* The new file is in place, the error only says it may not be on disk yet */
+            r = sync_dir(path);
+        }
+        free(tmpname);
+    }
+    free(path);
+    free(writer.buf);
+    return r;
+}
+
+/*
+ * Write the included files that nodes were added to since they were parsed
+ * or last written, each to its own file: the including file only has the
+ * directive. Returns the first error, the files written are marked so.
+ */
+static int sources_write(const nfcconf_source * all, nfcconf_source * source) {
+    int r = 0, e;
+
+    for (; source; source = source->next) {
+        if (!source->dir && source->arena && source->arena->late != source->arena->written) {
+            e = write_file(source->path, all, source->first, source->last);
+            if (!e) {
+                source->arena->written = source->arena->late;
+            } else if (!r) {
+                r = e;
+            }
+        }
+        e = sources_write(all, source->children);
+        if (!r) {
+            r = e;
+        }
+    }
+    return r;
+}
+
+int nfcconf_write(nfcconf_context * config, const char *filename) {
+    const char *path = filename ? filename : config->filename;
+    int r;
+
+    if (!path) {
+        return EINVAL;
+    }
+    r = write_file(path, config->arena->sources, config->root->items, NULL);
+    if (!r && (!filename || (config->filename && strcmp(filename, config->filename) == 0))) {
+        config->arena->written = config->arena->late;
+        r = sources_write(config->arena->sources, config->arena->sources);
+    }
+    return r;
+}
+
+int nfcconf_sync(nfcconf_context * config) {
+    if (config->arena->late != config->arena->written) {
+        return nfcconf_write(config, NULL);
+    }
+    return sources_write(config->arena->sources, config->arena->sources);
 }
@@ -0,0 +1,178 @@
+/*
+ * NFC Event Daemon
+ * Event rate limiting
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+#define UID_BUCKETS     4096        /* powers of two */
+#define READER_BUCKETS  64
+#define PROBES          8
+#define KEY_MAX         10          /* ISO14443A triple size UID */
+#define TOKEN           60000       /* units per token: rate units per ms */
+
+typedef struct {
+    uint8_t key[KEY_MAX];
+    uint8_t len;                    /* 0 for a free bucket */
+    uint64_t units;
+    uint64_t last_ms;
+} bucket;
+
+struct ned_ratelimit {
+    ned_rate uid;
+    ned_rate reader;
+    bucket *uids;
+    bucket readers[READER_BUCKETS];
+    ned_ratelimit_stats stats;
+};
+
+static uint32_t
+key_hash(const uint8_t *key, size_t len)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Find the bucket of a key, or the one to recycle for it
+ */
+static bucket *
+bucket_lookup(ned_ratelimit *limiter, bucket *table, size_t size, const uint8_t *key, size_t len,
+              const ned_rate *rate, uint64_t now_ms)
+{
+    uint32_t h = key_hash(key, len);
+    bucket *victim = NULL;
+
+    for (unsigned int i = 0; i < PROBES; i++) {
+        bucket *b = &table[(h + i) & (size - 1)];
+        if (b->len == len && memcmp(b->key, key, len) == 0)
+            return b;
+        if (b->len == 0) {
+            if (!victim || victim->len != 0)
+                victim = b;
+        } else if (!victim || (victim->len != 0 && b->last_ms < victim->last_ms)) {
+            victim = b;
+        }
+    }
+    if (victim->len != 0)
+        limiter->stats.evictions++;
+    memcpy(victim->key, key, len);
+    victim->len = len;
+    victim->units = (uint64_t) (rate->burst ? rate->burst : 1) * TOKEN;
+    victim->last_ms = now_ms;
+    return victim;
+}
+
+/**
+ * @brief Refill a bucket from the time elapsed since it was last looked at
+ * @return true if it holds a token
+ */
+static bool
+bucket_refill(bucket *b, const ned_rate *rate, uint64_t now_ms)
+{
+    uint64_t capacity = (uint64_t) (rate->burst ? rate->burst : 1) * TOKEN;
+
+    if (now_ms > b->last_ms) {
+        b->units += (now_ms - b->last_ms) * rate->rate;
+        if (b->units > capacity)
+            b->units = capacity;
+    }
+    b->last_ms = now_ms;
+    return b->units >= TOKEN;
+}
+
+ned_ratelimit *
+ned_ratelimit_new(const ned_rate *uid, const ned_rate *reader)
+{
+    ned_ratelimit *limiter;
+
+    if (uid->rate == 0 && reader->rate == 0)
+        return NULL;
+    limiter = calloc(1, sizeof(ned_ratelimit));
+    if (!limiter)
+        return NULL;
+    limiter->uids = calloc(UID_BUCKETS, sizeof(bucket));
+    if (!limiter->uids) {
+        free(limiter);
+        return NULL;
+    }
+    limiter->uid = *uid;
+    limiter->reader = *reader;
+    return limiter;
+}
+
+void
+ned_ratelimit_free(ned_ratelimit *limiter)
+{
+    if (!limiter)
+        return;
+    free(limiter->uids);
+    free(limiter);
+}
+
+ned_rate_verdict
+ned_ratelimit_check(ned_ratelimit *limiter, unsigned int reader_id,
+                    const uint8_t *uid, size_t uid_len, uint64_t now_ms)
+{
+    uint8_t key[KEY_MAX];
+    bucket *by_uid = NULL, *by_reader = NULL;
+
+    if (limiter->reader.rate) {
+        memcpy(key, &reader_id, sizeof(reader_id));
+        by_reader = bucket_lookup(limiter, limiter->readers, READER_BUCKETS, key, sizeof(reader_id),
+                                  &limiter->reader, now_ms);
+        if (!bucket_refill(by_reader, &limiter->reader, now_ms)) {
+            limiter->stats.reader_rejected++;
+            return NED_RATE_READER;
+        }
+    }
+    if (limiter->uid.rate && uid && uid_len) {
+        if (uid_len > KEY_MAX)
+            uid_len = KEY_MAX;
+        by_uid = bucket_lookup(limiter, limiter->uids, UID_BUCKETS, uid, uid_len, &limiter->uid, now_ms);
+        if (!bucket_refill(by_uid, &limiter->uid, now_ms)) {
+            limiter->stats.uid_rejected++;
+            return NED_RATE_UID;
+        }
+    }
+    /* Only take tokens once both buckets agreed */
+    if (by_reader)
+        by_reader->units -= TOKEN;
+    if (by_uid)
+        by_uid->units -= TOKEN;
+    limiter->stats.passed++;
+    return NED_RATE_PASS;
+}
+
+void
+ned_ratelimit_get_stats(const ned_ratelimit *limiter, ned_ratelimit_stats *stats)
+{
+    *stats = limiter->stats;
+}
@@ -0,0 +1,76 @@
+/*
+ * NFC Event Daemon
+ * Event rate limiting
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Token buckets, one per tag UID and one per reader. A bucket holds up to
+ * burst tokens and gains rate tokens per minute; a tag insertion takes one
+ * token from both the UID and the reader buckets, or is rejected.
+ *
+ * Buckets are only used from the main loop thread. They are refilled when
+ * they are looked at, from the time elapsed since then: there is no lock and
+ * no refill timer. UID buckets live in a fixed size table; when it is full,
+ * the least recently used bucket in the probe window is recycled, which can
+ * only make the limiter more lenient.
+ */
+
+typedef struct {
+    unsigned int rate;              /* tokens per minute, 0 for no limit */
+    unsigned int burst;
+} ned_rate;
+
+typedef enum {
+    NED_RATE_PASS,
+    NED_RATE_UID,                   /* rejected by the UID bucket */
+    NED_RATE_READER,                /* rejected by the reader bucket */
+} ned_rate_verdict;
+
+typedef struct {
+    uint64_t passed;
+    uint64_t uid_rejected;
+    uint64_t reader_rejected;
+    uint64_t evictions;
+} ned_ratelimit_stats;
+
+typedef struct ned_ratelimit ned_ratelimit;
+
+/**
+ * @brief Create a rate limiter
+ * @return limiter, or NULL on error (or if neither rate is limited)
+ */
+ned_ratelimit *ned_ratelimit_new(const ned_rate *uid, const ned_rate *reader);
+
+void ned_ratelimit_free(ned_ratelimit *limiter);
+
+/**
+ * @brief Take a token for a tag insertion
+ * @param uid tag UID, NULL if unknown (only the reader bucket applies)
+ */
+ned_rate_verdict ned_ratelimit_check(ned_ratelimit *limiter, unsigned int reader_id,
+                                     const uint8_t *uid, size_t uid_len, uint64_t now_ms);
+
+void ned_ratelimit_get_stats(const ned_ratelimit *limiter, ned_ratelimit_stats *stats);
+
+#endif /* __RATELIMIT_H__ */
@@ -0,0 +1,1010 @@
+/*
+ * NFC Event Daemon
+ * NFC readers and their polling threads
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "reader.h"
+
+/* Debugging functions */
+#include "debug/debug.h"
+#include "debug/nfc-utils.h"
+
+/* Consecutive poll errors before the device is reopened */
+#define READER_MAX_FAILURES    3
+/* Delay between two reconnection attempts, doubled after each failure */
+#define READER_BACKOFF_MIN_MS  250
+#define READER_BACKOFF_MAX_MS  30000
+/* Watchdog period, and how long a poll may overrun its expected duration */
+#define WATCHDOG_INTERVAL_MS   1000
+#define WATCHDOG_GRACE_MS      5000
+
+typedef struct queued_event {
+    ned_event event;
+    struct queued_event *next;
+} queued_event;
+
+/* Events posted by polling threads, drained by the loop thread */
+static struct {
+    pthread_mutex_t lock;
+    queued_event *head;
+    queued_event **tail;
+    ned_loop_async *async;
+    ned_loop_timer *watchdog;
+    ned_loop *loop;
+    ned_event_cb cb;
+    void *data;
+} queue = { PTHREAD_MUTEX_INITIALIZER, NULL, &queue.head, NULL, NULL, NULL, NULL, NULL };
+
+static ned_reader *readers = NULL;
+static unsigned int next_reader_id = 0;
+
+/*
+ * libnfc drivers probe and claim the same ports to list and to open devices:
+ * enumeration, opening and closing are serialized between the scan worker
+ * and polling threads reconnecting their device.
+ */
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Device scan, run by a worker thread and completed on the loop thread */
+static struct {
+    pthread_t thread;
+    bool running;
+    bool again;
+    ned_loop_async *done;
+    nfc_context *context;
+    ned_scan_cb cb;
+    void *data;
+    char (*known)[sizeof(nfc_connstring)];
+    size_t known_count;
+    ned_scan_device found[NED_SCAN_MAX];
+    size_t count;
+} scan;
+
+static nfc_device *
+device_open(nfc_context *context, const char *connstring)
+{
+    nfc_device *device;
+    pthread_mutex_lock(&open_lock);
+    device = nfc_open(context, connstring);
+    pthread_mutex_unlock(&open_lock);
+    return device;
+}
+
+static void
+device_close(nfc_device *device)
+{
+    pthread_mutex_lock(&open_lock);
+    nfc_close(device);
+    pthread_mutex_unlock(&open_lock);
+}
+
+static void
+queue_post(ned_reader *reader, nem_event_t event, const nfc_target *tag)
+{
+    queued_event *qe = calloc(1, sizeof(queued_event));
+    if (!qe) {
+        ERR("%s", "Unable to queue event (malloc)");
+        return;
+    }
+    qe->event.reader = reader;
+    qe->event.event = event;
+    qe->event.timestamp_us = ned_loop_now_us();
+    qe->event.reopened = reader->reopened;
+    reader->reopened = false;
+    if (tag) {
+        qe->event.has_tag = true;
+        memcpy(&qe->event.tag, tag, sizeof(nfc_target));
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    *queue.tail = qe;
+    queue.tail = &qe->next;
+    pthread_mutex_unlock(&queue.lock);
+
+    ned_loop_async_send(queue.async);
+}
+
+static void
+queue_drain(ned_loop *loop, void *data)
+{
+    queued_event *qe, *next;
+    ned_event batch[NED_EVENT_BATCH_MAX];
+    size_t count = 0;
+    (void) loop;
+    (void) data;
+
+    pthread_mutex_lock(&queue.lock);
+    qe = queue.head;
+    queue.head = NULL;
+    queue.tail = &queue.head;
+    pthread_mutex_unlock(&queue.lock);
+
+    for (; qe; qe = next) {
+        ned_reader *reader = qe->event.reader;
+        next = qe->next;
+        /* Present tags, as seen from the loop thread */
+        if (qe->event.event == EVENT_TAG_INSERTED) {
+            reader->has_tag = true;
+            reader->tag = qe->event.tag;
+            reader->tag_since_ms = qe->event.timestamp_us / 1000;
+        } else if (qe->event.event == EVENT_TAG_REMOVED) {
+            reader->has_tag = false;
+        }
+        batch[count++] = qe->event;
+        free(qe);
+        if (count == NED_EVENT_BATCH_MAX) {
+            queue.cb(batch, count, queue.data);
+            count = 0;
+        }
+    }
+    if (count)
+        queue.cb(batch, count, queue.data);
+}
+
+/**
+ * @brief Abort polls that run past their deadline
+ * A hung USB transfer would otherwise block the polling thread forever.
+ */
+static void
+watchdog_cb(ned_loop *loop, ned_loop_timer *timer, void *data)
+{
+    uint64_t now = ned_loop_now_ms();
+    (void) loop;
+    (void) timer;
+    (void) data;
+
+    for (ned_reader *reader = readers; reader; reader = reader->next) {
+        pthread_mutex_lock(&reader->lock);
+        if (reader->polling && reader->health != NED_READER_STALLED && now > reader->poll_deadline_ms) {
+            WARN("Poll on %s running %llu ms past its expected end, aborting", reader->name,
+                 (unsigned long long) (now - reader->poll_deadline_ms + WATCHDOG_GRACE_MS));
+            reader->health = NED_READER_STALLED;
+            NED_STAT_INC(reader->stats.watchdog_trips);
+            nfc_abort_command(reader->device);
+        }
+        pthread_mutex_unlock(&reader->lock);
+    }
+}
+
+/**
+ * @brief List the devices, and open those no reader has
+ * Runs on the scan worker, or on the loop thread for a blocking scan.
+ */
+static void
+scan_run(void)
+{
+    nfc_connstring list[NED_SCAN_MAX];
+    size_t count, i, j;
+
+    pthread_mutex_lock(&open_lock);
+    count = nfc_list_devices(scan.context, list, NED_SCAN_MAX);
+    pthread_mutex_unlock(&open_lock);
+    for (i = 0; i < count; i++) {
+        snprintf(scan.found[i].connstring, sizeof(scan.found[i].connstring), "%s", list[i]);
+        for (j = 0; j < scan.known_count; j++) {
+            if (strcmp(list[i], scan.known[j]) == 0)
+                break;
+        }
+        scan.found[i].device = (j < scan.known_count) ? NULL : device_open(scan.context, list[i]);
+    }
+    scan.count = count;
+}
+
+static void *
+scan_thread(void *arg)
+{
+    (void) arg;
+    scan_run();
+    ned_loop_async_send(scan.done);
+    return NULL;
+}
+
+/**
+ * @brief Start a scan with the current reader list
+ * @return 0 on success, -1 if no scan could be started
+ */
+static int
+scan_start(bool wait)
+{
+    ned_reader *reader;
+    size_t n = 0;
+    int res;
+
+    for (reader = readers; reader; reader = reader->next)
+        n++;
+    free(scan.known);
+    scan.known_count = 0;
+    scan.known = calloc(n ? n : 1, sizeof(*scan.known));
+    if (!scan.known)
+        return -1;
+    for (reader = readers; reader; reader = reader->next)
+        memcpy(scan.known[scan.known_count++], reader->connstring, sizeof(*scan.known));
+    if (wait) {
+        scan_run();
+        return 0;
+    }
+    res = pthread_create(&scan.thread, NULL, scan_thread, NULL);
+    if (res != 0) {
+        ERR("Unable to start scan thread: %s", strerror(res));
+        return -1;
+    }
+    scan.running = true;
+    return 0;
+}
+
+/**
+ * @brief Hand the scan results over, and close the devices left
+ */
+static void
+scan_complete(void)
+{
+    size_t i;
+
+    scan.cb(scan.found, scan.count, scan.data);
+    for (i = 0; i < scan.count; i++) {
+        if (scan.found[i].device)
+            device_close(scan.found[i].device);
+        scan.found[i].device = NULL;
+    }
+    scan.count = 0;
+}
+
+static void
+scan_done(ned_loop *loop, void *data)
+{
+    (void) loop;
+    (void) data;
+
+    if (!scan.running)
+        return;
+    pthread_join(scan.thread, NULL);
+    scan.running = false;
+    scan_complete();
+    if (scan.again) {
+        scan.again = false;
+        scan_start(false);
+    }
+}
+
+int
+ned_readers_scan(nfc_context *context, bool wait, ned_scan_cb cb, void *data)
+{
+    scan.context = context;
+    scan.cb = cb;
+    scan.data = data;
+    if (scan.running) {
+        /* The list may predate the change: scan again once done */
+        scan.again = true;
+        return 0;
+    }
+    if (scan_start(wait) < 0)
+        return -1;
+    if (wait)
+        scan_complete();
+    return 0;
+}
+
+int
+ned_readers_init(ned_loop *loop, ned_event_cb cb, void *data)
+{
+    queue.loop = loop;
+    queue.cb = cb;
+    queue.data = data;
+    queue.async = ned_loop_add_async(loop, queue_drain, NULL);
+    queue.watchdog = ned_loop_add_timer(loop, WATCHDOG_INTERVAL_MS, WATCHDOG_INTERVAL_MS, watchdog_cb, NULL);
+    scan.done = ned_loop_add_async(loop, scan_done, NULL);
+    return (queue.async && queue.watchdog && scan.done) ? 0 : -1;
+}
+
+/**
+ * @brief Abort the libnfc command in progress, if any
+ * Must be called with reader->lock held.
+ */
+static void
+reader_abort_locked(ned_reader *reader)
+{
+    if (reader->polling)
+        nfc_abort_command(reader->device);
+}
+
+void
+ned_readers_shutdown(void)
+{
+    queued_event *qe, *next;
+    size_t i;
+
+    /* A scan in progress only has devices to close */
+    if (scan.running) {
+        pthread_join(scan.thread, NULL);
+        scan.running = false;
+        for (i = 0; i < scan.count; i++) {
+            if (scan.found[i].device)
+                device_close(scan.found[i].device);
+        }
+    }
+    if (scan.done)
+        ned_loop_remove_async(queue.loop, scan.done);
+    free(scan.known);
+    memset(&scan, 0, sizeof(scan));
+
+    /* Ask every thread to stop first so that they all wind down in parallel */
+    for (ned_reader *reader = readers; reader; reader = reader->next) {
+        pthread_mutex_lock(&reader->lock);
+        reader->stop = true;
+        pthread_cond_broadcast(&reader->cond);
+        reader_abort_locked(reader);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    while (readers)
+        ned_reader_close(readers);
+
+    for (qe = queue.head; qe; qe = next) {
+        next = qe->next;
+        free(qe);
+    }
+    queue.head = NULL;
+    queue.tail = &queue.head;
+    ned_loop_remove_async(queue.loop, queue.async);
+    queue.async = NULL;
+    ned_loop_remove_timer(queue.loop, queue.watchdog);
+    queue.watchdog = NULL;
+}
+
+ned_reader *
+ned_readers_first(void)
+{
+    return readers;
+}
+
+/**
+ * @brief Sleep for ms milliseconds or until the reader is asked to stop
+ * @return true if the reader has to stop
+ */
+static bool
+reader_wait(ned_reader *reader, unsigned int ms)
+{
+    struct timespec deadline;
+    bool stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    while (!reader->stop && !reader->paused) {
+        if (pthread_cond_timedwait(&reader->cond, &reader->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    stop = reader->stop;
+    pthread_mutex_unlock(&reader->lock);
+    return stop;
+}
+
+/**
+ * @brief Whether the last poll was interrupted on purpose (stop or pause)
+ */
+static bool
+reader_interrupted(ned_reader *reader)
+{
+    bool res;
+    pthread_mutex_lock(&reader->lock);
+    res = reader->stop || reader->paused;
+    pthread_mutex_unlock(&reader->lock);
+    return res;
+}
+
+/**
+ * @brief Block while the reader is paused
+ * @return true if the reader has to stop
+ */
+static bool
+reader_wait_resumed(ned_reader *reader)
+{
+    bool stop;
+    pthread_mutex_lock(&reader->lock);
+    if (reader->paused)
+        /* Not polled meanwhile */
+        reader->tag_absent_ms = 0;
+    while (reader->paused && !reader->stop)
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    stop = reader->stop;
+    pthread_mutex_unlock(&reader->lock);
+    return stop;
+}
+
+static unsigned int
+reader_poll_interval(ned_reader *reader)
+{
+    unsigned int ms;
+    pthread_mutex_lock(&reader->lock);
+    ms = reader->poll_interval_ms;
+    pthread_mutex_unlock(&reader->lock);
+    return ms;
+}
+
+/**
+ * @brief Account for RF field state changes
+ */
+static void
+reader_field_changed(ned_reader *reader, bool on)
+{
+    uint64_t now = ned_loop_now_ms();
+
+    if (on == reader->field_on)
+        return;
+    if (on) {
+        NED_STAT_SET(reader->stats.field_on_since_ms, now);
+    } else {
+        NED_STAT_ADD(reader->stats.field_on_ms, now - NED_STAT_GET(reader->stats.field_on_since_ms));
+        NED_STAT_SET(reader->stats.field_on_since_ms, 0);
+    }
+    reader->field_on = on;
+}
+
+static void
+reader_set_field(ned_reader *reader, bool on)
+{
+    if (on == reader->field_on)
+        return;
+    if (nfc_device_set_property_bool(reader->device, NP_ACTIVATE_FIELD, on) < 0)
+        return;
+    reader_field_changed(reader, on);
+}
+
+/**
+ * @brief Pick the power mode of the next poll looking for a new tag
+ * @return number of polling periods
+ * Polls are always bounded, so that the watchdog can tell a long poll from
+ * a hung one. Continuous polling is a series of single periods: each one
+ * that finds nothing ends the latency bound of the next detection.
+ */
+static uint8_t
+reader_power_mode(ned_reader *reader, ned_power_mode *mode, unsigned int *off_ms, unsigned int period_ms)
+{
+    ned_duty_cycle duty;
+    uint64_t now = ned_loop_now_ms();
+    unsigned int n = 1;
+
+    pthread_mutex_lock(&reader->lock);
+    duty = reader->duty;
+    pthread_mutex_unlock(&reader->lock);
+
+    *off_ms = duty.off_ms;
+    if (duty.enabled && now >= reader->tag_seen_ms + duty.idle_ms) {
+        /* Short detection burst */
+        *mode = NED_POWER_DUTY_CYCLE;
+        n = duty.on_ms / period_ms;
+    } else {
+        /* Continuous, until idle_ms have passed without any tag if duty-cycling */
+        *mode = NED_POWER_CONTINUOUS;
+    }
+    /* 0xff is endless polling for libnfc, which the watchdog could not bound */
+    if (n > 0xfe)
+        n = 0xfe;
+    if (n < 1)
+        n = 1;
+
+    pthread_mutex_lock(&reader->lock);
+    reader->power_mode = *mode;
+    pthread_mutex_unlock(&reader->lock);
+    return n;
+}
+
+static nfc_target*
+ned_poll_for_tag(ned_reader *reader, nfc_target* tag)
+{
+    uint8_t uiPollNr;
+    const uint8_t uiPeriod = 2; /* 2 x 150 ms = 300 ms */
+    const nfc_modulation nm[1] = { { .nmt = NMT_ISO14443A, .nbr = NBR_106 } };
+    ned_power_mode mode = NED_POWER_CONTINUOUS;
+    unsigned int off_ms = 0;
+    uint64_t window_ms = 0;
+
+    if( tag != NULL ) {
+        /* We are looking for a previous tag */
+        /* In this case, to prevent for intensive polling we add a sleeping time */
+        /* but not for a restored tag, which is to be confirmed right away */
+        if ( NED_STAT_GET ( reader->stats.ready_ms ) )
+            reader_wait ( reader, reader_poll_interval ( reader ) );
+        if ( reader_interrupted ( reader ) )
+            return tag;
+        uiPollNr = 3; /* Polling duration : btPollNr * szTargetTypes * btPeriod * 150 = btPollNr * 300 = 900 */
+    } else {
+        /* We are looking for any tag: one period, or a short burst in low power mode */
+        uiPollNr = reader_power_mode ( reader, &mode, &off_ms, uiPeriod * 150 );
+        /* Start of this poll */
+        window_ms = ned_loop_now_ms();
+        reader_set_field ( reader, true );
+    }
+
+    nfc_target target;
+    pthread_mutex_lock ( &reader->lock );
+    if ( reader->stop || reader->paused ) {
+        pthread_mutex_unlock ( &reader->lock );
+        return tag;
+    }
+    reader->polling = true;
+    reader->poll_deadline_ms = ned_loop_now_ms() + uiPollNr * uiPeriod * 150 + WATCHDOG_GRACE_MS;
+    pthread_mutex_unlock ( &reader->lock );
+    /* Looking for any tag: whatever shows up from now on is a genuine change */
+    if ( ( tag == NULL ) && !NED_STAT_GET ( reader->stats.ready_ms ) )
+        NED_STAT_SET ( reader->stats.ready_ms, ned_loop_now_ms() );
+
+    int res = nfc_initiator_poll_target (reader->device, nm, 1, uiPollNr, uiPeriod, &target);
+
+    pthread_mutex_lock ( &reader->lock );
+    reader->polling = false;
+    if ( reader->health == NED_READER_STALLED ) {
+        /* Aborted by the watchdog, whatever the result */
+        res = NFC_ETIMEOUT;
+    } else if ( res >= 0 ) {
+        reader->health = NED_READER_HEALTHY;
+        reader->failures = 0;
+    } else if ( !reader->stop && !reader->paused && !reader->reconfigured ) {
+        reader->health = NED_READER_FAILING;
+        reader->failures++;
+        NED_STAT_INC ( reader->stats.poll_errors );
+    }
+    reader->reconfigured = false;
+    pthread_mutex_unlock ( &reader->lock );
+    NED_STAT_INC ( reader->stats.polls );
+    if ( res < 0 ) {
+        /* Errors do not change the tag state, a reconnection will */
+        return tag;
+    }
+    uint64_t now = ned_loop_now_ms();
+    if ( !NED_STAT_GET ( reader->stats.ready_ms ) )
+        NED_STAT_SET ( reader->stats.ready_ms, now );
+    if ( res == 0 ) {
+        reader->tag_absent_ms = now;
+        if ( ( tag == NULL ) && ( mode == NED_POWER_DUTY_CYCLE ) ) {
+            /* Nothing around: field off until the next burst */
+            reader_set_field ( reader, false );
+            reader_wait ( reader, off_ms );
+        }
+    } else {
+        /*
+         * The tag came in after the last poll that saw none: the time since
+         * then bounds the latency, field off periods included. Without such
+         * a poll, a tag found right away was already there and is not a
+         * detection, one found later came in during this poll.
+         */
+        if ( ( tag == NULL ) && ( reader->tag_absent_ms || ( now - window_ms >= uiPeriod * 150 ) ) ) {
+            uint64_t latency = now - ( reader->tag_absent_ms ? reader->tag_absent_ms : window_ms );
+            NED_STAT_INC ( reader->stats.detections[mode] );
+            NED_STAT_ADD ( reader->stats.detection_latency_ms[mode], latency );
+            if ( latency > NED_STAT_GET ( reader->stats.detection_latency_max_ms[mode] ) )
+                NED_STAT_SET ( reader->stats.detection_latency_max_ms[mode], latency );
+        }
+        reader->tag_seen_ms = now;
+        reader->tag_absent_ms = 0;
+        pthread_mutex_lock ( &reader->lock );
+        reader->power_mode = NED_POWER_CONTINUOUS;
+        pthread_mutex_unlock ( &reader->lock );
+    }
+    if (res > 0) {
+        if ( (tag != NULL) && (0 == memcmp(tag->nti.nai.abtUid, target.nti.nai.abtUid, target.nti.nai.szUidLen)) ) {
+            return tag;
+        } else {
+            nfc_target* rv = malloc(sizeof(nfc_target));
+            memcpy(rv, &target, sizeof(nfc_target));
+            nfc_initiator_deselect_target ( reader->device );
+            return rv;
+        }
+    } else {
+        return NULL;
+    }
+}
+
+/**
+ * @brief Configure a freshly opened device for polling
+ * @return 0 on success, -1 if a property could not be set
+ */
+static int
+reader_setup_device ( nfc_device *device )
+{
+    int res = 0;
+
+    if ( nfc_initiator_init ( device ) < 0 ) res = -1;
+
+    // Drop the field for a while
+    if ( nfc_device_set_property_bool ( device, NP_ACTIVATE_FIELD, false ) < 0 ) res = -1;
+    if ( nfc_device_set_property_bool ( device, NP_INFINITE_SELECT, false ) < 0 ) res = -1;
+
+    // Configure the CRC and Parity settings
+    if ( nfc_device_set_property_bool ( device, NP_HANDLE_CRC, true ) < 0 ) res = -1;
+    if ( nfc_device_set_property_bool ( device, NP_HANDLE_PARITY, true ) < 0 ) res = -1;
+
+    // Enable field so more power consuming cards can power themselves up
+    if ( nfc_device_set_property_bool ( device, NP_ACTIVATE_FIELD, true ) < 0 ) res = -1;
+    return res;
+}
+
+/**
+ * @brief Whether the device has to be reopened
+ */
+static bool
+reader_needs_reconnect(ned_reader *reader)
+{
+    bool res;
+    pthread_mutex_lock(&reader->lock);
+    res = (reader->health == NED_READER_STALLED) || (reader->failures >= READER_MAX_FAILURES);
+    pthread_mutex_unlock(&reader->lock);
+    return res;
+}
+
+/**
+ * @brief Close the device and reopen it with exponential backoff
+ * @return true if the reader has to stop
+ */
+static bool
+reader_reconnect(ned_reader *reader)
+{
+    unsigned int backoff = READER_BACKOFF_MIN_MS;
+    uint64_t start = ned_loop_now_ms(), elapsed;
+    nfc_device *device;
+
+    pthread_mutex_lock(&reader->lock);
+    WARN("%s is %s, reconnecting", reader->name, reader->health == NED_READER_STALLED ? "stalled" : "failing");
+    reader->health = NED_READER_RECONNECTING;
+    device = reader->device;
+    reader->device = NULL;
+    pthread_mutex_unlock(&reader->lock);
+    device_close(device);
+    reader_field_changed(reader, false);
+
+    for (;;) {
+        if (reader_wait_resumed(reader) || reader_wait(reader, backoff))
+            return true;
+        if (reader_interrupted(reader))
+            continue;
+        NED_STAT_INC(reader->stats.reconnect_attempts);
+        device = device_open(reader->context, reader->connstring);
+        if (device && reader_setup_device(device) == 0)
+            break;
+        if (device)
+            device_close(device);
+        DBG("Unable to reopen %s, next attempt in %u ms", reader->connstring, backoff * 2);
+        if (backoff < READER_BACKOFF_MAX_MS / 2)
+            backoff *= 2;
+        else
+            backoff = READER_BACKOFF_MAX_MS;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    reader->device = device;
+    reader->health = NED_READER_HEALTHY;
+    reader->failures = 0;
+    pthread_mutex_unlock(&reader->lock);
+    reader_field_changed(reader, true);
+    reader->reopened = true;
+    /* Not polled meanwhile */
+    reader->tag_absent_ms = 0;
+    elapsed = ned_loop_now_ms() - start;
+    NED_STAT_INC(reader->stats.reconnects);
+    NED_STAT_SET(reader->stats.last_reconnect_ms, elapsed);
+    NED_STAT_ADD(reader->stats.downtime_ms, elapsed);
+    INFO("%s reconnected in %llu ms", reader->name, (unsigned long long) elapsed);
+    return false;
+}
+
+static void *
+reader_thread(void *arg)
+{
+    ned_reader *reader = arg;
+    nfc_target* old_tag = reader->restored_tag;
+    nfc_target* new_tag;
+
+    reader->restored_tag = NULL;
+    DBG("Polling thread started for %s", reader->name);
+    while ( !reader_wait_resumed ( reader ) ) {
+        new_tag = ned_poll_for_tag(reader, old_tag);
+
+        if ( reader_needs_reconnect ( reader ) ) {
+            /* The tag can not be tracked while the device is away */
+            if ( new_tag != old_tag ) free(new_tag);
+            if ( old_tag != NULL ) {
+                DBG ( "%s", "Event detected: tag removed (reader lost)" );
+                NED_STAT_INC ( reader->stats.removed );
+                queue_post ( reader, EVENT_TAG_REMOVED, old_tag );
+                free(old_tag);
+                old_tag = NULL;
+            }
+            if ( reader_reconnect ( reader ) )
+                break;
+            continue;
+        }
+        if ( reader_interrupted ( reader ) ) {
+            /* Aborted polls look like removals: do not report them */
+            if ( new_tag != old_tag ) free(new_tag);
+            continue;
+        }
+        if ( old_tag == new_tag ) /* state unchanged */
+            continue;
+
+        if ( old_tag != NULL ) {
+            DBG ( "%s", "Event detected: tag removed" );
+            NED_STAT_INC ( reader->stats.removed );
+            queue_post ( reader, EVENT_TAG_REMOVED, old_tag );
+            free(old_tag);
+        }
+        if ( new_tag != NULL ) {
+            DBG ( "%s", "Event detected: tag inserted " );
+            NED_STAT_INC ( reader->stats.inserted );
+            queue_post ( reader, EVENT_TAG_INSERTED, new_tag );
+        }
+        old_tag = new_tag;
+    }
+    free(old_tag);
+    DBG("Polling thread stopped for %s", reader->name);
+    return NULL;
+}
+
+ned_reader *
+ned_reader_open(nfc_context *context, const char *connstring, unsigned int poll_interval_ms)
+{
+    nfc_device *device = device_open(context, connstring);
+
+    if ( device == NULL )
+        return NULL;
+    return ned_reader_adopt(context, device, poll_interval_ms);
+}
+
+ned_reader *
+ned_reader_adopt(nfc_context *context, nfc_device *device, unsigned int poll_interval_ms)
+{
+    ned_reader *reader, **tail;
+
+    if ( reader_setup_device ( device ) < 0 )
+        WARN ( "Unable to configure %s, polling may fail", nfc_device_get_name ( device ) );
+
+    reader = calloc(1, sizeof(ned_reader));
+    if (!reader) {
+        device_close(device);
+        return NULL;
+    }
+    reader->id = next_reader_id++;
+    reader->context = context;
+    reader->device = device;
+    snprintf(reader->connstring, sizeof(reader->connstring), "%s", nfc_device_get_connstring(device));
+    snprintf(reader->name, sizeof(reader->name), "%s", nfc_device_get_name(device));
+    reader->poll_interval_ms = poll_interval_ms;
+    reader->opened_ms = ned_loop_now_ms();
+    reader_field_changed(reader, true);
+    pthread_mutex_init(&reader->lock, NULL);
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&reader->cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    for (tail = &readers; *tail; tail = &(*tail)->next);
+    *tail = reader;
+    return reader;
+}
+
+void
+ned_reader_restore_tag(ned_reader *reader, const nfc_target *tag)
+{
+    if (reader->running || reader->restored_tag)
+        return;
+    reader->restored_tag = malloc(sizeof(nfc_target));
+    if (!reader->restored_tag)
+        return;
+    *reader->restored_tag = *tag;
+    reader->has_tag = true;
+    reader->tag = *tag;
+    reader->tag_since_ms = ned_loop_now_ms();
+}
+
+int
+ned_reader_start(ned_reader *reader)
+{
+    int res;
+
+    reader->stop = false;
+    res = pthread_create(&reader->thread, NULL, reader_thread, reader);
+    if (res != 0) {
+        ERR("Unable to start polling thread: %s", strerror(res));
+        return -1;
+    }
+    reader->running = true;
+    return 0;
+}
+
+void
+ned_reader_stop(ned_reader *reader)
+{
+    if (!reader->running)
+        return;
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = true;
+    pthread_cond_broadcast(&reader->cond);
+    reader_abort_locked(reader);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->thread, NULL);
+    reader->running = false;
+}
+
+/* Drop events of a reader that is going away */
+static void
+queue_purge(ned_reader *reader)
+{
+    queued_event **p, *qe;
+
+    pthread_mutex_lock(&queue.lock);
+    for (p = &queue.head; *p; ) {
+        qe = *p;
+        if (qe->event.reader == reader) {
+            *p = qe->next;
+            free(qe);
+        } else {
+            p = &qe->next;
+        }
+    }
+    queue.tail = p;
+    pthread_mutex_unlock(&queue.lock);
+}
+
+void
+ned_reader_close(ned_reader *reader)
+{
+    ned_reader **p;
+
+    ned_reader_stop(reader);
+    queue_purge(reader);
+    for (p = &readers; *p; p = &(*p)->next) {
+        if (*p == reader) {
+            *p = reader->next;
+            break;
+        }
+    }
+    if (reader->expire_timer)
+        ned_loop_remove_timer(queue.loop, reader->expire_timer);
+    if (reader->device)
+        device_close(reader->device);
+    DBG("NFC device %s is disconnected", reader->name);
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->lock);
+    free(reader->restored_tag);
+    free(reader);
+}
+
+void
+ned_reader_pause(ned_reader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->paused = true;
+    pthread_cond_broadcast(&reader->cond);
+    reader_abort_locked(reader);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+void
+ned_reader_resume(ned_reader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->paused = false;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+bool
+ned_reader_is_paused(ned_reader *reader)
+{
+    bool paused;
+    pthread_mutex_lock(&reader->lock);
+    paused = reader->paused;
+    pthread_mutex_unlock(&reader->lock);
+    return paused;
+}
+
+void
+ned_reader_set_poll_interval(ned_reader *reader, unsigned int poll_interval_ms)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->poll_interval_ms = poll_interval_ms;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+unsigned int
+ned_reader_get_poll_interval(ned_reader *reader)
+{
+    unsigned int ms;
+    pthread_mutex_lock(&reader->lock);
+    ms = reader->poll_interval_ms;
+    pthread_mutex_unlock(&reader->lock);
+    return ms;
+}
+
+void
+ned_reader_set_duty_cycle(ned_reader *reader, const ned_duty_cycle *duty)
+{
+    pthread_mutex_lock(&reader->lock);
+    /* A long continuous burst has to be cut short to switch to duty-cycling */
+    if (duty->enabled && !reader->duty.enabled && reader->polling) {
+        reader->reconfigured = true;
+        reader_abort_locked(reader);
+    }
+    reader->duty = *duty;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+ned_power_mode
+ned_reader_get_power_mode(ned_reader *reader)
+{
+    ned_power_mode mode;
+    pthread_mutex_lock(&reader->lock);
+    mode = reader->power_mode;
+    pthread_mutex_unlock(&reader->lock);
+    return mode;
+}
+
+uint64_t
+ned_reader_field_on_ms(ned_reader *reader)
+{
+    uint64_t since = NED_STAT_GET(reader->stats.field_on_since_ms);
+    uint64_t on = NED_STAT_GET(reader->stats.field_on_ms);
+    return since ? on + ned_loop_now_ms() - since : on;
+}
+
+ned_reader_health
+ned_reader_get_health(ned_reader *reader, unsigned int *failures)
+{
+    ned_reader_health health;
+    pthread_mutex_lock(&reader->lock);
+    health = reader->health;
+    if (failures)
+        *failures = reader->failures;
+    pthread_mutex_unlock(&reader->lock);
+    return health;
+}
+
+const char *
+ned_reader_health_name(ned_reader_health health)
+{
+    switch (health) {
+    case NED_READER_HEALTHY:
+        return "healthy";
+    case NED_READER_FAILING:
+        return "failing";
+    case NED_READER_STALLED:
+        return "stalled";
+    case NED_READER_RECONNECTING:
+        return "reconnecting";
+    }
+    return "unknown";
+}
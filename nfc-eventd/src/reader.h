@@ -0,0 +1,295 @@
+/*
+ * NFC Event Daemon
+ * NFC readers and their polling threads
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __READER_H__
+#define __READER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <nfc/nfc.h>
+
+#include "loop.h"
+#include "types.h"
+#include "dwell.h"
+
+typedef struct ned_reader ned_reader;
+
+/* Counters written by polling threads and read from the loop thread */
+#define NED_STAT_INC(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+#define NED_STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define NED_STAT_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define NED_STAT_SET(counter, value) __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+
+typedef struct {
+    uint64_t polls;
+    uint64_t poll_errors;
+    uint64_t inserted;
+    uint64_t removed;
+    uint64_t reconnects;
+    uint64_t reconnect_attempts;
+    uint64_t watchdog_trips;
+    uint64_t last_reconnect_ms;
+    uint64_t downtime_ms;
+    /* RF field on time, not counting the current period (field_on_since_ms) */
+    uint64_t field_on_ms;
+    uint64_t field_on_since_ms;
+    /*
+     * Per power mode: detections, and time since the end of the last poll
+     * that saw no tag (or since the start of the poll that found it),
+     * field off periods included: an upper bound of the detection latency
+     */
+    uint64_t detections[2];
+    uint64_t detection_latency_ms[2];
+    uint64_t detection_latency_max_ms[2];
+    /* Events dropped by rate limiting */
+    uint64_t rate_limited;
+    /* When the reader first reported a reliable tag state, 0 until then */
+    uint64_t ready_ms;
+} ned_reader_stats;
+
+typedef enum {
+    NED_POWER_CONTINUOUS,
+    NED_POWER_DUTY_CYCLE
+} ned_power_mode;
+
+/*
+ * Low power mode: while no tag has been seen for idle_ms, the RF field is
+ * only switched on for detection bursts of on_ms, separated by off_ms. Once a
+ * tag is found the reader polls continuously again.
+ */
+typedef struct {
+    bool enabled;
+    unsigned int on_ms;
+    unsigned int off_ms;
+    unsigned int idle_ms;
+} ned_duty_cycle;
+
+/*
+ * Health state machine of a reader:
+ * HEALTHY -> FAILING on poll errors, back to HEALTHY on the first good poll;
+ * FAILING -> RECONNECTING after a few consecutive errors;
+ * HEALTHY -> STALLED when the watchdog catches a poll running past its
+ * deadline, the poll is aborted and the reader goes RECONNECTING;
+ * RECONNECTING -> HEALTHY once the device has been reopened and configured.
+ */
+typedef enum {
+    NED_READER_HEALTHY,
+    NED_READER_FAILING,
+    NED_READER_STALLED,
+    NED_READER_RECONNECTING
+} ned_reader_health;
+
+/*
+ * Each reader owns a thread that blocks in libnfc polling calls. Tag status
+ * changes are queued and the main loop is woken up through an eventfd, so
+ * events are always dispatched to modules from the loop thread.
+ */
+struct ned_reader {
+    unsigned int id;
+    char connstring[sizeof(nfc_connstring)];
+    char name[256];
+    nfc_context *context;
+    nfc_device *device;
+
+    /* Poll thread, protected by lock */
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    bool paused;
+    bool polling;
+    bool reconfigured;
+    unsigned int poll_interval_ms;
+    ned_reader_health health;
+    unsigned int failures;
+    uint64_t poll_deadline_ms;
+    ned_duty_cycle duty;
+    ned_power_mode power_mode;
+
+    ned_reader_stats stats;
+    uint64_t opened_ms;
+
+    /* Poll thread only, set before the thread starts */
+    nfc_target *restored_tag;
+
+    /* Poll thread only */
+    bool field_on;
+    bool reopened;                  /* no event posted since the device was reopened */
+    uint64_t tag_seen_ms;
+    uint64_t tag_absent_ms;         /* last poll that saw no tag, 0 if none since one was seen */
+
+    /* Loop thread only */
+    ned_loop_timer *expire_timer;
+    bool has_tag;
+    nfc_target tag;
+    uint64_t tag_since_ms;
+    bool rate_limited;              /* the current tag insertion was dropped */
+    unsigned int rate_limited_pending;
+    nfc_target rate_limited_tag;
+    bool sched_applied;             /* scheduling changed from the default */
+    uint64_t dwell_since_us;        /* insertion seen by this daemon, 0 if none */
+    ned_dwell_sketch dwell;
+    ned_reader *next;
+};
+
+typedef struct {
+    ned_reader *reader;
+    nem_event_t event;
+    bool has_tag;
+    nfc_target tag;
+    uint64_t timestamp_us;
+    bool reopened;                  /* first event since the device was reopened */
+} ned_event;
+
+/* Most events handed to ned_event_cb at once */
+#define NED_EVENT_BATCH_MAX 64
+
+typedef void (*ned_event_cb)(const ned_event *events, size_t count, void *data);
+
+/* Most devices a scan reports */
+#define NED_SCAN_MAX 16
+
+/* A device seen by a scan */
+typedef struct {
+    char connstring[sizeof(nfc_connstring)];
+    /* Opened by the scan as no reader had it, NULL otherwise */
+    nfc_device *device;
+} ned_scan_device;
+
+/*
+ * Scan results, on the loop thread. Opened devices the callback does not
+ * take (setting device to NULL) are closed afterwards.
+ */
+typedef void (*ned_scan_cb)(ned_scan_device *found, size_t count, void *data);
+
+/**
+ * @brief Prepare the event queue shared by all readers
+ * @param cb called from the loop thread with batches of queued events, in
+ * the order they were posted
+ */
+int ned_readers_init(ned_loop *loop, ned_event_cb cb, void *data);
+
+/**
+ * @brief Stop and close every reader, then release the event queue
+ */
+void ned_readers_shutdown(void);
+
+/**
+ * @brief First reader of the list (follow ->next for the others)
+ */
+ned_reader *ned_readers_first(void);
+
+/**
+ * @brief Open and configure an NFC device, and add it to the reader list
+ * @param connstring device to open, NULL for libnfc's default device
+ */
+ned_reader *ned_reader_open(nfc_context *context, const char *connstring, unsigned int poll_interval_ms);
+
+/**
+ * @brief Add a reader for a device opened by a scan, configuring it
+ */
+ned_reader *ned_reader_adopt(nfc_context *context, nfc_device *device, unsigned int poll_interval_ms);
+
+/**
+ * @brief List the devices libnfc can see, and open those no reader has
+ * libnfc is only called from a worker thread, so the loop keeps running; a
+ * scan requested while one is in progress is run again once it is done.
+ * @param wait scan on the calling thread instead, cb included
+ */
+int ned_readers_scan(nfc_context *context, bool wait, ned_scan_cb cb, void *data);
+
+/**
+ * @brief Start the polling thread of a reader
+ */
+int ned_reader_start(ned_reader *reader);
+
+/**
+ * @brief Start from a tag known to be present, before the reader is started
+ * The first poll then only reports a change: no event if the same tag is
+ * still there.
+ */
+void ned_reader_restore_tag(ned_reader *reader, const nfc_target *tag);
+
+/**
+ * @brief Stop the polling thread and wait for it
+ * Pending libnfc commands are aborted, so this returns quickly.
+ */
+void ned_reader_stop(ned_reader *reader);
+
+/**
+ * @brief Stop, close and remove a reader from the list
+ */
+void ned_reader_close(ned_reader *reader);
+
+/**
+ * @brief Suspend polling until ned_reader_resume() is called
+ * A tag present when the reader is paused is not reported as removed.
+ */
+void ned_reader_pause(ned_reader *reader);
+
+/**
+ * @brief Resume polling of a paused reader
+ */
+void ned_reader_resume(ned_reader *reader);
+
+/**
+ * @brief Whether the reader is paused
+ */
+bool ned_reader_is_paused(ned_reader *reader);
+
+/**
+ * @brief Change the delay between two presence checks of a tag
+ */
+void ned_reader_set_poll_interval(ned_reader *reader, unsigned int poll_interval_ms);
+
+/**
+ * @brief Current delay between two presence checks of a tag
+ */
+unsigned int ned_reader_get_poll_interval(ned_reader *reader);
+
+/**
+ * @brief Configure RF field duty-cycling
+ */
+void ned_reader_set_duty_cycle(ned_reader *reader, const ned_duty_cycle *duty);
+
+/**
+ * @brief Power mode of the last poll
+ */
+ned_power_mode ned_reader_get_power_mode(ned_reader *reader);
+
+/**
+ * @brief Time the RF field has been on since the reader was opened
+ */
+uint64_t ned_reader_field_on_ms(ned_reader *reader);
+
+/**
+ * @brief Current health state and number of consecutive poll failures
+ */
+ned_reader_health ned_reader_get_health(ned_reader *reader, unsigned int *failures);
+
+/**
+ * @brief Printable name of a health state
+ */
+const char *ned_reader_health_name(ned_reader_health health);
+
+#endif /* __READER_H__ */
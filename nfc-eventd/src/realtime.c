@@ -0,0 +1,179 @@
+/*
+ * NFC Event Daemon
+ * Real-time scheduling of polling threads
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+#define JITTER_SAMPLES_MAX 1000000
+
+int
+ned_rt_apply(pthread_t thread, const ned_rt_sched *sched)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    int res;
+
+    /* No CPU: those of the calling thread, undoing a previous pinning */
+    if (sched->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(sched->cpu, &set);
+    } else if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        return -1;
+    }
+    res = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched->priority;
+    res = pthread_setschedparam(thread, sched->priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+int
+ned_rt_lock_memory(void)
+{
+    return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+int
+ned_rt_cpu_count(void)
+{
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return 1;
+    return CPU_COUNT(&set);
+}
+
+typedef struct {
+    const ned_rt_sched *sched;
+    unsigned int period_us;
+    size_t count;
+    uint64_t *samples;
+    int error;
+} jitter_test;
+
+static uint64_t
+timespec_ns(const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static void *
+jitter_thread(void *arg)
+{
+    jitter_test *test = arg;
+    struct timespec next, now;
+
+    if (ned_rt_apply(pthread_self(), test->sched) < 0) {
+        test->error = errno;
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (size_t i = 0; i < test->count; i++) {
+        next.tv_nsec += test->period_us * 1000;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        test->samples[i] = (timespec_ns(&now) - timespec_ns(&next)) / 1000;
+    }
+    return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile(const jitter_test *test, double q)
+{
+    size_t i = (size_t) (q * (test->count - 1));
+    return test->samples[i];
+}
+
+int
+ned_rt_jitter_test(const ned_rt_sched *sched, unsigned int period_us, unsigned int duration_ms,
+                   ned_rt_jitter *result)
+{
+    jitter_test test;
+    pthread_t thread;
+    int res;
+
+    if (period_us == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&test, 0, sizeof(test));
+    test.sched = sched;
+    test.period_us = period_us;
+    test.count = (uint64_t) duration_ms * 1000 / period_us;
+    if (test.count == 0)
+        test.count = 1;
+    if (test.count > JITTER_SAMPLES_MAX)
+        test.count = JITTER_SAMPLES_MAX;
+    test.samples = calloc(test.count, sizeof(uint64_t));
+    if (!test.samples)
+        return -1;
+    res = pthread_create(&thread, NULL, jitter_thread, &test);
+    if (res != 0) {
+        free(test.samples);
+        errno = res;
+        return -1;
+    }
+    pthread_join(thread, NULL);
+    if (test.error) {
+        free(test.samples);
+        errno = test.error;
+        return -1;
+    }
+    qsort(test.samples, test.count, sizeof(uint64_t), compare_u64);
+    result->samples = test.count;
+    result->p50_us = percentile(&test, 0.5);
+    result->p99_us = percentile(&test, 0.99);
+    result->p999_us = percentile(&test, 0.999);
+    result->max_us = test.samples[test.count - 1];
+    free(test.samples);
+    return 0;
+}
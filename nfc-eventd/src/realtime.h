@@ -0,0 +1,69 @@
+/*
+ * NFC Event Daemon
+ * Real-time scheduling of polling threads
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __REALTIME_H__
+#define __REALTIME_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Functions return 0 on success, -1 with errno set otherwise. SCHED_FIFO
+ * and mlockall() need CAP_SYS_NICE and CAP_IPC_LOCK (or matching rlimits).
+ */
+
+typedef struct {
+    int cpu;                        /* -1: any CPU */
+    int priority;                   /* SCHED_FIFO priority, 0: SCHED_OTHER */
+} ned_rt_sched;
+
+/**
+ * @brief Pin a thread to a CPU and set its scheduling policy
+ * With no CPU, the thread may run on any CPU the calling thread may use.
+ */
+int ned_rt_apply(pthread_t thread, const ned_rt_sched *sched);
+
+/**
+ * @brief Lock the process memory, current and future, to avoid page faults
+ */
+int ned_rt_lock_memory(void);
+
+/**
+ * @brief Number of CPUs the process may run on
+ */
+int ned_rt_cpu_count(void);
+
+typedef struct {
+    uint64_t samples;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t p999_us;
+    uint64_t max_us;
+} ned_rt_jitter;
+
+/**
+ * @brief Measure wake-up latency of a periodic thread
+ * A thread scheduled as sched wakes up every period_us for duration_ms and
+ * records how late each wake-up was.
+ */
+int ned_rt_jitter_test(const ned_rt_sched *sched, unsigned int period_us, unsigned int duration_ms,
+                       ned_rt_jitter *result);
+
+#endif /* __REALTIME_H__ */
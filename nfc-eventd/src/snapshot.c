@@ -0,0 +1,236 @@
+/*
+ * NFC Event Daemon
+ * Tag state snapshot
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+  #include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+/* Debugging functions */
+#include "debug/nfc-utils.h"
+
+#define SNAPSHOT_MAGIC   "NEDSTATE"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ENTRIES 16
+
+typedef struct {
+    uint32_t seq;                   /* odd while the entry is being written */
+    uint8_t used;
+    uint8_t has_tag;
+    uint8_t suppressed;
+    char connstring[sizeof(nfc_connstring)];
+    nfc_target tag;
+} snapshot_entry;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;            /* nfc_target differs between libnfc builds */
+    uint32_t entries;
+    snapshot_entry entry[SNAPSHOT_ENTRIES];
+} snapshot_file;
+
+static struct {
+    snapshot_file *file;
+    bool claimed[SNAPSHOT_ENTRIES];
+    bool restoring;
+    bool dirty;
+} snapshot = { NULL, { false }, false, false };
+
+static bool
+snapshot_valid(const snapshot_file *file)
+{
+    return memcmp(file->magic, SNAPSHOT_MAGIC, sizeof(file->magic)) == 0 &&
+           file->version == SNAPSHOT_VERSION &&
+           file->entry_size == sizeof(snapshot_entry) &&
+           file->entries == SNAPSHOT_ENTRIES;
+}
+
+int
+ned_snapshot_open(const char *path)
+{
+    struct stat st;
+    snapshot_file *file;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (st.st_size != sizeof(snapshot_file) && ftruncate(fd, sizeof(snapshot_file)) < 0)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    file = mmap(NULL, sizeof(snapshot_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+        return -1;
+
+    snapshot.restoring = true;
+    if (st.st_size != sizeof(snapshot_file) || !snapshot_valid(file)) {
+        if (st.st_size)
+            WARN("Ignoring tag state snapshot %s from another version", path);
+        memset(file, 0, sizeof(snapshot_file));
+        memcpy(file->magic, SNAPSHOT_MAGIC, sizeof(file->magic));
+        file->version = SNAPSHOT_VERSION;
+        file->entry_size = sizeof(snapshot_entry);
+        file->entries = SNAPSHOT_ENTRIES;
+        snapshot.restoring = false;
+    }
+    snapshot.file = file;
+    snapshot.dirty = true;
+    memset(snapshot.claimed, 0, sizeof(snapshot.claimed));
+    return 0;
+}
+
+static snapshot_entry *
+snapshot_find(const char *connstring)
+{
+    for (int i = 0; i < SNAPSHOT_ENTRIES; i++) {
+        snapshot_entry *e = &snapshot.file->entry[i];
+        if (e->used && strncmp(e->connstring, connstring, sizeof(e->connstring)) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void
+entry_begin(snapshot_entry *e)
+{
+    __atomic_store_n(&e->seq, e->seq | 1, __ATOMIC_RELEASE);
+}
+
+static void
+entry_end(snapshot_entry *e)
+{
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    snapshot.dirty = true;
+}
+
+bool
+ned_snapshot_restore(const ned_reader *reader, nfc_target *tag, bool *suppressed)
+{
+    snapshot_entry *e;
+
+    if (!snapshot.file || !snapshot.restoring)
+        return false;
+    e = snapshot_find(reader->connstring);
+    if (!e)
+        return false;
+    snapshot.claimed[e - snapshot.file->entry] = true;
+    if (e->seq & 1) {
+        WARN("Tag state of %s was not completely saved, ignoring it", reader->name);
+        return false;
+    }
+    if (!e->has_tag)
+        return false;
+    *tag = e->tag;
+    *suppressed = e->suppressed;
+    return true;
+}
+
+void
+ned_snapshot_forget_unclaimed(void)
+{
+    if (!snapshot.file || !snapshot.restoring)
+        return;
+    snapshot.restoring = false;
+    for (int i = 0; i < SNAPSHOT_ENTRIES; i++) {
+        snapshot_entry *e = &snapshot.file->entry[i];
+        if (e->used && !snapshot.claimed[i]) {
+            entry_begin(e);
+            e->used = 0;
+            entry_end(e);
+        }
+    }
+}
+
+void
+ned_snapshot_save(const ned_reader *reader)
+{
+    snapshot_entry *e;
+
+    if (!snapshot.file)
+        return;
+    e = snapshot_find(reader->connstring);
+    if (e && e->has_tag == reader->has_tag && e->suppressed == reader->rate_limited &&
+        (!reader->has_tag || memcmp(&e->tag, &reader->tag, sizeof(nfc_target)) == 0))
+        return;
+    for (int i = 0; !e && i < SNAPSHOT_ENTRIES; i++) {
+        if (!snapshot.file->entry[i].used)
+            e = &snapshot.file->entry[i];
+    }
+    if (!e) {
+        DBG("No room left to save the tag state of %s", reader->name);
+        return;
+    }
+    entry_begin(e);
+    e->used = 1;
+    snprintf(e->connstring, sizeof(e->connstring), "%s", reader->connstring);
+    e->has_tag = reader->has_tag;
+    e->suppressed = reader->rate_limited;
+    if (reader->has_tag)
+        e->tag = reader->tag;
+    entry_end(e);
+}
+
+void
+ned_snapshot_forget(const ned_reader *reader)
+{
+    snapshot_entry *e;
+
+    if (!snapshot.file || !(e = snapshot_find(reader->connstring)))
+        return;
+    entry_begin(e);
+    e->used = 0;
+    entry_end(e);
+}
+
+void
+ned_snapshot_sync(bool wait)
+{
+    if (!snapshot.file || !snapshot.dirty)
+        return;
+    if (msync(snapshot.file, sizeof(snapshot_file), wait ? MS_SYNC : MS_ASYNC) < 0)
+        WARN("Unable to save tag state snapshot: %s", strerror(errno));
+    snapshot.dirty = false;
+}
+
+void
+ned_snapshot_close(void)
+{
+    if (!snapshot.file)
+        return;
+    ned_snapshot_sync(true);
+    munmap(snapshot.file, sizeof(snapshot_file));
+    snapshot.file = NULL;
+}
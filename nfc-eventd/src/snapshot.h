@@ -0,0 +1,74 @@
+/*
+ * NFC Event Daemon
+ * Tag state snapshot
+ * Copyright (C) 2009 Romuald Conty <romuald@libnfc.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdbool.h>
+
+#include "reader.h"
+
+/*
+ * The tags present on each reader, kept in a small memory mapped file so
+ * that a restarted daemon knows which tags were already reported. Entries
+ * are keyed by connstring and updated in place from the loop thread; the
+ * file is flushed to disk periodically and on exit. An entry is written
+ * between two increments of its sequence number, so an entry left half
+ * written by a crash (odd sequence) is ignored.
+ */
+
+/**
+ * @brief Map the snapshot file, creating it if needed
+ * @return 0 on success, -1 on error
+ */
+int ned_snapshot_open(const char *path);
+
+/**
+ * @brief Look up the tag a reader had when the daemon stopped
+ * Only readers opened before ned_snapshot_forget_unclaimed() are restored.
+ * @param suppressed set if the module never saw that tag (rate limited)
+ * @return true if a tag was present
+ */
+bool ned_snapshot_restore(const ned_reader *reader, nfc_target *tag, bool *suppressed);
+
+/**
+ * @brief Forget the readers that did not come back after a restart
+ */
+void ned_snapshot_forget_unclaimed(void);
+
+/**
+ * @brief Record the current tag state of a reader
+ */
+void ned_snapshot_save(const ned_reader *reader);
+
+/**
+ * @brief Forget a reader that went away
+ */
+void ned_snapshot_forget(const ned_reader *reader);
+
+/**
+ * @brief Schedule writing the snapshot to disk
+ * @param wait block until it is written
+ */
+void ned_snapshot_sync(bool wait);
+
+void ned_snapshot_close(void);
+
+#endif /* __SNAPSHOT_H__ */
@@ -26,7 +26,8 @@
 typedef enum {
   EVENT_TAG_INSERTED,
   EVENT_TAG_REMOVED,
-  EVENT_EXPIRE_TIME
+  EVENT_EXPIRE_TIME,
+  EVENT_RATE_LIMITED
 } nem_event_t;
 
 #endif
@@ -36,18 +36,17 @@
 #include <stdlib.h>
 
 #include <string.h>
+#include <pthread.h>
 
 #include <nfc/nfc.h>
 
-static nfc_device *pnd;
-
 #define ERR(x, ...) printf("ERROR: " x "\n", __VA_ARGS__ )
 
 #define MAX_DEVICE_COUNT  16
 #define MAX_TARGET_COUNT  16
 #define MAX_ATS_LENGTH    32
 
-typedef char *(*identication_hook)(const nfc_iso14443a_info nai);
+typedef char *(*identication_hook)(nfc_device *pnd, const nfc_iso14443a_info nai);
 
 struct iso14443a_tag {
   uint8_t SAK;
@@ -62,17 +61,32 @@ struct felica_tag {
   const char *name;
 };
 
+// Each device is scanned by its own thread, into its own output
+struct device_scan {
+  nfc_context *context;
+  const char *connstring;
+  FILE *out;            // printed in device order once all scans are done
+  char error[256];      // nfc_perror() message, printed to stderr
+  bool opened;
+  uint8_t tag_count;
+  pthread_t thread;
+  bool threaded;
+};
+
+// Drivers enumerate the buses when opening a device: one at a time
+static pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static void
-print_hex(const uint8_t *pbtData, size_t szData)
+print_hex(FILE *out, const uint8_t *pbtData, size_t szData)
 {
   for (size_t i = 0; i < szData; i++) {
-    printf("%02x", pbtData[i]);
+    fprintf(out, "%02x", pbtData[i]);
   }
-  printf("\n");
+  fprintf(out, "\n");
 }
 
 static char *
-mifare_ultralight_identification(const nfc_iso14443a_info nai)
+mifare_ultralight_identification(nfc_device *pnd, const nfc_iso14443a_info nai)
 {
   uint8_t abtCmd[2];
   uint8_t abtRx[265];
@@ -111,7 +125,7 @@ Document used to code this function:
    DESFire EV1- Features and Hints
 */
 static char *
-mifare_desfire_identification(const nfc_iso14443a_info nai)
+mifare_desfire_identification(nfc_device *pnd, const nfc_iso14443a_info nai)
 {
   uint8_t abtCmd[] = { 0x60 }; // MIFARE DESFire GetVersion command
   uint8_t abtRx[265];
@@ -175,7 +189,7 @@ struct iso14443a_tag iso14443a_tags[] = {
 };
 
 static void
-print_iso14443a_name(const nfc_iso14443a_info nai)
+print_iso14443a_name(FILE *out, nfc_device *pnd, const nfc_iso14443a_info nai)
 {
   const char *tag_name[sizeof(iso14443a_tags) / sizeof(struct iso14443a_tag)];
   int matches = 0;
@@ -185,7 +199,7 @@ print_iso14443a_name(const nfc_iso14443a_info nai)
     if ((nai.btSak == iso14443a_tags[i].SAK)) {
       // printf("DBG: iso14443a_tags[i].ATS_length = %d , nai.szAtsLen = %d", iso14443a_tags[i].ATS_length, nai.szAtsLen);
       if (iso14443a_tags[i].identication_fct != NULL) {
-        additionnal_info[matches] = iso14443a_tags[i].identication_fct(nai);
+        additionnal_info[matches] = iso14443a_tags[i].identication_fct(pnd, nai);
       } else {
         additionnal_info[matches] = NULL;
       }
@@ -205,33 +219,33 @@ print_iso14443a_name(const nfc_iso14443a_info nai)
   }
   int i;
   if (matches != 0) {
-    printf("UID=");
-    print_hex(nai.abtUid, nai.szUidLen);
-    printf("\n");
+    fprintf(out, "UID=");
+    print_hex(out, nai.abtUid, nai.szUidLen);
+    fprintf(out, "\n");
     if (matches > 1) {
-      printf("Several possible matches:\n");
+      fprintf(out, "Several possible matches:\n");
     }
     for (i = 0; i < matches; i++) {
-      printf("* %s", tag_name[i]);
+      fprintf(out, "* %s", tag_name[i]);
       if (additionnal_info[i] != NULL) {
-        printf("%s", additionnal_info[i]);
+        fprintf(out, "%s", additionnal_info[i]);
         free(additionnal_info[i]);
       }
-      printf("\n");
+      fprintf(out, "\n");
     }
   } else {
-    printf("Unknown ISO14443A tag type: ");
-    printf("ATQA (SENS_RES): ");
-    print_hex(nai.abtAtqa, 2);
-    printf(", UID (NFCID%c): ", (nai.abtUid[0] == 0x08 ? '3' : '1'));
-    print_hex(nai.abtUid, nai.szUidLen);
-    printf(", SAK (SEL_RES): ");
-    print_hex(&nai.btSak, 1);
+    fprintf(out, "Unknown ISO14443A tag type: ");
+    fprintf(out, "ATQA (SENS_RES): ");
+    print_hex(out, nai.abtAtqa, 2);
+    fprintf(out, ", UID (NFCID%c): ", (nai.abtUid[0] == 0x08 ? '3' : '1'));
+    print_hex(out, nai.abtUid, nai.szUidLen);
+    fprintf(out, ", SAK (SEL_RES): ");
+    print_hex(out, &nai.btSak, 1);
     if (nai.szAtsLen) {
-      printf(", ATS (ATR): ");
-      print_hex(nai.abtAts, nai.szAtsLen);
+      fprintf(out, ", ATS (ATR): ");
+      print_hex(out, nai.abtAts, nai.szAtsLen);
     }
-    printf("\n");
+    fprintf(out, "\n");
   }
 }
 
@@ -242,31 +256,146 @@ struct felica_tag felica_tags[] = {
 };
 
 static void
-print_nfc_felica_info(const nfc_felica_info nfi)
+print_nfc_felica_info(FILE *out, const nfc_felica_info nfi)
 {
-  printf("        ID (NFCID2): ");
-  print_hex(nfi.abtId, 8);
-  printf("    Parameter (PAD): ");
-  print_hex(nfi.abtPad, 8);
-  printf("    System Code (SC): ");
-  print_hex(nfi.abtSysCode, 2);
+  fprintf(out, "        ID (NFCID2): ");
+  print_hex(out, nfi.abtId, 8);
+  fprintf(out, "    Parameter (PAD): ");
+  print_hex(out, nfi.abtPad, 8);
+  fprintf(out, "    System Code (SC): ");
+  print_hex(out, nfi.abtSysCode, 2);
 
   for (size_t i = 0; i < sizeof(felica_tags) / sizeof(struct felica_tag); i++) {
     if ((nfi.abtSysCode[0] == felica_tags[i].abtSysCode[0]) && (nfi.abtSysCode[1] == felica_tags[i].abtSysCode[1])) {
-      printf("    %s\n", felica_tags[i].name);
+      fprintf(out, "    %s\n", felica_tags[i].name);
     }
   }
 }
 
+static void
+scan_device(struct device_scan *scan)
+{
+  FILE *out = scan->out;
+  nfc_device *pnd;
+  nfc_target ant[MAX_TARGET_COUNT];
+  int res = 0;
+
+  pthread_mutex_lock(&open_mutex);
+  pnd = nfc_open(scan->context, scan->connstring);
+  pthread_mutex_unlock(&open_mutex);
+
+  if (pnd == NULL) {
+    fprintf(out, "ERROR: %s\n", "Unable to connect to NFC device.");
+    return;
+  }
+  scan->opened = true;
+  nfc_initiator_init(pnd);
+
+  // Drop the field for a while
+  nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
+
+  // Let the reader only try once to find a tag
+  nfc_device_set_property_bool(pnd, NP_INFINITE_SELECT, false);
+
+  // Enable field so more power consuming cards can power themselves up
+  nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true);
+
+  fprintf(out, "NFC device: %s \n", nfc_device_get_name(pnd));
+
+  nfc_modulation nm = {
+    .nmt = NMT_ISO14443A,
+    .nbr = NBR_106
+  };
+  if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
+    for (int n = 0; n < res; n++) {
+      print_iso14443a_name(out, pnd, ant[n].nti.nai);
+    }
+    scan->tag_count += res;
+  }
+
+  nm.nmt = NMT_ISO14443B;
+  if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
+    for (int n = 0; n < res; n++) {
+      fprintf(out, "  ISO14443B: ");
+      fprintf(out, "PUPI: ");
+      print_hex(out, ant[n].nti.nbi.abtPupi, 4);
+      fprintf(out, " Application Data: ");
+      print_hex(out, ant[n].nti.nbi.abtApplicationData, 4);
+      fprintf(out, " Protocol Info: ");
+      print_hex(out, ant[n].nti.nbi.abtProtocolInfo, 3);
+      fprintf(out, "\n");
+    }
+    scan->tag_count += res;
+  } else {
+    snprintf(scan->error, sizeof(scan->error), "%s: %s", "nfc_initiator_list_passive_targets", nfc_strerror(pnd));
+  }
+
+  nm.nmt = NMT_FELICA;
+  nm.nbr = NBR_212;
+  // List Felica tags
+  if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
+    for (int n = 0; n < res; n++) {
+      print_nfc_felica_info(out, ant[n].nti.nfi);
+      fprintf(out, "\n");
+    }
+    scan->tag_count += res;
+  }
+
+  nm.nbr = NBR_424;
+  if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
+    for (int n = 0; n < res; n++) {
+      print_nfc_felica_info(out, ant[n].nti.nfi);
+      fprintf(out, "\n");
+    }
+    scan->tag_count += res;
+  }
+
+  fprintf(out, "%d tag(s) on device.\n", scan->tag_count);
+
+  // Disable field
+  nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
+
+  pthread_mutex_lock(&open_mutex);
+  nfc_close(pnd);
+  pthread_mutex_unlock(&open_mutex);
+}
+
+static void *
+scan_thread(void *arg)
+{
+  scan_device((struct device_scan *) arg);
+  return NULL;
+}
+
+// Copy the buffered output of a scan to stdout
+static void
+print_scan(struct device_scan *scan)
+{
+  char buf[4096];
+  size_t len;
+
+  if (scan->out != stdout) {
+    rewind(scan->out);
+    while ((len = fread(buf, 1, sizeof(buf), scan->out)) > 0) {
+      fwrite(buf, 1, len, stdout);
+    }
+    fclose(scan->out);
+    scan->out = NULL;
+  }
+  if (scan->error[0] != '\0') {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", scan->error);
+  }
+}
+
 int
 main(int argc, const char *argv[])
 {
   uint8_t device_count = 0;
-  uint8_t device_tag_count = 0;	// per device
   uint8_t tag_count = 0;	// total
 
   size_t szDeviceFound;
-  int res = 0;
+  int ret = EXIT_SUCCESS;
 
   (void)(argc);
   (void)(argv);
@@ -275,6 +404,7 @@ main(int argc, const char *argv[])
   nfc_init(&context);
   // Try to open the NFC device
   nfc_connstring connstrings[MAX_DEVICE_COUNT];
+  struct device_scan scans[MAX_DEVICE_COUNT];
 
   szDeviceFound = nfc_list_devices(context, connstrings, MAX_DEVICE_COUNT);
 
@@ -282,90 +412,49 @@ main(int argc, const char *argv[])
     ERR("%s", "No device found.");
   }
 
+  // Scan all the devices at once, the slowest one sets the pace
+  memset(scans, 0, sizeof(scans));
   for (size_t i = 0; i < szDeviceFound; i++) {
-    pnd = nfc_open(context, connstrings[i]);
-    nfc_target ant[MAX_TARGET_COUNT];
-
-    device_count++;
-    device_tag_count = 0;
-
-    if (pnd == NULL) {
-      ERR("%s", "Unable to connect to NFC device.");
-      return EXIT_FAILURE;
+    scans[i].context = context;
+    scans[i].connstring = connstrings[i];
+    scans[i].out = tmpfile();
+    if (scans[i].out != NULL && pthread_create(&scans[i].thread, NULL, scan_thread, &scans[i]) == 0) {
+      scans[i].threaded = true;
     }
-    nfc_initiator_init(pnd);
-
-    // Drop the field for a while
-    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
-
-    // Let the reader only try once to find a tag
-    nfc_device_set_property_bool(pnd, NP_INFINITE_SELECT, false);
-
-    // Enable field so more power consuming cards can power themselves up
-    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true);
-
-    printf("NFC device: %s \n", nfc_device_get_name(pnd));
-
-    nfc_modulation nm = {
-      .nmt = NMT_ISO14443A,
-      .nbr = NBR_106
-    };
-    if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
-      for (int n = 0; n < res; n++) {
-        print_iso14443a_name(ant[n].nti.nai);
-      }
-      device_tag_count += res;
+  }
+  for (size_t i = 0; i < szDeviceFound; i++) {
+    if (scans[i].threaded) {
+      pthread_join(scans[i].thread, NULL);
     }
+  }
 
-    nm.nmt = NMT_ISO14443B;
-    if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
-      for (int n = 0; n < res; n++) {
-        printf("  ISO14443B: ");
-        printf("PUPI: ");
-        print_hex(ant[n].nti.nbi.abtPupi, 4);
-        printf(" Application Data: ");
-        print_hex(ant[n].nti.nbi.abtApplicationData, 4);
-        printf(" Protocol Info: ");
-        print_hex(ant[n].nti.nbi.abtProtocolInfo, 3);
-        printf("\n");
+  // Then print the results in device order
+  for (size_t i = 0; i < szDeviceFound; i++) {
+    if (!scans[i].threaded) {
+      // No thread nor buffer for this one: scan it now
+      if (scans[i].out == NULL) {
+        scans[i].out = stdout;
       }
-      device_tag_count += res;
-    } else {
-      nfc_perror(pnd, "nfc_initiator_list_passive_targets");
+      scan_device(&scans[i]);
     }
+    print_scan(&scans[i]);
 
-    nm.nmt = NMT_FELICA;
-    nm.nbr = NBR_212;
-    // List Felica tags
-    if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
-      for (int n = 0; n < res; n++) {
-        print_nfc_felica_info(ant[n].nti.nfi);
-        printf("\n");
-      }
-      device_tag_count += res;
+    device_count++;
+    if (!scans[i].opened) {
+      ret = EXIT_FAILURE;
+      break;
     }
-
-    nm.nbr = NBR_424;
-    if ((res = nfc_initiator_list_passive_targets(pnd, nm, ant, MAX_TARGET_COUNT)) >= 0) {
-      for (int n = 0; n < res; n++) {
-        print_nfc_felica_info(ant[n].nti.nfi);
-        printf("\n");
-      }
-      device_tag_count += res;
+    tag_count += scans[i].tag_count;
+  }
+  for (size_t i = 0; i < szDeviceFound; i++) {
+    if (scans[i].out != NULL && scans[i].out != stdout) {
+      fclose(scans[i].out);
     }
-
-    printf("%d tag(s) on device.\n", device_tag_count);
-    tag_count += device_tag_count;
-
-    // Disable field
-    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
-
-    nfc_close(pnd);
   }
-  if (device_count > 1) {
+  if (ret == EXIT_SUCCESS && device_count > 1) {
     printf("Total: %d tag(s) on %d device(s).\n", tag_count, device_count);
   }
 
   nfc_exit(context);
-  return EXIT_SUCCESS;
+  return ret;
 }